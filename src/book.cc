@@ -20,6 +20,7 @@
 #include "book.h"
 
 #include <cstdio>
+#include <cstring>
 #include <algorithm>
 #include <atomic>
 #include <chrono>
@@ -27,9 +28,16 @@
 #include <functional>
 #include <iostream>
 #include <random>
+#include <tuple>
 #include <vector>
 #include <unordered_map>
 #include <omp.h>
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #include "common/progress_timer.h"
 #include "gamedb.h"
 #include "node.h"
@@ -49,6 +57,93 @@ const int kRemoveQuickAttackOpening = false;
 // 定跡手を探索する最大深さ
 const Depth kBookSearchDepth = 32 * kOnePly;
 
+// 定跡手を探索する際の、スレッドごとの置換表のサイズ（MB）
+const size_t kBookSearchHashSize = 512;
+
+/**
+ * 定跡手の探索結果を、チェックポイントのファイルに記録するためのレコードです.
+ */
+struct BookSearchRecord {
+  uint64_t entry_index;
+  uint64_t key;
+  uint32_t move;
+  int32_t score;
+};
+
+// 定跡ファイルの先頭に置く識別子
+constexpr char kBookFileMagic[8] = {'G', 'K', 'B', 'O', 'O', 'K', '0', '1'};
+
+// 定跡手のエントリを置く位置の境界（エントリがキャッシュラインをまたがないようにする）
+constexpr uint64_t kBookEntryAlignment = 64;
+
+/**
+ * 定跡ファイルのヘッダです.
+ * ヘッダの後ろに、ハッシュ関数のシード（HashSeeds）と、ハッシュ値の順にソートされた定跡手のエントリが続きます。
+ */
+struct BookFileHeader {
+  char magic[8];
+  uint32_t entry_size;
+  uint32_t reserved;
+  uint64_t num_entries;
+  uint64_t hash_seeds_offset;
+  uint64_t entries_offset;
+};
+
+/**
+ * 局面のハッシュ値を、大小関係を保ったまま符号なし整数に変換します（補間探索に用います）.
+ */
+inline uint64_t ToOrderedKey(Key64 key) {
+  return static_cast<uint64_t>(static_cast<int64_t>(key)) ^ (UINT64_C(1) << 63);
+}
+
+/**
+ * ファイルの内容を、読み込み専用で参照できるようにします.
+ * メモリマップが使える環境ではメモリマップし、それ以外の環境では、ファイル全体をメモリに読み込みます。
+ * @return ファイルの内容（ファイルを開けなかった場合は、nullptr）
+ */
+std::shared_ptr<const uint8_t> MapFile(const char* const file_name, size_t* const file_size) {
+#if !defined(_WIN32)
+  int fd = open(file_name, O_RDONLY);
+  if (fd == -1) {
+    return nullptr;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1 || file_stat.st_size == 0) {
+    close(fd);
+    return nullptr;
+  }
+  const size_t size = file_stat.st_size;
+  void* address = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED) {
+    return nullptr;
+  }
+  madvise(address, size, MADV_RANDOM); // 定跡の検索は、ファイル上のランダムな位置を参照する
+  *file_size = size;
+  return std::shared_ptr<const uint8_t>(static_cast<const uint8_t*>(address), [size](const uint8_t* p) {
+    munmap(const_cast<uint8_t*>(p), size);
+  });
+#else
+  std::FILE* file = std::fopen(file_name, "rb");
+  if (file == nullptr) {
+    return nullptr;
+  }
+  std::vector<uint8_t> buffer;
+  uint8_t chunk[65536];
+  for (size_t n; (n = std::fread(chunk, 1, sizeof(chunk), file)) > 0; ) {
+    buffer.insert(buffer.end(), chunk, chunk + n);
+  }
+  std::fclose(file);
+  if (buffer.empty()) {
+    return nullptr;
+  }
+  *file_size = buffer.size();
+  uint8_t* data = new uint8_t[buffer.size()];
+  std::memcpy(data, buffer.data(), buffer.size());
+  return std::shared_ptr<const uint8_t>(data, std::default_delete<const uint8_t[]>());
+#endif
+}
+
 // 戦型の別名（表記ゆれ等に対応するため）
 const std::unordered_map<std::string, std::string> g_opening_strategy_aliases{
   // 矢倉
@@ -195,37 +290,82 @@ Move BookMoves::PickRandom() const {
   return candidates[0].book_move.move;
 }
 
-Key64 Book::ComputeKey(const Position& original_pos) const {
-  Key64 key(0);
-  Position pos = original_pos;
-
+Key64 Book::ComputeKey(const Position& pos) const {
   // 後手番であれば、将棋盤を１８０度反転して、先手番として扱う
-  if (pos.side_to_move() == kWhite) {
-    pos.Flip();
-  }
+  // （局面をコピーして反転させる代わりに、反転後のマスと駒に対応するシードを直接参照する）
+  const bool flip = pos.side_to_move() == kWhite;
+  Key64 key(0);
 
   // 盤上の駒
   for (Square s : Square::all_squares()) {
-    key += hash_seeds_.psq[pos.piece_on(s)][s];
+    const Piece p = pos.piece_on(s);
+    if (p != kNoPiece) {
+      key += flip ? hash_seeds_.psq[p.opponent_piece()][Square::rotate180(s)]
+                  : hash_seeds_.psq[p][s];
+    }
   }
 
   // 持ち駒
   for (Color c : {kBlack, kWhite})
     for (PieceType pt : Piece::all_hand_types())
       for (int n = pos.hand(c).count(pt); n > 0; --n) {
-        key += hash_seeds_.hands[c][pt];
+        key += hash_seeds_.hands[flip ? ~c : c][pt];
       }
 
   return key;
 }
 
-BookMoves Book::Probe(const Position& pos) const {
-  assert(std::is_sorted(entries_.begin(), entries_.end()));
+Book::KeyTracker::KeyTracker(const Book& book, const Position& pos)
+    : hash_seeds_(book.hash_seeds_),
+      side_to_move_(pos.side_to_move()) {
+  keys_[kBlack] = keys_[kWhite] = Key64(0);
+  for (Square s : Square::all_squares()) {
+    if (pos.piece_on(s) != kNoPiece) {
+      AddPiece(pos.piece_on(s), s, +1);
+    }
+  }
+  for (Color c : {kBlack, kWhite})
+    for (PieceType pt : Piece::all_hand_types())
+      for (int n = pos.hand(c).count(pt); n > 0; --n) {
+        AddHandPiece(c, pt, +1);
+      }
+}
+
+void Book::KeyTracker::UpdateKeys(const Move move, const int sign) {
+  const Color stm = move.piece().color();
+  if (move.is_drop()) {
+    AddHandPiece(stm, move.piece_type(), -sign);
+  } else {
+    AddPiece(move.piece(), move.from(), -sign);
+    if (move.is_capture()) {
+      AddPiece(move.captured_piece(), move.to(), -sign);
+      AddHandPiece(stm, move.captured_piece().hand_type(), +sign);
+    }
+  }
+  AddPiece(move.piece_after_move(), move.to(), +sign);
+  side_to_move_ = sign > 0 ? ~stm : stm;
+}
+
+inline void Book::KeyTracker::AddPiece(const Piece piece, const Square square, const int sign) {
+  const Key64 black_key = hash_seeds_.psq[piece][square];
+  const Key64 white_key = hash_seeds_.psq[piece.opponent_piece()][Square::rotate180(square)];
+  keys_[kBlack] += sign > 0 ? black_key : -black_key;
+  keys_[kWhite] += sign > 0 ? white_key : -white_key;
+}
+
+inline void Book::KeyTracker::AddHandPiece(const Color owner, const PieceType pt, const int sign) {
+  const Key64 black_key = hash_seeds_.hands[owner][pt];
+  const Key64 white_key = hash_seeds_.hands[~owner][pt];
+  keys_[kBlack] += sign > 0 ? black_key : -black_key;
+  keys_[kWhite] += sign > 0 ? white_key : -white_key;
+}
+
+BookMoves Book::Probe(const Position& pos, const Key64 key) const {
+  assert(std::is_sorted(entries_begin(), entries_end()));
+  assert(key == ComputeKey(pos));
 
   // 1. 与えられた局面の定跡手を探す
-  Entry key;
-  key.key = ComputeKey(pos);
-  auto range = std::equal_range(entries_.begin(), entries_.end(), key);
+  auto range = FindEntries(key);
 
   // 2. 定跡手をBookMovesクラスに登録していく
   BookMoves book_moves;
@@ -259,8 +399,13 @@ BookMoves Book::Probe(const Position& pos) const {
 }
 
 BookMoves Book::GetBookMoves(const Position& pos, const UsiOptions& usi_options) const {
+  return GetBookMoves(pos, ComputeKey(pos), usi_options);
+}
+
+BookMoves Book::GetBookMoves(const Position& pos, const Key64 key,
+                             const UsiOptions& usi_options) const {
   // 定跡DBから現局面の登録手を探す
-  BookMoves book_moves = Probe(pos);
+  BookMoves book_moves = Probe(pos, key);
 
   // DBに手が登録されていない場合は、ここでおしまい
   if (book_moves.empty()) {
@@ -403,123 +548,279 @@ OpeningStrategySet Book::DetermineOpeningStrategy(const Position& pos) const {
   return opening_strategies;
 }
 
+std::pair<const Book::Entry*, const Book::Entry*> Book::FindEntries(const Key64 key) const {
+  const Entry* const entries = entries_begin();
+  const uint64_t target = ToOrderedKey(key);
+
+  // 1. 補間探索で、ハッシュ値がkey以上となる最初のエントリ（lower bound）の範囲を絞り込む
+  // 範囲[lo, hi]の中に答えがあり、loより前はkey未満、hi以降はkey以上であることを保ちながら、範囲を狭めていく。
+  // 範囲の両端のハッシュ値は、直前に参照したエントリのものを覚えておくので、１回の反復で参照するエントリは１つで済む。
+  size_t lo = 0, hi = entries_end() - entries;
+  uint64_t lo_key = 0, hi_key = UINT64_MAX;
+  for (int iteration = 0; hi - lo > 8; ++iteration) {
+    // ハッシュ値の分布に偏りがあって、補間がうまくいかない場合に備えて、時々二分探索を行う
+    size_t mid;
+    if (iteration % 4 == 3) {
+      mid = lo + (hi - lo) / 2;
+    } else {
+      double ratio = double(target - lo_key) / (double(hi_key - lo_key) + 1.0);
+      mid = lo + std::min(static_cast<size_t>(ratio * (hi - lo)), hi - lo - 1);
+    }
+    const uint64_t mid_key = ToOrderedKey(entries[mid].key);
+    if (mid_key < target) {
+      lo = mid + 1;
+      lo_key = mid_key;
+    } else {
+      hi = mid;
+      hi_key = mid_key;
+    }
+  }
+
+  // 2. 残った範囲を線形探索して、keyに一致するエントリの範囲を求める
+  while (lo < hi && ToOrderedKey(entries[lo].key) < target) {
+    ++lo;
+  }
+  const Entry* first = entries + lo;
+  const Entry* last = first;
+  while (last != entries_end() && last->key == key) {
+    ++last;
+  }
+  return std::make_pair(first, last);
+}
+
 void Book::ReadFromFile(const char* file_name) {
-  // 1. 定跡ファイルを開く
-  std::FILE* file = std::fopen(file_name, "rb");
-  if (file == NULL) {
+  // 以前に読み込んだ定跡データを破棄する
+  entries_.clear();
+  mapping_.reset();
+  mapped_entries_ = nullptr;
+  num_mapped_entries_ = 0;
+
+  // 1. 定跡ファイルをメモリマップする
+  size_t file_size = 0;
+  std::shared_ptr<const uint8_t> mapping = MapFile(file_name, &file_size);
+  if (!mapping) {
     std::printf("info string Failed to Open %s.\n", file_name);
     return;
   }
+  const uint8_t* data = mapping.get();
+
+  // 2. ヘッダがあれば、定跡手のエントリはコピーせずに、メモリマップしたものをそのまま使う
+  BookFileHeader header;
+  if (   file_size >= sizeof(header)
+      && std::memcmp(data, kBookFileMagic, sizeof(kBookFileMagic)) == 0) {
+    std::memcpy(&header, data, sizeof(header));
+    const bool ok = header.entry_size == sizeof(Entry)
+                 && header.hash_seeds_offset >= sizeof(header)
+                 && header.hash_seeds_offset + sizeof(HashSeeds) <= header.entries_offset
+                 && header.entries_offset % kBookEntryAlignment == 0
+                 && header.entries_offset <= file_size
+                 && header.num_entries <= (file_size - header.entries_offset) / sizeof(Entry);
+    if (!ok) {
+      std::printf("info string The book file %s is broken.\n", file_name);
+      return;
+    }
+    std::memcpy(&hash_seeds_, data + header.hash_seeds_offset, sizeof(hash_seeds_));
+    mapped_entries_ = reinterpret_cast<const Entry*>(data + header.entries_offset);
+    num_mapped_entries_ = header.num_entries;
+    mapping_ = mapping;
+    return;
+  }
 
-  // 2. ハッシュ関数のシードを読み込む
-  if (std::fread(&hash_seeds_, sizeof(hash_seeds_), 1, file) < 1) {
+  // 3. ヘッダのない古い形式のファイルは、ハッシュ関数のシードに続くエントリを、メモリに読み込む
+  if (file_size < sizeof(hash_seeds_)) {
     std::printf("info string Failed to read the hash seeds of the book.\n");
-    std::fclose(file);
     return;
   }
+  std::memcpy(&hash_seeds_, data, sizeof(hash_seeds_));
+  entries_.resize((file_size - sizeof(hash_seeds_)) / sizeof(Entry));
+  std::memcpy(entries_.data(), data + sizeof(hash_seeds_), entries_.size() * sizeof(Entry));
+}
 
-  // 3. 定跡手のエントリを読み込む
-  entries_.clear();
-  for (Entry buf; std::fread(&buf, sizeof(buf), 1, file);) {
-    entries_.push_back(buf);
+void Book::CopyMappedEntries() {
+  if (mapped_entries_ != nullptr) {
+    entries_.assign(mapped_entries_, mapped_entries_ + num_mapped_entries_);
+    mapping_.reset();
+    mapped_entries_ = nullptr;
+    num_mapped_entries_ = 0;
   }
-
-  // 4. ファイルを閉じる
-  std::fclose(file);
 }
 
 #if !defined(MINIMUM)
 
 void Book::WriteToFile(const char* file_name) const {
-  // 1. 保存先のファイルを開く
-  std::FILE* file = std::fopen(file_name, "wb");
+  // 1. 一時ファイルを開く
+  // 保存先のファイルをメモリマップしている場合があるので、一時ファイルに書き込んでから、名前を変更する
+  const std::string temp_file_name = std::string(file_name) + ".tmp";
+  std::FILE* file = std::fopen(temp_file_name.c_str(), "wb");
   if (file == NULL) {
-    std::printf("info string Failed to Open %s.\n", file_name);
+    std::printf("info string Failed to Open %s.\n", temp_file_name.c_str());
     return;
   }
 
-  // 2. データを書き込む
-  std::fwrite(&hash_seeds_, sizeof(hash_seeds_), 1, file);
-  for (const Entry& entry : entries_) {
-    std::fwrite(&entry, sizeof(entry), 1, file);
+  // 2. ヘッダを作成する
+  BookFileHeader header;
+  std::memcpy(header.magic, kBookFileMagic, sizeof(header.magic));
+  header.entry_size = sizeof(Entry);
+  header.reserved = 0;
+  header.num_entries = entries_end() - entries_begin();
+  header.hash_seeds_offset = sizeof(header);
+  header.entries_offset = (header.hash_seeds_offset + sizeof(hash_seeds_) + kBookEntryAlignment - 1)
+                        / kBookEntryAlignment * kBookEntryAlignment;
+
+  // 3. データを書き込む（エントリの前は、境界を揃えるために0で埋める）
+  const std::vector<uint8_t> padding(header.entries_offset - header.hash_seeds_offset - sizeof(hash_seeds_), 0);
+  bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1
+         && std::fwrite(&hash_seeds_, sizeof(hash_seeds_), 1, file) == 1
+         && std::fwrite(padding.data(), 1, padding.size(), file) == padding.size()
+         && std::fwrite(entries_begin(), sizeof(Entry), header.num_entries, file) == header.num_entries;
+
+  // 4. 一時ファイルを閉じて、保存先のファイル名に変更する
+  ok = (std::fclose(file) == 0) && ok;
+#if defined(_WIN32)
+  std::remove(file_name); // Windowsでは、既存のファイルがあると名前を変更できない
+#endif
+  if (!ok || std::rename(temp_file_name.c_str(), file_name) != 0) {
+    std::printf("info string Failed to write %s.\n", file_name);
   }
-
-  // 3. 保存先のファイルを閉じる
-  std::fclose(file);
 }
 
-void Book::SearchAllBookMoves() {
-  // 棋譜DBを準備する
-  std::ifstream game_db_file(GameDatabase::kDefaultDatabaseFile);
-  GameDatabase game_db(game_db_file);
-  game_db.set_title_matches_only(true);
-
-  // 棋譜DBから棋譜を全て読み込む
-  std::vector<Game> all_games;
-  for (Game game; game_db.ReadOneGame(&game); ) {
-    all_games.push_back(game);
+void Book::SearchAllBookMoves(const char* checkpoint_file) {
+  // 探索結果をエントリに書き込むので、メモリマップしている場合は、メモリにコピーしておく
+  CopyMappedEntries();
+
+  // 1. 前回中断したところまでの評価値を、チェックポイントのファイルから復元する
+  // （チェックポイントには、探索を終えたエントリの番号とハッシュ値、指し手、評価値が、探索を終えた順に記録されている）
+  size_t num_restored_moves = 0;
+  std::FILE* restored_file = checkpoint_file ? std::fopen(checkpoint_file, "rb") : nullptr;
+  if (restored_file != nullptr) {
+    for (BookSearchRecord record; std::fread(&record, sizeof(record), 1, restored_file) == 1; ) {
+      if (   record.entry_index < entries_.size()
+          && entries_[record.entry_index].key == Key64(record.key)
+          && entries_[record.entry_index].move.ToUint32() == record.move) {
+        entries_[record.entry_index].score = static_cast<Score>(record.score);
+        ++num_restored_moves;
+      }
+    }
+    std::fclose(restored_file);
+    std::printf("Restored %zu searched moves from %s.\n", num_restored_moves, checkpoint_file);
   }
 
-  // USIオプションを使い、得点を付加する対象の手を特定する
-  UsiOptions usi_options;
-  usi_options["NarrowBook"] = std::string("true");
-  usi_options["TinyBook"] = std::string("true");
-
-  // 進行状況を表示するためのタイマーを準備する
-  ProgressTimer progress_timer(entries_.size());
-  std::atomic_long num_searched_moves(0); // 探索して評価値をつけた指し手の数
+  // 2. 棋譜DBから棋譜を全て読み込む
+  GameDatabase game_db;
+  game_db.set_title_matches_only(true);
+  std::vector<Game> all_games = game_db.ReadAllGames();
+  if (game_db.failed()) {
+    return; // 壊れた棋譜DBから、一部の棋譜だけで定跡を作ることはしない
+  }
 
-  // 全ての棋譜について、順番に探索して評価値をつけていく
+  // 3. 定跡手を探索する局面（タスク）を列挙する
+  // 同じ局面は多くの棋譜に現れるので、局面の定跡手のエントリの範囲ごとに、最初に現れた棋譜と手数だけを残す。
+  // これにより、各エントリを探索するタスクはちょうど１つになるので、探索中にエントリを排他制御する必要がなくなる。
+  struct Task {
+    bool operator<(const Task& rhs) const {
+      return std::tie(first_entry, game_id, ply) < std::tie(rhs.first_entry, rhs.game_id, rhs.ply);
+    }
+    size_t first_entry;
+    uint32_t num_entries;
+    uint32_t game_id;
+    uint32_t ply;
+  };
+  const int num_threads = omp_get_max_threads();
+  std::vector<std::vector<Task>> tasks_per_thread(num_threads);
 #pragma omp parallel for schedule(dynamic)
   for (size_t game_id = 0; game_id < all_games.size(); ++game_id) {
     const Game& game = all_games.at(game_id);
-
-    // 各種データを初期化する
+    std::vector<Task>& tasks = tasks_per_thread.at(omp_get_thread_num());
     Position pos = Position::CreateStartPosition();
-    Node node(pos);
-    SharedData shared_data;
-    shared_data.hash_table.SetSize(512);
-    Search search(shared_data);
-
+    KeyTracker book_key(*this, pos);
     for (size_t ply = 0; ply < game.moves.size(); ++ply) {
       Move move = game.moves.at(ply);
-
-      if (ply >= kMaxBookPly || !node.MoveIsLegal(move)) {
+      if (ply >= kMaxBookPly || !pos.MoveIsLegal(move)) {
         break;
       }
+      const auto range = FindEntries(book_key.key());
+      const bool all_searched = std::all_of(range.first, range.second, [](const Entry& e) {
+        return e.score != kScoreNone;
+      });
+      if (!all_searched) {
+        tasks.push_back(Task{static_cast<size_t>(range.first - entries_begin()),
+                             static_cast<uint32_t>(range.second - range.first),
+                             static_cast<uint32_t>(game_id),
+                             static_cast<uint32_t>(ply)});
+      }
+      pos.MakeMove(move);
+      book_key.MakeMove(move);
+    }
+  }
+  std::vector<Task> tasks;
+  for (std::vector<Task>& thread_tasks : tasks_per_thread) {
+    tasks.insert(tasks.end(), thread_tasks.begin(), thread_tasks.end());
+    std::vector<Task>().swap(thread_tasks);
+  }
+  std::sort(tasks.begin(), tasks.end());
+  tasks.erase(std::unique(tasks.begin(), tasks.end(), [](const Task& lhs, const Task& rhs) {
+    return lhs.first_entry == rhs.first_entry;
+  }), tasks.end());
+  size_t num_unsearched_moves = 0;
+  for (const Task& task : tasks) {
+    num_unsearched_moves += std::count_if(entries_.begin() + task.first_entry,
+                                          entries_.begin() + task.first_entry + task.num_entries,
+                                          [](const Entry& e) { return e.score == kScoreNone; });
+  }
+  std::printf("positions=%zu unsearched_moves=%zu\n", tasks.size(), num_unsearched_moves);
+
+  // 探索を終えた定跡手を、チェックポイントのファイルに追記していく
+  std::FILE* checkpoint = checkpoint_file ? std::fopen(checkpoint_file, "ab") : nullptr;
+
+  // USIオプションを使い、得点を付加する対象の手を特定する
+  UsiOptions usi_options;
+  usi_options["NarrowBook"] = std::string("true");
+  usi_options["TinyBook"] = std::string("true");
 
-      // 定跡DBに登録されている手を調べる
-      Entry entry_as_key;
-      entry_as_key.key = ComputeKey(node);
-      auto range = std::equal_range(entries_.begin(), entries_.end(), entry_as_key);
+  // 進行状況を表示するためのタイマーを準備する
+  ProgressTimer progress_timer(num_unsearched_moves);
+  std::atomic_long num_searched_moves(0); // 探索して評価値をつけた指し手の数
 
-      // 指し手が登録されていなければ、この局面はスキップして次へと進む
-      if (range.first == range.second) {
-        node.MakeMove(move);
+  // 4. 各スレッドが、タスクを１つずつ取り出して探索していく
+  // 置換表等の探索用のデータは、スレッドごとに１つだけ用意して、すべてのタスクで使い回す。
+  std::vector<SharedData> shared_datas(num_threads);
+  std::atomic<size_t> next_task(0);
+#pragma omp parallel
+  {
+    const int thread_id = omp_get_thread_num();
+    SharedData& shared = shared_datas.at(thread_id);
+    shared.hash_table.SetSize(kBookSearchHashSize);
+    std::unique_ptr<HistoryTables> histories(new HistoryTables);
+    histories->Clear();
+    Search search(shared, thread_id, histories.get());
+    std::vector<BookSearchRecord> records;
+
+    for (size_t task_id; (task_id = next_task.fetch_add(1)) < tasks.size(); ) {
+      const Task& task = tasks.at(task_id);
+      const Game& game = all_games.at(task.game_id);
+
+      // 棋譜の手に沿って、タスクの局面まで進める
+      Node node(Position::CreateStartPosition());
+      for (uint32_t ply = 0; ply < task.ply; ++ply) {
+        node.MakeMove(game.moves.at(ply));
         node.Evaluate(); // 評価値の差分計算に必要
-        continue;
       }
 
       // 定跡のデータを取得する
-      BookMoves book_moves = GetBookMoves(node, usi_options);
+      const Key64 key = entries_.at(task.first_entry).key;
+      BookMoves book_moves = GetBookMoves(node, key, usi_options);
 
-      // 定跡DBに登録されている手があれば、順に探索していく
-      for (auto entry = range.first; entry != range.second; ++entry) {
-        bool skip_this_move = false;
+      // 前の局面の探索で得られたHistoryが残らないように、スレッド専用のHistoryをクリアする
+      search.ClearHistory();
+      shared.countermoves_history.Clear();
 
-        // マルチスレッド処理するので、重複して探索しないように、排他制御を行う
-        #pragma omp critical
-        {
-          if (entry->score != kScoreNone) {
-            // 定跡手のscoreがkScoreNone以外になっていたら、既に探索済みということなのでスキップする
-            skip_this_move = true;
-          } else {
-            // kScoreZeroに値を変更しておく。これにより、この手を他スレッドが重複して探索することはなくなる
-            entry->score = kScoreZero;
-          }
-        }
+      // 定跡DBに登録されている手があれば、順に探索していく
+      records.clear();
+      for (size_t i = task.first_entry; i < task.first_entry + task.num_entries; ++i) {
+        Entry& entry = entries_.at(i);
 
-        if (skip_this_move) {
+        // 探索済みの手（チェックポイントから復元したもの）はスキップする
+        if (entry.score != kScoreNone) {
           continue;
         }
 
@@ -529,43 +830,53 @@ void Book::SearchAllBookMoves() {
                                      num_searched_moves.load());
 
         // 定跡手をエントリから取り出す（後手番の手も、先手視点で保存されていることに注意）
-        Move book_move = entry->move;
+        // 非合法手や、定跡DBにおいてimportanceが負の手は、探索せずに評価値を0点とする
+        Move book_move = entry.move;
         if (node.side_to_move() == kWhite) {
           book_move = book_move.Flip();
         }
-
-        if (!node.MoveIsLegal(book_move)) {
-          continue;
-        }
-
-        // 定跡DBにおいてimportanceが負の手はスキップする
         auto iter = std::find_if(book_moves.begin(), book_moves.end(), [&](const BookMove& bm) {
           return bm.move == book_move;
         });
-        if (iter != book_moves.end() && iter->importance < 0) {
-          continue;
+        Score score = kScoreZero;
+        if (node.MoveIsLegal(book_move) && !(iter != book_moves.end() && iter->importance < 0)) {
+          // 定跡手以下の探索を行う
+          // 置換表はクリアせずに、世代を進めるだけにする（マスタースレッド以外では、PrepareForNextSearch()で世代が進まない）
+          search.PrepareForNextSearch();
+          if (!search.is_master_thread()) {
+            shared.hash_table.NextAge();
+          }
+          shared.signals.Reset();
+          node.MakeMove(book_move);
+          Score inf = kScoreInfinite;
+          score = -search.AlphaBetaSearch(node, -inf, inf, kBookSearchDepth);
+          node.UnmakeMove(book_move);
+          num_searched_moves += 1;
         }
 
-        // 定跡手以下の探索を行う
-        search.PrepareForNextSearch();
-        shared_data.Clear();
-        node.MakeMove(book_move);
-        Score inf = kScoreInfinite;
-        Score score = -search.AlphaBetaSearch(node, -inf, inf, kBookSearchDepth);
-        node.UnmakeMove(book_move);
-        num_searched_moves += 1;
-
-        // 評価値を保存する（上で排他制御済みなので、ここでは他スレッドと競合しないので排他制御不要）
+        // 評価値を保存する（各エントリを探索するタスクは１つだけなので、他スレッドと競合しない）
         // 注意：後手の場合は、先手視点の得点に変換しておく
-        entry->score = node.side_to_move() == kBlack ? score : -score;
+        entry.score = node.side_to_move() == kBlack ? score : -score;
+        records.push_back(BookSearchRecord{i, static_cast<uint64_t>(entry.key),
+                                           entry.move.ToUint32(),
+                                           static_cast<int32_t>(entry.score)});
       }
 
-      // 次の局面に進む
-      node.MakeMove(move);
-      node.Evaluate(); // 評価値の差分計算に必要
+      // 局面ごとに、探索結果をチェックポイントに追記する
+      if (checkpoint != nullptr && !records.empty()) {
+#pragma omp critical(book_checkpoint)
+        {
+          std::fwrite(records.data(), sizeof(BookSearchRecord), records.size(), checkpoint);
+          std::fflush(checkpoint);
+        }
+      }
     }
   }
 
+  if (checkpoint != nullptr) {
+    std::fclose(checkpoint);
+  }
+
   // 初期局面等の定跡手の評価値が何点になっているかを表示する
   {
     Position pos = Position::CreateStartPosition();
@@ -615,8 +926,7 @@ Book Book::CreateBook(const OpeningStrategySet& opening_strategies) {
   }
 
   // 2. 対局データを読み込む準備をする
-  std::ifstream game_db_file(GameDatabase::kDefaultDatabaseFile);
-  GameDatabase game_db(game_db_file);
+  GameDatabase game_db;
   game_db.set_title_matches_only(true);
   struct MapKey {
     bool operator==(const MapKey& rhs) const {
@@ -679,6 +989,7 @@ Book Book::CreateBook(const OpeningStrategySet& opening_strategies) {
     }
 
     Position pos = startpos;
+    KeyTracker book_key(book, pos);
     Color winner = game.result == Game::kBlackWin ? kBlack : kWhite;
 
     for (size_t ply = 0; ply < game.moves.size(); ++ply) {
@@ -689,7 +1000,7 @@ Book Book::CreateBook(const OpeningStrategySet& opening_strategies) {
       }
 
       // std::mapに用いるキーを作成する
-      Key64 position_key = book.ComputeKey(pos);
+      Key64 position_key = book_key.key();
       Move relative_move = move;
       if (pos.side_to_move() == kWhite) {
         relative_move.Flip();
@@ -706,6 +1017,7 @@ Book Book::CreateBook(const OpeningStrategySet& opening_strategies) {
 
       // 棋譜の手に沿って局面を進める
       pos.MakeMove(move);
+      book_key.MakeMove(move);
     }
   }
 
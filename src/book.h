@@ -20,7 +20,9 @@
 #ifndef BOOK_H_
 #define BOOK_H_
 
+#include <memory>
 #include <string>
+#include <utility>
 #include <vector>
 #include "common/arraymap.h"
 #include "common/bitset.h"
@@ -220,11 +222,15 @@ class Book {
 
   /**
    * ファイルから定跡データを読み込みます.
+   *
+   * ファイルは読み込み専用でメモリマップし、定跡手のエントリはコピーせずにそのまま参照するので、
+   * 読み込みはすぐに終わり、同じマシンで複数のエンジンを動かす場合にも、メモリ上のデータが共有されます。
+   * ヘッダのない古い形式のファイルの場合は、従来どおり、エントリをメモリに読み込みます。
    */
   void ReadFromFile(const char* file_name);
 
   /**
-   * ファイルに定跡データを書き込みます.
+   * ファイルに定跡データを書き込みます（ReadFromFile()でメモリマップできる形式で書き込みます）.
    */
   void WriteToFile(const char* file_name) const;
 
@@ -238,8 +244,14 @@ class Book {
    *   - 磯崎元洋: 技巧敗退の原因, やねうら王公式サイト,
    *     http://yaneuraou.yaneu.com/2015/11/27/技巧敗退の原因/, 2015.
    *   - 平岡拓也: Apery on GitHub, https://github.com/HiraokaTakuya/apery.
+   *
+   * 探索する局面は、棋譜DBから予め重複なく列挙しておき、各スレッドが１局面ずつ取り出して探索します。
+   * 置換表等の探索用のデータは、スレッドごとに１つだけ用意して、すべての局面で使い回します。
+   *
+   * @param checkpoint_file 探索結果を随時追記するファイル名（途中で中断した場合は、同じファイル名を指定すると、
+   *                        探索済みの定跡手を飛ばして再開できます。nullptrの場合は、記録しません）
    */
-  void SearchAllBookMoves();
+  void SearchAllBookMoves(const char* checkpoint_file = nullptr);
 
   /**
    * 棋譜から定跡データベースを作成します.
@@ -261,7 +273,20 @@ class Book {
    * @param pos 定跡手を取得したい局面
    * @return データベースに登録された、その局面における定跡手
    */
-  BookMoves Probe(const Position& pos) const;
+  BookMoves Probe(const Position& pos) const {
+    return Probe(pos, ComputeKey(pos));
+  }
+
+  /**
+   * 局面のハッシュ値が計算済みの場合に、定跡手の一覧を取得します.
+   * @param key 局面のハッシュ値（ComputeKey()またはKeyTrackerで計算したもの）
+   */
+  BookMoves Probe(const Position& pos, Key64 key) const;
+
+  /**
+   * 局面のハッシュ値が計算済みの場合に、定跡手の一覧を取得します（GetBookMoves()と同じ選別を行います）.
+   */
+  BookMoves GetBookMoves(const Position& pos, Key64 key, const UsiOptions& usi_options) const;
 
   /**
    * 局面のハッシュ値を計算するための乱数シードを保管しておくクラスです.
@@ -271,6 +296,51 @@ class Book {
     ArrayMap<Key64, Color, PieceType> hands;
   };
 
+  /**
+   * 局面のハッシュ値を、指し手に合わせて差分計算するためのクラスです.
+   *
+   * 定跡の作成時や、定跡手の探索時には、棋譜の局面を１手ずつ進めながら定跡DBを参照するので、
+   * 局面ごとにComputeKey()で盤上と持ち駒をすべて走査する代わりに、このクラスで差分計算します。
+   * 後手番の局面は、盤面を１８０度回転させて先手番として扱うので、盤面をそのまま見たハッシュ値と、
+   * 回転させて見たハッシュ値の両方を保持しておき、手番に応じて使い分けます。
+   */
+  class KeyTracker {
+   public:
+    KeyTracker(const Book& book, const Position& pos);
+
+    /**
+     * 指し手に合わせてハッシュ値を更新します（局面のMakeMove()と対にして呼んでください）.
+     */
+    void MakeMove(Move move) {
+      UpdateKeys(move, +1);
+    }
+
+    /**
+     * MakeMove()による更新を元に戻します.
+     */
+    void UnmakeMove(Move move) {
+      UpdateKeys(move, -1);
+    }
+
+    /**
+     * 現局面のハッシュ値を返します（ComputeKey()の返り値と一致します）.
+     */
+    Key64 key() const {
+      return keys_[side_to_move_];
+    }
+
+   private:
+    void UpdateKeys(Move move, int sign);
+    void AddPiece(Piece piece, Square square, int sign);
+    void AddHandPiece(Color owner, PieceType pt, int sign);
+
+    const HashSeeds& hash_seeds_;
+
+    /** 先手番から見たハッシュ値（盤面をそのまま見たもの）と、後手番から見たハッシュ値（盤面を回転させたもの） */
+    ArrayMap<Key64, Color> keys_;
+    Color side_to_move_;
+  };
+
   /**
    * 定跡データベースに登録される、定跡手のエントリです.
    * 定跡手１手につき、１つのエントリを使います。
@@ -285,8 +355,32 @@ class Book {
     Score score = kScoreNone;
   };
 
+  /**
+   * 局面のハッシュ値に一致する定跡手のエントリの範囲を、補間探索によって求めます.
+   * 局面のハッシュ値は一様に分布しているので、二分探索よりも少ない回数（キャッシュミス）で見つかります。
+   */
+  std::pair<const Entry*, const Entry*> FindEntries(Key64 key) const;
+
+  /**
+   * メモリマップしているエントリを、書き換えられるように、メモリにコピーします.
+   */
+  void CopyMappedEntries();
+
+  const Entry* entries_begin() const {
+    return mapped_entries_ != nullptr ? mapped_entries_ : entries_.data();
+  }
+
+  const Entry* entries_end() const {
+    return mapped_entries_ != nullptr ? mapped_entries_ + num_mapped_entries_ : entries_.data() + entries_.size();
+  }
+
   HashSeeds hash_seeds_;
   std::vector<Entry> entries_;
+
+  /** メモリマップした定跡ファイルと、その中の定跡手のエントリ（ハッシュ値の順にソートされている） */
+  std::shared_ptr<const uint8_t> mapping_;
+  const Entry* mapped_entries_ = nullptr;
+  size_t num_mapped_entries_ = 0;
 };
 
 #endif /* BOOK_H_ */
@@ -20,27 +20,39 @@
 #include "cli.h"
 
 #include <algorithm>
+#include <chrono>
+#include <cinttypes>
 #include <fstream>
+#include <random>
+#include <sstream>
 #include <vector>
 #include <unordered_map>
+#include <omp.h>
 #include "common/array.h"
 #include "common/simple_timer.h"
 #include "book.h"
 #include "cluster.h"
 #include "consultation.h"
+#include "evaluation.h"
 #include "gamedb.h"
+#include "huffman_code.h"
 #include "learning.h"
 #include "mate1ply.h"
 #include "mate3.h"
+#include "mate_n.h"
 #include "movegen.h"
+#include "move_feature.h"
 #include "move_probability.h"
 #include "position.h"
 #include "progress.h"
 #include "search.h"
+#include "swap.h"
+#include "teacher_archive.h"
 #include "teacher_data.h"
 #include "thinking.h"
 #include "usi.h"
 #include "usi_protocol.h"
+#include "YaneuraOu/config.h"
 
 #if !defined(MINIMUM)
 
@@ -48,8 +60,11 @@ namespace {
 
 void BenchmarkSearch();
 void BenchmarkMoveGeneration(int num_calls);
+void BenchmarkSwap(int num_calls);
 void BenchmarkMateSearch(int num_calls, int ply);
+void BenchmarkMateSuite(const char* file_name, int num_calls);
 void CreateBook(const std::string& output_dir_name);
+void SearchBookMoves(const char* input_file_name, const char* output_file_name);
 void ComputeStatsOfGameDatabase(const char* event_name);
 void ComputeAllPossibleQuietMoves();
 void ComputePlayerRatings();
@@ -72,20 +87,52 @@ void Cli::ExecuteCommand(int argc, char* argv[]) {
   } else if (command == "--bench-movegen") {
     int num_tries = argc >= 3 ? std::atoi(argv[2]) : 1;
     BenchmarkMoveGeneration(num_tries);
+  } else if (command == "--bench-see") {
+    int num_tries = argc >= 3 ? std::atoi(argv[2]) : 100000;
+    BenchmarkSwap(num_tries);
   } else if (command == "--bench-mate1") {
     int num_tries = argc >= 3 ? std::atoi(argv[2]) : 1;
     BenchmarkMateSearch(num_tries, 1);
   } else if (command == "--bench-mate3") {
     int num_tries = argc >= 3 ? std::atoi(argv[2]) : 1;
     BenchmarkMateSearch(num_tries, 3);
+  } else if (command == "--bench-mate-suite") {
+    const char* file_name = argc >= 3 ? argv[2] : "mate_problems.txt";
+    int num_tries = argc >= 4 ? std::atoi(argv[3]) : 1;
+    BenchmarkMateSuite(file_name, num_tries);
+  } else if (command == "--bench-huffman") {
+    int num_positions = argc >= 3 ? std::atoi(argv[2]) : 10000;
+    HuffmanCode::Benchmark(num_positions);
+  } else if (command == "--bench-probability") {
+    int num_tries = argc >= 3 ? std::atoi(argv[2]) : 10000;
+    MoveProbability::Benchmark(num_tries);
   } else if (command == "--cluster") {
     Cluster cluster;
     cluster.Start();
+  } else if (command == "--fake-cluster-worker") {
+    FakeClusterWorker fake_worker;
+    fake_worker.Start();
   } else if (command == "--compute-all-quiets") {
     ComputeAllPossibleQuietMoves();
   } else if (command == "--consultation") {
     Consultation consultation;
     consultation.Start();
+  } else if (command == "--convert-book") {
+    const char* input_file_name = argc >= 3 ? argv[2] : "book.bin";
+    const char* output_file_name = argc >= 4 ? argv[3] : input_file_name;
+    Book book;
+    book.ReadFromFile(input_file_name);
+    book.WriteToFile(output_file_name);
+  } else if (command == "--convert-game-db") {
+    const char* input_file_name = argc >= 3 ? argv[2] : GameDatabase::kDefaultDatabaseFile;
+    const char* output_file_name = argc >= 4 ? argv[3] : GameDatabase::kDefaultBinaryDatabaseFile;
+    BinaryGameDatabase::ConvertFromTextFile(input_file_name, output_file_name);
+  } else if (command == "--convert-teacher-data") {
+    const char* input_file_name = argc >= 3 ? argv[2] : "teacher_positions.bin";
+    const char* output_file_name = argc >= 4 ? argv[3] : "teacher_positions.tpa";
+    bool is_pv_data = argc >= 5 && std::string(argv[4]) == "pvs";
+    TeacherArchive::ConvertFromFlatFile(input_file_name, output_file_name,
+                                        is_pv_data ? TeacherArchive::kPvs : TeacherArchive::kPositions);
   } else if (command == "--create-book") {
     std::string output_dir_name = argc >= 3 ? argv[2] : "books";
     CreateBook(output_dir_name);
@@ -93,29 +140,42 @@ void Cli::ExecuteCommand(int argc, char* argv[]) {
     const char* event_name = argc >= 3 ? argv[2] : nullptr;
     ComputeStatsOfGameDatabase(event_name);
   } else if (command == "--generate-games") {
-    TeacherData::GenerateTeacherGames();
+    const char* filter_file = argc >= 3 ? argv[2] : nullptr;
+    TeacherData::GenerateTeacherGames(filter_file);
   } else if (command == "--generate-positions") {
-    TeacherData::GenerateTeacherPositions();
+    uint32_t seed = argc >= 3 ? std::strtoul(argv[2], nullptr, 10) : std::random_device()();
+    const char* filter_file = argc >= 4 ? argv[3] : nullptr;
+    TeacherData::GenerateTeacherPositions(seed, filter_file);
   } else if (command == "--generate-pvs") {
     TeacherData::GenerateTeacherPvs();
   } else if (command == "--learn") {
     bool use_rootstrap = false;
     bool use_logistic_regression = false;
-    Learning::LearnEvaluationParameters(use_rootstrap, use_logistic_regression);
+    bool resume = argc >= 3 && std::string(argv[2]) == "--resume";
+    Learning::LearnEvaluationParameters(use_rootstrap, use_logistic_regression,
+                                        resume);
   } else if (command == "--learn-with-rootstrap") {
     bool use_rootstrap = true;
     bool use_logistic_regression = false;
-    Learning::LearnEvaluationParameters(use_rootstrap, use_logistic_regression);
+    bool resume = argc >= 3 && std::string(argv[2]) == "--resume";
+    Learning::LearnEvaluationParameters(use_rootstrap, use_logistic_regression,
+                                        resume);
   } else if (command == "--learn-with-regression") {
     bool use_rootstrap = true;
     bool use_logistic_regression = true;
-    Learning::LearnEvaluationParameters(use_rootstrap, use_logistic_regression);
+    bool resume = argc >= 3 && std::string(argv[2]) == "--resume";
+    Learning::LearnEvaluationParameters(use_rootstrap, use_logistic_regression,
+                                        resume);
   } else if (command == "--learn-progress") {
     Progress::LearnParameters();
   } else if (command == "--learn-probability") {
     MoveProbability::Learn();
   } else if (command == "--compute-ratings") {
     ComputePlayerRatings();
+  } else if (command == "--search-book") {
+    const char* input_file_name = argc >= 3 ? argv[2] : "book.bin";
+    const char* output_file_name = argc >= 4 ? argv[3] : input_file_name;
+    SearchBookMoves(input_file_name, output_file_name);
   } else {
     std::printf("CLI: No such command. %s\n", command.c_str());
   }
@@ -139,7 +199,20 @@ void BenchmarkSearch() {
   go_options.byoyomi = 30000;
   thinking.Initialize();
   thinking.StartNewGame();
+#if defined(POSITION_INFO_STATS)
+  PositionInfoCache::ClearStats();
+#endif
   thinking.StartThinking(node, go_options);
+#if defined(POSITION_INFO_STATS)
+  PositionInfoCache::PrintStats();
+#endif
+
+  // 詰み探索のコストと、それによって得られた詰みの数を表示する（全スレッドの合計）
+  const Search::MateStats& mate_stats = thinking.mate_stats();
+  std::printf("Mate3: tried=%" PRIu64 " nodes=%" PRIu64 "\n",
+              mate_stats.mate3_tried, mate_stats.mate3_nodes);
+  std::printf("MateN: tried=%" PRIu64 " found=%" PRIu64 " nodes=%" PRIu64 "\n",
+              mate_stats.mate_n_tried, mate_stats.mate_n_found, mate_stats.mate_n_nodes);
 }
 
 /**
@@ -182,6 +255,67 @@ void BenchmarkMoveGeneration(const int num_calls) {
   }
 }
 
+/**
+ * SEE（Swap）のベンチマークを行います.
+ *
+ * 合法手すべて、及び取る手のみについて、Swap::Evaluate()を１手ずつ呼ぶ場合と、
+ * Swap::EvaluateMoves()でまとめて計算する場合の速度を比較します。
+ * @param num_calls 各テスト局面について、SEE値の計算を繰り返す回数
+ */
+void BenchmarkSwap(const int num_calls) {
+  std::printf("Start SEE Benchmark!\n\n");
+
+  // 1. テスト局面を準備する
+  // a. 初期局面
+  Position startpos = Position::CreateStartPosition();
+  // b. いわゆる「指し手生成祭り」局面
+  Position festivalpos = Position::FromSfen(
+      "l6nl/5+P1gk/2np1S3/p1p4Pp/3P2Sp1/1PPb2P1P/P5GS1/R8/LN4bKL w RGgsn5p 1");
+
+  // 2. 各テスト局面について、ベンチマークテストを行う
+  for (const Position& pos : {startpos, festivalpos}) {
+    std::printf("Position=%s\n", pos.ToSfen().c_str());
+
+    SimpleMoveList<kAllMoves, true> legal_moves(pos);
+    SimpleMoveList<kCaptures, true> captures(pos);
+
+    for (int i = 0; i < 2; ++i) {
+      const ExtMove* begin = i == 0 ? legal_moves.begin() : captures.begin();
+      const ExtMove* end = i == 0 ? legal_moves.end() : captures.end();
+      const size_t num_moves = end - begin;
+      Array<Score, Move::kMaxLegalMoves> scalar_values, batch_values;
+
+      // a. １手ずつ計算する
+      int64_t checksum = 0;
+      SimpleTimer scalar_timer;
+      for (int n = 0; n < num_calls; ++n) {
+        for (size_t j = 0; j < num_moves; ++j) {
+          scalar_values[j] = Swap::Evaluate(begin[j].move, pos);
+        }
+        checksum += scalar_values[n % std::max(num_moves, size_t(1))];
+      }
+      double scalar_elapsed = std::max(scalar_timer.GetElapsedSeconds(), 0.001);
+
+      // b. 移動先のマスごとにまとめて計算する
+      SimpleTimer batch_timer;
+      for (int n = 0; n < num_calls; ++n) {
+        Swap::EvaluateMoves(pos, begin, end, batch_values.begin());
+        checksum -= batch_values[n % std::max(num_moves, size_t(1))];
+      }
+      double batch_elapsed = std::max(batch_timer.GetElapsedSeconds(), 0.001);
+
+      // ベンチマークテストの結果を表示する
+      bool match = checksum == 0
+                && std::equal(scalar_values.begin(), scalar_values.begin() + num_moves,
+                              batch_values.begin());
+      std::printf("%-8s Moves=%3zu Scalar=%.3fsec Batch=%.3fsec Speedup=%.2fx Match=%s\n",
+                  i == 0 ? "AllMoves" : "Captures", num_moves, scalar_elapsed,
+                  batch_elapsed, scalar_elapsed / batch_elapsed, match ? "OK" : "NG");
+    }
+    std::printf("\n");
+  }
+}
+
 /**
  * １手詰関数のベンチマークテストを行うための、テスト局面集です.
  * テスト局面は、将棋ソフト「Blunder」（http://ak110.github.io/）と同じものを用いています.
@@ -244,6 +378,147 @@ void BenchmarkMateSearch(const int num_calls, const int ply) {
   }
 }
 
+/**
+ * 詰将棋問題集を使って、詰み関数の正確さと速度を測定します.
+ *
+ * 問題集ファイルの各行は、「SFEN（4フィールド） 最短の詰み手数」の形式です。
+ * 詰まない局面の場合は、詰み手数を0とします。また、#で始まる行は読み飛ばします。
+ * <pre>
+ * 4+R4/4n4/4S4/4k4/4p4/4NL3/9/9/8K b RBGSNLPb3g2sn2l16p 1 1
+ * lnsgkgsnl/1r5b1/ppppppppp/9/9/9/PPPPPPPPP/1B5R1/LNSGKGSNL b - 1 0
+ * </pre>
+ *
+ * 各詰み関数（１手詰・３手詰・５手詰・７手詰）について、全ての局面を全コアで並列に解き、
+ * 結果を１行１つのJSONオブジェクトとして標準出力に出力します（リリース間の比較用）。
+ *   - positions: 問題集の局面数、tested: 実際に詰み関数を呼んだ局面数、skipped: 王手がかかっているため飛ばした局面数
+ *   - false_positives: 詰まない（またはその手数では詰まない）のに詰みと判定した局面の数
+ *   - false_negatives: 関数の手数以内の詰みがあるのに見つけられなかった局面の数
+ *   - p50_ns等: 局面ごとの１回あたりの実行時間（ナノ秒）のパーセンタイル
+ *
+ * @param file_name 問題集ファイルのファイル名
+ * @param num_calls １局面あたりに詰み関数を呼び出す回数
+ */
+void BenchmarkMateSuite(const char* file_name, const int num_calls) {
+  struct Problem {
+    std::string sfen;
+    int mate_length;
+  };
+
+  // 1. 問題集ファイルを読み込む
+  std::ifstream ifs(file_name);
+  if (!ifs) {
+    std::printf("Failed to open %s.\n", file_name);
+    return;
+  }
+  std::vector<Problem> problems;
+  for (std::string line; std::getline(ifs, line);) {
+    if (line.empty() || line[0] == '#') {
+      continue;
+    }
+    std::istringstream iss(line);
+    std::string board, side, hand, ply;
+    Problem problem;
+    if (iss >> board >> side >> hand >> ply >> problem.mate_length) {
+      problem.sfen = board + " " + side + " " + hand + " " + ply;
+      problems.push_back(problem);
+    }
+  }
+  if (problems.empty()) {
+    std::printf("No problems in %s.\n", file_name);
+    return;
+  }
+
+  // 2. 各詰み関数について、ベンチマークを行う
+  const int num_threads = omp_get_max_threads();
+  const int num_problems = static_cast<int>(problems.size());
+
+  for (int max_plies : {1, 3, 5, 7}) {
+    std::vector<double> nanoseconds(num_problems, 0.0);
+    std::vector<int> skipped(num_problems, 0);
+    int64_t true_positives = 0, false_positives = 0;
+    int64_t true_negatives = 0, false_negatives = 0;
+    SimpleTimer total_timer;
+
+#pragma omp parallel for schedule(dynamic) reduction(+:true_positives, false_positives, true_negatives, false_negatives)
+    for (int i = 0; i < num_problems; ++i) {
+      const Problem& problem = problems[i];
+      Position pos = Position::FromSfen(problem.sfen);
+      const Key64 board_key = pos.ComputeBoardKey();
+
+      // 詰み関数は、王手がかかっていない局面でしか呼べない
+      if (pos.in_check()) {
+        skipped[i] = 1;
+        continue;
+      }
+
+      // ５手詰・７手詰関数のキャッシュは、呼び出しのたびに消去する（キャッシュヒットで速度を水増ししないため）
+      MateCache cache(256);
+      Move mate_move = kMoveNone;
+      bool found = false;
+      auto start = std::chrono::steady_clock::now();
+      for (int j = 0; j < num_calls; ++j) {
+        if (max_plies == 1) {
+          found = IsMateInOnePly(pos, &mate_move);
+        } else if (max_plies == 3) {
+          Mate3Result m3result;
+          found = IsMateInThreePlies(pos, &m3result);
+          mate_move = m3result.mate_move;
+        } else {
+          cache.Clear();
+          MateNResult mresult;
+          found = IsMateInNPlies(pos, board_key, max_plies, UINT64_MAX,
+                                 &cache, &mresult);
+          mate_move = mresult.mate_move;
+        }
+      }
+      auto end = std::chrono::steady_clock::now();
+      nanoseconds[i] = std::chrono::duration<double, std::nano>(end - start).count()
+                     / std::max(num_calls, 1);
+
+      // 正解と照合する（非合法な詰み手は、誤判定として扱う）
+      const bool expected = 0 < problem.mate_length && problem.mate_length <= max_plies;
+      if (found && (!expected || !pos.MoveIsLegal(mate_move))) {
+        false_positives += 1;
+      } else if (found) {
+        true_positives += 1;
+      } else if (expected) {
+        false_negatives += 1;
+      } else {
+        true_negatives += 1;
+      }
+    }
+
+    const double elapsed = std::max(total_timer.GetElapsedSeconds(), 0.001);
+
+    // 3. パーセンタイルを計算して、結果を出力する
+    std::vector<double> times;
+    for (int i = 0; i < num_problems; ++i) {
+      if (!skipped[i]) {
+        times.push_back(nanoseconds[i]);
+      }
+    }
+    std::sort(times.begin(), times.end());
+    auto percentile = [&](double p) -> double {
+      if (times.empty()) return 0.0;
+      size_t index = static_cast<size_t>(p * (times.size() - 1) + 0.5);
+      return times.at(index);
+    };
+    const int64_t num_tested = static_cast<int64_t>(times.size());
+
+    std::printf("{\"routine\":\"mate%d\",\"positions\":%d,\"tested\":%" PRId64 ",\"skipped\":%" PRId64
+                ",\"threads\":%d,\"calls_per_position\":%d"
+                ",\"true_positives\":%" PRId64 ",\"false_positives\":%" PRId64
+                ",\"true_negatives\":%" PRId64 ",\"false_negatives\":%" PRId64
+                ",\"calls_per_sec\":%.0f"
+                ",\"p50_ns\":%.0f,\"p90_ns\":%.0f,\"p99_ns\":%.0f,\"max_ns\":%.0f}\n",
+                max_plies, num_problems, num_tested, int64_t(num_problems) - num_tested,
+                num_threads, num_calls,
+                true_positives, false_positives, true_negatives, false_negatives,
+                num_tested * double(num_calls) / elapsed,
+                percentile(0.50), percentile(0.90), percentile(0.99), percentile(1.00));
+  }
+}
+
 /**
  * 定跡DBファイルを作成します.
  * @param output_dir_name 定跡データの出力先のディレクトリ名
@@ -274,14 +549,38 @@ void CreateBook(const std::string& output_dir_name) {
   }
 }
 
+/**
+ * 定跡DBファイルの全定跡手を探索して、評価値を付けます.
+ * 探索結果は「出力先のファイル名.checkpoint」に随時記録されるので、中断した場合は、同じ引数で再開できます。
+ * @param input_file_name  定跡DBファイル
+ * @param output_file_name 評価値を付けた定跡DBファイルの出力先
+ */
+void SearchBookMoves(const char* input_file_name, const char* output_file_name) {
+  // 評価関数を読み込む
+  UsiOptions usi_options;
+  Evaluation::ReadParametersFromFile("params.bin");
+#if defined(EVAL_NNUE)
+  Eval::load_eval(usi_options);
+#endif
+
+  // 定跡手を探索する
+  const std::string checkpoint_file_name = std::string(output_file_name) + ".checkpoint";
+  Book book;
+  book.ReadFromFile(input_file_name);
+  book.SearchAllBookMoves(checkpoint_file_name.c_str());
+  book.WriteToFile(output_file_name);
+
+  // 最後まで探索を終えたので、チェックポイントは不要になる
+  std::remove(checkpoint_file_name.c_str());
+}
+
 /**
  * 棋譜DBファイルの統計データを計算して、画面に表示します.
  * @param event_name 統計データを取得する対象の棋戦名（例："名人戦"など）
  */
 void ComputeStatsOfGameDatabase(const char* event_name) {
   // 1. 棋譜DBファイルを開く
-  std::ifstream game_db_file(GameDatabase::kDefaultDatabaseFile);
-  GameDatabase game_db(game_db_file);
+  GameDatabase game_db;
 
   // 2. 棋譜DBファイルを読み込む準備をする
   struct Stats {
@@ -423,17 +722,17 @@ void ComputeAllPossibleQuietMoves() {
  */
 void ComputePlayerRatings() {
   // 1. 棋譜DBファイルを開く
-  std::ifstream game_db_file(GameDatabase::kDefaultDatabaseFile);
-  GameDatabase game_db(game_db_file);
+  GameDatabase game_db;
   game_db.set_title_matches_only(true);
 
   // 2. 棋譜DBから全ての対局を読み込む
-  std::vector<Game> games;
-  for (Game game; game_db.ReadOneGame(&game);) {
-    if (game.result != Game::kDraw) {
-      games.push_back(game);
-    }
+  std::vector<Game> games = game_db.ReadAllGames();
+  if (game_db.failed()) {
+    return;
   }
+  games.erase(std::remove_if(games.begin(), games.end(), [](const Game& game) {
+    return game.result == Game::kDraw;
+  }), games.end());
   std::sort(games.begin(), games.end(), [](const Game& l, const Game& r) {
     return l.date < r.date;
   });
@@ -36,15 +36,21 @@ class Cli {
    *   - --bench-movegen      指し手生成のベンチマークテストを行う
    *   - --bench-mate1        １手詰関数のベンチマークテストを行う
    *   - --bench-mate3        ３手詰関数のベンチマークテストを行う
+   *   - --bench-mate-suite   詰将棋問題集を使って、詰み関数の正確さと速度を測定する
+   *   - --bench-huffman      局面のハフマン符号化・復号化のベンチマークテストを行う
    *   - --cluster            疎結合並列探索（GPS将棋風クラスタ）のマスターを起動する
    *   - --compute-all-quiets すべてのquiet movesを列挙する
    *   - --consultation       合議アルゴリズムを用いたクラスタのマスターを起動する
+   *   - --convert-book       古い形式の定跡DBファイルを、メモリマップしてそのまま使える形式に変換する
+   *   - --convert-game-db    棋譜DBファイルを、すぐに読み込めるバイナリ形式（kifu_db.bin）に変換する
+   *   - --convert-teacher-data 教師データのファイルを、ブロック単位で圧縮したアーカイブ形式に変換する
    *   - --create-book        棋譜DBファイルから定跡DBファイルを作成する
    *   - --db-stats           棋譜DBファイルの統計データを計算して表示する
-   *   - --learn              評価関数の学習を行う
+   *   - --learn              評価関数の学習を行う（--resumeを付けると、前回のチェックポイントから再開する）
    *   - --learn-progress     進行度推定関数の学習を行う
    *   - --learn-probability  指し手の実現確率の学習を行う
    *   - --compute-ratings    棋譜DBファイルに登場するプレイヤーのレーティングを計算する
+   *   - --search-book        定跡DBファイルの全定跡手を探索して評価値を付ける（中断しても、同じ引数で再開できる）
    */
   static void ExecuteCommand(int argc, char* argv[]);
 };
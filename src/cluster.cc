@@ -21,19 +21,108 @@
 
 #include "cluster.h"
 
+#include <algorithm>
+#include <chrono>
+#include <cinttypes>
+#include <fstream>
+#include <iostream>
 #include <sstream>
+#include <sched.h>
 #include "book.h"
 #include "movegen.h"
 #include "synced_printf.h"
+#include "tt_exchange.h"
 
 namespace {
 
 Book g_book;
 
+/** ワーカーの割り当てを見直す間隔 */
+constexpr std::chrono::milliseconds kRebalanceInterval(1000);
+
+/** 最善手からこれ以上劣るリーフノードは、反駁されたものとみなして、ワーカーを割り当て直す */
+constexpr Score kRefutedScoreMargin = static_cast<Score>(300);
+
+/** 反駁されたかどうかを判断するために、リーフノードで最低限必要な探索ノード数 */
+constexpr int64_t kMinNodesToJudgeRefuted = 1000000;
+
+/** PV上のリーフノードを分割する際の、ルートからの深さの上限 */
+constexpr size_t kMaxSplitDepth = 8;
+
+/** ダミーのワーカーが、１反復あたりに探索したことにするノード数 */
+constexpr int64_t kFakeNodesPerIteration = 200000;
+
+/** ダミーのワーカーが、時間制限のあるgoコマンドに対して行う反復の回数 */
+constexpr int kFakeFiniteDepth = 4;
+
+/**
+ * このプロセスが使用を許可されているCPUのリストを返します（taskset、cgroups等による制限を反映する）.
+ */
+std::vector<int> GetAllowedCpuIds() {
+  std::vector<int> cpu_ids;
+  cpu_set_t cpu_set;
+  CPU_ZERO(&cpu_set);
+  if (sched_getaffinity(0, sizeof(cpu_set), &cpu_set) == 0) {
+    for (int cpu_id = 0; cpu_id < CPU_SETSIZE; ++cpu_id) {
+      if (CPU_ISSET(cpu_id, &cpu_set)) {
+        cpu_ids.push_back(cpu_id);
+      }
+    }
+  }
+  if (cpu_ids.empty()) {
+    const int num_cpus = std::max(std::thread::hardware_concurrency(), 1u);
+    for (int cpu_id = 0; cpu_id < num_cpus; ++cpu_id) {
+      cpu_ids.push_back(cpu_id);
+    }
+  }
+  return cpu_ids;
+}
+
+/**
+ * 「0-3,8」のような形式のCPUのリストを解釈します.
+ * @return 正しい形式であれば、true
+ */
+bool ParseCpuList(const std::string& str, std::vector<int>* const cpu_ids) {
+  std::istringstream is(str);
+  for (std::string range; std::getline(is, range, ','); ) {
+    int first = -1, last = -1;
+    char dash = 0;
+    std::istringstream range_is(range);
+    if (!(range_is >> first) || first < 0 || first >= CPU_SETSIZE) {
+      return false;
+    }
+    last = first;
+    if (range_is >> dash) {
+      if (dash != '-' || !(range_is >> last) || last < first || last >= CPU_SETSIZE) {
+        return false;
+      }
+    }
+    for (int cpu_id = first; cpu_id <= last; ++cpu_id) {
+      cpu_ids->push_back(cpu_id);
+    }
+  }
+  return !cpu_ids->empty();
+}
+
+/**
+ * ダミーのワーカーが用いる、局面から決まる評価値です（-1000〜+1000点）.
+ * Zobristハッシュの乱数はプロセスごとに異なるため、SFEN文字列のハッシュ値（FNV-1a）を用います。
+ */
+Score ComputeFakeScore(const Position& pos) {
+  uint64_t x = UINT64_C(0xcbf29ce484222325);
+  for (char c : pos.ToSfen()) {
+    x = (x ^ static_cast<uint8_t>(c)) * UINT64_C(0x100000001b3);
+  }
+  x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+  x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+  x ^= x >> 31;
+  return static_cast<Score>(static_cast<int>(x % 2001) - 1000);
+}
+
 }
 
 void MinimaxNode::Split(const std::vector<std::string>& split_moves) {
-  assert(is_leaf_node() && ignoremoves_.empty()); // この場合のみ分割できる
+  assert(is_leaf_node()); // リーフノードのみ分割できる
 
   if (split_moves.empty()) {
     return;
@@ -47,6 +136,14 @@ void MinimaxNode::Split(const std::vector<std::string>& split_moves) {
     child.root_position_sfen_ = root_position_sfen_;
     child.path_from_root_ = path_from_root_;
     child.path_from_root_.push_back(move);
+
+    // これまでの最善手に対応する子ノードには、これまでの探索情報を引き継ぐ
+    // （子ノードは相手の手番なので、評価値を反転する）
+    if (   usi_info_.pv.size() > path_from_root_.size()
+        && usi_info_.pv.at(path_from_root_.size()) == move) {
+      child.usi_info_ = usi_info_;
+      child.usi_info_.score = -usi_info_.score;
+    }
   }
 
   // その他すべての手は、最後のノードにまとめて割り当てる
@@ -56,7 +153,9 @@ void MinimaxNode::Split(const std::vector<std::string>& split_moves) {
     child.parent_ = this;
     child.root_position_sfen_ = root_position_sfen_;
     child.path_from_root_ = path_from_root_;
-    child.ignoremoves_ = split_moves;
+    child.ignoremoves_ = ignoremoves_;
+    child.ignoremoves_.insert(child.ignoremoves_.end(),
+                              split_moves.begin(), split_moves.end());
   }
 }
 
@@ -109,7 +208,7 @@ void MinimaxNode::UpdateMinimaxTree() {
   // Step 1. usi_info_を更新する
   //
   if (!is_leaf_node()) {
-    int best_child_id = 0;
+    size_t best_child_id = 0;
     int max_seldepth = 0;
     Score best_score = -kScoreInfinite - 1;
     int64_t total_nps = 0, total_nodes = 0;
@@ -120,11 +219,7 @@ void MinimaxNode::UpdateMinimaxTree() {
       const UsiInfo& child_info = child->usi_info_;
 
       // 子ノードの評価値を取得する
-      Score child_score = child_info.score;
-      if (child->ignoremoves_.empty()) {
-        // ignoremovesが指定されていなければ、相手の手番なので、評価値を反転する
-        child_score = -child_score;
-      }
+      Score child_score = child->score_from_parent();
 
       // 子ノードで最大の評価値を更新する
       if (child_score > best_score) {
@@ -150,6 +245,7 @@ void MinimaxNode::UpdateMinimaxTree() {
     usi_info_.hashfull = best_node_info.hashfull;
     usi_info_.nps      = total_nps;
     usi_info_.pv       = best_node_info.pv;
+    best_child_id_ = best_child_id;
   }
 
   //
@@ -164,11 +260,28 @@ void MinimaxNode::Reset() {
   parent_ = nullptr;
   child_nodes_.clear();
   usi_info_ = UsiInfo();
+  best_child_id_ = 0;
   root_position_sfen_.clear();
   path_from_root_.clear();
   ignoremoves_.clear();
 }
 
+MinimaxNode* MinimaxNode::FindPrincipalLeafNode() {
+  MinimaxNode* node = this;
+  while (!node->is_leaf_node()) {
+    node = node->child_nodes_.at(node->best_child_id_).get();
+  }
+  return node;
+}
+
+Score MinimaxNode::ComputeScoreDeficit() const {
+  Score deficit = kScoreZero;
+  for (const MinimaxNode* node = this; node->parent_ != nullptr; node = node->parent_) {
+    deficit = std::max(deficit, node->parent_->usi_info_.score - node->score_from_parent());
+  }
+  return deficit;
+}
+
 ClusterWorker::ClusterWorker(size_t worker_id, Cluster& cluster)
     : worker_id_(worker_id),
       cluster_(cluster) {
@@ -183,30 +296,35 @@ ClusterWorker::~ClusterWorker() {
 }
 
 void ClusterWorker::Initialize() {
+  const UsiOptions& options = cluster_.usi_options();
+  const bool local_workers = options["ClusterLocalWorkers"];
+  const size_t num_workers = cluster_.num_workers();
+
   // 1. 外部プロセスを使い、USIエンジンを起動する
-  if (worker_id_ == cluster_.master_worker_id()) {
-    // a. マスターの起動
+  if (local_workers || worker_id_ == cluster_.master_worker_id()) {
+    // a. マスター、またはローカルマシンのワーカーの起動: パイプで通信する
+    std::string command = "exec " + cluster_.worker_command(worker_id_);
     char* const args[] = {
-        const_cast<char*>("./release"),
+        const_cast<char*>("sh"),
+        const_cast<char*>("-c"),
+        const_cast<char*>(command.c_str()),
         NULL
     };
-    if (external_process_.StartProcess(args[0], args) < 0) {
+    // ローカルマシンのワーカーは、割り当てられたCPUに固定する
+    const std::vector<int>& cpu_ids = local_workers ? cluster_.worker_cpu_ids(worker_id_)
+                                                    : std::vector<int>();
+    if (external_process_.StartProcess(args[0], args, cpu_ids) < 0) {
       std::perror("StartProcess()\n");
       return;
     }
   } else {
-    // b. ワーカーの起動
+    // b. リモートマシンのワーカーの起動: SSHで通信する
     std::string worker_name = "worker-" + std::to_string(worker_id_);
+    std::string command = "cd gikou/bin; " + cluster_.worker_command(worker_id_);
     char* const args[] = {
-#if 1
-        // リモートマシンをワーカーとして使用する場合: SSHで通信する
         const_cast<char*>("ssh"),
         const_cast<char*>(worker_name.c_str()), // ~/.ssh/configでワーカーのホスト名を設定しておく
-        const_cast<char*>("cd gikou/bin; ./release"), // ディレクトリを移動後、実行する
-#else
-        // ローカルマシンをワーカーとして使用する場合: パイプで通信する
-        const_cast<char*>("./release"),
-#endif
+        const_cast<char*>(command.c_str()), // ディレクトリを移動後、実行する
         NULL
     };
     if (external_process_.StartProcess(args[0], args) < 0) {
@@ -215,13 +333,23 @@ void ClusterWorker::Initialize() {
     }
   }
 
-  // 2. 対局準備のため、USIコマンドをエンジンに送信する
-  SendCommand("usi");
-  const UsiOptions& options = cluster_.usi_options(); // オプションの一部を下流に伝達する
-  SendCommand("setoption name USI_Hash value %d", (int)options["USI_Hash"]);
-  SendCommand("setoption name Threads value %d", (int)options["Threads"]);
-  SendCommand("setoption name DrawScore value %d", (int)options["DrawScore"]);
-  SendCommand("isready");
+  // 2. 対局準備のため、USIコマンドをエンジンに送信する（オプションの一部を下流に伝達する）
+  // ローカルマシンのワーカーは、１台のマシンを分け合うので、スレッド数とハッシュサイズを等分する
+  int hash_size = options["USI_Hash"], num_threads = options["Threads"];
+  if (local_workers) {
+    hash_size = std::max(hash_size / static_cast<int>(num_workers), 1);
+    num_threads = std::max(num_threads / static_cast<int>(num_workers), 1);
+  }
+  SendCommand("usi\n"
+              "setoption name USI_Hash value %d\n"
+              "setoption name Threads value %d\n"
+              "setoption name DrawScore value %d\n"
+              "setoption name TTExportDepth value %d\n"
+              "setoption name TTExportMaxEntries value %d\n"
+              "isready",
+              hash_size, num_threads, (int)options["DrawScore"],
+              (int)options["ClusterTTExchangeDepth"],
+              (int)options["ClusterTTExchangeMaxEntries"]);
 
   // 3. readyokが送られてくるまで待機する
   for (std::string line; RecieveCommand(&line); ) {
@@ -237,7 +365,21 @@ void ClusterWorker::Run() {
     is >> token;
     if (token == "info") {
       UsiInfo info = UsiProtocol::ParseInfoCommand(is);
-      cluster_.UpdateInfo(worker_id_, info);
+      // info stringや、読み筋を含まないinfoコマンドは、ミニマックス木の評価値を壊すので無視する
+      if (info.string.empty() && !info.pv.empty()) {
+        cluster_.UpdateInfo(worker_id_, info);
+      }
+    } else if (token == "ttdata") {
+      std::string payload;
+      is >> payload;
+      cluster_.ForwardTtData(worker_id_, payload);
+    } else if (token == "ttstats") {
+      uint64_t num_exported = 0, num_imported = 0;
+      for (std::string name; is >> name; ) {
+        if      (name == "exported") is >> num_exported;
+        else if (name == "imported") is >> num_imported;
+      }
+      cluster_.RecordTtStats(worker_id_, num_imported);
     } else if (token == "bestmove") {
       break;
     }
@@ -246,6 +388,28 @@ void ClusterWorker::Run() {
 
 Cluster::Cluster()
     : UsiProtocol("Gikou Cluster", "Yosuke Demura") {
+  UsiOptions& options = mutable_usi_options();
+
+  // ワーカー数
+  options.Add("ClusterWorkers", UsiOption(16, 1, 64));
+
+  // 全ワーカーを、このマシン上のプロセスとして起動する場合はtrue（falseならば、sshでリモートマシンに起動する）
+  options.Add("ClusterLocalWorkers", UsiOption(false));
+
+  // ワーカーのエンジンを起動するコマンド
+  options.Add("ClusterWorkerCommand", UsiOption("./release", 0));
+
+  // ローカルのワーカーを、それぞれ別のCPUに固定する場合はtrue
+  options.Add("ClusterCpuPinning", UsiOption(true));
+
+  // ワーカーごとのCPUと起動コマンドを指定するファイル
+  options.Add("ClusterWorkerConfigFile", UsiOption("<empty>", 0));
+
+  // ワーカー間で交換する置換表のエントリの、最小の深さ（0の場合は、交換しない）
+  options.Add("ClusterTTExchangeDepth", UsiOption(0, 0, kMaxPly));
+
+  // 各ワーカーが１秒あたりにエクスポートする、置換表のエントリ数の上限
+  options.Add("ClusterTTExchangeMaxEntries", UsiOption(1000, 1, 100000));
 }
 
 void Cluster::OnIsreadyCommandEntered() {
@@ -255,6 +419,11 @@ void Cluster::OnIsreadyCommandEntered() {
   // ワーカを必要なだけ起動する
   if (workers_.empty()) {
     // 初回は別プロセスを立ち上げる
+    num_workers_ = usi_options()["ClusterWorkers"];
+    ConfigureWorkers();
+    num_tt_entries_exported_.assign(num_workers_, 0);
+    num_tt_entries_forwarded_.assign(num_workers_, 0);
+    num_tt_entries_imported_.assign(num_workers_, 0);
     for (size_t worker_id = 0; worker_id < num_workers_; ++worker_id) {
       ClusterWorker* engine = new ClusterWorker(worker_id, *this);
       engine->StartNewThread();
@@ -281,6 +450,67 @@ void Cluster::OnIsreadyCommandEntered() {
   SYNCED_PRINTF("readyok\n");
 }
 
+void Cluster::ConfigureWorkers() {
+  worker_commands_.assign(num_workers_, std::string());
+  worker_cpu_ids_.assign(num_workers_, std::vector<int>());
+
+  // 1. 設定ファイルから、ワーカーごとのCPUと起動コマンドを読み込む
+  std::vector<bool> cpu_specified(num_workers_, false);
+  const std::string config_file = usi_options()["ClusterWorkerConfigFile"].string();
+  if (!config_file.empty() && config_file != "<empty>") {
+    std::ifstream ifs(config_file);
+    if (!ifs) {
+      SYNCED_PRINTF("info string Failed to open %s.\n", config_file.c_str());
+    }
+    size_t worker_id = 0;
+    for (std::string line; worker_id < num_workers_ && std::getline(ifs, line); ) {
+      line = line.substr(0, line.find('#'));
+      std::istringstream is(line);
+      std::string cpu_list;
+      if (!(is >> cpu_list)) {
+        continue; // 空行
+      }
+      if (cpu_list != "-") {
+        if (ParseCpuList(cpu_list, &worker_cpu_ids_.at(worker_id))) {
+          cpu_specified.at(worker_id) = true;
+        } else {
+          SYNCED_PRINTF("info string Invalid CPU list for worker %zu: %s\n",
+                        worker_id, cpu_list.c_str());
+          worker_cpu_ids_.at(worker_id).clear();
+        }
+      }
+      std::getline(is >> std::ws, worker_commands_.at(worker_id));
+      ++worker_id;
+    }
+  }
+
+  // 2. CPUが指定されていないワーカーには、このプロセスが使えるCPUを等分して割り当てる
+  if (!usi_options()["ClusterCpuPinning"]) {
+    return;
+  }
+  const std::vector<int> allowed_cpus = GetAllowedCpuIds();
+  const size_t num_cpus = allowed_cpus.size();
+  for (size_t worker_id = 0; worker_id < num_workers_; ++worker_id) {
+    std::vector<int>& cpu_ids = worker_cpu_ids_.at(worker_id);
+    if (cpu_specified.at(worker_id)) {
+      continue;
+    }
+    for (size_t i = worker_id * num_cpus / num_workers_;
+         i < (worker_id + 1) * num_cpus / num_workers_; ++i) {
+      cpu_ids.push_back(allowed_cpus.at(i));
+    }
+    if (cpu_ids.empty()) {
+      // CPUよりもワーカーが多い場合は、複数のワーカーで同じCPUを共有する
+      cpu_ids.push_back(allowed_cpus.at(worker_id % num_cpus));
+    }
+  }
+}
+
+std::string Cluster::worker_command(size_t worker_id) const {
+  const std::string& command = worker_commands_.at(worker_id);
+  return command.empty() ? usi_options()["ClusterWorkerCommand"].string() : command;
+}
+
 void Cluster::OnUsinewgameCommandEntered() {
   SendCommandToAllWorkers("usinewgame");
 }
@@ -315,16 +545,18 @@ void Cluster::OnGoCommandEntered(const UsiGoOptions& go_options) {
   }
 
   // 4. MultiPV探索を行い、ワーカを割り当てる指し手を決める
-  int kMaxSplitAtRoot = 8;
+  // （ルートの分割で生じるリーフノードの数が、ワーカー数を超えないようにする）
+  int kMaxSplitAtRoot = std::min(8, static_cast<int>(num_workers_));
   size_t multipv = std::min(num_legal_moves, kMaxSplitAtRoot - 1);
   std::vector<UsiInfo> presearch_infos(multipv);
   ClusterWorker& master = master_worker();
   if (multipv >= 1) {
     // MultiPV探索の指示を出す
-    master.SendCommand("setoption name OwnBook value false");
-    master.SendCommand("setoption name MultiPV value %zu", multipv);
-    master.SendCommand(position_sfen().c_str());
-    master.SendCommand("go byoyomi %d", kPresearchTime);
+    master.SendCommand("setoption name OwnBook value false\n"
+                       "setoption name MultiPV value %zu\n"
+                       "%s\n"
+                       "go byoyomi %d",
+                       multipv, position_sfen().c_str(), kPresearchTime);
     // infoコマンドを受信して、上位の手を調べる
     for (std::string line; master.RecieveCommand(&line); ) {
       std::istringstream is(line);
@@ -347,7 +579,6 @@ void Cluster::OnGoCommandEntered(const UsiGoOptions& go_options) {
   // 5. MultiPV探索で得られた情報を元に、探索木を構築する
   root_of_minimax_tree_.Reset();
   root_of_minimax_tree_.set_root_position_sfen(position_sfen());
-  leaf_nodes_.clear();
   // a. 深さ１: ルートを最大８分割する
   {
     std::vector<std::string> split_moves;
@@ -356,17 +587,19 @@ void Cluster::OnGoCommandEntered(const UsiGoOptions& go_options) {
     }
     root_of_minimax_tree_.Split(split_moves);
   }
-  // b. 深さ２: 上位７手については、更に２分割する
-  for (size_t i = 0; i < presearch_infos.size(); ++i) {
+  // b. 深さ２: 上位７手については、更に２分割する（ワーカー数に余裕がある場合のみ）
+  size_t num_leaf_nodes = multipv + 1;
+  for (size_t i = 0; i < presearch_infos.size() && num_leaf_nodes < num_workers_; ++i) {
     const std::vector<std::string>& pv = presearch_infos.at(i).pv;
     if (pv.size() >= 2) {
       MinimaxNode& child = root_of_minimax_tree_.GetChild(i);
       std::vector<std::string> split_moves{pv.at(1)};
       child.Split(split_moves);
+      ++num_leaf_nodes;
     }
   }
-  // c. 深さ３: 最善手については、更に２分割する
-  {
+  // c. 深さ３: 最善手については、更に２分割する（ワーカー数に余裕がある場合のみ）
+  if (!presearch_infos.empty() && num_leaf_nodes < num_workers_) {
     const std::vector<std::string>& pv = presearch_infos.front().pv;
     if (pv.size() >= 3) {
       MinimaxNode& grandchild = root_of_minimax_tree_.GetChild(0).GetChild(0);
@@ -374,18 +607,22 @@ void Cluster::OnGoCommandEntered(const UsiGoOptions& go_options) {
       grandchild.Split(split_moves);
     }
   }
-  root_of_minimax_tree_.RegisterAllLeafNodes(&leaf_nodes_);
-  assert(leaf_nodes_.size() <= workers_.size());
+  std::vector<MinimaxNode*> leaf_nodes;
+  root_of_minimax_tree_.RegisterAllLeafNodes(&leaf_nodes);
+  assert(leaf_nodes.size() <= workers_.size());
 
   // 6. 各リーフノードについて、それぞれ１台のワーカを割り当てる
-  for (size_t worker_id = 0; worker_id < leaf_nodes_.size(); ++worker_id) {
-    std::unique_ptr<ClusterWorker>& worker = workers_.at(worker_id);
-    const MinimaxNode& leaf_node = *leaf_nodes_.at(worker_id);
-    worker->SendCommand("%s", leaf_node.GetPositionCommand().c_str());
-    worker->SendCommand("%s", leaf_node.GetGoCommand().c_str());
-    worker->ExecuteTask();
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    leaf_nodes_.assign(workers_.size(), nullptr);
+    for (size_t worker_id = 0; worker_id < leaf_nodes.size(); ++worker_id) {
+      AssignLeafNode(worker_id, leaf_nodes.at(worker_id));
+    }
   }
 
+  // 7. 探索中は、定期的にワーカーの割り当てを見直す
+  StartRebalancing();
+
 #define USE_SIMPLE_TIMER
 #ifdef USE_SIMPLE_TIMER
   if (!go_options.infinite && !go_options.ponder) {
@@ -400,6 +637,9 @@ void Cluster::OnGoCommandEntered(const UsiGoOptions& go_options) {
 }
 
 void Cluster::OnStopCommandEntered() {
+  // ワーカーの割り当ての見直しを終了する
+  StopRebalancing();
+
   // 下流の各エンジンにstopコマンドを送信する
   SendCommandToAllWorkers("stop");
 
@@ -408,6 +648,17 @@ void Cluster::OnStopCommandEntered() {
     worker->WaitUntilTaskIsFinished();
   }
 
+  // 置換表のエントリを交換している場合は、ワーカーごとの交換したエントリ数を出力する
+  if (usi_options()["ClusterTTExchangeDepth"] > 0) {
+    for (size_t worker_id = 0; worker_id < num_tt_entries_exported_.size(); ++worker_id) {
+      SYNCED_PRINTF("info string ttexchange worker %zu exported %" PRIu64 " received %" PRIu64
+                    " imported %" PRIu64 "\n",
+                    worker_id, num_tt_entries_exported_.at(worker_id),
+                    num_tt_entries_forwarded_.at(worker_id),
+                    num_tt_entries_imported_.at(worker_id));
+    }
+  }
+
   // 最善手を送信する
   const std::vector<std::string>& pv = root_of_minimax_tree_.usi_info().pv;
   if (pv.empty()) {
@@ -446,11 +697,17 @@ void Cluster::UpdateInfo(int worker_id, const UsiInfo& usi_info) {
   // 前回の最善手情報を保存しておく
   const UsiInfo previous_info = root_of_minimax_tree_.usi_info();
 
+  // 割り当てを変更中のワーカーから届いた情報は、捨てる
+  MinimaxNode* leaf_node = leaf_nodes_.at(worker_id);
+  if (leaf_node == nullptr) {
+    return;
+  }
+
   // たったいま受信したUSIのinfoコマンドの内容を保存する
-  leaf_nodes_.at(worker_id)->set_usi_info(usi_info);
+  leaf_node->set_usi_info(usi_info);
 
   // ミニマックス木を更新する
-  leaf_nodes_.at(worker_id)->UpdateMinimaxTree();
+  leaf_node->UpdateMinimaxTree();
 
   // ミニマックス木更新後の最善手情報を取得する
   const UsiInfo& current_info = root_of_minimax_tree_.usi_info();
@@ -466,4 +723,283 @@ void Cluster::UpdateInfo(int worker_id, const UsiInfo& usi_info) {
   }
 }
 
+void Cluster::ForwardTtData(size_t worker_id, const std::string& payload) {
+  // 1. 転送先（探索中の他のワーカー）を決める
+  std::vector<size_t> destinations;
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    const uint64_t num_entries = TtExchange::CountEntries(payload);
+    num_tt_entries_exported_.at(worker_id) += num_entries;
+    for (size_t i = 0; i < leaf_nodes_.size(); ++i) {
+      if (i != worker_id && leaf_nodes_.at(i) != nullptr) {
+        destinations.push_back(i);
+        num_tt_entries_forwarded_.at(i) += num_entries;
+      }
+    }
+  }
+
+  // 2. 転送する（パイプへの書き込みで、ミニマックス木の更新を止めないように、ロックの外で行う）
+  for (size_t i : destinations) {
+    workers_.at(i)->SendCommand("ttdata %s", payload.c_str());
+  }
+}
+
+void Cluster::RecordTtStats(size_t worker_id, uint64_t num_imported) {
+  std::unique_lock<std::mutex> lock(mutex_);
+  num_tt_entries_imported_.at(worker_id) = num_imported;
+}
+
+void Cluster::AssignLeafNode(size_t worker_id, MinimaxNode* leaf_node) {
+  std::unique_ptr<ClusterWorker>& worker = workers_.at(worker_id);
+  leaf_nodes_.at(worker_id) = leaf_node;
+  worker->SendCommand("%s\n%s",
+                      leaf_node->GetPositionCommand().c_str(),
+                      leaf_node->GetGoCommand().c_str());
+  worker->ExecuteTask();
+}
+
+void Cluster::StartRebalancing() {
+  stop_rebalancing_ = false;
+  rebalance_thread_ = std::thread([this]() {
+    std::unique_lock<std::mutex> lock(rebalance_mutex_);
+    while (!rebalance_condition_.wait_for(lock, kRebalanceInterval,
+                                          [this](){ return stop_rebalancing_; })) {
+      lock.unlock();
+      RebalanceWorkers();
+      lock.lock();
+    }
+  });
+}
+
+void Cluster::StopRebalancing() {
+  if (!rebalance_thread_.joinable()) {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lock(rebalance_mutex_);
+    stop_rebalancing_ = true;
+    rebalance_condition_.notify_one();
+  }
+  rebalance_thread_.join();
+}
+
+void Cluster::RebalanceWorkers() {
+  std::unique_lock<std::mutex> lock(mutex_);
+
+  // 1. PV上のリーフノードと、それを探索しているワーカーを調べる
+  MinimaxNode* pv_leaf = root_of_minimax_tree_.FindPrincipalLeafNode();
+  size_t pv_worker_id = SIZE_MAX;
+  for (size_t worker_id = 0; worker_id < leaf_nodes_.size(); ++worker_id) {
+    if (leaf_nodes_.at(worker_id) == pv_leaf) {
+      pv_worker_id = worker_id;
+    }
+  }
+
+  // 2. 割り当てを変更するワーカーを選ぶ
+  size_t donor_id = SIZE_MAX;
+  // a. 何も探索していないワーカーがいれば、そのワーカーを選ぶ
+  for (size_t worker_id = 0; worker_id < leaf_nodes_.size(); ++worker_id) {
+    if (   worker_id != pv_worker_id
+        && (leaf_nodes_.at(worker_id) == nullptr || !workers_.at(worker_id)->is_running())) {
+      donor_id = worker_id;
+      break;
+    }
+  }
+  // b. いなければ、最善手から最も大きく劣るリーフノードを探索しているワーカーを選ぶ
+  if (donor_id == SIZE_MAX) {
+    Score max_deficit = kRefutedScoreMargin - 1;
+    for (size_t worker_id = 0; worker_id < leaf_nodes_.size(); ++worker_id) {
+      const MinimaxNode* leaf_node = leaf_nodes_.at(worker_id);
+      if (   worker_id == pv_worker_id
+          || leaf_node->usi_info().nodes < kMinNodesToJudgeRefuted) {
+        continue;
+      }
+      Score deficit = leaf_node->ComputeScoreDeficit();
+      if (deficit > max_deficit) {
+        max_deficit = deficit;
+        donor_id = worker_id;
+      }
+    }
+  }
+  if (donor_id == SIZE_MAX) {
+    return;
+  }
+
+  // 3. PV上のリーフノードを探索しているワーカーがいなければ、そのまま割り当てる
+  // （以前ワーカーを外したリーフノードが、他のノードの評価値が下がったことで、再び最善になった場合）
+  if (pv_worker_id == SIZE_MAX) {
+    leaf_nodes_.at(donor_id) = nullptr;
+    workers_.at(donor_id)->SendCommand("stop");
+    lock.unlock();
+    workers_.at(donor_id)->WaitUntilTaskIsFinished();
+    lock.lock();
+    AssignLeafNode(donor_id, pv_leaf);
+    return;
+  }
+
+  // 4. PV上のリーフノードを、その最善手とその他の手に分割する
+  const std::vector<std::string>& pv = pv_leaf->usi_info().pv;
+  const size_t depth = pv_leaf->path_from_root().size();
+  if (depth >= kMaxSplitDepth || pv.size() <= depth) {
+    return;
+  }
+  const std::vector<std::string> split_moves{pv.at(depth)};
+
+  // 5. 両方のワーカーの探索を止める（止めている間に届いた情報は、UpdateInfo()で捨てられる）
+  leaf_nodes_.at(pv_worker_id) = nullptr;
+  leaf_nodes_.at(donor_id) = nullptr;
+  workers_.at(pv_worker_id)->SendCommand("stop");
+  workers_.at(donor_id)->SendCommand("stop");
+  lock.unlock();
+  workers_.at(pv_worker_id)->WaitUntilTaskIsFinished();
+  workers_.at(donor_id)->WaitUntilTaskIsFinished();
+  lock.lock();
+
+  // 6. 最善手の子ノードは元のワーカーに、その他の手の子ノードは選んだワーカーに探索させる
+  // なお、選んだワーカーが探索していたリーフノードには、それまでの探索情報がそのまま残る
+  pv_leaf->Split(split_moves);
+  AssignLeafNode(pv_worker_id, &pv_leaf->GetChild(0));
+  AssignLeafNode(donor_id, &pv_leaf->GetChild(1));
+}
+
+void FakeClusterWorker::Start() {
+  std::setvbuf(stdout, NULL, _IONBF, 0);
+
+  Position pos = Position::CreateStartPosition();
+  std::thread search_thread;
+  auto stop_search = [&]() {
+    stop_ = true;
+    if (search_thread.joinable()) {
+      search_thread.join();
+    }
+  };
+
+  for (std::string line; std::getline(std::cin, line); ) {
+    std::istringstream is(line);
+    std::string type;
+    is >> type;
+
+    if (type == "usi") {
+      SYNCED_PRINTF("id name Gikou Fake Cluster Worker\n");
+      SYNCED_PRINTF("id author Yosuke Demura\n");
+      SYNCED_PRINTF("usiok\n");
+
+    } else if (type == "isready") {
+      SYNCED_PRINTF("readyok\n");
+
+    } else if (type == "setoption") {
+      // MultiPVのみ対応する（その他のオプションは無視する）
+      std::string token, name, value;
+      while (is >> token) {
+        if (token == "name") {
+          is >> name;
+        } else if (token == "value") {
+          is >> value;
+        }
+      }
+      if (name == "MultiPV" && !value.empty()) {
+        multipv_ = std::max(std::stoi(value), 1);
+      }
+
+    } else if (type == "position") {
+      std::string token;
+      is >> token;
+      if (token == "startpos") {
+        pos = Position::CreateStartPosition();
+        is >> token;
+      } else if (token == "sfen") {
+        std::string board, stm, hands, move_count;
+        is >> board >> stm >> hands >> move_count;
+        pos = Position::FromSfen(board + " " + stm + " " + hands + " " + move_count);
+        is >> token;
+      }
+      if (token == "moves") {
+        for (std::string move_str; is >> move_str; ) {
+          pos.MakeMove(Move::FromSfen(move_str, pos));
+        }
+      }
+
+    } else if (type == "go") {
+      stop_search();
+      bool infinite = false;
+      std::vector<std::string> ignoremoves;
+      for (std::string token; is >> token; ) {
+        if (token == "infinite" || token == "ponder") {
+          infinite = true;
+        } else if (token == "ignoremoves") {
+          for (std::string move_str; is >> move_str; ) {
+            ignoremoves.push_back(move_str);
+          }
+        }
+      }
+      stop_ = false;
+      search_thread = std::thread([=]() { Search(pos, ignoremoves, infinite); });
+
+    } else if (type == "stop") {
+      stop_search();
+
+    } else if (type == "quit") {
+      stop_search();
+      return;
+    }
+  }
+  stop_search();
+}
+
+void FakeClusterWorker::Search(Position pos, std::vector<std::string> ignoremoves,
+                               bool infinite) {
+  // 1. ignoremovesに含まれない各合法手に、指した後の局面のハッシュ値から評価値を与える
+  std::vector<std::pair<Score, std::string>> root_moves;
+  for (const ExtMove& em : SimpleMoveList<kAllMoves, true>(pos)) {
+    std::string move_str = em.move.ToSfen();
+    if (std::find(ignoremoves.begin(), ignoremoves.end(), move_str) != ignoremoves.end()) {
+      continue;
+    }
+    Position next = pos;
+    next.MakeMove(em.move);
+    root_moves.emplace_back(ComputeFakeScore(next), move_str);
+  }
+  std::stable_sort(root_moves.begin(), root_moves.end(),
+                   [](const std::pair<Score, std::string>& lhs,
+                      const std::pair<Score, std::string>& rhs) {
+    return lhs.first > rhs.first;
+  });
+
+  // 2. 反復深化を模して、一定間隔でinfoコマンドを出力する
+  if (!root_moves.empty()) {
+    const size_t num_pvs = std::min(static_cast<size_t>(multipv_), root_moves.size());
+    for (int depth = 1; ; ++depth) {
+      const int64_t time = depth * 100;
+      const int64_t nodes = depth * kFakeNodesPerIteration;
+      for (size_t i = 0; i < num_pvs; ++i) {
+        SYNCED_PRINTF("info depth %d seldepth %d time %" PRId64 " nodes %" PRId64
+                      " nps %" PRId64 " score cp %d multipv %zu pv %s\n",
+                      depth, depth, time, nodes, nodes * 1000 / time,
+                      static_cast<int>(root_moves.at(i).first), i + 1,
+                      root_moves.at(i).second.c_str());
+      }
+      if (!infinite && depth >= kFakeFiniteDepth) {
+        break;
+      }
+      // 次の反復まで待つ（stopコマンドが来たら、すぐに打ち切る）
+      for (int i = 0; i < 10 && !stop_; ++i) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      if (stop_) {
+        break;
+      }
+    }
+  }
+
+  // 3. 時間制限がない場合は、stopコマンドが来るまでbestmoveを返さない
+  while (infinite && !stop_) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(10));
+  }
+  if (root_moves.empty()) {
+    SYNCED_PRINTF("bestmove resign\n");
+  } else {
+    SYNCED_PRINTF("bestmove %s\n", root_moves.front().second.c_str());
+  }
+}
+
 #endif /* !defined(MINIMUM) */
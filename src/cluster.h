@@ -22,7 +22,11 @@
 
 #if !defined(MINIMUM)
 
+#include <atomic>
+#include <condition_variable>
 #include <memory>
+#include <string>
+#include <thread>
 #include <vector>
 #include "node.h"
 #include "process.h"
@@ -41,6 +45,9 @@ class Cluster;
  * 4. 得られたリーフノードに、ワーカーマシンを割り当てて探索します
  * 5. ワーカーマシンからUSIのinfoコマンドを受信したら、UpdateMinimaxTree()を使ってミニマックス木を更新します。
  * 6. 探索後、最終的に得られた最善手が、ルートノードのusi_info_.pvに格納されます。
+ *
+ * 探索中にリーフノードをさらに分割することもできます（Split()参照）。
+ * その場合、分割されたノードの探索情報は、その最善手に対応する子ノードへ引き継がれます。
  */
 class MinimaxNode {
  public:
@@ -50,7 +57,10 @@ class MinimaxNode {
    * split_movesに指定された上位N手については、1手につき1ノードを割り当て、
    * その他の手については、まとめて1ノードを割り当てます。
    *
-   * なお、すでにignoremoves_が設定されているノードは、それ以上分割できないことに注意してください。
+   * ignoremoves_が設定されているノードを分割した場合、その他の手をまとめたノードには、
+   * 元のignoremoves_にsplit_movesを加えたものが、ignoremoves_として設定されます。
+   * また、このノードが探索済みで、その最善手がsplit_movesに含まれる場合は、
+   * このノードの探索情報（PV、評価値等）を、その指し手に対応する子ノードに引き継ぎます。
    *
    * @param split_moves ここに指定された上位N手については、1手につき1ノードを割り当てます。
    */
@@ -94,6 +104,19 @@ class MinimaxNode {
    */
   void Reset();
 
+  /**
+   * このノードから、最善の子ノードを順に辿っていき、最善応手手順（PV）上のリーフノードを返します.
+   */
+  MinimaxNode* FindPrincipalLeafNode();
+
+  /**
+   * このノードの評価値が、ルートノードまでの経路上で、最善の兄弟ノードからどれだけ劣っているかを返します.
+   *
+   * 経路上の各ノードについて、「親ノードの評価値 − 親ノードから見たこのノードの評価値」を求め、その最大値を返します。
+   * PV上のノードであれば0になり、値が大きいほど、最終的な指し手の選択に影響しにくいノードであるといえます。
+   */
+  Score ComputeScoreDeficit() const;
+
   /**
    * child_idに対応した子ノードを返します.
    *
@@ -154,7 +177,19 @@ class MinimaxNode {
     root_position_sfen_ = sfen;
   }
 
+  const std::vector<std::string>& path_from_root() const {
+    return path_from_root_;
+  }
+
  private:
+  /**
+   * 親ノードから見た、このノードの評価値を返します.
+   * ignoremovesが指定されていなければ、相手の手番なので、評価値を反転します。
+   */
+  Score score_from_parent() const {
+    return ignoremoves_.empty() ? -usi_info_.score : usi_info_.score;
+  }
+
   /** 親ノードへのポインタ. なお、ルートノードの場合は、親ノードがないので、nullptrになります。 */
   MinimaxNode* parent_ = nullptr;
 
@@ -164,6 +199,9 @@ class MinimaxNode {
   /** このノードの探索情報. USIのinfoコマンドと同じ形式で、情報を保持しています。 */
   UsiInfo usi_info_;
 
+  /** 最善の子ノードのID（内部ノードの場合のみ有効）. */
+  size_t best_child_id_ = 0;
+
   /** ミニマックス木のルートノードの、局面のSFEN表記. 例えば、初期局面なら、「position startpos」です。 */
   std::string root_position_sfen_;
 
@@ -206,9 +244,10 @@ class ClusterWorker : public TaskThread {
    */
   template<typename... Args>
   void SendCommand(const char* format, const Args&... args) {
+    // 末尾の改行まで含めて、１回の書き込みで送信する
+    // （複数のコマンドを改行で区切って渡せば、それらもまとめて１回で送信される）
     std::unique_lock<std::mutex> lock(mutex_);
-    external_process_.Printf(format, args...);
-    external_process_.Printf("\n");
+    external_process_.Printf((std::string(format) + "\n").c_str(), args...);
   }
 
   /**
@@ -237,6 +276,9 @@ class ClusterWorker : public TaskThread {
  * 2. 最善手については、３台のマシンを割り当てて探索する。
  * 3. ２番目〜７番目に良い手については、各指し手ごとに２台ずつのマシンを割り当てて探索する。
  * 4. 残りの手（８番目以降の手）については、まとめて１台のマシンで探索する。
+ * 5. 探索中は、定期的に各リーフノードの重要度を見直し、探索を終えて遊んでいるワーカーや、
+ *    最善手から大きく劣る（反駁された）リーフノードを探索しているワーカーを、
+ *    PV上のリーフノードを分割した子ノードに割り当て直す。
  *
  * （疎結合並列探索についての参考文献）
  *   - 金子知適, 田中哲朗: 最善手の予測に基づくゲーム木探索の分散並列実行,
@@ -245,6 +287,25 @@ class ClusterWorker : public TaskThread {
  */
 class Cluster : public UsiProtocol {
  public:
+  /**
+   * クラスタ独自のUSIオプションを追加します.
+   *
+   * ClusterWorkers      ワーカー数（最初のisreadyコマンドで、その数だけワーカーを起動します）
+   * ClusterLocalWorkers trueの場合は、全ワーカーを、このマシン上の外部プロセスとして起動します。
+   *                     falseの場合は、マスター以外のワーカーを、sshでリモートマシン（worker-1, worker-2, ...）上に起動します。
+   * ClusterWorkerCommand ワーカーのエンジンを起動するコマンド（リモートマシンでは、~/gikou/binで実行されます）
+   * ClusterCpuPinning   trueの場合は、ローカルのワーカーごとにCPUを分割して、各ワーカーのプロセスをそのCPUに固定します
+   *                     （分割するのは、このプロセスが使用を許可されているCPU（taskset等で指定されたもの）だけです）
+   * ClusterWorkerConfigFile ワーカーごとの設定ファイル（<empty>の場合は、使わない）
+   *                     １行に１ワーカー分（ワーカーIDの順）、「<CPUのリスト> [<起動コマンド>]」の形式で記述します。
+   *                     CPUのリストは「0-3,8」のような形式で、「-」の場合は自動で割り当てます。
+   *                     起動コマンドを省略した場合は、ClusterWorkerCommandを用います。空行と#以降は無視されます。
+   *
+   * ClusterTTExchangeDepth 0より大きい場合は、この深さ以上の置換表のエントリを、ワーカー間で交換します（TtExchange参照）
+   * ClusterTTExchangeMaxEntries 各ワーカーが１秒あたりにエクスポートする、置換表のエントリ数の上限
+   *
+   * ローカルのワーカーを使う場合は、ThreadsとUSI_Hashを、ワーカー数で等分したものが、各ワーカーに設定されます。
+   */
   Cluster();
   ~Cluster() {}
   void OnIsreadyCommandEntered();
@@ -255,9 +316,35 @@ class Cluster : public UsiProtocol {
   void OnQuitCommandEntered();
   void OnGameoverCommandEntered(const std::string& result);
   void UpdateInfo(int worker_id, const UsiInfo& worker_info);
+
+  /**
+   * ワーカーからエクスポートされた置換表のエントリ（ttdataコマンドの引数）を、探索中の他のワーカーに転送します.
+   */
+  void ForwardTtData(size_t worker_id, const std::string& payload);
+
+  /**
+   * ワーカーから送られてきた、置換表の交換に関する統計（ttstatsコマンド）を記録します.
+   */
+  void RecordTtStats(size_t worker_id, uint64_t num_imported);
+
   size_t master_worker_id() const {
     return num_workers_ - 1; // 最後のワーカーをマスターとして扱う
   }
+  size_t num_workers() const {
+    return num_workers_;
+  }
+
+  /**
+   * ワーカーを起動するコマンドを返します（ClusterWorkerConfigFileで指定されていなければ、ClusterWorkerCommand）.
+   */
+  std::string worker_command(size_t worker_id) const;
+
+  /**
+   * ワーカーのプロセスを固定するCPUのリストを返します（空の場合は、固定しない）.
+   */
+  const std::vector<int>& worker_cpu_ids(size_t worker_id) const {
+    return worker_cpu_ids_.at(worker_id);
+  }
 
  private:
   ClusterWorker& master_worker() {
@@ -270,20 +357,106 @@ class Cluster : public UsiProtocol {
     }
   }
 
-  /** ワーカー数（現在は16で固定しています）. */
+  /**
+   * ワーカーにリーフノードを割り当てて、探索を開始させます（mutex_をロックした状態で呼んでください）.
+   */
+  void AssignLeafNode(size_t worker_id, MinimaxNode* leaf_node);
+
+  /**
+   * 探索中に、定期的にワーカーの割り当てを見直すスレッドを開始・停止します.
+   */
+  void StartRebalancing();
+  void StopRebalancing();
+
+  /**
+   * ワーカーの割り当てを１回見直します.
+   *
+   * 遊んでいるワーカー、または最善手から大きく劣るリーフノードを探索しているワーカーを１台選び、
+   * PV上のリーフノードを分割して、その片方を探索させます。
+   */
+  void RebalanceWorkers();
+
+  /**
+   * ClusterWorkerConfigFileとClusterCpuPinningに従って、各ワーカーの起動コマンドとCPUを決めます.
+   */
+  void ConfigureWorkers();
+
+  /** ワーカー数（最初のisreadyコマンドの時点での、ClusterWorkersオプションの値）. */
   size_t num_workers_ = 16;
 
+  /** ClusterWorkerConfigFileで指定された、各ワーカーの起動コマンド（空の場合は、ClusterWorkerCommandを用いる） */
+  std::vector<std::string> worker_commands_;
+
+  /** 各ワーカーのプロセスを固定するCPU */
+  std::vector<std::vector<int>> worker_cpu_ids_;
+
   /** 別プロセスで動作しているワーカー. */
   std::vector<std::unique_ptr<ClusterWorker>> workers_;
 
-  /** 各ワーカーから送られてきた最新の情報（ミニマックス木のリーフノード情報として保持）. */
+  /**
+   * 各ワーカーが探索しているリーフノード（添字はワーカーID）.
+   * 各ワーカーから送られてきた最新の情報は、このリーフノードの情報として保持されます。
+   * 何も探索していないワーカーや、割り当てを変更中のワーカーについては、nullptrになります。
+   */
   std::vector<MinimaxNode*> leaf_nodes_;
 
+  /** 各ワーカーがエクスポートした、置換表のエントリ数と、各ワーカーに転送したエントリ数 */
+  std::vector<uint64_t> num_tt_entries_exported_;
+  std::vector<uint64_t> num_tt_entries_forwarded_;
+
+  /** 各ワーカーが、転送されたエントリのうち実際に置換表に書き込んだ数（ttstatsコマンドで報告される） */
+  std::vector<uint64_t> num_tt_entries_imported_;
+
   /** ミニマックス木のルートノード */
   MinimaxNode root_of_minimax_tree_;
 
   /** 排他制御用 */
   std::mutex mutex_;
+
+  /** ワーカーの割り当てを見直すスレッドと、その停止指示用 */
+  std::thread rebalance_thread_;
+  std::mutex rebalance_mutex_;
+  std::condition_variable rebalance_condition_;
+  bool stop_rebalancing_ = false;
+};
+
+/**
+ * クラスタの動作確認用に、ワーカーのUSIエンジンの代わりに動作するダミーのエンジンです.
+ *
+ * 実際の探索は行わず、各合法手の評価値を、その手を指した後の局面のSFEN文字列から決まる擬似乱数とし、
+ * 反復深化を模したinfoコマンドを一定間隔（1反復あたり100ミリ秒）で出力します。
+ * 同じ局面とgoコマンドに対しては（プロセスが異なっても）常に同じ内容を出力するので、
+ * リモートマシンや評価関数のファイルがなくても、マスター側の動作（ミニマックス木の更新や、
+ * ワーカーの割り当ての見直し）を、再現性のある形で確かめられます。
+ *
+ * 使い方: クラスタのマスターで、ClusterLocalWorkersをtrueに、
+ * ClusterWorkerCommandを「./release --fake-cluster-worker」にします。
+ *
+ * 確認手順の例（binディレクトリで実行。定跡を使うと結果が変わるので、OwnBookはfalseにします）:
+ * @code
+ * (printf "usi\n"
+ *  printf "setoption name OwnBook value false\n"
+ *  printf "setoption name ClusterWorkers value 4\n"
+ *  printf "setoption name ClusterLocalWorkers value true\n"
+ *  printf "setoption name ClusterWorkerCommand value ./release --fake-cluster-worker\n"
+ *  printf "isready\nusinewgame\nposition startpos\ngo btime 0 wtime 0 byoyomi 2000\n"
+ *  sleep 4; printf "quit\n") | ./release --cluster | grep bestmove
+ * @endcode
+ * 何度実行しても同じ手（ワーカー数が1, 4, 8の場合は、それぞれ9g9f, 2h5h, 4i3h）を返せば正常です。
+ * ClusterWorkerConfigFileで一部のワーカーのCPUや起動コマンドを指定した場合も、結果は変わりません。
+ */
+class FakeClusterWorker {
+ public:
+  /**
+   * 標準入力からUSIコマンドを受け取り、quitコマンドが来るまで応答します.
+   */
+  void Start();
+
+ private:
+  void Search(Position pos, std::vector<std::string> ignoremoves, bool infinite);
+
+  int multipv_ = 1;
+  std::atomic_bool stop_{false};
 };
 
 #endif /* !defined(MINIMUM) */
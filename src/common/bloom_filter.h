@@ -0,0 +1,250 @@
+/*
+ * 技巧 (Gikou), a USI shogi (Japanese chess) playing engine.
+ * Copyright (C) 2016-2017 Yosuke Demura
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMON_BLOOM_FILTER_H_
+#define COMMON_BLOOM_FILTER_H_
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <unistd.h>
+
+/**
+ * 複数のスレッドから同時に使うことができる、ロックフリーなブルームフィルタです.
+ *
+ * 64ビットのハッシュ値（局面のハッシュ値など）を登録し、すでに登録されているかどうかを調べます。
+ * 登録されていないキーを「登録済み」と判定すること（偽陽性）はありますが、その逆はありません。
+ * キャッシュミスを減らすため、１つのキーに対応するビットは、すべて同じ512ビットのブロックの中に置いています
+ * （blocked Bloom filter）。
+ *
+ * 同じキーを複数のスレッドが同時に登録した場合は、どちらのスレッドでも「未登録」と判定されることがあります。
+ */
+class BloomFilter {
+ public:
+  /**
+   * @param expected_num_keys 登録するキーの数の見込み
+   * @param bits_per_key      キー１つあたりのビット数（大きいほど偽陽性が減る。20ビットで0.01%程度）
+   */
+  BloomFilter(uint64_t expected_num_keys, double bits_per_key = 20.0) {
+    uint64_t min_bits = static_cast<uint64_t>(expected_num_keys * bits_per_key);
+    num_bits_ = kBlockBits;
+    while (num_bits_ < min_bits) {
+      num_bits_ *= 2;
+    }
+    // 最適なハッシュ関数の数は、(ビット数 / キー数) * ln2 である
+    int k = static_cast<int>(std::lround(bits_per_key * 0.693));
+    num_hashes_ = static_cast<uint32_t>(std::min(std::max(k, 1), 16));
+    Allocate();
+  }
+
+  BloomFilter(const BloomFilter&) = delete;
+  BloomFilter& operator=(const BloomFilter&) = delete;
+
+  /**
+   * キーを登録します.
+   * @return すでに登録されていた（と判定された）場合は、true
+   */
+  bool TestAndSet(uint64_t key) {
+    uint64_t h = Mix(key);
+    std::atomic<uint64_t>* block = words_.get() + (h & (num_blocks() - 1)) * kWordsPerBlock;
+    bool found = true;
+    for (uint32_t i = 0; i < num_hashes_; ++i) {
+      uint64_t bit_index = NextBitIndex(i, &h);
+      uint64_t mask = uint64_t(1) << (bit_index & 63);
+      std::atomic<uint64_t>& word = block[bit_index >> 6];
+      // すでにビットが立っている場合は、キャッシュラインへの書き込みを避ける
+      if (word.load(std::memory_order_relaxed) & mask) {
+        continue;
+      }
+      if (!(word.fetch_or(mask, std::memory_order_relaxed) & mask)) {
+        found = false;
+      }
+    }
+    if (!found) {
+      num_keys_.fetch_add(1, std::memory_order_relaxed);
+    }
+    return found;
+  }
+
+  /**
+   * キーが登録されているかどうかを調べます（登録はしません）.
+   */
+  bool Test(uint64_t key) const {
+    uint64_t h = Mix(key);
+    const std::atomic<uint64_t>* block = words_.get() + (h & (num_blocks() - 1)) * kWordsPerBlock;
+    for (uint32_t i = 0; i < num_hashes_; ++i) {
+      uint64_t bit_index = NextBitIndex(i, &h);
+      uint64_t mask = uint64_t(1) << (bit_index & 63);
+      if (!(block[bit_index >> 6].load(std::memory_order_relaxed) & mask)) {
+        return false;
+      }
+    }
+    return true;
+  }
+
+  /**
+   * ファイルに保存します.
+   * 一時ファイルに書き込んでから名前を変更するので、途中で中断されても、以前のファイルは壊れません。
+   * 他のスレッドが登録を行っている間に呼んだ場合は、その時点までに登録を終えたキーが保存されます。
+   */
+  bool SaveToFile(const char* file_name) const {
+    std::string temp_name = std::string(file_name) + ".tmp";
+    std::FILE* file = std::fopen(temp_name.c_str(), "wb");
+    if (file == nullptr) {
+      return false;
+    }
+    Header header;
+    std::memcpy(header.magic, kMagic, sizeof(header.magic));
+    header.num_bits = num_bits_;
+    header.num_hashes = num_hashes_;
+    header.reserved = 0;
+    header.num_keys = num_keys();
+    bool ok = std::fwrite(&header, sizeof(header), 1, file) == 1;
+    for (uint64_t i = 0; ok && i < num_words(); ++i) {
+      uint64_t word = words_[i].load(std::memory_order_relaxed);
+      ok = std::fwrite(&word, sizeof(word), 1, file) == 1;
+    }
+    // ディスクへの書き込みが完了してから、リネームする
+    ok = ok && std::fflush(file) == 0 && fsync(fileno(file)) == 0;
+    ok = (std::fclose(file) == 0) && ok;
+    return ok && std::rename(temp_name.c_str(), file_name) == 0;
+  }
+
+  /**
+   * ファイルから読み込みます（以前の内容は、ファイルの内容で置き換えられます）.
+   * @return ファイルを開くことができ、内容が正しければ、true（falseの場合、内容は変更されません）
+   */
+  bool LoadFromFile(const char* file_name) {
+    std::FILE* file = std::fopen(file_name, "rb");
+    if (file == nullptr) {
+      return false;
+    }
+    Header header;
+    if (std::fread(&header, sizeof(header), 1, file) != 1
+        || std::memcmp(header.magic, kMagic, sizeof(header.magic)) != 0
+        || header.num_bits < kBlockBits
+        || (header.num_bits & (header.num_bits - 1)) != 0
+        || header.num_hashes == 0 || header.num_hashes > 16) {
+      std::fclose(file);
+      return false;
+    }
+    std::unique_ptr<uint64_t[]> buffer(new uint64_t[header.num_bits / 64]);
+    bool ok = std::fread(buffer.get(), sizeof(uint64_t), header.num_bits / 64, file)
+              == header.num_bits / 64;
+    std::fclose(file);
+    if (!ok) {
+      return false;
+    }
+    num_bits_ = header.num_bits;
+    num_hashes_ = header.num_hashes;
+    Allocate();
+    for (uint64_t i = 0; i < num_words(); ++i) {
+      words_[i].store(buffer[i], std::memory_order_relaxed);
+    }
+    num_keys_.store(header.num_keys, std::memory_order_relaxed);
+    return true;
+  }
+
+  /**
+   * これまでに登録したキーの数（偽陽性で登録済みと判定されたものを除く）を返します.
+   */
+  uint64_t num_keys() const {
+    return num_keys_.load(std::memory_order_relaxed);
+  }
+
+  uint64_t num_bits() const {
+    return num_bits_;
+  }
+
+  /**
+   * 指定された数のキーを登録したときの、偽陽性の確率の見積もりを返します.
+   */
+  double EstimateFalsePositiveRate(uint64_t num_keys) const {
+    double k = num_hashes_;
+    return std::pow(1.0 - std::exp(-k * double(num_keys) / double(num_bits_)), k);
+  }
+
+  uint32_t num_hashes() const {
+    return num_hashes_;
+  }
+
+ private:
+  static constexpr uint64_t kBlockBits = 512;
+  static constexpr uint64_t kWordsPerBlock = kBlockBits / 64;
+  static constexpr uint32_t kBitIndicesPerHash = 64 / 9;
+  static constexpr const char* kMagic = "GKBLOOM1";
+
+  struct Header {
+    char magic[8];
+    uint64_t num_bits;
+    uint32_t num_hashes;
+    uint32_t reserved;
+    uint64_t num_keys;
+  };
+
+  /**
+   * キーのビットを十分に混ぜ合わせます（SplitMix64の最終段と同じ処理）.
+   */
+  static uint64_t Mix(uint64_t x) {
+    x += UINT64_C(0x9e3779b97f4a7c15);
+    x = (x ^ (x >> 30)) * UINT64_C(0xbf58476d1ce4e5b9);
+    x = (x ^ (x >> 27)) * UINT64_C(0x94d049bb133111eb);
+    return x ^ (x >> 31);
+  }
+
+  /**
+   * ブロック内のビットの位置を、ハッシュ値から９ビットずつ取り出します（使い切ったら、ハッシュ値を混ぜ直す）.
+   */
+  static uint64_t NextBitIndex(uint32_t i, uint64_t* const h) {
+    if (i % kBitIndicesPerHash == 0) {
+      *h = Mix(*h);
+    }
+    uint64_t bit_index = *h & (kBlockBits - 1);
+    *h >>= 9;
+    return bit_index;
+  }
+
+  uint64_t num_words() const {
+    return num_bits_ / 64;
+  }
+
+  uint64_t num_blocks() const {
+    return num_bits_ / kBlockBits;
+  }
+
+  void Allocate() {
+    words_.reset(new std::atomic<uint64_t>[num_words()]);
+    for (uint64_t i = 0; i < num_words(); ++i) {
+      words_[i].store(0, std::memory_order_relaxed);
+    }
+    num_keys_.store(0, std::memory_order_relaxed);
+  }
+
+  uint64_t num_bits_ = 0;
+  uint32_t num_hashes_ = 0;
+  std::unique_ptr<std::atomic<uint64_t>[]> words_;
+  std::atomic<uint64_t> num_keys_{0};
+};
+
+#endif /* COMMON_BLOOM_FILTER_H_ */
@@ -0,0 +1,73 @@
+/*
+ * 技巧 (Gikou), a USI shogi (Japanese chess) playing engine.
+ * Copyright (C) 2016-2017 Yosuke Demura
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef COMMON_RING_BUFFER_H_
+#define COMMON_RING_BUFFER_H_
+
+#include <atomic>
+#include <cstddef>
+#include "array.h"
+
+/**
+ * １つのスレッドが書き込み、別の１つのスレッドが読み出すための、ロックフリーなリングバッファです.
+ *
+ * 書き込み側・読み出し側とも、相手のスレッドを待つことはありません（満杯・空の場合は、falseを返します）。
+ * 書き込み側と読み出し側が、それぞれ２つ以上のスレッドになる場合には使えないことに注意してください。
+ */
+template<typename T, size_t kCapacity>
+class RingBuffer {
+  static_assert((kCapacity & (kCapacity - 1)) == 0, "kCapacity must be a power of 2.");
+
+ public:
+  /**
+   * 末尾に要素を追加します（書き込み側のスレッドから呼んでください）.
+   * @return バッファが満杯で追加できなかった場合は、false
+   */
+  bool TryPush(const T& value) {
+    const size_t tail = tail_.load(std::memory_order_relaxed);
+    if (tail - head_.load(std::memory_order_acquire) == kCapacity) {
+      return false;
+    }
+    buffer_[tail & (kCapacity - 1)] = value;
+    tail_.store(tail + 1, std::memory_order_release);
+    return true;
+  }
+
+  /**
+   * 先頭の要素を取り出します（読み出し側のスレッドから呼んでください）.
+   * @return バッファが空で取り出せなかった場合は、false
+   */
+  bool TryPop(T* const value) {
+    const size_t head = head_.load(std::memory_order_relaxed);
+    if (head == tail_.load(std::memory_order_acquire)) {
+      return false;
+    }
+    *value = buffer_[head & (kCapacity - 1)];
+    head_.store(head + 1, std::memory_order_release);
+    return true;
+  }
+
+ private:
+  // 書き込み側と読み出し側で、同じキャッシュラインを取り合わないようにする
+  alignas(64) std::atomic<size_t> head_{0};
+  alignas(64) std::atomic<size_t> tail_{0};
+  alignas(64) Array<T, kCapacity> buffer_;
+};
+
+#endif /* COMMON_RING_BUFFER_H_ */
@@ -21,7 +21,10 @@
 
 #include "consultation.h"
 
+#include <algorithm>
 #include <chrono>
+#include <cinttypes>
+#include <climits>
 #include <map>
 #include <sstream>
 #include "book.h"
@@ -80,20 +83,19 @@ void ConsultationWorker::Initialize() {
   }
 
   // 2. 対局準備のため、USIコマンドをエンジンに送信する
-  SendCommand("usi");
   const UsiOptions& options = consultation_.usi_options();
+  int hash_size = options["USI_Hash"], num_threads = options["Threads"];
   if (worker_id() == consultation_.master_worker_id()) {
     // マスターワーカーのメモリ容量とスレッド数については、特定のマシンを使うことにして、ひとまずベタ打ちしておく
-    SendCommand("setoption name USI_Hash value %d", 8192);
-    SendCommand("setoption name Threads value %d", 5);
-    SendCommand("setoption name DrawScore value %d", (int)options["DrawScore"]);
-  } else {
-    // USIオプションを下流に伝達する
-    SendCommand("setoption name USI_Hash value %d", (int)options["USI_Hash"]);
-    SendCommand("setoption name Threads value %d", (int)options["Threads"]);
-    SendCommand("setoption name DrawScore value %d", (int)options["DrawScore"]);
+    hash_size = 8192;
+    num_threads = 5;
   }
-  SendCommand("isready");
+  SendCommand("usi\n"
+              "setoption name USI_Hash value %d\n"
+              "setoption name Threads value %d\n"
+              "setoption name DrawScore value %d\n"
+              "isready",
+              hash_size, num_threads, (int)options["DrawScore"]);
 
   // 3. readyokが送られてくるまで待機する
   for (std::string line; RecieveCommand(&line); ) {
@@ -111,7 +113,10 @@ void ConsultationWorker::Run() {
       // ワーカーとの通信が切断された場合、それ以降そのワーカーからのinfoコマンドは無視される
       if (is_alive()) {
         UsiInfo info = UsiProtocol::ParseInfoCommand(is);
-        consultation_.UpdateInfo(worker_id_, info);
+        // info stringや、読み筋を含まないinfoコマンドは、投票の対象にならないので無視する
+        if (info.string.empty() && !info.pv.empty()) {
+          consultation_.UpdateInfo(worker_id_, info);
+        }
       }
     } else if (token == "bestmove") {
       break;
@@ -127,9 +132,25 @@ void TimeManagerForConsultation::HandleTimeUpEvent() {
   consultation_.OnStopCommandEntered();
 }
 
+void TimeManagerForConsultation::HandleEarlyStopEvent() {
+  // 合議の結果が安定したために打ち切る場合は、目標思考時間までの残り時間を、節約できた時間として記録する
+  consultation_.RecordTimeSaved(remaining_time());
+  consultation_.OnStopCommandEntered();
+}
+
 Consultation::Consultation()
     : UsiProtocol("Gikou Hybrid Cluster", "Yosuke Demura"),
       time_manager_(usi_options(), *this) {
+  UsiOptions& options = mutable_usi_options();
+
+  // 早期打ち切りに必要な、同じ指し手を推すワーカーの割合（パーセント。0の場合は、早期打ち切りを行わない）
+  options.Add("ConsultationEarlyStopAgreement", UsiOption(0, 0, 100));
+
+  // 早期打ち切りに必要な、合意が崩れずに各ワーカーが進めた反復深化の回数（0の場合は、この条件を使わない）
+  options.Add("ConsultationEarlyStopIterations", UsiOption(3, 0, 100));
+
+  // 早期打ち切りに必要な、合意が崩れなかった時間（ミリ秒。0の場合は、この条件を使わない）
+  options.Add("ConsultationEarlyStopTime", UsiOption(0, 0, 60000));
 }
 
 void Consultation::OnIsreadyCommandEntered() {
@@ -165,6 +186,8 @@ void Consultation::OnIsreadyCommandEntered() {
 }
 
 void Consultation::OnUsinewgameCommandEntered() {
+  num_early_stops_ = 0;
+  total_time_saved_ = 0;
   SendCommandToAllWorkers("usinewgame");
 }
 
@@ -209,12 +232,16 @@ void Consultation::OnGoCommandEntered(const UsiGoOptions& go_options) {
   worker_infos_.clear();
   worker_infos_.resize(workers_.size());
 
-  // 各ワーカーにpositionコマンドを送信する
-  SendCommandToAllWorkers(position_sfen().c_str());
+  // 早期打ち切りの設定を読み込む
+  early_stop_allowed_ = !go_options.infinite;
+  early_stop_agreement_ = usi_options()["ConsultationEarlyStopAgreement"];
+  early_stop_iterations_ = usi_options()["ConsultationEarlyStopIterations"];
+  early_stop_time_ = usi_options()["ConsultationEarlyStopTime"];
+  stable_move_.clear();
 
-  // 各ワーカーに探索の指示を出す
+  // 各ワーカーにpositionコマンドを送信して、探索の指示を出す
   for (std::unique_ptr<ConsultationWorker>& worker : workers_) {
-    worker->SendCommand("go infinite");
+    worker->SendCommand("%s\ngo infinite", position_sfen().c_str());
     worker->ExecuteTask();
   }
 }
@@ -273,6 +300,11 @@ void Consultation::OnQuitCommandEntered() {
 }
 
 void Consultation::OnGameoverCommandEntered(const std::string& result) {
+  // この対局で、早期打ち切りによって節約できた時間を出力する
+  if (early_stop_agreement_ > 0) {
+    SYNCED_PRINTF("info string early stops %d time saved %" PRId64 " ms in this game\n",
+                  num_early_stops_, total_time_saved_);
+  }
   SendCommandToAllWorkers(("gameover " + result).c_str());
 }
 
@@ -375,6 +407,78 @@ void Consultation::UpdateInfo(int worker_id, const UsiInfo& worker_info) {
 
   // 最善手に関する情報を更新する
   UpdateInfo();
+
+  // 合議の結果が安定していれば、探索を早めに打ち切る
+  MonitorVotes();
+}
+
+void Consultation::MonitorVotes() {
+  if (   !early_stop_allowed_
+      || early_stop_agreement_ == 0
+      || time_manager_.early_stop_requested()
+      || best_move_info_.pv.empty()) {
+    return;
+  }
+
+  // 1. 現在の最善手に投票しているワーカーの数を数える（投票権のないマスターワーカーは除く）
+  const std::string& best_move = best_move_info_.pv.front();
+  int num_voters = 0, num_agreements = 0;
+  for (size_t i = 0; i < worker_infos_.size(); ++i) {
+    if (int(i) == master_worker_id() || !workers_.at(i)->is_alive()) {
+      continue;
+    }
+    const UsiInfo& info = worker_infos_.at(i);
+    num_voters += 1;
+    num_agreements += !info.pv.empty() && info.pv.front() == best_move;
+  }
+
+  // 2. 超多数の合意が得られていなければ、合意の記録を破棄する
+  if (num_voters == 0 || num_agreements * 100 < early_stop_agreement_ * num_voters) {
+    stable_move_.clear();
+    return;
+  }
+
+  // 3. 新たに合意が成立した場合は、その時点の時刻と、各ワーカーの探索深さを記録しておく
+  if (best_move != stable_move_) {
+    stable_move_ = best_move;
+    stable_since_ = std::chrono::steady_clock::now();
+    stable_depths_.resize(worker_infos_.size());
+    for (size_t i = 0; i < worker_infos_.size(); ++i) {
+      stable_depths_.at(i) = worker_infos_.at(i).depth;
+    }
+  }
+
+  // 4. 合意が成立してから、合意しているワーカーが最低何回反復深化を進めたかを調べる
+  int num_iterations = INT_MAX;
+  for (size_t i = 0; i < worker_infos_.size(); ++i) {
+    const UsiInfo& info = worker_infos_.at(i);
+    if (   int(i) != master_worker_id()
+        && workers_.at(i)->is_alive()
+        && !info.pv.empty()
+        && info.pv.front() == best_move) {
+      num_iterations = std::min(num_iterations, info.depth - stable_depths_.at(i));
+    }
+  }
+  auto stable_time = std::chrono::duration_cast<std::chrono::milliseconds>(
+      std::chrono::steady_clock::now() - stable_since_).count();
+
+  // 5. 合意が十分に長く続いていれば、早期打ち切りを要求する
+  bool iterations_are_enough = early_stop_iterations_ > 0 && num_iterations >= early_stop_iterations_;
+  bool time_is_enough = early_stop_time_ > 0 && stable_time >= early_stop_time_;
+  bool no_condition = early_stop_iterations_ == 0 && early_stop_time_ == 0;
+  if (iterations_are_enough || time_is_enough || no_condition) {
+    SYNCED_PRINTF("info string early stop %s votes %d/%d iterations %d time %" PRId64 "\n",
+                  best_move.c_str(), num_agreements, num_voters, num_iterations,
+                  int64_t(stable_time));
+    time_manager_.RequestEarlyStop();
+  }
+}
+
+void Consultation::RecordTimeSaved(int64_t time_saved) {
+  num_early_stops_ += 1;
+  total_time_saved_ += time_saved;
+  SYNCED_PRINTF("info string time saved %" PRId64 " ms (%d early stops, %" PRId64 " ms in this game)\n",
+                time_saved, num_early_stops_, total_time_saved_);
 }
 
 void Consultation::NotifySearchIsFinished() {
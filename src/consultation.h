@@ -22,6 +22,7 @@
 
 #if !defined(MINIMUM)
 
+#include <chrono>
 #include "process.h"
 #include "task_thread.h"
 #include "time_manager.h"
@@ -54,9 +55,10 @@ class ConsultationWorker : public TaskThread {
    */
   template<typename... Args>
   void SendCommand(const char* format, const Args&... args) {
+    // 末尾の改行まで含めて、１回の書き込みで送信する
+    // （複数のコマンドを改行で区切って渡せば、それらもまとめて１回で送信される）
     std::unique_lock<std::mutex> lock(mutex_);
-    external_process_.Printf(format, args...);
-    external_process_.Printf("\n");
+    external_process_.Printf((std::string(format) + "\n").c_str(), args...);
   }
 
   /**
@@ -111,6 +113,7 @@ class TimeManagerForConsultation : public TimeManager {
         consultation_(consultation) {
   }
   void HandleTimeUpEvent();
+  void HandleEarlyStopEvent();
  private:
   Consultation& consultation_;
 };
@@ -123,6 +126,13 @@ class TimeManagerForConsultation : public TimeManager {
  *   2. ただし、投票数が同数の場合には「楽観合議」を行う
  * というものです。
  *
+ * また、ワーカーから送られてくるinfoコマンドを基に投票を常に監視しており、
+ * 一定割合（ConsultationEarlyStopAgreement）以上のワーカーが同じ指し手を推していて、その合意が
+ *   - 一定回数（ConsultationEarlyStopIterations）の反復深化の間、または
+ *   - 一定時間（ConsultationEarlyStopTime、ミリ秒）の間
+ * 崩れなかった場合は、目標思考時間を待たずに探索を打ち切ります（早期打ち切り）。
+ * 節約した時間は、持ち時間として次の手以降に使うことができます。
+ *
  * （合議アルゴリズムについての参考文献）
  *   - 伊藤毅志: コンピュータ将棋における合議アルゴリズム, 『コンピュータ将棋の進歩６』,
  *     pp.85-103, 共立出版, 2012.
@@ -158,6 +168,13 @@ class Consultation : public UsiProtocol {
    */
   void NotifySearchIsFinished();
 
+  /**
+   * 早期打ち切りにより節約できた時間を記録し、標準出力へ出力します.
+   * 時間管理用スレッドが、早期打ち切りを行う際に呼んでください。
+   * @param time_saved 節約できた時間（ミリ秒）
+   */
+  void RecordTimeSaved(int64_t time_saved);
+
   /**
    * すべてのワーカーが探索を終えるまで待機します.
    *
@@ -195,6 +212,12 @@ class Consultation : public UsiProtocol {
    */
   void SendBestmoveCommand(std::string command, const UsiGoOptions& go_options);
 
+  /**
+   * 投票の状況を調べ、合意が十分に安定していれば、時間管理クラスに早期打ち切りを要求します.
+   * 各ワーカーのinfoコマンドを処理するたびに、info_mutex_をロックした状態で呼んでください。
+   */
+  void MonitorVotes();
+
   /** 合議アルゴリズムのワーカー */
   std::vector<std::unique_ptr<ConsultationWorker>> workers_;
 
@@ -216,6 +239,25 @@ class Consultation : public UsiProtocol {
   /** trueであれば、bestmoveコマンドを、後で（stop/ponderhitコマンド到着時）に送信する */
   bool send_bestmove_later_ = false;
 
+  /** trueであれば、今回の探索で早期打ち切りを行ってもよい（go infiniteのときはfalse） */
+  bool early_stop_allowed_ = false;
+
+  /** 早期打ち切りの条件（各USIオプションの値） */
+  int early_stop_agreement_ = 0, early_stop_iterations_ = 0, early_stop_time_ = 0;
+
+  /** 現在、超多数のワーカーが合意している指し手（合意がない場合は、空文字列） */
+  std::string stable_move_;
+
+  /** 現在の合意が成立した時刻 */
+  std::chrono::time_point<std::chrono::steady_clock> stable_since_;
+
+  /** 現在の合意が成立した時点での、各ワーカーの探索深さ */
+  std::vector<int> stable_depths_;
+
+  /** 現在の対局で、早期打ち切りを行った回数と、それにより節約した時間の合計（ミリ秒） */
+  int num_early_stops_ = 0;
+  int64_t total_time_saved_ = 0;
+
   /** 合議アルゴリズム使用中に、時間管理を行うためのクラス */
   TimeManagerForConsultation time_manager_;
 
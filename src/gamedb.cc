@@ -19,50 +19,81 @@
 
 #include "gamedb.h"
 
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
 #include <iomanip>
 #include <sstream>
 #include <string>
+#include <unordered_map>
 #include <unordered_set>
+#include <fcntl.h>
+#include <omp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 #include "notations.h"
+#include "position.h"
 
 #if !defined(MINIMUM)
 
 namespace {
+
 const std::unordered_set<std::string> g_title_matches = {
     "竜王戦", "名人戦", "王位戦", "王座戦", "棋王戦", "王将戦", "棋聖戦", "順位戦",
 };
-} // namespace
 
-bool GameDatabase::ReadOneGame(Game* game) {
-  assert(game != nullptr);
+/** バイナリ形式の棋譜DBファイルの先頭に置く識別子 */
+constexpr char kBinaryDatabaseMagic[8] = {'G', 'K', 'G', 'A', 'M', 'E', 'D', 'B'};
+constexpr uint32_t kBinaryDatabaseVersion = 1;
 
-START:
-  std::string line;
+struct BinaryDatabaseHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+  uint64_t num_games;
+  uint64_t records_offset;
+  uint64_t strings_offset;
+  uint64_t strings_size;
+  uint64_t moves_offset;
+  uint64_t num_moves;
+};
 
-  // Step 1. ヘッダー部分を１行読み込む
-  if (!std::getline(input_stream_, line)) {
-    return false;
-  }
+/**
+ * 16ビットに詰めた指し手で、「打つ手」の移動元に用いる値（81 + 駒の種類）.
+ *
+ * <pre>
+ * 0000 0000 0111 1111 移動先のマス
+ * 0011 1111 1000 0000 移動元のマス（打つ手の場合は、kDropOrigin + 打った駒の種類）
+ * 0100 0000 0000 0000 成る手か否か
+ * </pre>
+ */
+constexpr int kDropOrigin = 81;
 
-  // Step 2. ヘッダー部分を解析する
+uint16_t PackMove(const Move move) {
+  const int from = move.is_drop() ? kDropOrigin + move.piece_type() : int(move.from());
+  return static_cast<uint16_t>(int(move.to()) | (from << 7) | (int(move.is_promotion()) << 14));
+}
+
+/**
+ * テキスト形式の棋譜DBファイルの、ヘッダー部分（１行目）を解析します.
+ * @return 棋譜の手数
+ */
+int ParseHeader(const std::string& line, Game* const game) {
   std::istringstream header_input(line);
-  int game_length, game_id, game_result;
+  int game_length = 0, game_id, game_result = 0;
   header_input >> game_id >> game->date;
   header_input >> game->players[kBlack] >> game->players[kWhite];
   header_input >> game_result >> game_length >> game->event >> game->opening;
   game->result = static_cast<Game::Result>(game_result);
+  return game_length;
+}
 
-  // Step 3. 指し手が記録されている１行を読み込む
-  if (!std::getline(input_stream_, line)) {
-    return false;
-  }
-
-  // 指定があれば、７大棋戦＋順位戦以外の対局をスキップする
-  if (title_matches_only_ && g_title_matches.count(game->event) == 0) {
-    goto START;
-  }
-
-  // Step 4. 指し手をパースする
+/**
+ * テキスト形式の棋譜DBファイルの、指し手の部分（２行目）を解析します.
+ */
+void ParseMoves(const std::string& line, const int game_length, Game* const game) {
   std::istringstream moves_input(line);
   Position pos = Position::CreateStartPosition();
   game->moves.clear();
@@ -79,8 +110,393 @@ START:
     game->moves.push_back(move);
     pos.MakeMove(move);
   }
+}
+
+/**
+ * バイナリ形式の棋譜DBファイルが、変換元のテキスト形式のファイルより新しければ（または、テキスト形式のファイルがなければ）、
+ * trueを返します.
+ */
+bool BinaryDatabaseIsUpToDate(const char* binary_file_name, const char* text_file_name) {
+  struct stat binary_stat, text_stat;
+  if (stat(text_file_name, &text_stat) == -1) {
+    return true;
+  }
+  if (stat(binary_file_name, &binary_stat) == -1) {
+    return false;
+  }
+  return binary_stat.st_mtime >= text_stat.st_mtime;
+}
+
+} // namespace
+
+struct BinaryGameDatabase::GameRecord {
+  uint64_t moves_begin;
+  uint32_t players[2];
+  uint32_t date;
+  uint32_t event;
+  uint32_t opening;
+  uint16_t num_moves;
+  uint8_t result;
+  uint8_t reserved;
+};
+
+BinaryGameDatabase::~BinaryGameDatabase() {
+  if (data_ != nullptr) {
+    munmap(const_cast<uint8_t*>(data_), mapped_size_);
+  }
+}
+
+bool BinaryGameDatabase::IsBinaryDatabase(const char* const file_name) {
+  std::FILE* fp = std::fopen(file_name, "rb");
+  if (fp == nullptr) {
+    return false;
+  }
+  char magic[sizeof(kBinaryDatabaseMagic)];
+  bool is_binary = std::fread(magic, sizeof(magic), 1, fp) == 1
+                && std::memcmp(magic, kBinaryDatabaseMagic, sizeof(magic)) == 0;
+  std::fclose(fp);
+  return is_binary;
+}
+
+bool BinaryGameDatabase::Open(const char* const file_name) {
+  static_assert(sizeof(GameRecord) == 32, "");
+  assert(!is_open());
+
+  // 1. ファイルをメモリマップする
+  int fd = open(file_name, O_RDONLY);
+  if (fd == -1) {
+    std::printf("Failed to open %s.\n", file_name);
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1 || file_stat.st_size < static_cast<off_t>(sizeof(BinaryDatabaseHeader))) {
+    std::printf("%s is not a binary game database.\n", file_name);
+    close(fd);
+    return false;
+  }
+  const size_t file_size = file_stat.st_size;
+  void* address = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED) {
+    std::printf("Failed to map %s.\n", file_name);
+    return false;
+  }
+  const uint8_t* data = static_cast<const uint8_t*>(address);
+
+  // 2. ヘッダと各領域の位置を検証する
+  BinaryDatabaseHeader header;
+  std::memcpy(&header, data, sizeof(header));
+  bool ok = std::memcmp(header.magic, kBinaryDatabaseMagic, sizeof(kBinaryDatabaseMagic)) == 0
+         && header.version == kBinaryDatabaseVersion
+         && header.records_offset == sizeof(BinaryDatabaseHeader)
+         && header.num_games <= (file_size - header.records_offset) / sizeof(GameRecord)
+         && header.strings_offset == header.records_offset + header.num_games * sizeof(GameRecord)
+         && header.strings_size >= 1
+         && header.strings_size <= file_size - header.strings_offset
+         && header.moves_offset == header.strings_offset + header.strings_size
+         && header.moves_offset % sizeof(uint16_t) == 0
+         && header.num_moves <= (file_size - header.moves_offset) / sizeof(uint16_t)
+         && data[header.strings_offset + header.strings_size - 1] == '\0';
+
+  // 3. 各対局のレコードが、ファイルの範囲内を指しているかを検証する
+  const GameRecord* records = reinterpret_cast<const GameRecord*>(data + header.records_offset);
+  for (size_t i = 0; ok && i < header.num_games; ++i) {
+    const GameRecord& r = records[i];
+    ok = r.moves_begin <= header.num_moves
+      && r.num_moves <= header.num_moves - r.moves_begin
+      && r.players[kBlack] < header.strings_size
+      && r.players[kWhite] < header.strings_size
+      && r.date < header.strings_size
+      && r.event < header.strings_size
+      && r.opening < header.strings_size
+      && r.result <= Game::kWhiteWin;
+  }
+  if (!ok) {
+    std::printf("%s is broken.\n", file_name);
+    munmap(address, file_size);
+    return false;
+  }
+
+  // 対局は先頭から順に読まれることが多いので、先読みを促しておく
+  madvise(address, file_size, MADV_WILLNEED);
+
+  data_ = data;
+  mapped_size_ = file_size;
+  num_games_ = header.num_games;
+  records_ = records;
+  strings_ = reinterpret_cast<const char*>(data + header.strings_offset);
+  moves_ = reinterpret_cast<const uint16_t*>(data + header.moves_offset);
+  return true;
+}
+
+const BinaryGameDatabase::GameRecord& BinaryGameDatabase::record(const size_t game_id) const {
+  assert(game_id < num_games_);
+  return records_[game_id];
+}
+
+const char* BinaryGameDatabase::event(const size_t game_id) const {
+  return string_at(record(game_id).event);
+}
+
+bool BinaryGameDatabase::ReadGame(const size_t game_id, Game* const game) const {
+  assert(game != nullptr);
+
+  // 1. ヘッダー部分をコピーする
+  const GameRecord& r = record(game_id);
+  game->players[kBlack] = string_at(r.players[kBlack]);
+  game->players[kWhite] = string_at(r.players[kWhite]);
+  game->result = static_cast<Game::Result>(r.result);
+  game->date = string_at(r.date);
+  game->event = string_at(r.event);
+  game->opening = string_at(r.opening);
+
+  // 2. 指し手を復元する（移動する駒と取られる駒は、盤上の駒の配置を追うことで求める）
+  static const ArrayMap<Piece, Square> start_board = [] {
+    ArrayMap<Piece, Square> board;
+    Position startpos = Position::CreateStartPosition();
+    for (Square s : Square::all_squares()) {
+      board[s] = startpos.piece_on(s);
+    }
+    return board;
+  }();
+  ArrayMap<Piece, Square> board = start_board;
+  Color side_to_move = kBlack;
+  game->moves.clear();
+  game->moves.reserve(r.num_moves);
+  for (size_t ply = 0; ply < r.num_moves; ++ply) {
+    const uint16_t packed = moves_[r.moves_begin + ply];
+    const int to_index = packed & 0x7f, from_index = (packed >> 7) & 0x7f;
+    const bool promotion = (packed >> 14) & 1;
+    if (to_index >= kDropOrigin) {
+      return false;
+    }
+    const Square to(to_index);
+    Move move;
+    if (from_index >= kDropOrigin) {
+      const PieceType pt = static_cast<PieceType>(from_index - kDropOrigin);
+      if (pt < kPawn || pt > kRook || promotion || board[to] != kNoPiece) {
+        return false;
+      }
+      move = Move(side_to_move, pt, to);
+    } else {
+      const Square from(from_index);
+      const Piece piece = board[from], captured = board[to];
+      if (   piece == kNoPiece || piece.color() != side_to_move
+          || (captured != kNoPiece && (captured.color() == side_to_move || captured.type() == kKing))) {
+        return false;
+      }
+      move = Move(piece, from, to, promotion, captured);
+      board[from] = kNoPiece;
+    }
+    board[to] = move.piece_after_move();
+    game->moves.push_back(move);
+    side_to_move = ~side_to_move;
+  }
+
+  return true;
+}
+
+bool BinaryGameDatabase::ConvertFromTextFile(const char* const input_file_name,
+                                             const char* const output_file_name) {
+  // 1. テキスト形式のファイルを、対局ごとに２行ずつ読み込む
+  std::ifstream input(input_file_name);
+  if (!input) {
+    std::printf("Failed to open %s.\n", input_file_name);
+    return false;
+  }
+  std::vector<std::string> header_lines, move_lines;
+  for (std::string header, moves; std::getline(input, header) && std::getline(input, moves); ) {
+    header_lines.push_back(header);
+    move_lines.push_back(moves);
+  }
+  std::printf("Read %zu games from %s.\n", header_lines.size(), input_file_name);
 
+  // 2. 各対局を、複数のスレッドで並列に解析する
+  std::vector<Game> games(header_lines.size());
+#pragma omp parallel for schedule(dynamic, 64)
+  for (size_t i = 0; i < games.size(); ++i) {
+    int game_length = ParseHeader(header_lines[i], &games[i]);
+    ParseMoves(move_lines[i], game_length, &games[i]);
+  }
+
+  // 3. 文字列と指し手を、それぞれの領域にまとめる
+  std::string strings(1, '\0'); // 先頭には、空文字列を置く
+  std::unordered_map<std::string, uint32_t> string_offsets = {{"", 0}};
+  auto add_string = [&](const std::string& str) -> uint32_t {
+    auto inserted = string_offsets.emplace(str, static_cast<uint32_t>(strings.size()));
+    if (inserted.second) {
+      strings.append(str.c_str(), str.size() + 1);
+    }
+    return inserted.first->second;
+  };
+  std::vector<GameRecord> records(games.size());
+  std::vector<uint16_t> moves;
+  for (size_t i = 0; i < games.size(); ++i) {
+    const Game& game = games[i];
+    GameRecord& r = records[i];
+    r.moves_begin = moves.size();
+    r.players[kBlack] = add_string(game.players[kBlack]);
+    r.players[kWhite] = add_string(game.players[kWhite]);
+    r.date = add_string(game.date);
+    r.event = add_string(game.event);
+    r.opening = add_string(game.opening);
+    r.num_moves = static_cast<uint16_t>(std::min(game.moves.size(), size_t(UINT16_MAX)));
+    r.result = static_cast<uint8_t>(game.result);
+    r.reserved = 0;
+    for (size_t ply = 0; ply < r.num_moves; ++ply) {
+      moves.push_back(PackMove(game.moves[ply]));
+    }
+  }
+  if (strings.size() % 2 != 0) {
+    strings.push_back('\0'); // 指し手領域を、2バイト境界に揃える
+  }
+
+  // 4. ファイルに書き出す
+  BinaryDatabaseHeader header;
+  std::memcpy(header.magic, kBinaryDatabaseMagic, sizeof(header.magic));
+  header.version = kBinaryDatabaseVersion;
+  header.reserved = 0;
+  header.num_games = records.size();
+  header.records_offset = sizeof(BinaryDatabaseHeader);
+  header.strings_offset = header.records_offset + records.size() * sizeof(GameRecord);
+  header.strings_size = strings.size();
+  header.moves_offset = header.strings_offset + header.strings_size;
+  header.num_moves = moves.size();
+
+  std::FILE* output = std::fopen(output_file_name, "wb");
+  if (output == nullptr) {
+    std::printf("Failed to open %s.\n", output_file_name);
+    return false;
+  }
+  bool ok = std::fwrite(&header, sizeof(header), 1, output) == 1
+         && std::fwrite(records.data(), sizeof(GameRecord), records.size(), output) == records.size()
+         && std::fwrite(strings.data(), 1, strings.size(), output) == strings.size()
+         && std::fwrite(moves.data(), sizeof(uint16_t), moves.size(), output) == moves.size();
+  ok = (std::fclose(output) == 0) && ok;
+  if (!ok) {
+    std::printf("Failed to write %s.\n", output_file_name);
+    return false;
+  }
+  std::printf("Wrote %zu games (%zu moves) to %s.\n", records.size(), moves.size(), output_file_name);
   return true;
 }
 
+GameDatabase::GameDatabase() {
+  if (BinaryGameDatabase::IsBinaryDatabase(kDefaultBinaryDatabaseFile)) {
+    if (!BinaryDatabaseIsUpToDate(kDefaultBinaryDatabaseFile, kDefaultDatabaseFile)) {
+      // 変換後にテキスト形式のファイルが更新された場合は、古いバイナリ形式のファイルは使わない
+      std::printf("%s is older than %s. Reading %s instead.\n", kDefaultBinaryDatabaseFile,
+                  kDefaultDatabaseFile, kDefaultDatabaseFile);
+      file_stream_.open(kDefaultDatabaseFile);
+      input_stream_ = &file_stream_;
+      return;
+    }
+    binary_db_.reset(new BinaryGameDatabase);
+    if (binary_db_->Open(kDefaultBinaryDatabaseFile)) {
+      return;
+    }
+    binary_db_.reset();
+  }
+  file_stream_.open(kDefaultDatabaseFile);
+  input_stream_ = &file_stream_;
+}
+
+GameDatabase::~GameDatabase() {
+}
+
+bool GameDatabase::IsSkipped(const size_t game_id) const {
+  return title_matches_only_ && g_title_matches.count(binary_db_->event(game_id)) == 0;
+}
+
+bool GameDatabase::ReadOneGame(Game* game) {
+  assert(game != nullptr);
+
+  // バイナリ形式のファイルを読み込んでいる場合
+  if (binary_db_) {
+    while (next_game_id_ < binary_db_->size() && IsSkipped(next_game_id_)) {
+      ++next_game_id_;
+    }
+    if (next_game_id_ >= binary_db_->size()) {
+      return false;
+    }
+    if (!binary_db_->ReadGame(next_game_id_, game)) {
+      std::printf("Failed to read game %zu from the binary game database.\n", next_game_id_);
+      failed_ = true;
+      return false;
+    }
+    ++next_game_id_;
+    return true;
+  }
+
+START:
+  std::string line;
+
+  // Step 1. ヘッダー部分を１行読み込む
+  if (!std::getline(*input_stream_, line)) {
+    return false;
+  }
+
+  // ファイル末尾の空行は、ファイルの終わりとみなす（途中で切れているわけではない）
+  if (line.empty() && input_stream_->peek() == std::char_traits<char>::eof()) {
+    return false;
+  }
+
+  // Step 2. ヘッダー部分を解析する
+  int game_length = ParseHeader(line, game);
+
+  // Step 3. 指し手が記録されている１行を読み込む
+  // （ヘッダー部分だけで終わっている場合は、ファイルが途中で切れているとみなす）
+  if (!std::getline(*input_stream_, line)) {
+    std::printf("The game database ends in the middle of a game.\n");
+    failed_ = true;
+    return false;
+  }
+
+  // 指定があれば、７大棋戦＋順位戦以外の対局をスキップする
+  if (title_matches_only_ && g_title_matches.count(game->event) == 0) {
+    goto START;
+  }
+
+  // Step 4. 指し手をパースする
+  ParseMoves(line, game_length, game);
+
+  return true;
+}
+
+std::vector<Game> GameDatabase::ReadAllGames(const size_t max_games) {
+  std::vector<Game> games;
+
+  // テキスト形式のファイルは、先頭から順に読むしかない
+  if (!binary_db_) {
+    for (Game game; games.size() < max_games && ReadOneGame(&game); ) {
+      games.push_back(game);
+    }
+    return games;
+  }
+
+  // バイナリ形式のファイルは、読み込む対局を先に決めてから、並列に指し手を復元する
+  std::vector<size_t> game_ids;
+  for (; next_game_id_ < binary_db_->size() && game_ids.size() < max_games; ++next_game_id_) {
+    if (!IsSkipped(next_game_id_)) {
+      game_ids.push_back(next_game_id_);
+    }
+  }
+  games.resize(game_ids.size());
+  std::vector<char> succeeded(game_ids.size());
+#pragma omp parallel for schedule(dynamic, 256)
+  for (size_t i = 0; i < game_ids.size(); ++i) {
+    succeeded[i] = binary_db_->ReadGame(game_ids[i], &games[i]);
+  }
+
+  // 読み出しに失敗した対局があれば、その直前までの対局を返す
+  const size_t num_succeeded = std::find(succeeded.begin(), succeeded.end(), false) - succeeded.begin();
+  if (num_succeeded < games.size()) {
+    std::printf("Failed to read game %zu from the binary game database.\n", game_ids[num_succeeded]);
+    failed_ = true;
+    next_game_id_ = game_ids[num_succeeded];
+    games.resize(num_succeeded);
+  }
+  return games;
+}
+
 #endif // !defined(MINIMUM)
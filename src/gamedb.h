@@ -20,7 +20,10 @@
 #ifndef GAMEDB_H_
 #define GAMEDB_H_
 
+#include <cstdint>
+#include <fstream>
 #include <istream>
+#include <memory>
 #include <string>
 #include <vector>
 #include "common/arraymap.h"
@@ -63,6 +66,83 @@ struct Game {
   std::vector<Move> moves;
 };
 
+/**
+ * 棋譜DBファイルを、バイナリ形式に変換したもの（kifu_db.bin等）を読み込むためのクラスです.
+ *
+ * ファイルの構成は、以下のとおりです。
+ *   1. ヘッダ（対局数、各領域の位置）
+ *   2. 対局ごとのレコード（対局者・対局日・棋戦・戦型の文字列の位置、対局結果、手数、指し手の位置）
+ *   3. 文字列領域（同じ文字列は１度だけ保存する）
+ *   4. 指し手領域（１手16ビットに詰めた指し手を、全対局分並べたもの）
+ *
+ * ファイルは読み込み専用でメモリマップするので、開くのは一瞬で済みます。
+ * 各対局には直接アクセスでき、ReadGame()は複数のスレッドから同時に呼び出すことができます。
+ * 指し手の復元は盤面の駒の配置を追うだけなので、Positionクラスでの合法性チェックも行いません。
+ */
+class BinaryGameDatabase {
+ public:
+  BinaryGameDatabase() {}
+  ~BinaryGameDatabase();
+
+  BinaryGameDatabase(const BinaryGameDatabase&) = delete;
+  BinaryGameDatabase& operator=(const BinaryGameDatabase&) = delete;
+
+  /**
+   * ファイルがバイナリ形式の棋譜DBであれば（先頭にヘッダがあれば）、trueを返します.
+   */
+  static bool IsBinaryDatabase(const char* file_name);
+
+  /**
+   * ファイルを読み込み専用でメモリマップして、ヘッダとレコードを検証します.
+   * @return ファイルを開くことができ、内容が正しければ、true
+   */
+  bool Open(const char* file_name);
+
+  bool is_open() const {
+    return data_ != nullptr;
+  }
+
+  /**
+   * 対局数を返します.
+   */
+  size_t size() const {
+    return num_games_;
+  }
+
+  /**
+   * 対局の棋戦の名前を返します（指し手を復元せずに、棋戦で対局を絞り込むことができます）.
+   */
+  const char* event(size_t game_id) const;
+
+  /**
+   * 指定された対局を読み込みます.
+   * @return 対局データを正しく復元できた場合は、true
+   */
+  bool ReadGame(size_t game_id, Game* game) const;
+
+  /**
+   * テキスト形式の棋譜DBファイルを、バイナリ形式に変換します.
+   * 指し手の解析（合法性のチェックを含む）は、複数のスレッドで並列に行います。
+   */
+  static bool ConvertFromTextFile(const char* input_file_name,
+                                  const char* output_file_name);
+
+ private:
+  struct GameRecord;
+
+  const GameRecord& record(size_t game_id) const;
+  const char* string_at(uint32_t offset) const {
+    return strings_ + offset;
+  }
+
+  const uint8_t* data_ = nullptr;
+  size_t mapped_size_ = 0;
+  size_t num_games_ = 0;
+  const GameRecord* records_ = nullptr;
+  const char* strings_ = nullptr;
+  const uint16_t* moves_ = nullptr;
+};
+
 /**
  * 対局DBファイルから対局データを読み出すためのクラスです.
  *
@@ -74,6 +154,11 @@ struct Game {
  * を対局の数だけ並べたものです。
  *
  * 日本語が含まれる棋譜ファイルの場合は、エンコーディングはUTF-8にしておいてください.
+ *
+ * デフォルトコンストラクタを用いた場合は、バイナリ形式に変換した棋譜DBファイル（kifu_db.bin）があればそれを、
+ * なければテキスト形式の棋譜DBファイル（kifu_db.txt）を読み込みます。
+ * ただし、kifu_db.binがkifu_db.txtより古い場合は、変換後にテキスト形式のファイルが更新されたとみなして、
+ * kifu_db.txtの方を読み込みます。
  */
 class GameDatabase {
  public:
@@ -82,21 +167,48 @@ class GameDatabase {
    */
   static constexpr const char* kDefaultDatabaseFile = "kifu_db.txt";
 
+  /**
+   * デフォルトで読み込む、バイナリ形式の棋譜DBファイルの場所.
+   */
+  static constexpr const char* kDefaultBinaryDatabaseFile = "kifu_db.bin";
+
+  /**
+   * デフォルトの棋譜DBファイルを読み込みます（バイナリ形式のファイルを優先します）.
+   */
+  GameDatabase();
+
   /**
    * コンストラクタで、読み出しを行うDBファイルのストリームを指定してください.
    * なお、読み出すファイルは、utf-8でエンコーディングされている必要があります。
    */
   GameDatabase(std::istream& is)
-      : input_stream_(is) {
+      : input_stream_(&is) {
   }
 
+  ~GameDatabase();
+
   /**
    * 対局１局分のデータを読み出します.
    * @param game 読み出した対局データの保存先のポインタ
-   * @return まだDBに残りの対局がある場合はtrue
+   * @return まだDBに残りの対局がある場合はtrue（読み出しに失敗した場合は、false を返し、failed()がtrueになる）
    */
   bool ReadOneGame(Game* game);
 
+  /**
+   * 残りの対局データを、まとめて読み出します.
+   * バイナリ形式のファイルを読み込んでいる場合は、複数のスレッドで並列に指し手を復元します。
+   * 読み出しに失敗した場合は、その直前までの対局データを返し、failed()がtrueになります。
+   * @param max_games 読み出す対局数の上限
+   */
+  std::vector<Game> ReadAllGames(size_t max_games = SIZE_MAX);
+
+  /**
+   * 対局データの読み出しに失敗した（ファイルが壊れている、途中で切れている等）場合は、trueを返します.
+   */
+  bool failed() const {
+    return failed_;
+  }
+
   /**
    * 読み出す対局データを、７大棋戦＋順位戦の対局に限定するか否かを設定します.
    * @param title_matches_only trueであれば、読み出す棋譜を７台棋戦＋順位戦の対局に限定する
@@ -106,8 +218,14 @@ class GameDatabase {
   }
 
  private:
-  std::istream& input_stream_;
+  bool IsSkipped(size_t game_id) const;
+
+  std::istream* input_stream_ = nullptr;
+  std::ifstream file_stream_;
+  std::unique_ptr<BinaryGameDatabase> binary_db_;
+  size_t next_game_id_ = 0;
   bool title_matches_only_ = false;
+  bool failed_ = false;
 };
 
 #endif /* GAMEDB_H_ */
@@ -46,8 +46,8 @@ HashEntry* HashTable::LookUp(Key64 key64) const {
   return nullptr;
 }
 
-void HashTable::Save(Key64 key64, Move move, Score score, Depth depth,
-                              Bound bound, Score eval, bool skip_mate3, bool is_pv) {
+void HashTable::Store(Key64 key64, Move move, Score score, Depth depth,
+                      Bound bound, Score eval, bool skip_mate3, bool is_pv) {
   const Key32 key32 = key64.ToKey32();
   HashEntry::Flag flag = skip_mate3 ? HashEntry::kSkipMate3 : HashEntry::kFlagNone;
   if (is_pv) {
@@ -87,6 +87,34 @@ void HashTable::Save(Key64 key64, Move move, Score score, Depth depth,
   replace->Save(key64, score, bound, depth, move, eval, flag, age_);
 }
 
+bool HashTable::Peek(Key64 key64, HashEntry* const entry) const {
+  const Key32 key32 = key64.ToKey32();
+  for (const HashEntry& tte : table_[key64 & key_mask_]) {
+    if (tte.key32() == key32) {
+      *entry = tte;
+      return true;
+    }
+  }
+  return false;
+}
+
+bool HashTable::SaveImportedEntry(Key64 key64, Move move, Score score, Depth depth,
+                                  Bound bound, Score eval, bool skip_mate3) {
+  // 置換表が確保されていなければ、何もしない
+  if (table_ == nullptr) {
+    return false;
+  }
+
+  // 自分の探索結果の方が深ければ、そちらを残す
+  HashEntry entry;
+  if (Peek(key64, &entry) && entry.depth() >= depth) {
+    return false;
+  }
+
+  Store(key64, move, score, depth, bound, eval, skip_mate3, false);
+  return true;
+}
+
 void HashTable::InsertMoves(const Node& root_node,
                             const std::vector<Move>& moves) {
   // local copy
@@ -23,6 +23,7 @@
 #include <vector>
 #include "common/array.h"
 #include "hash_entry.h"
+#include "tt_exchange.h"
 class Node;
 
 /**
@@ -42,7 +43,38 @@ class HashTable {
    * 特定の局面に関する情報を保存する.
    */
   void Save(Key64 key64, Move move, Score score, Depth depth, Bound bound,
-            Score eval, bool skip_mate3, bool is_pv);
+            Score eval, bool skip_mate3, bool is_pv) {
+    Store(key64, move, score, depth, bound, eval, skip_mate3, is_pv);
+#if !defined(MINIMUM)
+    if (tt_exchange_ != nullptr) {
+      tt_exchange_->RecordSave(key64, depth, bound);
+    }
+#endif
+  }
+
+  /**
+   * 特定の局面に関する情報を、エントリの鮮度を更新せずに取り出します.
+   * @return エントリが見つかった場合は、true
+   */
+  bool Peek(Key64 key64, HashEntry* entry) const;
+
+  /**
+   * 他のエンジンから受け取った局面の情報を保存します（TtExchange用）.
+   * 同じ局面について、すでに同じ深さ以上の情報がある場合は、保存しません。
+   * また、ここで保存した情報は、TtExchangeによって再びエクスポートされることはありません。
+   * @return 保存した場合は、true
+   */
+  bool SaveImportedEntry(Key64 key64, Move move, Score score, Depth depth,
+                         Bound bound, Score eval, bool skip_mate3);
+
+#if !defined(MINIMUM)
+  /**
+   * 深いエントリが保存されたことを知らせる先を設定します（nullptrの場合は、知らせない）.
+   */
+  void set_tt_exchange(TtExchange* tt_exchange) {
+    tt_exchange_ = tt_exchange;
+  }
+#endif
 
   /**
    * 指し手をハッシュテーブルに挿入します.
@@ -97,6 +129,9 @@ class HashTable {
   }
 
  private:
+  void Store(Key64 key64, Move move, Score score, Depth depth, Bound bound,
+             Score eval, bool skip_mate3, bool is_pv);
+
   /** バケツ１個あたりに保存する、エントリの数. */
   static constexpr size_t kBucketSize = 4;
 
@@ -120,6 +155,11 @@ class HashTable {
 
   /** ハッシュテーブルに入っている情報の古さ */
   uint8_t age_;
+
+#if !defined(MINIMUM)
+  /** 深いエントリが保存されたことを知らせる先 */
+  TtExchange* tt_exchange_ = nullptr;
+#endif
 };
 
 #endif /* HASH_TABLE_H_ */
@@ -19,10 +19,22 @@
 
 #include "huffman_code.h"
 
+#if !defined(MINIMUM)
+#include <cinttypes>
+#include <cstdio>
+#include <random>
+#include <vector>
+#include "common/simple_timer.h"
+#include "movegen.h"
+#endif
+
 namespace {
 
 /**
  * ハフマン符号化を補助するための、ビットストリームです.
+ *
+ * 複数のビットを、64ビット単位でまとめて読み書きします。
+ * 末尾の64ビットに番兵を置いているので、末尾付近でも、境界を気にせずに先読み（peek()）することができます。
  */
 struct BitStream {
  public:
@@ -30,35 +42,45 @@ struct BitStream {
     array_.clear();
   }
 
-  BitStream(const Array<uint64_t, 4>& array)
-      : array_(array) {
+  BitStream(const Array<uint64_t, 4>& array) {
+    for (size_t i = 0; i < 4; ++i) {
+      array_[i] = array[i];
+    }
+    array_[4] = 0;
   }
 
-  uint64_t get() {
-    uint64_t value = (array_[pos_ / 64] >> (pos_ % 64)) & UINT64_C(1);
-    ++pos_;
-    assert(value == 0 || value == 1);
-    return value;
+  /**
+   * 現在の位置から、countビットを読み出します（位置は進めません）.
+   */
+  uint64_t peek(size_t count) const {
+    assert(count < 64);
+    const size_t q = pos_ / 64, r = pos_ % 64;
+    uint64_t value = array_[q] >> r;
+    if (r != 0) {
+      value |= array_[q + 1] << (64 - r);
+    }
+    return value & ((UINT64_C(1) << count) - 1);
   }
 
-  uint64_t read(size_t count) {
-    uint64_t value = 0;
-    for (size_t i = 0; i < count; ++i) {
-      value |= get() << i;
-    }
-    return value;
+  void skip(size_t count) {
+    pos_ += count;
+    assert(pos_ <= size());
   }
 
-  void put(uint64_t value) {
-    assert(value == 0 || value == 1);
-    array_[pos_ / 64] |= value << (pos_ % 64);
-    ++pos_;
+  uint64_t read(size_t count) {
+    uint64_t value = peek(count);
+    skip(count);
+    return value;
   }
 
   void write(uint64_t value, size_t count) {
-    for (size_t i = 0; i < count; ++i) {
-      put((value >> i) & UINT64_C(1));
+    assert(count < 64 && (value >> count) == 0);
+    const size_t q = pos_ / 64, r = pos_ % 64;
+    array_[q] |= value << r;
+    if (r + count > 64) {
+      array_[q + 1] |= value >> (64 - r);
     }
+    skip(count);
   }
 
   size_t size() const {
@@ -69,12 +91,14 @@ struct BitStream {
     return pos_ == size();
   }
 
-  const Array<uint64_t, 4>& array() {
-    return array_;
+  Array<uint64_t, 4> array() const {
+    Array<uint64_t, 4> array;
+    std::copy(array_.begin(), array_.begin() + 4, array.begin());
+    return array;
   }
 
  private:
-  Array<uint64_t, 4> array_;
+  Array<uint64_t, 5> array_;
   size_t pos_ = 0;
 };
 
@@ -101,15 +125,31 @@ const ArrayMap<HuffmanBitString, PieceType> g_huffman_code_table = {
 };
 
 /**
- * ハフマン符号を高速に復号化するための参照テーブルです.
+ * 盤上の駒・持ち駒の、ハフマン符号の最大長です（駒の種類＋持ち主＋成り駒か否か）.
  */
-Array<PieceType, 6, 64> g_huffman_decoder_table; // [ビット長][ハフマン符号]
+constexpr int kMaxBoardPieceLength = 8;
+constexpr int kMaxHandPieceLength = 7;
 
 /**
- * 与えられたハフマン符号に該当する駒が存在しない場合、g_huffman_decoder_tableに
- * この値をセットしておきます.
+ * ハフマン符号を復号化した結果です.
  */
-const PieceType kHuffmanCodeNotFound = static_cast<PieceType>(-1);
+struct DecodedPiece {
+  Piece piece;
+  int length; // 0の場合は、該当する駒が存在しないことを表す
+};
+
+/**
+ * 駒のハフマン符号を、１回の表引きで復号化するための参照テーブルです.
+ * 次の8ビット（持ち駒の場合は7ビット）をインデックスとして、駒と符号の長さを求めます。
+ */
+Array<DecodedPiece, 1 << kMaxBoardPieceLength> g_board_piece_decoder_table;
+Array<DecodedPiece, 1 << kMaxHandPieceLength> g_hand_piece_decoder_table;
+
+/**
+ * 駒を、１回の表引きで符号化するための参照テーブルです.
+ */
+ArrayMap<HuffmanBitString, Piece> g_board_piece_encoder_table;
+ArrayMap<HuffmanBitString, Piece> g_hand_piece_encoder_table;
 
 /**
  * 駒をハフマン符号で符号化します.
@@ -148,27 +188,171 @@ inline HuffmanBitString EncodePiece(Piece piece) {
  */
 template<bool kIsHandPiece>
 inline Piece DecodePiece(BitStream& bit_stream) {
-  // 1. 駒の種類
+  const DecodedPiece& decoded = kIsHandPiece
+      ? g_hand_piece_decoder_table[bit_stream.peek(kMaxHandPieceLength)]
+      : g_board_piece_decoder_table[bit_stream.peek(kMaxBoardPieceLength)];
+  assert(decoded.length != 0);
+  bit_stream.skip(decoded.length);
+  return decoded.piece;
+}
+
+/**
+ * 復号化テーブルのうち、ハフマン符号がhuffmanに一致するすべてのエントリに、駒をセットします.
+ * （ハフマン符号の後ろに続くビットは何でもよいので、テーブルの複数のエントリが同じ駒を指すことになる）
+ */
+template<size_t kTableSize>
+void SetDecoderTableEntries(Piece piece, HuffmanBitString huffman,
+                            Array<DecodedPiece, kTableSize>* const table) {
+  for (size_t i = 0; i < kTableSize; ++i) {
+    if ((i & ((size_t(1) << huffman.length) - 1)) == size_t(huffman.bits)) {
+      (*table)[i] = DecodedPiece{piece, huffman.length};
+    }
+  }
+}
+
+#if !defined(MINIMUM)
+
+/**
+ * 従来の（１ビットずつ読み書きする）実装です（ベンチマークで比較するためにのみ用います）.
+ */
+namespace reference {
+
+struct BitStream {
+ public:
+  BitStream() {
+    array_.clear();
+  }
+
+  BitStream(const Array<uint64_t, 4>& array)
+      : array_(array) {
+  }
+
+  uint64_t get() {
+    uint64_t value = (array_[pos_ / 64] >> (pos_ % 64)) & UINT64_C(1);
+    ++pos_;
+    return value;
+  }
+
+  uint64_t read(size_t count) {
+    uint64_t value = 0;
+    for (size_t i = 0; i < count; ++i) {
+      value |= get() << i;
+    }
+    return value;
+  }
+
+  void put(uint64_t value) {
+    array_[pos_ / 64] |= value << (pos_ % 64);
+    ++pos_;
+  }
+
+  void write(uint64_t value, size_t count) {
+    for (size_t i = 0; i < count; ++i) {
+      put((value >> i) & UINT64_C(1));
+    }
+  }
+
+  bool eof() const {
+    return pos_ == 256;
+  }
+
+  const Array<uint64_t, 4>& array() {
+    return array_;
+  }
+
+ private:
+  Array<uint64_t, 4> array_;
+  size_t pos_ = 0;
+};
+
+/**
+ * 駒の種類のハフマン符号を、１ビットずつ復号化するための参照テーブルです.
+ */
+Array<PieceType, 6, 64> g_huffman_decoder_table; // [ビット長][ハフマン符号]
+const PieceType kHuffmanCodeNotFound = static_cast<PieceType>(-1);
+
+void InitDecoderTable() {
+  for (int length = 0; length < 6; ++length)
+    for (int bits = 0; bits < 64; ++bits) {
+      g_huffman_decoder_table[length][bits] = kHuffmanCodeNotFound;
+    }
+  for (int i = kNoPieceType; i <= kRook; ++i) {
+    PieceType piece_type = static_cast<PieceType>(i);
+    HuffmanBitString huffman = g_huffman_code_table[piece_type];
+    g_huffman_decoder_table[huffman.length - 1][huffman.bits] = piece_type;
+  }
+}
+
+template<bool kIsHandPiece>
+Piece DecodePiece(BitStream& bit_stream) {
   uint64_t code = kIsHandPiece ? 1 : 0;
   PieceType pt = kHuffmanCodeNotFound;
   for (int i = kIsHandPiece ? 1 : 0; pt == kHuffmanCodeNotFound; ++i) {
-    assert(i < 6);
     code |= bit_stream.get() << i;
     pt = g_huffman_decoder_table[i][code];
   }
-
   if (pt == kNoPieceType) {
     return kNoPiece;
   }
-
-  // 2. 駒の持ち主
   Color color = static_cast<Color>(bit_stream.get());
   Piece piece(color, pt);
-
-  // 3. 成り駒か否か
   return (pt != kGold && bit_stream.get()) ? piece.promoted_piece() : piece;
 }
 
+HuffmanCode EncodePosition(const Position& pos) {
+  BitStream bit_stream;
+  bit_stream.put(static_cast<int>(pos.side_to_move()));
+  bit_stream.write(static_cast<int>(pos.king_square(kBlack)), 7);
+  bit_stream.write(static_cast<int>(pos.king_square(kWhite)), 7);
+  for (Square s : Square::all_squares()) {
+    Piece piece = pos.piece_on(s);
+    if (piece.type() != kKing) {
+      HuffmanBitString huffman = EncodePiece<false>(piece);
+      bit_stream.write(huffman.bits, huffman.length);
+    }
+  }
+  for (Color c : {kBlack, kWhite}) {
+    Hand hand = pos.hand(c);
+    for (PieceType pt : Piece::all_hand_types()) {
+      int count = hand.count(pt);
+      if (count == 0) continue;
+      HuffmanBitString huffman = EncodePiece<true>(Piece(c, pt));
+      do {
+        bit_stream.write(huffman.bits, huffman.length);
+      } while (--count > 0);
+    }
+  }
+  return HuffmanCode(bit_stream.array());
+}
+
+Position DecodePosition(const HuffmanCode& huffman_code) {
+  Position pos;
+  BitStream bit_stream(huffman_code.array());
+  pos.set_side_to_move(static_cast<Color>(bit_stream.get()));
+  Square black_king_square(bit_stream.read(7));
+  Square white_king_square(bit_stream.read(7));
+  pos.PutPiece(kBlackKing, black_king_square);
+  pos.PutPiece(kWhiteKing, white_king_square);
+  for (Square s : Square::all_squares()) {
+    if (pos.is_empty(s)) {
+      Piece piece = DecodePiece<false>(bit_stream);
+      if (piece != kNoPiece) {
+        pos.PutPiece(piece, s);
+      }
+    }
+  }
+  pos.InitStateInfo();
+  while (!bit_stream.eof()) {
+    Piece piece = DecodePiece<true>(bit_stream);
+    pos.AddOneToHand(piece.color(), piece.type());
+  }
+  return pos;
+}
+
+} // namespace reference
+
+#endif // !defined(MINIMUM)
+
 } // namespace
 
 HuffmanCode HuffmanCode::EncodePosition(const Position& pos) {
@@ -185,7 +369,7 @@ HuffmanCode HuffmanCode::EncodePosition(const Position& pos) {
   BitStream bit_stream;
 
   // 1. 手番
-  bit_stream.put(static_cast<int>(pos.side_to_move()));
+  bit_stream.write(static_cast<int>(pos.side_to_move()), 1);
 
   // 2. 玉の位置
   bit_stream.write(static_cast<int>(pos.king_square(kBlack)), 7);
@@ -195,7 +379,7 @@ HuffmanCode HuffmanCode::EncodePosition(const Position& pos) {
   for (Square s : Square::all_squares()) {
     Piece piece = pos.piece_on(s);
     if (piece.type() != kKing) {
-      HuffmanBitString huffman = EncodePiece<false>(piece);
+      HuffmanBitString huffman = g_board_piece_encoder_table[piece];
       bit_stream.write(huffman.bits, huffman.length);
     }
   }
@@ -206,7 +390,7 @@ HuffmanCode HuffmanCode::EncodePosition(const Position& pos) {
     for (PieceType pt : Piece::all_hand_types()) {
       int count = hand.count(pt);
       if (count == 0) continue;
-      HuffmanBitString huffman = EncodePiece<true>(Piece(c, pt));
+      HuffmanBitString huffman = g_hand_piece_encoder_table[Piece(c, pt)];
       do {
         bit_stream.write(huffman.bits, huffman.length);
       } while (--count > 0);
@@ -223,7 +407,7 @@ Position HuffmanCode::DecodePosition(const HuffmanCode& huffman_code) {
   BitStream bit_stream(huffman_code.array());
 
   // 1. 手番
-  Color side_to_move = static_cast<Color>(bit_stream.get());
+  Color side_to_move = static_cast<Color>(bit_stream.read(1));
   pos.set_side_to_move(side_to_move);
 
   // 2. 玉の位置
@@ -253,20 +437,178 @@ Position HuffmanCode::DecodePosition(const HuffmanCode& huffman_code) {
   return pos;
 }
 
+PsqList HuffmanCode::DecodePsqList(const HuffmanCode& huffman_code,
+                                   ArrayMap<Square, Color>* const king_squares) {
+  BitStream bit_stream(huffman_code.array());
+
+  // 1. 手番（読み飛ばす）
+  bit_stream.skip(1);
+
+  // 2. 玉の位置
+  Square black_king_square(bit_stream.read(7));
+  Square white_king_square(bit_stream.read(7));
+  if (king_squares != nullptr) {
+    (*king_squares)[kBlack] = black_king_square;
+    (*king_squares)[kWhite] = white_king_square;
+  }
+
+  // 3. 盤上の駒（玉のマスは、kNoPieceのままにしておく）
+  ArrayMap<Piece, Square> board;
+  for (Square s : Square::all_squares()) {
+    if (s != black_king_square && s != white_king_square) {
+      board[s] = DecodePiece<false>(bit_stream);
+    }
+  }
+
+  // 4. 持ち駒
+  ArrayMap<Hand, Color> hands;
+  while (!bit_stream.eof()) {
+    Piece piece = DecodePiece<true>(bit_stream);
+    hands[piece.color()].add_one(piece.type());
+  }
+
+  return PsqList(hands, board);
+}
+
 void HuffmanCode::Init() {
-  // 1. g_huffman_decoder_tableを初期化する
+  // 1. 盤上の駒の符号化・復号化テーブルを初期化する
+  for (Piece piece : Piece::all_pieces()) {
+    if (piece.type() != kKing) {
+      HuffmanBitString huffman = EncodePiece<false>(piece);
+      g_board_piece_encoder_table[piece] = huffman;
+      SetDecoderTableEntries(piece, huffman, &g_board_piece_decoder_table);
+    }
+  }
+  g_board_piece_encoder_table[kNoPiece] = EncodePiece<false>(kNoPiece);
+  SetDecoderTableEntries(kNoPiece, EncodePiece<false>(kNoPiece), &g_board_piece_decoder_table);
+
+  // 2. 持ち駒の符号化・復号化テーブルを初期化する
+  for (Color c : {kBlack, kWhite}) {
+    for (PieceType pt : Piece::all_hand_types()) {
+      Piece piece(c, pt);
+      HuffmanBitString huffman = EncodePiece<true>(piece);
+      g_hand_piece_encoder_table[piece] = huffman;
+      SetDecoderTableEntries(piece, huffman, &g_hand_piece_decoder_table);
+    }
+  }
+
+#if !defined(MINIMUM)
+  reference::InitDecoderTable();
+#endif
+}
+
+#if !defined(MINIMUM)
+
+void HuffmanCode::Benchmark(const int num_positions) {
+  std::printf("Start Huffman Code Benchmark!\n\n");
+
+  // 1. テスト局面を準備する（初期局面から、ランダムに指し手を選んで進めた局面）
+  std::mt19937 rng(0);
+  std::vector<Position> positions;
+  Position pos = Position::CreateStartPosition();
+  while (positions.size() < static_cast<size_t>(num_positions)) {
+    SimpleMoveList<kAllMoves, true> legal_moves(pos);
+    if (legal_moves.size() == 0 || pos.game_ply() >= 256) {
+      pos = Position::CreateStartPosition();
+      continue;
+    }
+    int move_id = std::uniform_int_distribution<int>(0, legal_moves.size() - 1)(rng);
+    pos.MakeMove(legal_moves[move_id].move);
+    positions.push_back(Position::FromSfen(pos.ToSfen())); // 過去の局面の履歴を持たないようにする
+  }
+
+  const int kNumRepeats = 10;
+  const double num_calls = double(kNumRepeats) * positions.size();
+  auto print_result = [&](const char* method, double elapsed) {
+    elapsed = std::max(elapsed, 0.001);
+    std::printf("%-18s Time=%.3fsec Speed=%.0fpositions/sec\n",
+                method, elapsed, num_calls / elapsed);
+  };
+
+  // 2. 符号化の速度を測定する
+  std::vector<HuffmanCode> reference_codes(positions.size()), codes(positions.size());
+  {
+    SimpleTimer timer;
+    for (int n = 0; n < kNumRepeats; ++n) {
+      for (size_t i = 0; i < positions.size(); ++i) {
+        reference_codes[i] = reference::EncodePosition(positions[i]);
+      }
+    }
+    print_result("Encode(Reference)", timer.GetElapsedSeconds());
+  }
   {
-    // 初期値として、kHuffmanCodeNotFoundをセットする
-    for (int length = 0; length < 6; ++length)
-      for (int bits = 0; bits < 64; ++bits) {
-        g_huffman_decoder_table[length][bits] = kHuffmanCodeNotFound;
+    SimpleTimer timer;
+    for (int n = 0; n < kNumRepeats; ++n) {
+      for (size_t i = 0; i < positions.size(); ++i) {
+        codes[i] = EncodePosition(positions[i]);
       }
+    }
+    print_result("Encode", timer.GetElapsedSeconds());
+  }
 
-    // 各駒のハフマン符号をセットする
-    for (int i = kNoPieceType; i <= kRook; ++i) {
-      PieceType piece_type = static_cast<PieceType>(i);
-      HuffmanBitString huffman = g_huffman_code_table[piece_type];
-      g_huffman_decoder_table[huffman.length - 1][huffman.bits] = piece_type;
+  // 3. 復号化の速度を測定する
+  uint64_t checksum = 0;
+  {
+    SimpleTimer timer;
+    for (int n = 0; n < kNumRepeats; ++n) {
+      for (const HuffmanCode& code : codes) {
+        Position decoded = reference::DecodePosition(code);
+        checksum += decoded.king_square(kBlack) + decoded.hand(kBlack).count(kPawn);
+      }
     }
+    print_result("Decode(Reference)", timer.GetElapsedSeconds());
   }
+  {
+    SimpleTimer timer;
+    for (int n = 0; n < kNumRepeats; ++n) {
+      for (const HuffmanCode& code : codes) {
+        Position decoded = DecodePosition(code);
+        checksum -= decoded.king_square(kBlack) + decoded.hand(kBlack).count(kPawn);
+      }
+    }
+    print_result("Decode", timer.GetElapsedSeconds());
+  }
+
+  // 4. 特徴（PsqList）を求める速度を、局面を復号化してから求める方法と比較する
+  {
+    SimpleTimer timer;
+    for (int n = 0; n < kNumRepeats; ++n) {
+      for (const HuffmanCode& code : codes) {
+        PsqList list(DecodePosition(code));
+        checksum += list.size();
+      }
+    }
+    print_result("PsqList(Decode)", timer.GetElapsedSeconds());
+  }
+  {
+    SimpleTimer timer;
+    for (int n = 0; n < kNumRepeats; ++n) {
+      for (const HuffmanCode& code : codes) {
+        PsqList list = DecodePsqList(code);
+        checksum -= list.size();
+      }
+    }
+    print_result("DecodePsqList", timer.GetElapsedSeconds());
+  }
+
+  // 5. 計算結果が一致するかを確認する
+  size_t num_mismatches = 0;
+  for (size_t i = 0; i < positions.size(); ++i) {
+    const Position& original = positions[i];
+    ArrayMap<Square, Color> king_squares;
+    PsqList list = DecodePsqList(codes[i], &king_squares);
+    bool match = std::equal(codes[i].array().begin(), codes[i].array().end(),
+                            reference_codes[i].array().begin())
+              && DecodePosition(codes[i]).ToSfen() == original.ToSfen()
+              && reference::DecodePosition(codes[i]).ToSfen() == original.ToSfen()
+              && codes[i].side_to_move() == original.side_to_move()
+              && king_squares[kBlack] == original.king_square(kBlack)
+              && king_squares[kWhite] == original.king_square(kWhite)
+              && PsqList::TwoListsHaveSameItems(list, PsqList(original));
+    num_mismatches += !match;
+  }
+  std::printf("Positions=%zu Mismatches=%zu Checksum=%" PRIu64 "\n",
+              positions.size(), num_mismatches, checksum);
 }
+
+#endif // !defined(MINIMUM)
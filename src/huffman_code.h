@@ -22,11 +22,13 @@
 
 #include "common/array.h"
 #include "position.h"
+#include "psq.h"
 
 /**
  * 局面情報をハフマン符号化するためのクラスです.
  *
  * ハフマン符号化することにより、任意の将棋の局面を256ビットに圧縮することができます。
+ * 符号化・復号化は、駒１枚ごとに１回の表引きで行います。
  *
  * （参考文献）
  *   - 磯崎元洋: 将棋の局面を256bitに圧縮するには？, やねうら王公式サイト,
@@ -58,6 +60,31 @@ class HuffmanCode {
    */
   static Position DecodePosition(const HuffmanCode& huffman_code);
 
+  /**
+   * 局面のハフマン符号から、Positionクラスを作成せずに、インデックスリスト（PsqList）を作成します.
+   * 評価関数の特徴や進行度など、駒の配置だけが必要な場合は、DecodePosition()を経由するよりも高速です。
+   * @param huffman_code 局面のハフマン符号
+   * @param king_squares 両玉の位置を保存する場所（nullptrの場合は、保存しない）
+   */
+  static PsqList DecodePsqList(const HuffmanCode& huffman_code,
+                               ArrayMap<Square, Color>* king_squares = nullptr);
+
+  /**
+   * 局面を復号化せずに、手番だけを返します.
+   */
+  Color side_to_move() const {
+    return static_cast<Color>(array_[0] & UINT64_C(1));
+  }
+
+#if !defined(MINIMUM)
+  /**
+   * 符号化・復号化のベンチマークを行います.
+   * 従来の実装（１ビットずつ読み書きする方法）と、表引きによる実装とで、速度と結果の一致を確認します。
+   * @param num_positions テストに用いる局面の数
+   */
+  static void Benchmark(int num_positions);
+#endif
+
   static void Init();
 
  private:
@@ -24,8 +24,10 @@
 #include <algorithm>
 #include <fstream>
 #include <random>
+#include <sstream>
 #include <thread>
 #include <omp.h>
+#include <unistd.h>
 #include "common/progress_timer.h"
 #include "evaluation.h"
 #include "gamedb.h"
@@ -74,6 +76,9 @@ constexpr float kRmsPropEpsilon = 1e-4f; // ゼロ除算を防止するために
 // 平均化SGDの設定
 constexpr float kAveragedSgdDecay = 0.9995f; // 指数移動平均の減衰率（大きいほど過去のパラメータを重視）
 
+// チェックポイントの設定（チェックポイントは、パラメータを同期する100イテレーションごとに保存される）
+constexpr const char* kCheckpointFile = "learning_checkpoint.bin"; // チェックポイントのファイル名
+
 /**
  * 学習時の統計データをまとめて保存するためのクラスです.
  */
@@ -150,33 +155,32 @@ void ResetMaterialValues(ParamsType* const params) {
  * 棋譜DBから棋譜を読み込みます.
  * @param num_games DBから読み込む棋譜の数
  * @param begin     何番目以降の棋譜を読み込むか
- * @return 読み込んだ棋譜
+ * @param games     読み込んだ棋譜の保存先
+ * @return 棋譜DBを最後まで（または必要な数だけ）読み込めた場合は、true（DBが壊れている場合は、false）
  */
-std::vector<Game> ExtractGamesFromDatabase(const size_t num_games,
-                                           const size_t begin = 0) {
+bool ExtractGamesFromDatabase(const size_t num_games, const size_t begin,
+                              std::vector<Game>* const games) {
   // 1. データベースを準備する
-  std::ifstream db_file(GameDatabase::kDefaultDatabaseFile);
-  GameDatabase game_db(db_file);
+  GameDatabase game_db;
   game_db.set_title_matches_only(true);
 
   // 2. 必要な数だけ、棋譜を抽出する
-  std::vector<Game> games;
   size_t game_index = 0;
-  for (Game game; game_db.ReadOneGame(&game) && games.size() < num_games; ) {
+  for (Game game; games->size() < num_games && game_db.ReadOneGame(&game); ) {
     if (game_index++ < begin) {
       continue;
     }
-    games.push_back(game);
+    games->push_back(game);
   }
 
-  return games;
+  return !game_db.failed();
 }
 
 /*
  * 損失関数の勾配を更新します.
  */
 void UpdateGradient(const Position& pos, const float delta,
-                    Gradient* const gradient) {
+                    SparseGradient* const gradient) {
   assert(gradient != nullptr);
   PsqList psq_list(pos);
   float progress = static_cast<float>(Progress::EstimateProgress(pos, psq_list));
@@ -190,7 +194,7 @@ void UpdateGradient(const Position& pos, const float delta,
 void ComputeGradientOfDisagreementLoss(
     const std::vector<std::vector<Move>>& pv_list,
     const std::valarray<int>& scores, const int margin, Position& pos,
-    Gradient* const gradient, LearningStats* const stats) {
+    SparseGradient* const gradient, LearningStats* const stats) {
   assert(pv_list.size() == scores.size());
   assert(margin >= 0);
   assert(gradient != nullptr);
@@ -248,7 +252,7 @@ void ComputeGradientOfDisagreementLoss(
  */
 void ComputeGradientOfLogLiklihoodLoss(const Position& pos,
                                        const float progress, const Color winner,
-                                       Gradient* const gradient,
+                                       SparseGradient* const gradient,
                                        LearningStats* const stats) {
   assert(0.0f <= progress && progress <= 1.0f);
   assert(gradient != nullptr);
@@ -285,7 +289,7 @@ void ComputeGradientOfLogLiklihoodLoss(const Position& pos,
  */
 void ComputeGradientOfOscillationLoss(
     const std::vector<std::vector<Move>>& pv_list, const int num_pvs,
-    const std::valarray<int>& scores, Position& pos, Gradient* const gradient,
+    const std::valarray<int>& scores, Position& pos, SparseGradient* const gradient,
     LearningStats* const stats) {
   assert(gradient != nullptr);
   assert(stats != nullptr);
@@ -343,7 +347,7 @@ void ComputeGradientOfOscillationLoss(
  */
 void ComputeGradientOfRootStrapLoss(const TeacherPosition& teacher_position,
                                     SharedData& shared_data,
-                                    Gradient* const gradient,
+                                    SparseGradient* const gradient,
                                     LearningStats* const stats) {
   assert(gradient != nullptr);
   assert(stats != nullptr);
@@ -389,7 +393,7 @@ void ComputeGradientOfRootStrapLoss(const TeacherPosition& teacher_position,
  *     http://www.computer-shogi.org/wcsc26/appeal/Gekisashi/appeal.txt, 2016.
  */
 void ComputeGradientOfLogisticRegressionLoss(const TeacherPosition& teacher_position,
-                                             Gradient* const gradient,
+                                             SparseGradient* const gradient,
                                              LearningStats* const stats) {
   // ハフマン符号で圧縮されている局面をデコードする
   Position pos = HuffmanCode::DecodePosition(teacher_position.huffman_code);
@@ -440,7 +444,7 @@ LearningStats ComputeGradient(Position& pos, SharedData& shared_data,
                               const Move teacher_move, const float progress,
                               const Color winner,
                               std::mt19937& mersenne_twister,
-                              Gradient* const gradient) {
+                              SparseGradient* const gradient) {
   assert(gradient != nullptr);
 
   LearningStats stats;
@@ -584,150 +588,389 @@ LearningStats ComputeGradient(Position& pos, SharedData& shared_data,
   return stats;
 }
 
+/**
+ * 勾配ベクトルの要素がゼロ（ミニバッチ中で一度も更新されなかった）ならば、trueを返します.
+ */
+inline bool IsZero(const PackedWeight& weight) {
+  return weight == PackedWeight(0.0f);
+}
+
+/**
+ * ArrayMapのキーの値域の大きさを返します.
+ */
+template<typename Key>
+constexpr size_t NumKeys() {
+  return static_cast<size_t>(Limits<Key>::max() - Limits<Key>::min() + 1);
+}
+
+/**
+ * ArrayMapのキーのうち、n番目（最小値から数えて）のものを返します.
+ */
+template<typename Key>
+Key NthKey(const size_t n) {
+  return static_cast<Key>(static_cast<int>(Limits<Key>::min()) + static_cast<int>(n));
+}
+
+/**
+ * 次元下げ後の勾配ベクトルに足し込むとともに、足し込んだ要素のインデックスを記録するファンクタです.
+ */
+class TrackingUpdater {
+ public:
+  TrackingUpdater(PackedWeight inc, const ExtendedParams& params, std::vector<uint32_t>* indices)
+      : increment_(inc),
+        first_(reinterpret_cast<const PackedWeight*>(&params)),
+        indices_(indices) {
+  }
+  void apply(PackedWeight n, PackedWeight& item) {
+    item += n * increment_;
+    indices_->push_back(static_cast<uint32_t>(&item - first_));
+  }
+ private:
+  PackedWeight increment_;
+  const PackedWeight* first_;
+  std::vector<uint32_t>* indices_;
+};
+
 /**
  * 勾配ベクトルについて、いわゆる次元下げを適用します.
+ *
+ * 密な勾配ベクトル全体を走査する代わりに、ミニバッチで更新された要素のリスト（MergeGradients()の戻り値）だけをたどり、
+ * 各要素のインデックスから、勾配ベクトルのどのパラメータ（キーの組）にあたるかを求めて次元下げします。
  * @param gradient            勾配ベクトル（input）
+ * @param entries             勾配がゼロでない要素のリスト（input）
  * @param convoluted_gradient 次元下げが適用された勾配ベクトル（output）
+ * @return 次元下げの結果、書き込んだ要素のインデックス（重複を含み、順不同）
  */
-void ConvoluteGradient(const std::unique_ptr<Gradient>& gradient,
-                       std::unique_ptr<ExtendedParams>& convoluted_gradient) {
+std::vector<uint32_t> ConvoluteGradient(const std::unique_ptr<Gradient>& gradient,
+                                        const std::vector<SparseGradient::Entry>& entries,
+                                        std::unique_ptr<ExtendedParams>& convoluted_gradient) {
   // 短い別名をつける
   std::unique_ptr<ExtendedParams>& cv = convoluted_gradient;
+  Gradient& g = *gradient;
 
-  // 1. KPを次元下げ
-#pragma omp parallel for schedule(static)
-  for (int i = Square::min(); i <= Square::max(); ++i) {
-    Square king_sq(i);
-    for (PsqIndex psq : PsqIndex::all_indices()) {
-      ExtendedParams::Updater updater(gradient->king_piece[king_sq][psq]);
-      cv->EachKP<kBlack>(king_sq, psq, updater);
+  // 勾配ベクトル上での、各パラメータの範囲を求める
+  struct Range {
+    size_t first, last;
+    bool Contains(size_t i) const { return first <= i && i < last; }
+  };
+  auto range_of = [&](const auto& member) {
+    const size_t first = reinterpret_cast<const PackedWeight*>(&member) - g.begin();
+    return Range{first, first + sizeof(member) / sizeof(PackedWeight)};
+  };
+  const Range kp = range_of(g.king_piece), pp = range_of(g.two_pieces);
+  const Range controls = range_of(g.controls), king_safety = range_of(g.king_safety);
+  const Range rook_control = range_of(g.rook_control), bishop_control = range_of(g.bishop_control);
+  const Range lance_control = range_of(g.lance_control), rook_threat = range_of(g.rook_threat);
+  const Range bishop_threat = range_of(g.bishop_threat), lance_threat = range_of(g.lance_threat);
+
+  constexpr size_t kNumSquares = NumKeys<Square>();
+  constexpr size_t kNumPsq = NumKeys<PsqIndex>();
+  constexpr size_t kNumPsqControls = NumKeys<PsqControlIndex>();
+  constexpr size_t kNumDirections = NumKeys<Direction>();
+  constexpr size_t kNumPieces = NumKeys<Piece>();
+  const auto all_pieces_plus_no_piece = Piece::all_pieces().set(kNoPiece);
+
+  // 各要素のインデックスからキーを求めて、次元下げする
+  // （異なる要素の次元下げが同じパラメータに書き込むことがあるので、１スレッドで処理する）
+  std::vector<uint32_t> indices;
+  for (const SparseGradient::Entry& entry : entries) {
+    if (IsZero(entry.value)) {
+      continue; // 勾配がゼロの要素は、次元下げしても結果が変わらない
     }
-  }
+    const size_t i = entry.index;
+    const TrackingUpdater updater(entry.value, *cv, &indices);
+
+    if (kp.Contains(i)) {
+      // 1. KPを次元下げ
+      const size_t o = i - kp.first;
+      cv->EachKP<kBlack>(NthKey<Square>(o / kNumPsq), NthKey<PsqIndex>(o % kNumPsq), updater);
+
+    } else if (pp.Contains(i)) {
+      // 2. PPを次元下げ
+      const size_t o = i - pp.first;
+      cv->EachPP(NthKey<PsqIndex>(o / kNumPsq), NthKey<PsqIndex>(o % kNumPsq), updater);
+
+    } else if (controls.Contains(i)) {
+      // 3. 各マスの利き評価を次元下げ
+      const size_t o = i - controls.first;
+      const Color king_color = NthKey<Color>(o / (kNumSquares * kNumPsqControls));
+      const Square ksq = NthKey<Square>(o / kNumPsqControls % kNumSquares);
+      const PsqControlIndex index = NthKey<PsqControlIndex>(o % kNumPsqControls);
+      if (index.IsOk()) {
+        if (king_color == kBlack) {
+          cv->EachControl<kBlack>(ksq, index, updater);
+        } else {
+          cv->EachControl<kWhite>(ksq, index, updater);
+        }
+      }
 
-  // 2. PPを次元下げ
-#pragma omp parallel for schedule(static)
-  for (int i = PsqIndex::min(); i <= PsqIndex::max(); ++i) {
-    PsqIndex psq1(i);
-    for (PsqIndex psq2 : PsqIndex::all_indices()) {
-      ExtendedParams::Updater updater(gradient->two_pieces[psq1][psq2]);
-      cv->EachPP(psq1, psq2, updater);
+    } else if (king_safety.Contains(i)) {
+      // 4. 玉の安全度を次元下げ
+      const size_t o = i - king_safety.first;
+      const size_t n = o / 16;
+      const HandSet hand_set = NthKey<HandSet>(n / (kNumDirections * kNumPieces));
+      const Direction dir = NthKey<Direction>(n / kNumPieces % kNumDirections);
+      const Piece piece = NthKey<Piece>(n % kNumPieces);
+      if (all_pieces_plus_no_piece.test(piece)) {
+        cv->EachKingSafety<kBlack>(hand_set, dir, piece, o % 16 / 4, o % 4, updater);
+      }
+
+    } else if (   rook_control.Contains(i) || bishop_control.Contains(i)
+               || lance_control.Contains(i)) {
+      // 5. 飛車・角・香車の利きを次元下げ
+      const size_t o = i - (rook_control.Contains(i) ? rook_control.first
+                          : bishop_control.Contains(i) ? bishop_control.first : lance_control.first);
+      const Color c = NthKey<Color>(o / (kNumSquares * kNumSquares * kNumSquares));
+      const Square ksq = NthKey<Square>(o / (kNumSquares * kNumSquares) % kNumSquares);
+      const Square from = NthKey<Square>(o / kNumSquares % kNumSquares);
+      const Square to = NthKey<Square>(o % kNumSquares);
+      if (rook_control.Contains(i)) {
+        cv->EachSliderControl<kBlack, kRook>(c, ksq, from, to, updater);
+      } else if (bishop_control.Contains(i)) {
+        cv->EachSliderControl<kBlack, kBishop>(c, ksq, from, to, updater);
+      } else {
+        cv->EachSliderControl<kBlack, kLance>(c, ksq, from, to, updater);
+      }
+
+    } else if (   rook_threat.Contains(i) || bishop_threat.Contains(i)
+               || lance_threat.Contains(i)) {
+      // 6. 飛車・角・香車の利きが付いている駒を次元下げ
+      const size_t o = i - (rook_threat.Contains(i) ? rook_threat.first
+                          : bishop_threat.Contains(i) ? bishop_threat.first : lance_threat.first);
+      const Square ksq = NthKey<Square>(o / (kNumSquares * kNumPieces));
+      const Square square = NthKey<Square>(o / kNumPieces % kNumSquares);
+      const Piece threatened = NthKey<Piece>(o % kNumPieces);
+      if (Piece::all_pieces().test(threatened)) {
+        if (rook_threat.Contains(i)) {
+          cv->EachThreat<kBlack, kRook>(ksq, square, threatened, updater);
+        } else if (bishop_threat.Contains(i)) {
+          cv->EachThreat<kBlack, kBishop>(ksq, square, threatened, updater);
+        } else {
+          cv->EachThreat<kBlack, kLance>(ksq, square, threatened, updater);
+        }
+      }
     }
   }
 
-  const auto all_pieces_plus_no_piece = Piece::all_pieces().set(kNoPiece);
+  // 7. 手番をコピー
+  cv->tempo = gradient->tempo;
+  indices.push_back(static_cast<uint32_t>(&cv->tempo - cv->begin()));
 
-  // 3. 各マスの利き評価を次元下げ
-#pragma omp parallel for schedule(static)
-  for (int i = PsqControlIndex::min(); i <= PsqControlIndex::max(); ++i) {
-    PsqControlIndex index(i);
-    if (index.IsOk()) {
-      for (Square ksq : Square::all_squares()) {
-        ExtendedParams::Updater updater_b(gradient->controls[kBlack][ksq][index]);
-        ExtendedParams::Updater updater_w(gradient->controls[kWhite][ksq][index]);
-        cv->EachControl<kBlack>(ksq, index, updater_b);
-        cv->EachControl<kWhite>(ksq, index, updater_w);
+  return indices;
+}
+
+/**
+ * 各スレッドの疎な勾配を集計して、密な勾配ベクトルに書き込みます.
+ *
+ * 各スレッドの勾配をインデックス順にソートしたうえで、インデックスの範囲ごとに分担して足し合わせます（sort-and-reduce）。
+ * 書き込み先の勾配ベクトルは、あらかじめゼロクリアされている必要があります。
+ * @return 書き込んだ要素のリスト（インデックスの昇順。次のイテレーションの前に、その要素だけをゼロクリアするために使う）
+ */
+std::vector<SparseGradient::Entry> MergeGradients(
+    const std::vector<SparseGradient>& thread_local_gradients,
+    const std::unique_ptr<Gradient>& gradient) {
+  // 1. 各スレッドの勾配を、インデックス順にソートする
+  std::vector<std::vector<SparseGradient::Entry>> sorted(thread_local_gradients.size());
+#pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < thread_local_gradients.size(); ++i) {
+    sorted.at(i) = thread_local_gradients.at(i).GetSortedEntries();
+  }
+
+  // 2. インデックスの範囲ごとに、全スレッドの勾配を足し合わせる
+  auto less = [](const SparseGradient::Entry& lhs, const SparseGradient::Entry& rhs) {
+    return lhs.index < rhs.index;
+  };
+  const size_t num_ranges = 4 * omp_get_max_threads();
+  const size_t range_size = (gradient->size() + num_ranges - 1) / num_ranges;
+  std::vector<std::vector<SparseGradient::Entry>> merged(num_ranges);
+#pragma omp parallel for schedule(dynamic)
+  for (size_t r = 0; r < num_ranges; ++r) {
+    const SparseGradient::Entry lower{static_cast<uint32_t>(r * range_size), PackedWeight(0.0f)};
+    const SparseGradient::Entry upper{static_cast<uint32_t>((r + 1) * range_size), PackedWeight(0.0f)};
+    std::vector<SparseGradient::Entry>& entries = merged.at(r);
+    for (const std::vector<SparseGradient::Entry>& s : sorted) {
+      entries.insert(entries.end(),
+                     std::lower_bound(s.begin(), s.end(), lower, less),
+                     std::lower_bound(s.begin(), s.end(), upper, less));
+    }
+    std::sort(entries.begin(), entries.end(), less);
+
+    // 同じインデックスの要素をまとめる
+    size_t size = 0;
+    for (size_t i = 0; i < entries.size(); ++i) {
+      if (size > 0 && entries[size - 1].index == entries[i].index) {
+        entries[size - 1].value += entries[i].value;
+      } else {
+        entries[size++] = entries[i];
       }
     }
+    entries.resize(size);
+
+    for (const SparseGradient::Entry& entry : entries) {
+      (*gradient)[entry.index] = entry.value;
+    }
   }
 
-  // 4. 玉の安全度を次元下げ
-#pragma omp parallel for schedule(static)
-  for (unsigned h = HandSet::min(); h <= HandSet::max(); ++h)
-    for (int d = 0; d < 8; ++d)
-      for (Piece piece : all_pieces_plus_no_piece)
-        for (int attacks = 0; attacks < 4; ++attacks)
-          for (int defenses = 0; defenses < 4; ++defenses) {
-            HandSet hand_set(h);
-            Direction dir = static_cast<Direction>(d);
-            ExtendedParams::Updater updater(gradient->king_safety[hand_set][dir][piece][attacks][defenses]);
-            cv->EachKingSafety<kBlack>(hand_set, dir, piece, attacks, defenses, updater);
-          }
+  // 3. 各範囲の結果をつなげる
+  std::vector<SparseGradient::Entry> result;
+  for (const std::vector<SparseGradient::Entry>& entries : merged) {
+    result.insert(result.end(), entries.begin(), entries.end());
+  }
+  return result;
+}
 
-  // 5. 飛車・角・香車の利きを次元下げ
-#pragma omp parallel for schedule(static)
-  for (int s = Square::min(); s <= Square::max(); ++s) {
-    Square i(s);
-    for (Color c : {kBlack, kWhite})
-      for (Square j : Square::all_squares())
-        for (Square k : Square::all_squares()) {
-          ExtendedParams::Updater updater_r(gradient->rook_control[c][i][j][k]);
-          ExtendedParams::Updater updater_b(gradient->bishop_control[c][i][j][k]);
-          ExtendedParams::Updater updater_l(gradient->lance_control[c][i][j][k]);
-          cv->EachSliderControl<kBlack, kRook>(c, i, j, k, updater_r);
-          cv->EachSliderControl<kBlack, kBishop>(c, i, j, k, updater_b);
-          cv->EachSliderControl<kBlack, kLance>(c, i, j, k, updater_l);
-        }
+/**
+ * 次元下げ後の勾配がゼロでない要素（このイテレーションで更新すべきパラメータ）のインデックスを求めます.
+ * 調べるのは、次元下げで書き込んだ要素（ConvoluteGradient()の戻り値）だけです。
+ * 駒割のパラメータは、歩の価値を固定する処理があるため、勾配に関わらず毎回更新します。
+ * @return インデックスの昇順に並べたリスト
+ */
+std::vector<uint32_t> FindUpdatedParams(const std::unique_ptr<ExtendedParams>& gradient,
+                                        std::vector<uint32_t> written_indices) {
+  const size_t begin = gradient->size_of_material();
+  std::sort(written_indices.begin(), written_indices.end());
+  written_indices.erase(std::unique(written_indices.begin(), written_indices.end()),
+                        written_indices.end());
+
+  std::vector<uint32_t> result;
+  for (size_t i = 0; i < begin; ++i) {
+    result.push_back(i);
+  }
+  for (uint32_t i : written_indices) {
+    if (i >= begin && !IsZero(*(gradient->begin() + i))) {
+      result.push_back(i);
+    }
+  }
+  return result;
+}
 
-    for (Square j : Square::all_squares())
-      for (Piece p : Piece::all_pieces()) {
-        ExtendedParams::Updater updater_r(gradient->rook_threat[i][j][p]);
-        ExtendedParams::Updater updater_b(gradient->bishop_threat[i][j][p]);
-        ExtendedParams::Updater updater_l(gradient->lance_threat[i][j][p]);
-        cv->EachThreat<kBlack, kRook>(i, j, p, updater_r);
-        cv->EachThreat<kBlack, kBishop>(i, j, p, updater_b);
-        cv->EachThreat<kBlack, kLance>(i, j, p, updater_l);
-      }
+/**
+ * １つのパラメータについて、１回分の更新を行います（RMSprop + FOBOS）.
+ * @param g         勾配
+ * @param penalized ペナルティをかけるパラメータならば、true（駒割にはペナルティをかけない）
+ * @param v         パラメータ
+ * @param a         勾配の２乗の指数移動平均（RMSprop）
+ */
+inline void UpdateParam(const PackedWeight g, const bool penalized,
+                        PackedWeight& v, PackedWeight& a) {
+  // 更新幅の設定（RMSprop）
+  a = a * kRmsPropDecay + (g * g);
+  const PackedWeight eta = kRmsPropStepRate / (a + kRmsPropEpsilon).apply(std::sqrt);
+
+  // パラメータを更新（坂を下る）
+  v -= eta * g;
+
+  // 駒割り以外のパラメータについてのみ、ペナルティをかける（FOBOS）
+  if (penalized) {
+    auto ramp = [](float x) {
+      return std::max(x, 0.0f);
+    };
+    v = v.apply(math::sign) * (v.apply(std::abs) - eta * kL1Penalty).apply(ramp);
   }
+}
 
-  // 6. 手番をコピー
-  cv->tempo = gradient->tempo;
+/**
+ * 勾配がゼロだったために省略していた、num_steps回分のパラメータ更新を、まとめて行います（lazy update）.
+ *
+ * 勾配がゼロでも、RMSpropの減衰、L1ペナルティ、平均化パラメータへの足し込みは毎回行われるので、ここでそれらを追いつかせます。
+ * L1ペナルティによりパラメータがゼロになった後は、減衰だけを考えればよいので、まとめて計算します。
+ * @param sum 平均化パラメータを求めるための、パラメータの指数移動平均（の分子）
+ */
+inline void CatchUpParam(int num_steps, const bool penalized,
+                         PackedWeight& v, PackedWeight& a, PackedWeight& sum) {
+  const PackedWeight zero(0.0f);
+  for (; num_steps > 0 && v != zero; --num_steps) {
+    UpdateParam(zero, penalized, v, a);
+    sum = sum * kAveragedSgdDecay + v;
+  }
+  if (num_steps > 0) {
+    a *= static_cast<float>(std::pow(kRmsPropDecay, num_steps));
+    sum *= static_cast<float>(std::pow(kAveragedSgdDecay, num_steps));
+  }
 }
 
 /*
  * 計算した勾配を使って、評価関数のパラメータを更新します.
  *
  * パラメータの更新には、RMSprop及びFOBOSを用いて、素早く学習が収束するようにしています。
+ * 勾配がゼロでない（updated_paramsに含まれる）パラメータだけを更新し、
+ * 前回の更新以降に省略していた分は、CatchUpParam()で追いつかせます。
+ * 更新されなかったパラメータは、SynchronizeParams()を呼ぶまで、古い値のままになります。
  *
  * （参考文献）
  *   - 海野裕也, et al.: 『オンライン機械学習』, pp.95-96, 講談社, 2015.
  *   - John Duchi, Yoram Singer: Efficient Learning with Forward-Backward Splitting,
  *     http://web.stanford.edu/~jduchi/projects/DuchiSi09c_slides.pdf, p.12, 2009.
+ *   - Bob Carpenter: Lazy Sparse Stochastic Gradient Descent for Regularized Multinomial Logistic Regression,
+ *     2008.
  */
-LearningStats UpdateParams(const std::unique_ptr<ExtendedParams>& gradient,
-                           std::unique_ptr<ExtendedParams>& accumulated_gradient,
-                           std::unique_ptr<ExtendedParams>& params) {
+void UpdateParams(const int iteration,
+                  const std::vector<uint32_t>& updated_params,
+                  const std::unique_ptr<ExtendedParams>& gradient,
+                  std::unique_ptr<ExtendedParams>& accumulated_gradient,
+                  std::unique_ptr<ExtendedParams>& params,
+                  std::unique_ptr<ExtendedParams>& accumulated_params,
+                  std::vector<int>& last_updates) {
   if (kVerboseMessage) {
     std::printf("Update params.\n");
   }
 
+  const size_t size_of_material = gradient->size_of_material();
+
+#pragma omp parallel for schedule(static)
+  for (size_t n = 0; n < updated_params.size(); ++n) {
+    const size_t i = updated_params[n];
+    auto& v = *(params->begin() + i);
+    auto& a = *(accumulated_gradient->begin() + i);
+    auto& sum = *(accumulated_params->begin() + i);
+    const bool penalized = i >= size_of_material;
+    CatchUpParam(iteration - 1 - last_updates[i], penalized, v, a, sum);
+    UpdateParam(*(gradient->begin() + i), penalized, v, a);
+    last_updates[i] = iteration;
+  }
+
+  // 歩の価値を１００点に固定する
+  params->material[kPawn] = 100.0f;
+
+  // 後で平均化パラメータを求めるために、現在のパラメータを足し込んでおく
+#pragma omp parallel for schedule(static)
+  for (size_t n = 0; n < updated_params.size(); ++n) {
+    const size_t i = updated_params[n];
+    (*accumulated_params)[i] *= kAveragedSgdDecay;
+    (*accumulated_params)[i] += (*params)[i];
+  }
+}
+
+/**
+ * 更新を省略していたすべてのパラメータを、iteration回目の更新後の状態まで追いつかせます.
+ * @return ペナルティ項の現在の値
+ */
+float SynchronizeParams(const int iteration,
+                        std::unique_ptr<ExtendedParams>& accumulated_gradient,
+                        std::unique_ptr<ExtendedParams>& params,
+                        std::unique_ptr<ExtendedParams>& accumulated_params,
+                        std::vector<int>& last_updates) {
+  const size_t size_of_material = params->size_of_material();
   float l1_penalty = 0.0f;
 
 #pragma omp parallel for reduction(+:l1_penalty) schedule(static)
-  for (size_t i = 0; i < gradient->size(); ++i) {
+  for (size_t i = 0; i < params->size(); ++i) {
     auto& v = *(params->begin() + i);
     auto& a = *(accumulated_gradient->begin() + i);
-    auto g = *(gradient->begin() + i);
+    auto& sum = *(accumulated_params->begin() + i);
+    const bool penalized = i >= size_of_material;
+    CatchUpParam(iteration - last_updates[i], penalized, v, a, sum);
+    last_updates[i] = iteration;
 
     // ペナルティ項の現在の値を計算する（駒割にはペナルティをかけない）
-    if (i >= gradient->size_of_material()) {
+    if (penalized) {
       for (size_t j = 0; j < v.size(); ++j) {
         l1_penalty += std::abs(v[j]);
       }
     }
-
-    // 更新幅の設定（RMSprop）
-    a = a * kRmsPropDecay + (g * g);
-    const PackedWeight eta = kRmsPropStepRate / (a + kRmsPropEpsilon).apply(std::sqrt);
-
-    // パラメータを更新（坂を下る）
-    v -= eta * g;
-
-    // 駒割り以外のパラメータについてのみ、ペナルティをかける（FOBOS）
-    if (i >= gradient->size_of_material()) {
-      auto ramp = [](float x) {
-        return std::max(x, 0.0f);
-      };
-      v = v.apply(math::sign) * (v.apply(std::abs) - eta * kL1Penalty).apply(ramp);
-    }
   }
 
-  // 歩の価値を１００点に固定する
-  params->material[kPawn] = 100.0f;
-
-  LearningStats stats;
-  stats.penalty = kL1Penalty * l1_penalty;
-
-  return stats;
+  return kL1Penalty * l1_penalty;
 }
 
 /**
@@ -1032,10 +1275,213 @@ float ComputeAccuracy(const std::vector<Game>& games) {
   return static_cast<float>(sum_accuracy) / num_positions;
 }
 
+/**
+ * 学習に用いる局面のIDです（棋譜の番号と手数の組）.
+ */
+struct PositionId {
+  PositionId() {}
+  PositionId(int g, int p) : game_id(g), ply(p) {}
+  int game_id = 0;
+  int ply = 0;
+};
+
+/**
+ * 学習を中断・再開するために必要な状態（チェックポイント）です.
+ */
+struct Checkpoint {
+  /**
+   * チェックポイントをファイルに書き込みます.
+   * いったん一時ファイルに書き込んでからリネームするので、書き込み中にプロセスが終了しても、既存のファイルは壊れません。
+   */
+  bool WriteToFile(const char* file_name) const;
+
+  /**
+   * チェックポイントをファイルから読み込みます.
+   */
+  bool ReadFromFile(const char* file_name);
+
+  /** 最後に終了したイテレーション */
+  int iteration = 0;
+
+  /** その時点でのペナルティ項の値 */
+  float l1_penalty = 0.0f;
+
+  /** 教師局面を読み込むクラス（TeacherPositionLoader）の乱数の種と、読み込み済みの局面数 */
+  uint32_t rootstrap_seed = 0;
+  uint64_t rootstrap_consumed = 0;
+  uint32_t logistic_regression_seed = 0;
+  uint64_t logistic_regression_consumed = 0;
+
+  /** 各スレッドの乱数発生器の状態 */
+  std::vector<std::string> rng_states;
+
+  /** シャッフル済みの局面ID */
+  std::vector<PositionId> position_ids;
+
+  std::unique_ptr<ExtendedParams> current_params;
+  std::unique_ptr<ExtendedParams> accumulated_params;
+  std::unique_ptr<ExtendedParams> accumulated_gradient;
+};
+
+constexpr char kCheckpointMagic[8] = {'G', 'K', 'L', 'E', 'A', 'R', 'N', '1'};
+
+bool Checkpoint::WriteToFile(const char* const file_name) const {
+  const std::string temp_file_name = std::string(file_name) + ".tmp";
+  std::FILE* fp = std::fopen(temp_file_name.c_str(), "wb");
+  if (fp == nullptr) {
+    return false;
+  }
+
+  bool ok = true;
+  auto write = [&](const void* data, size_t size) {
+    ok = ok && (size == 0 || std::fwrite(data, size, 1, fp) == 1);
+  };
+  const uint64_t params_size = sizeof(ExtendedParams);
+  const uint64_t num_rngs = rng_states.size();
+  const uint64_t num_position_ids = position_ids.size();
+
+  write(kCheckpointMagic, sizeof(kCheckpointMagic));
+  write(&params_size, sizeof(params_size));
+  write(&iteration, sizeof(iteration));
+  write(&l1_penalty, sizeof(l1_penalty));
+  write(&rootstrap_seed, sizeof(rootstrap_seed));
+  write(&rootstrap_consumed, sizeof(rootstrap_consumed));
+  write(&logistic_regression_seed, sizeof(logistic_regression_seed));
+  write(&logistic_regression_consumed, sizeof(logistic_regression_consumed));
+  write(&num_rngs, sizeof(num_rngs));
+  for (const std::string& state : rng_states) {
+    const uint64_t length = state.size();
+    write(&length, sizeof(length));
+    write(state.data(), length);
+  }
+  write(&num_position_ids, sizeof(num_position_ids));
+  write(position_ids.data(), num_position_ids * sizeof(PositionId));
+  write(current_params.get(), sizeof(ExtendedParams));
+  write(accumulated_params.get(), sizeof(ExtendedParams));
+  write(accumulated_gradient.get(), sizeof(ExtendedParams));
+
+  // ディスクへの書き込みが完了してから、リネームする
+  ok = ok && std::fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+  ok = (std::fclose(fp) == 0) && ok;
+  return ok && std::rename(temp_file_name.c_str(), file_name) == 0;
+}
+
+bool Checkpoint::ReadFromFile(const char* const file_name) {
+  std::FILE* fp = std::fopen(file_name, "rb");
+  if (fp == nullptr) {
+    return false;
+  }
+
+  bool ok = true;
+  auto read = [&](void* data, size_t size) {
+    ok = ok && (size == 0 || std::fread(data, size, 1, fp) == 1);
+  };
+  char magic[sizeof(kCheckpointMagic)];
+  uint64_t params_size = 0, num_rngs = 0, num_position_ids = 0;
+
+  read(magic, sizeof(magic));
+  read(&params_size, sizeof(params_size));
+  ok = ok && std::equal(magic, magic + sizeof(magic), kCheckpointMagic)
+          && params_size == sizeof(ExtendedParams);
+  read(&iteration, sizeof(iteration));
+  read(&l1_penalty, sizeof(l1_penalty));
+  read(&rootstrap_seed, sizeof(rootstrap_seed));
+  read(&rootstrap_consumed, sizeof(rootstrap_consumed));
+  read(&logistic_regression_seed, sizeof(logistic_regression_seed));
+  read(&logistic_regression_consumed, sizeof(logistic_regression_consumed));
+  read(&num_rngs, sizeof(num_rngs));
+  rng_states.clear();
+  for (uint64_t i = 0; ok && i < num_rngs; ++i) {
+    uint64_t length = 0;
+    read(&length, sizeof(length));
+    std::string state(ok ? length : 0, '\0');
+    read(&state[0], state.size());
+    rng_states.push_back(state);
+  }
+  read(&num_position_ids, sizeof(num_position_ids));
+  position_ids.resize(ok ? num_position_ids : 0);
+  read(position_ids.data(), position_ids.size() * sizeof(PositionId));
+  current_params.reset(new ExtendedParams);
+  accumulated_params.reset(new ExtendedParams);
+  accumulated_gradient.reset(new ExtendedParams);
+  read(current_params.get(), sizeof(ExtendedParams));
+  read(accumulated_params.get(), sizeof(ExtendedParams));
+  read(accumulated_gradient.get(), sizeof(ExtendedParams));
+
+  std::fclose(fp);
+  return ok;
+}
+
+/**
+ * チェックポイントを、バックグラウンドのスレッドでファイルに書き込むためのクラスです.
+ *
+ * 書き込み中も学習を続けられるように、書き込む状態は専用の領域にコピーしておきます。
+ * 前回の書き込みがまだ終わっていない場合に限り、次のチェックポイントの保存時に、その終了を待ちます。
+ */
+class CheckpointWriter {
+ public:
+  ~CheckpointWriter() {
+    Wait();
+  }
+
+  /**
+   * 前回の書き込みが終わるのを待ってから、書き込み用の領域を返します.
+   * 返された領域に現在の状態をコピーしてから、StartWriting()を呼んでください。
+   */
+  Checkpoint* WaitAndGetBuffer() {
+    Wait();
+    if (!buffer_.current_params) {
+      buffer_.current_params.reset(new ExtendedParams);
+      buffer_.accumulated_params.reset(new ExtendedParams);
+      buffer_.accumulated_gradient.reset(new ExtendedParams);
+    }
+    return &buffer_;
+  }
+
+  /**
+   * 書き込み用の領域の内容を、バックグラウンドでファイルに書き込みます.
+   */
+  void StartWriting(const char* file_name) {
+    thread_ = std::thread([this, file_name]() {
+      if (!buffer_.WriteToFile(file_name)) {
+        std::printf("Failed to write %s.\n", file_name);
+      }
+    });
+  }
+
+  void Wait() {
+    if (thread_.joinable()) {
+      thread_.join();
+    }
+  }
+
+ private:
+  Checkpoint buffer_;
+  std::thread thread_;
+};
+
+/**
+ * ログファイルに最後に記録されたイテレーションを返します（ファイルがないか、空の場合は0）.
+ * 各行の先頭には、イテレーションの番号が書かれているものとします。
+ */
+int ReadLastLoggedIteration(const char* const file_name) {
+  std::ifstream ifs(file_name);
+  int last_iteration = 0;
+  for (std::string line; std::getline(ifs, line); ) {
+    std::istringstream is(line);
+    int iteration;
+    if (is >> iteration) {
+      last_iteration = iteration;
+    }
+  }
+  return last_iteration;
+}
+
 } // namespace
 
 void Learning::LearnEvaluationParameters(const bool use_rootstrap,
-                                         const bool use_logistic_regression) {
+                                         const bool use_logistic_regression,
+                                         const bool resume) {
   // スレッド数の設定
   const int num_threads = std::max(1U, std::thread::hardware_concurrency());
   omp_set_num_threads(num_threads);
@@ -1043,15 +1489,13 @@ void Learning::LearnEvaluationParameters(const bool use_rootstrap,
 
   // データベースから棋譜を読み込む（学習用と、交差検定用の2つがある）
   std::printf("Extract the games from the database.\n");
-  const std::vector<Game> games = ExtractGamesFromDatabase(kNumGames, 0);
-  const std::vector<Game> test_set = ExtractGamesFromDatabase(kNumTestSet, kNumGames);
+  std::vector<Game> games, test_set;
+  if (   !ExtractGamesFromDatabase(kNumGames, 0, &games)
+      || !ExtractGamesFromDatabase(kNumTestSet, kNumGames, &test_set)) {
+    return; // 壊れた棋譜DBから、一部の棋譜だけで学習することはしない
+  }
 
   // 全局面にIDを割り振る（あとで局面のシャッフルを行うため）
-  struct PositionId {
-    PositionId(int g, int p) : game_id(g), ply(p) {}
-    int game_id;
-    int ply;
-  };
   std::vector<PositionId> position_ids;
   for (size_t i = 0; i < games.size(); ++i) {
     for (size_t j = 0; j < games.at(i).moves.size(); ++j) {
@@ -1059,33 +1503,62 @@ void Learning::LearnEvaluationParameters(const bool use_rootstrap,
     }
   }
 
-  // RootStrapに用いる教師局面を読み込む
-  std::vector<TeacherPosition> rootstrap_positions;
+  // 学習を再開する場合は、チェックポイントを読み込む
+  Checkpoint checkpoint;
+  if (resume) {
+    std::printf("Read the checkpoint from %s.\n", kCheckpointFile);
+    if (!checkpoint.ReadFromFile(kCheckpointFile)) {
+      std::printf("Failed to read %s.\n", kCheckpointFile);
+      return;
+    }
+    if (checkpoint.position_ids.size() != position_ids.size()) {
+      std::printf("The checkpoint does not match the game database.\n");
+      return;
+    }
+    position_ids = checkpoint.position_ids;
+    std::printf("Resume from iteration %d.\n", checkpoint.iteration + 1);
+  }
+
+  // 乱数の種を生成するための準備
+  std::random_device rd;
+
+  // RootStrapに用いる教師局面のファイルを開く（ファイル全体をメモリに読み込むことはしない）
+  std::unique_ptr<TeacherPositionLoader> rootstrap_positions;
   if (use_rootstrap) {
-    std::printf("Read the teacher positions from the file.\n");
-    std::FILE* teacher_file = std::fopen("teacher_positions.bin", "rb");
-    for (TeacherPosition buf; std::fread(&buf, sizeof(buf), 1, teacher_file); ) {
-      rootstrap_positions.push_back(buf);
+    std::printf("Open the teacher positions file.\n");
+    rootstrap_positions.reset(resume
+        ? new TeacherPositionLoader("teacher_positions.bin", checkpoint.rootstrap_seed,
+                                    checkpoint.rootstrap_consumed)
+        : new TeacherPositionLoader("teacher_positions.bin", rd()));
+    if (!rootstrap_positions->is_open()) {
+      return;
     }
-    std::fclose(teacher_file);
+    std::printf("Found %zu teacher positions.\n", rootstrap_positions->size());
   }
 
-  // ロジスティック回帰に用いる教師局面を読み込む
-  std::vector<TeacherPosition> logistic_regression_positions;
+  // ロジスティック回帰に用いる教師局面のファイルを開く
+  std::unique_ptr<TeacherPositionLoader> logistic_regression_positions;
   if (use_logistic_regression) {
-    std::printf("Read the teacher games from the file.\n");
-    std::FILE* teacher_file = std::fopen("teacher_games.bin", "rb");
-    for (TeacherPosition buf; std::fread(&buf, sizeof(buf), 1, teacher_file); ) {
-      logistic_regression_positions.push_back(buf);
+    std::printf("Open the teacher games file.\n");
+    logistic_regression_positions.reset(resume
+        ? new TeacherPositionLoader("teacher_games.bin", checkpoint.logistic_regression_seed,
+                                    checkpoint.logistic_regression_consumed)
+        : new TeacherPositionLoader("teacher_games.bin", rd()));
+    if (!logistic_regression_positions->is_open()) {
+      return;
     }
-    std::fclose(teacher_file);
+    std::printf("Found %zu teacher positions.\n", logistic_regression_positions->size());
   }
+  std::vector<const TeacherPosition*> teacher_batch;
 
   // 乱数発生器（メルセンヌ・ツイスタ）の準備
-  std::random_device rd;
   std::vector<std::mt19937> mersenne_twisters;
   for (int i = 0; i < num_threads; ++i) {
     mersenne_twisters.emplace_back(rd());
+    if (resume && i < int(checkpoint.rng_states.size())) {
+      std::istringstream is(checkpoint.rng_states.at(i));
+      is >> mersenne_twisters.back();
+    }
   }
 
   // 勾配やパラメータを初期化する
@@ -1094,36 +1567,53 @@ void Learning::LearnEvaluationParameters(const bool use_rootstrap,
   std::unique_ptr<ExtendedParams> current_params(new ExtendedParams);
   std::unique_ptr<ExtendedParams> accumulated_params(new ExtendedParams);
   std::unique_ptr<Gradient> gradient(new Gradient);
-  std::vector<Gradient> thread_local_gradient(num_threads);
+  std::vector<SparseGradient> thread_local_gradient(num_threads, SparseGradient(gradient.get()));
   std::vector<SharedData> shared_data(num_threads);
+  std::vector<int> last_updates(current_params->size(), 0); // 各パラメータを最後に更新したイテレーション
+  float l1_penalty = 0.0f; // 最後にSynchronizeParams()を呼んだ時点での、ペナルティ項の値
   g_eval_params->Clear();
+  gradient->Clear();
+  convoluted_gradient->Clear();
   accumulated_gradient->Clear();
   current_params->Clear();
   accumulated_params->Clear();
   ResetMaterialValues(current_params.get());
+  int first_iteration = 1;
+  if (resume) {
+    // チェックポイントは、パラメータの同期直後に保存されているので、全パラメータが最新の状態になっている
+    current_params = std::move(checkpoint.current_params);
+    accumulated_params = std::move(checkpoint.accumulated_params);
+    accumulated_gradient = std::move(checkpoint.accumulated_gradient);
+    std::fill(last_updates.begin(), last_updates.end(), checkpoint.iteration);
+    l1_penalty = checkpoint.l1_penalty;
+    first_iteration = checkpoint.iteration + 1;
+  }
   CopyParams(current_params);
   for (auto& s : shared_data) {
     s.hash_table.SetSize(64);
   }
-
-  // ログファイルのクリア
-  {
-    std::FILE* fp = std::fopen("learning_log.txt", "w");
-    if (fp == nullptr) {
-      std::printf("Failed to open learning_log.txt.\n");
-    }
-    std::fclose(fp);
-  }
-  {
-    std::FILE* fp = std::fopen("learning_material.txt", "w");
-    if (fp == nullptr) {
-      std::printf("Failed to open learning_material.txt.\n");
+  CheckpointWriter checkpoint_writer;
+
+  // ログファイルのクリア（学習を再開する場合は、これまでのログに追記する）
+  // 再開する場合、チェックポイントより後のイテレーションのログが既に書き込まれていることがあるので、
+  // 同じイテレーションの行が重複しないように、ログに記録済みのイテレーションまでは書き込みを省略する
+  int last_logged_iteration = 0, last_material_iteration = 0;
+  if (resume) {
+    last_logged_iteration = ReadLastLoggedIteration("learning_log.txt");
+    last_material_iteration = ReadLastLoggedIteration("learning_material.txt");
+  } else {
+    for (const char* file_name : {"learning_log.txt", "learning_material.txt"}) {
+      std::FILE* fp = std::fopen(file_name, "w");
+      if (fp == nullptr) {
+        std::printf("Failed to open %s.\n", file_name);
+        continue;
+      }
+      std::fclose(fp);
     }
-    std::fclose(fp);
   }
 
   // 学習のイテレーションを開始する
-  for (int iteration = 1; iteration <= kNumIteration; ++iteration) {
+  for (int iteration = first_iteration; iteration <= kNumIteration; ++iteration) {
     if (kVerboseMessage) {
       std::printf("Start new iteration: %d\n", iteration);
     }
@@ -1174,17 +1664,13 @@ void Learning::LearnEvaluationParameters(const bool use_rootstrap,
 
     // RootStrapの勾配を計算する
     if (use_rootstrap) {
-      // 予め作成しておいた教師局面の中から、RootStrapの勾配計算に用いる局面をランダムに選ぶ
-      for (int i = 0; i < kRootStrapBatchSize; ++i) {
-        std::uniform_int_distribution<size_t> dis(i, rootstrap_positions.size() - 1);
-        auto begin = rootstrap_positions.begin();
-        std::iter_swap(begin + i, begin + dis(mersenne_twisters.front()));
-      }
+      // 教師局面のファイルから、RootStrapの勾配計算に用いる局面を取り出す（エポックごとにシャッフルされている）
+      rootstrap_positions->NextBatch(kRootStrapBatchSize, &teacher_batch);
 
       // 予め作成しておいた教師局面を使って、RootStrapの勾配を計算する
 #pragma omp parallel for schedule(dynamic)
-      for (int i = 0; i < kRootStrapBatchSize; ++i) {
-        const TeacherPosition& teacher_pos = rootstrap_positions.at(i);
+      for (size_t i = 0; i < teacher_batch.size(); ++i) {
+        const TeacherPosition& teacher_pos = *teacher_batch[i];
         LearningStats temp;
         int thread_id = omp_get_thread_num();
         ComputeGradientOfRootStrapLoss(teacher_pos, shared_data.at(thread_id),
@@ -1197,17 +1683,13 @@ void Learning::LearnEvaluationParameters(const bool use_rootstrap,
 
     // ロジスティック回帰の勾配を計算する
     if (use_logistic_regression) {
-      // 予め作成しておいた自己対戦棋譜中の局面から、ロジスティック回帰の勾配計算に用いる局面をランダムに選ぶ
-      for (int i = 0; i < kLogisticRegressionBatchSize; ++i) {
-        std::uniform_int_distribution<size_t> dis(i, logistic_regression_positions.size() - 1);
-        auto begin = logistic_regression_positions.begin();
-        std::iter_swap(begin + i, begin + dis(mersenne_twisters.front()));
-      }
+      // 自己対戦棋譜中の局面のファイルから、ロジスティック回帰の勾配計算に用いる局面を取り出す
+      logistic_regression_positions->NextBatch(kLogisticRegressionBatchSize, &teacher_batch);
 
       // 予め作成しておいた自己対戦棋譜中の局面を使って、ロジスティック回帰の勾配を計算する
 #pragma omp parallel for schedule(dynamic)
-      for (int i = 0; i < kLogisticRegressionBatchSize; ++i) {
-        const TeacherPosition& teacher_pos = logistic_regression_positions.at(i);
+      for (size_t i = 0; i < teacher_batch.size(); ++i) {
+        const TeacherPosition& teacher_pos = *teacher_batch[i];
         LearningStats temp;
         int thread_id = omp_get_thread_num();
         ComputeGradientOfLogisticRegressionLoss(teacher_pos,
@@ -1219,32 +1701,65 @@ void Learning::LearnEvaluationParameters(const bool use_rootstrap,
     }
 
     // 各スレッドの勾配を集約する
-    gradient->Clear();
-#pragma omp parallel for schedule(static)
-    for (size_t i = 0; i < gradient->size(); ++i) {
-      for (int j = 0; j < num_threads; ++j) {
-        (*gradient)[i] += thread_local_gradient[j][i];
-      }
-    }
+    const std::vector<SparseGradient::Entry> gradient_entries = MergeGradients(thread_local_gradient, gradient);
 
-    // 勾配ベクトルについて、いわゆる次元下げを適用する
-    convoluted_gradient->Clear();
-    ConvoluteGradient(gradient, convoluted_gradient);
+    // 勾配ベクトルについて、いわゆる次元下げを適用する（勾配がゼロでない要素のみ）
+    std::vector<uint32_t> convoluted_indices = ConvoluteGradient(gradient, gradient_entries,
+                                                                 convoluted_gradient);
 
-    // 勾配を利用して、パラメータを更新する
+    // 勾配を利用して、パラメータを更新する（勾配がゼロでないパラメータのみ）
     if (kVerboseMessage) {
       std::printf("Update the evaluation parameters...\n");
     }
-    stats += UpdateParams(convoluted_gradient, accumulated_gradient, current_params);
-    CopyParams(current_params);
+    const std::vector<uint32_t> updated_params = FindUpdatedParams(convoluted_gradient,
+                                                                   std::move(convoluted_indices));
+    UpdateParams(iteration, updated_params, convoluted_gradient,
+                 accumulated_gradient, current_params, accumulated_params,
+                 last_updates);
 
-    // 後で平均化パラメータを求めるために、現在のパラメータを足し込んでおく
+    // 次のイテレーションのために、書き込んだ要素だけをゼロクリアしておく
+#pragma omp parallel for schedule(static)
+    for (size_t i = 0; i < gradient_entries.size(); ++i) {
+      (*gradient)[gradient_entries[i].index] = PackedWeight(0.0f);
+    }
 #pragma omp parallel for schedule(static)
-    for (size_t i = 0; i < accumulated_params->size(); ++i) {
-      (*accumulated_params)[i] *= kAveragedSgdDecay;
-      (*accumulated_params)[i] += (*current_params)[i];
+    for (size_t i = 0; i < updated_params.size(); ++i) {
+      (*convoluted_gradient)[updated_params[i]] = PackedWeight(0.0f);
     }
 
+    // 省略していたパラメータの更新を、定期的にすべて反映させる
+    if (iteration % 100 == 0) {
+      l1_penalty = SynchronizeParams(iteration, accumulated_gradient,
+                                     current_params, accumulated_params,
+                                     last_updates);
+
+      // 学習を中断しても再開できるように、チェックポイントを保存する（書き込みはバックグラウンドで行う）
+      Checkpoint* snapshot = checkpoint_writer.WaitAndGetBuffer();
+      snapshot->iteration = iteration;
+      snapshot->l1_penalty = l1_penalty;
+      if (use_rootstrap) {
+        snapshot->rootstrap_seed = rootstrap_positions->seed();
+        snapshot->rootstrap_consumed = rootstrap_positions->num_consumed();
+      }
+      if (use_logistic_regression) {
+        snapshot->logistic_regression_seed = logistic_regression_positions->seed();
+        snapshot->logistic_regression_consumed = logistic_regression_positions->num_consumed();
+      }
+      snapshot->rng_states.clear();
+      for (const std::mt19937& mt : mersenne_twisters) {
+        std::ostringstream os;
+        os << mt;
+        snapshot->rng_states.push_back(os.str());
+      }
+      snapshot->position_ids = position_ids;
+      *snapshot->current_params = *current_params;
+      *snapshot->accumulated_params = *accumulated_params;
+      *snapshot->accumulated_gradient = *accumulated_gradient;
+      checkpoint_writer.StartWriting(kCheckpointFile);
+    }
+    stats.penalty = l1_penalty;
+    CopyParams(current_params);
+
     if (iteration % 100 == 0) {
       // 平均化パラメータを求める
       // ここでは、より直近のデータを重視するため、「指数移動平均」を使っている。
@@ -1283,33 +1798,35 @@ void Learning::LearnEvaluationParameters(const bool use_rootstrap,
       // ファイル保存＆一致率計算後は、元のパラメータに戻す
       CopyParams(current_params);
 
-      // 学習時の統計データをログファイルに出力する
-      std::FILE* fp_log = std::fopen("learning_log.txt", "a");
-      if (fp_log == nullptr) {
-        std::printf("Failed to open learning_log.txt.\n");
-        break;
+      // 学習時の統計データをログファイルに出力する（再開前に記録済みのイテレーションは除く）
+      if (iteration > last_logged_iteration) {
+        std::FILE* fp_log = std::fopen("learning_log.txt", "a");
+        if (fp_log == nullptr) {
+          std::printf("Failed to open learning_log.txt.\n");
+          break;
+        }
+        std::fprintf(fp_log,
+                     "%d loss=%.0f penalty=%.1f wr_l=%.1f wr_e=%f o_l=%.1f o_e=%.1f o_s=%.0f accuracy=%f prediction=%f pos=%d moves=%d samples=%d nodes=%d\n",
+                     iteration,
+                     stats.loss,
+                     stats.penalty,
+                     stats.win_rate_loss,
+                     std::sqrt(stats.win_rate_error / stats.win_rate_samples),
+                     stats.oscillation_loss,
+                     std::sqrt(stats.oscillation_error / stats.oscillation_samples),
+                     stats.oscillation_samples,
+                     accuracy,
+                     (float)stats.num_right_answers / stats.num_positions,
+                     stats.num_positions,
+                     stats.num_moves,
+                     stats.num_samples,
+                     stats.num_nodes);
+        std::fclose(fp_log);
       }
-      std::fprintf(fp_log,
-                   "%d loss=%.0f penalty=%.1f wr_l=%.1f wr_e=%f o_l=%.1f o_e=%.1f o_s=%.0f accuracy=%f prediction=%f pos=%d moves=%d samples=%d nodes=%d\n",
-                   iteration,
-                   stats.loss,
-                   stats.penalty,
-                   stats.win_rate_loss,
-                   std::sqrt(stats.win_rate_error / stats.win_rate_samples),
-                   stats.oscillation_loss,
-                   std::sqrt(stats.oscillation_error / stats.oscillation_samples),
-                   stats.oscillation_samples,
-                   accuracy,
-                   (float)stats.num_right_answers / stats.num_positions,
-                   stats.num_positions,
-                   stats.num_moves,
-                   stats.num_samples,
-                   stats.num_nodes);
-      std::fclose(fp_log);
     }
 
-    // 学習途中の駒割りの値をファイルに出力する
-    {
+    // 学習途中の駒割りの値をファイルに出力する（再開前に記録済みのイテレーションは除く）
+    if (iteration > last_material_iteration) {
       std::FILE* fp = std::fopen("learning_material.txt", "a");
       if (fp == nullptr) {
         std::printf("Failed to open learning_material.txt.\n");
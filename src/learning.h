@@ -21,6 +21,9 @@
 #define LEARNING_H_
 
 #include <cassert>
+#include <algorithm>
+#include <cstdint>
+#include <vector>
 #include "common/arraymap.h"
 #include "common/iterator.h"
 #include "common/math.h"
@@ -39,9 +42,11 @@ class Learning {
    * 評価関数パラメータの学習を開始します.
    * @param use_rootstrap 学習時にRootStrapを併用する場合は、trueにする
    * @param use_logistic_regression 学習時にロジスティック回帰（「激指」方式）を併用する場合は、true
+   * @param resume 前回保存されたチェックポイント（learning_checkpoint.bin）から学習を再開する場合は、true
    */
   static void LearnEvaluationParameters(bool use_rootstrap,
-                                        bool use_logistic_regression);
+                                        bool use_logistic_regression,
+                                        bool resume);
 };
 
 /**
@@ -604,7 +609,8 @@ struct Gradient {
     return sizeof(*this) / sizeof(PackedWeight);
   }
 
-  void UpdateControl(const Position& pos, const PackedWeight& delta) {
+  template<typename Add>
+  void UpdateControl(const Position& pos, const PackedWeight& delta, Add& add) {
     const Square bk = pos.king_square(kBlack);
     const Square wk = pos.king_square(kWhite);
     const ExtendedBoard& extended_board = pos.extended_board();
@@ -614,17 +620,17 @@ struct Gradient {
     for (const Square s : Square::all_squares()) {
       PsqControlIndex index = list[s];
       // 1. 先手玉との関係
-      controls[kBlack][bk][index] += delta;
+      add(controls[kBlack][bk][index], delta);
       // 2. 後手玉との関係
       // 注：KPとは異なり、インデックスの反転処理に時間がかかるため、インデックスと符号の反転処理は行わず、
       // 先手玉用・後手玉用の２つのテーブルを用意することで対応している。
       // その代わり、次元下げを行う段階で、インデックスと符号の反転処理を行っている。
-      controls[kWhite][wk][index] += delta;
+      add(controls[kWhite][wk][index], delta);
     }
   }
 
-  template<Color kKingColor, bool kMirrorHorizontally>
-  void UpdateKingSafety(const Position& pos, const PackedWeight& delta) {
+  template<Color kKingColor, bool kMirrorHorizontally, typename Add>
+  void UpdateKingSafety(const Position& pos, const PackedWeight& delta, Add& add) {
     const Square ksq = pos.king_square(kKingColor);
 
     // 1. 相手の持ち駒のbit setを取得する
@@ -663,7 +669,7 @@ struct Gradient {
       int attackers = attacks.at(dir_m);
       int defenders = defenses.at(dir_m);
       // 勾配を更新する
-      king_safety[hs][dir][piece][attackers][defenders] += delta;
+      add(king_safety[hs][dir][piece][attackers][defenders], delta);
     };
 
     // 5. 玉の周囲8マスについて、それぞれ勾配を更新する
@@ -677,19 +683,19 @@ struct Gradient {
     update_gradient(kDirSW);
   }
 
-  template<Color kKingColor>
-  void UpdateKingSafety(const Position& pos, const PackedWeight& delta) {
+  template<Color kKingColor, typename Add>
+  void UpdateKingSafety(const Position& pos, const PackedWeight& delta, Add& add) {
     // 玉が右側にいる場合は、左右反転させて、将棋盤の左側にあるものとして評価する
     // これにより、「玉の左か右か」という観点でなく、「盤の端か中央か」という観点での評価を行うことができる
     if (pos.king_square(kKingColor).relative_square(kKingColor).file() <= kFile4) {
-      UpdateKingSafety<kKingColor, true>(pos, delta);
+      UpdateKingSafety<kKingColor, true>(pos, delta, add);
     } else {
-      UpdateKingSafety<kKingColor, false>(pos, delta);
+      UpdateKingSafety<kKingColor, false>(pos, delta, add);
     }
   }
 
-  template<Color kColor>
-  void UpdateSlidingPieces(const Position& pos, const PackedWeight& delta) {
+  template<Color kColor, typename Add>
+  void UpdateSlidingPieces(const Position& pos, const PackedWeight& delta, Add& add) {
     Square own_ksq = pos.king_square(kColor);
     Square opp_ksq = pos.king_square(~kColor);
     if (kColor == kWhite) {
@@ -712,9 +718,9 @@ struct Gradient {
           to = Square::rotate180(to);
           if (threatened != kNoPiece) threatened = threatened.opponent_piece();
         }
-        rook_control[kBlack][own_ksq][from][to] += delta;
-        rook_control[kWhite][opp_ksq][from][to] += delta;
-        rook_threat[opp_ksq][to][threatened] += delta;
+        add(rook_control[kBlack][own_ksq][from][to], delta);
+        add(rook_control[kWhite][opp_ksq][from][to], delta);
+        add(rook_threat[opp_ksq][to][threatened], delta);
       }
     });
 
@@ -734,9 +740,9 @@ struct Gradient {
           to = Square::rotate180(to);
           if (threatened != kNoPiece) threatened = threatened.opponent_piece();
         }
-        bishop_control[kBlack][own_ksq][from][to] += delta;
-        bishop_control[kWhite][opp_ksq][from][to] += delta;
-        bishop_threat[opp_ksq][to][threatened] += delta;
+        add(bishop_control[kBlack][own_ksq][from][to], delta);
+        add(bishop_control[kWhite][opp_ksq][from][to], delta);
+        add(bishop_threat[opp_ksq][to][threatened], delta);
       }
     });
 
@@ -753,9 +759,9 @@ struct Gradient {
           to = Square::rotate180(to);
           if (threatened != kNoPiece) threatened = threatened.opponent_piece();
         }
-        lance_control[kBlack][own_ksq][from][to] += delta;
-        lance_control[kWhite][opp_ksq][from][to] += delta;
-        lance_threat[opp_ksq][to][threatened] += delta;
+        add(lance_control[kBlack][own_ksq][from][to], delta);
+        add(lance_control[kWhite][opp_ksq][from][to], delta);
+        add(lance_threat[opp_ksq][to][threatened], delta);
       }
     });
   }
@@ -765,6 +771,19 @@ struct Gradient {
    */
   void Update(const Position& pos, const PsqList& list, const float delta,
               const float progress) {
+    auto add = [](PackedWeight& item, const PackedWeight& d) {
+      item += d;
+    };
+    Update(pos, list, delta, progress, add);
+  }
+
+  /**
+   * 勾配ベクトルの各要素を、add(要素, 増分)という呼び出しで更新します.
+   * SparseGradientのように、このオブジェクト自体には書き込まずに、更新された要素の位置だけを利用することもできます。
+   */
+  template<typename Add>
+  void Update(const Position& pos, const PsqList& list, const float delta,
+              const float progress, Add& add) {
     const Color stm = pos.side_to_move();
     const Square bk = pos.king_square(kBlack);
     const Square wk = Square::rotate180(pos.king_square(kWhite));
@@ -777,28 +796,28 @@ struct Gradient {
     // 1. ２駒の関係
     for (const PsqPair* i = list.begin(); i != list.end(); ++i) {
       // a. KP（KPは、序盤・中盤・終盤と３通りに分かれている）
-      king_piece[bk][i->black()] += delta3x1; // 加算
-      king_piece[wk][i->white()] -= delta3x1; // 減算
+      add(king_piece[bk][i->black()], delta3x1); // 加算
+      add(king_piece[wk][i->white()], -delta3x1); // 減算
       // b. PP（PPは、序盤・終盤 * 手番で、2*2=4通りに分かれている）
       for (const PsqPair* j = list.begin(); j <= i; ++j) {
-        two_pieces[i->black()][j->black()] += delta2x2;
+        add(two_pieces[i->black()][j->black()], delta2x2);
       }
     }
 
     // 2. 各マスの利き
-    UpdateControl(pos, delta2x2);
+    UpdateControl(pos, delta2x2, add);
 
     // 3. 玉の安全度
-    UpdateKingSafety<kBlack>(pos, delta2x2);
-    UpdateKingSafety<kWhite>(pos, FlipWeights2x2(delta2x2));
+    UpdateKingSafety<kBlack>(pos, delta2x2, add);
+    UpdateKingSafety<kWhite>(pos, FlipWeights2x2(delta2x2), add);
 
     // 4. 飛車・角の利き
-    UpdateSlidingPieces<kBlack>(pos, delta2x2);
-    UpdateSlidingPieces<kWhite>(pos, FlipWeights2x2(delta2x2));
+    UpdateSlidingPieces<kBlack>(pos, delta2x2, add);
+    UpdateSlidingPieces<kWhite>(pos, FlipWeights2x2(delta2x2), add);
 
     // 5. 手番
     // 注：手番は、EvalDetail::ComputeFinalScore()に合わせるため、0.5を掛ける。
-    tempo += (stm == kBlack ? 0.5f : -0.5f) * delta3x1;
+    add(tempo, (stm == kBlack ? 0.5f : -0.5f) * delta3x1);
   }
 
   //
@@ -900,4 +919,124 @@ struct Gradient {
   }
 };
 
+/**
+ * 損失関数の勾配のうち、実際に更新された要素だけを保持するクラスです.
+ *
+ * スレッドごとに密なGradientを持つ代わりにこのクラスを使うと、メモリ使用量が「更新された要素の数」程度で済みます。
+ * 各要素は、Gradient内での位置（Gradient::begin()からのオフセット）をインデックスとして、
+ * オープンアドレス法のハッシュテーブルに保存されます。
+ */
+class SparseGradient {
+ public:
+  struct Entry {
+    uint32_t index;
+    PackedWeight value;
+  };
+
+  /**
+   * @param layout 要素の位置を求めるためだけに用いる、密な勾配ベクトル（このクラスからは書き込みません）
+   */
+  explicit SparseGradient(Gradient* layout)
+      : layout_(layout),
+        keys_(kInitialCapacity, kEmpty),
+        values_(kInitialCapacity) {
+  }
+
+  /**
+   * 保存されている要素をすべて消去します（確保したメモリは、次回以降のために残しておきます）.
+   */
+  void Clear() {
+    std::fill(keys_.begin(), keys_.end(), kEmpty);
+    size_ = 0;
+  }
+
+  /**
+   * indexの位置にある要素に、deltaを加算します.
+   */
+  void Add(uint32_t index, const PackedWeight& delta) {
+    assert(index != kEmpty);
+    const size_t mask = keys_.size() - 1;
+    for (size_t slot = Hash(index) & mask; ; slot = (slot + 1) & mask) {
+      if (keys_[slot] == index) {
+        values_[slot] += delta;
+        return;
+      }
+      if (keys_[slot] == kEmpty) {
+        keys_[slot] = index;
+        values_[slot] = delta;
+        if (++size_ * 2 > keys_.size()) {
+          Grow();
+        }
+        return;
+      }
+    }
+  }
+
+  /**
+   * Gradient::Update()と同じ要素を、deltaだけ更新します.
+   */
+  void Update(const Position& pos, const PsqList& list, const float delta,
+              const float progress) {
+    auto add = [this](PackedWeight& item, const PackedWeight& d) {
+      Add(static_cast<uint32_t>(&item - layout_->begin()), d);
+    };
+    layout_->Update(pos, list, delta, progress, add);
+  }
+
+  /**
+   * 保存されている要素を、インデックスの昇順に並べて返します.
+   */
+  std::vector<Entry> GetSortedEntries() const {
+    std::vector<Entry> entries;
+    entries.reserve(size_);
+    for (size_t slot = 0; slot < keys_.size(); ++slot) {
+      if (keys_[slot] != kEmpty) {
+        entries.push_back(Entry{keys_[slot], values_[slot]});
+      }
+    }
+    std::sort(entries.begin(), entries.end(), [](const Entry& lhs, const Entry& rhs) {
+      return lhs.index < rhs.index;
+    });
+    return entries;
+  }
+
+  /**
+   * 保存されている要素の数を返します.
+   */
+  size_t size() const {
+    return size_;
+  }
+
+ private:
+  static constexpr size_t kInitialCapacity = 1 << 16;
+  static constexpr uint32_t kEmpty = UINT32_MAX;
+
+  static uint32_t Hash(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+    return x;
+  }
+
+  void Grow() {
+    std::vector<uint32_t> old_keys(keys_.size() * 2, kEmpty);
+    std::vector<PackedWeight> old_values(values_.size() * 2);
+    old_keys.swap(keys_);
+    old_values.swap(values_);
+    size_ = 0;
+    for (size_t slot = 0; slot < old_keys.size(); ++slot) {
+      if (old_keys[slot] != kEmpty) {
+        Add(old_keys[slot], old_values[slot]);
+      }
+    }
+  }
+
+  Gradient* layout_;
+  std::vector<uint32_t> keys_;
+  std::vector<PackedWeight> values_;
+  size_t size_ = 0;
+};
+
 #endif /* LEARNING_H_ */
@@ -0,0 +1,305 @@
+/*
+ * 技巧 (Gikou), a USI shogi (Japanese chess) playing engine.
+ * Copyright (C) 2016-2017 Yosuke Demura
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "mate_n.h"
+
+#include <algorithm>
+#include "mate3.h"
+#include "movegen.h"
+#include "position.h"
+#include "proofpiece.h"
+#include "zobrist.h"
+
+namespace {
+
+/**
+ * ｎ手詰関数の内部で共有する情報です.
+ */
+struct MateSearchContext {
+  MateCache* cache;
+  uint64_t nodes_limit; // この値をnodes_searched()が超えたら探索を打ち切る
+  bool aborted;
+};
+
+/**
+ * 指し手 move で１手進めた後の、盤上の駒と手番のハッシュ値を求めます（Node::MakeMove()と同じ計算）.
+ */
+inline Key64 BoardKeyAfter(Key64 board_key, Move move, Color side_to_move) {
+  board_key += Zobrist::null_move(side_to_move);
+  if (move.is_drop()) {
+    board_key += Zobrist::psq(move.piece(), move.to());
+  } else {
+    board_key -= Zobrist::psq(move.captured_piece(), move.to());
+    board_key -= Zobrist::psq(move.piece(), move.from());
+    board_key += Zobrist::psq(move.piece_after_move(), move.to());
+  }
+  return board_key;
+}
+
+bool IsMateWithin(Position& pos, Key64 board_key, int plies,
+                  MateSearchContext* ctx, MateNResult* result);
+
+/**
+ * plies手以内に手番側の玉が詰まされる場合は、trueを返します（pliesは偶数で、4以上）.
+ */
+bool IsMatedWithin(Position& pos, Key64 board_key, int plies,
+                   MateSearchContext* ctx, MateNResult* result) {
+  assert(pos.in_check());
+  assert(plies >= 4 && plies % 2 == 0);
+
+  int max_mate_distance = 0;
+  Hand child_proof_pieces;
+  EvasionPicker evasion_picker(pos);
+
+  while (evasion_picker.has_next()) {
+    const Move move = evasion_picker.next_move();
+
+    if (!pos.PseudoLegalMoveIsLegal(move)) {
+      continue;
+    }
+
+    // 受け方の手が逆王手になっている場合は、処理が難しくなるので、一律不詰とする
+    if (pos.MoveGivesCheck(move)) {
+      return false;
+    }
+
+    const Key64 child_key = BoardKeyAfter(board_key, move, pos.side_to_move());
+    pos.MakeMove(move, false);
+
+    // 残りの手数で詰むか調べる
+    bool mated = false;
+    int child_distance = 0;
+    Hand child_proof;
+    if (plies - 1 == 3) {
+      Mate3Result m3result;
+      if (IsMateInThreePlies(pos, &m3result)) {
+        mated = true;
+        child_distance = m3result.mate_distance;
+        child_proof = m3result.proof_pieces;
+      }
+    } else {
+      MateNResult r;
+      if (IsMateWithin(pos, child_key, plies - 1, ctx, &r)) {
+        mated = true;
+        child_distance = r.mate_distance;
+        child_proof = r.proof_pieces;
+      }
+    }
+
+    pos.UnmakeMove(move);
+
+    // 攻め方の王手から逃れる手を見つけたので、plies手以内には詰まないことになる
+    if (!mated) {
+      return false;
+    }
+
+    max_mate_distance = std::max(max_mate_distance, child_distance + 1);
+    child_proof_pieces |= child_proof;
+  }
+
+  // 結果を保存する
+  result->proof_pieces = ProofPieces::AtLeaf(pos) | child_proof_pieces;
+  result->mate_distance = max_mate_distance;
+  assert(result->mate_distance % 2 == 0);
+
+  return true;
+}
+
+/**
+ * plies手以内に受け方の玉を詰ますことができる場合は、trueを返します（pliesは奇数で、5以上）.
+ */
+bool IsMateWithin(Position& pos, Key64 board_key, const int plies,
+                  MateSearchContext* const ctx, MateNResult* const result) {
+  assert(!pos.in_check());
+  assert(plies >= 5 && plies % 2 == 1);
+
+  // そもそも、受け方の玉が存在しなければ、詰まされることはない
+  if (!pos.king_exists(~pos.side_to_move())) {
+    return false;
+  }
+
+  // キャッシュを調べる
+  const Hand hand = pos.stm_hand();
+  if (ctx->cache->ProbeMate(board_key, hand, plies, result)) {
+    return true;
+  }
+  if (ctx->cache->ProbeNoMate(board_key, hand, plies)) {
+    return false;
+  }
+
+  // 探索量が上限に達したら、探索を打ち切る
+  if (pos.nodes_searched() >= ctx->nodes_limit) {
+    ctx->aborted = true;
+    return false;
+  }
+
+  const Color side_to_move = pos.side_to_move();
+  const Square ksq = pos.king_square(~side_to_move);
+
+  // 近接王手を生成する
+  SimpleMoveList<kAdjacentChecks> adjacent_checks(pos);
+
+  for (const ExtMove& ext_move : adjacent_checks) {
+    const Move move = ext_move.move;
+    assert(pos.MoveGivesCheck(move));
+
+    if (!pos.PseudoLegalMoveIsLegal(move)) {
+      continue;
+    }
+
+    // 受け方の玉で取り返されると、残り(plies - 2)手で詰まなくなる場合は、その王手を枝刈りする
+    // （残り５手の場合のみ。３手詰関数を使って判定する。）
+    if (   plies == 5
+        && move.is_drop()
+        && neighborhood8_bb(ksq).test(move.to())
+        && !pos.square_is_attacked(side_to_move, move.to())) {
+      pos.MakeDropAndKingRecapture(move);
+      Mate3Result m3result;
+      bool prune = !pos.in_check() && !IsMateInThreePlies(pos, &m3result);
+      pos.UnmakeDropAndKingRecapture(move);
+      if (prune) {
+        continue;
+      }
+    }
+
+    const Key64 child_key = BoardKeyAfter(board_key, move, side_to_move);
+    pos.MakeMove(move, true);
+
+    // 残り(plies - 1)手で詰むか調べる
+    MateNResult r;
+    if (IsMatedWithin(pos, child_key, plies - 1, ctx, &r)) {
+      pos.UnmakeMove(move);
+      // 打ち歩詰め
+      if (move.is_pawn_drop() && r.mate_distance == 0) {
+        continue;
+      }
+      // 結果を保存する
+      result->mate_move = move;
+      result->mate_distance = r.mate_distance + 1;
+      result->proof_pieces = ProofPieces::AtAttackSide(r.proof_pieces, move);
+      ctx->cache->SaveMate(board_key, *result);
+      return true;
+    }
+
+    pos.UnmakeMove(move);
+
+    if (ctx->aborted) {
+      return false;
+    }
+  }
+
+  ctx->cache->SaveNoMate(board_key, hand, plies);
+  return false;
+}
+
+} // namespace
+
+MateCache::MateCache(size_t size)
+    : table_(size),
+      key_mask_(size - 1) {
+  assert((size & (size - 1)) == 0);
+  Clear();
+}
+
+void MateCache::Clear() {
+  for (Entry& entry : table_) {
+    entry.key = Key64(0);
+    entry.hand = Hand();
+    entry.move = kMoveNone;
+    entry.plies = 0;
+    entry.is_mate = false;
+  }
+  num_probes_ = 0;
+  num_hits_ = 0;
+}
+
+bool MateCache::ProbeMate(Key64 board_key, Hand hand, int max_plies,
+                          MateNResult* const result) const {
+  ++num_probes_;
+  const Entry* entry = Find(board_key);
+  if (   entry != nullptr
+      && entry->is_mate
+      && entry->plies <= max_plies
+      && hand.Dominates(entry->hand)) {
+    result->mate_move = entry->move;
+    result->mate_distance = entry->plies;
+    result->proof_pieces = entry->hand;
+    ++num_hits_;
+    return true;
+  }
+  return false;
+}
+
+bool MateCache::ProbeNoMate(Key64 board_key, Hand hand, int plies) const {
+  const Entry* entry = Find(board_key);
+  if (   entry != nullptr
+      && !entry->is_mate
+      && entry->plies >= plies
+      && entry->hand.Dominates(hand)) {
+    ++num_hits_;
+    return true;
+  }
+  return false;
+}
+
+void MateCache::SaveMate(Key64 board_key, const MateNResult& result) {
+  assert(result.mate_distance >= 1);
+  Entry& entry = table_[static_cast<uint64_t>(board_key) & key_mask_];
+  entry.key = board_key;
+  entry.hand = result.proof_pieces;
+  entry.move = result.mate_move;
+  entry.plies = static_cast<int16_t>(result.mate_distance);
+  entry.is_mate = true;
+}
+
+void MateCache::SaveNoMate(Key64 board_key, Hand hand, int plies) {
+  assert(plies >= 1);
+  Entry& entry = table_[static_cast<uint64_t>(board_key) & key_mask_];
+  // 同一局面の詰みの情報は、不詰の情報で上書きしない
+  if (entry.key == board_key && entry.is_mate && entry.plies != 0) {
+    return;
+  }
+  entry.key = board_key;
+  entry.hand = hand;
+  entry.move = kMoveNone;
+  entry.plies = static_cast<int16_t>(plies);
+  entry.is_mate = false;
+}
+
+bool IsMateInNPlies(Position& pos, Key64 board_key, int max_plies,
+                    uint64_t max_nodes, MateCache* const cache,
+                    MateNResult* const result, bool* const aborted) {
+  assert(!pos.in_check());
+  assert(max_plies >= 5 && max_plies % 2 == 1);
+  assert(cache != nullptr);
+  assert(result != nullptr);
+
+  MateSearchContext ctx;
+  ctx.cache = cache;
+  ctx.nodes_limit = max_nodes < UINT64_MAX - pos.nodes_searched()
+                  ? pos.nodes_searched() + max_nodes
+                  : UINT64_MAX;
+  ctx.aborted = false;
+
+  const bool found = IsMateWithin(pos, board_key, max_plies, &ctx, result);
+  if (aborted != nullptr) {
+    *aborted = !found && ctx.aborted;
+  }
+  return found;
+}
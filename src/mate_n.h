@@ -0,0 +1,138 @@
+/*
+ * 技巧 (Gikou), a USI shogi (Japanese chess) playing engine.
+ * Copyright (C) 2016-2017 Yosuke Demura
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef MATE_N_H_
+#define MATE_N_H_
+
+#include <vector>
+#include "hand.h"
+#include "move.h"
+#include "types.h"
+class Position;
+
+/**
+ * ｎ手詰関数の結果を保存するためのクラスです.
+ */
+struct MateNResult {
+  /** 受け方の玉をｎ手以内に詰ますことができる手. */
+  Move mate_move;
+
+  /** 相手玉が詰むとして、それは何手詰か. */
+  int mate_distance;
+
+  /** 証明駒（相手玉を詰ますのに最低限必要な、攻め方の持ち駒）. */
+  Hand proof_pieces;
+};
+
+/**
+ * ｎ手詰関数の探索結果（詰み・不詰）を記憶しておくための、小さなキャッシュです.
+ *
+ * 盤上の駒と手番のハッシュ値をキーにして、攻め方の持ち駒を一緒に保存しておきます。
+ * 持ち駒の優越関係を利用しているので、以下の場合にもキャッシュにヒットします。
+ *   - 詰み: 攻め方の持ち駒が、保存されている証明駒を優越している場合
+ *   - 不詰: 保存されている攻め方の持ち駒が、現在の攻め方の持ち駒を優越している場合
+ *
+ * 探索スレッドごとに１つずつ持つことを想定しているため、排他制御は行っていません。
+ */
+class MateCache {
+ public:
+  /** デフォルトのエントリ数（2の累乗である必要があります）. */
+  static constexpr size_t kDefaultSize = 1 << 14;
+
+  explicit MateCache(size_t size = kDefaultSize);
+
+  /**
+   * キャッシュの内容を消去します.
+   */
+  void Clear();
+
+  /**
+   * 詰みが記録されていれば、trueを返します.
+   * @param board_key  盤上の駒と手番のハッシュ値
+   * @param hand       攻め方の持ち駒
+   * @param max_plies  許容する最大の手数
+   * @param result     詰みが記録されていた場合に、その結果を保存する場所
+   */
+  bool ProbeMate(Key64 board_key, Hand hand, int max_plies,
+                 MateNResult* result) const;
+
+  /**
+   * 指定された手数以上の探索で、不詰であることが記録されていれば、trueを返します.
+   */
+  bool ProbeNoMate(Key64 board_key, Hand hand, int plies) const;
+
+  /**
+   * 詰みであることを記録します.
+   */
+  void SaveMate(Key64 board_key, const MateNResult& result);
+
+  /**
+   * 指定された手数で不詰であったことを記録します.
+   */
+  void SaveNoMate(Key64 board_key, Hand hand, int plies);
+
+  uint64_t num_probes() const {
+    return num_probes_;
+  }
+
+  uint64_t num_hits() const {
+    return num_hits_;
+  }
+
+ private:
+  struct Entry {
+    Key64 key;
+    Hand hand;     // 詰みの場合は証明駒、不詰の場合は攻め方の持ち駒
+    Move move;     // 詰みの場合の詰ます手
+    int16_t plies; // 詰みの場合は詰みまでの手数、不詰の場合は探索した手数
+    bool is_mate;
+  };
+
+  const Entry* Find(Key64 board_key) const {
+    const Entry& entry = table_[static_cast<uint64_t>(board_key) & key_mask_];
+    return entry.key == board_key && entry.plies != 0 ? &entry : nullptr;
+  }
+
+  std::vector<Entry> table_;
+  uint64_t key_mask_;
+  mutable uint64_t num_probes_ = 0;
+  mutable uint64_t num_hits_ = 0;
+};
+
+/**
+ * 与えられた局面について、max_plies手以内の詰みが存在する場合は、trueを返します.
+ *
+ * ３手詰関数（mate3.cc）と同様に、合駒できない王手（近接王手）のみを調べています。
+ * 残り３手となった局面では３手詰関数を呼び、途中の攻め方の局面の結果はキャッシュに記憶します。
+ * 探索量が max_nodes を超えた場合には、探索を打ち切り、falseを返します（キャッシュには保存しません）。
+ *
+ * @param pos       詰みの有無を調べたい局面（王手がかかっていないこと）
+ * @param board_key 盤上の駒と手番のハッシュ値（Node::board_key()）
+ * @param max_plies 調べる最大の手数（5 または 7）
+ * @param max_nodes 探索ノード数の上限
+ * @param cache     詰み・不詰を記憶するキャッシュ
+ * @param result    詰みが見つかった場合に、その結果を保存する場所です
+ * @param aborted   探索量の上限に達して探索を打ち切った場合に、trueが保存されます（省略可）
+ * @return max_plies手以内の詰みが存在する場合は、true
+ */
+bool IsMateInNPlies(Position& pos, Key64 board_key, int max_plies,
+                    uint64_t max_nodes, MateCache* cache, MateNResult* result,
+                    bool* aborted = nullptr);
+
+#endif /* MATE_N_H_ */
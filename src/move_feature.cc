@@ -19,6 +19,9 @@
 
 #include "move_feature.h"
 
+#include <cinttypes>
+#include <cstdio>
+#include <algorithm>
 #include <type_traits>
 #include "common/bitfield.h"
 #include "common/math.h"
@@ -618,12 +621,16 @@ bool IsPawnDropInterruptingOwnRook(Move move, const Position& pos) {
 const int kNumBinaryMoveFeatures = key_chain.total_size_of_keys();
 const int kNumMoveFeatures = kNumBinaryMoveFeatures + kNumContinuousMoveFeatures;
 
-template<Color kColor>
-MoveFeatureList ExtractMoveFeatures(const Move move, const Position& pos,
-                                    const PositionInfo& pos_info) {
+/**
+ * 指し手の特徴を抽出し、feature_listに追加します.
+ * FeatureListには、push_back()メソッドと、continuous_valuesメンバを持つ型を指定します。
+ */
+template<Color kColor, typename FeatureList>
+void ExtractMoveFeaturesTo(const Move move, const Position& pos,
+                           const PositionInfo& pos_info, const Score see_score,
+                           FeatureList& feature_list) {
   assert(pos.MoveIsPseudoLegal(move));
-
-  MoveFeatureList feature_list;
+  assert(see_score == Swap::Evaluate(move, pos));
 
   const ExtendedBoard& old_eb = pos.extended_board();
   const ExtendedBoard new_eb = GetNewExtendedBoard(old_eb, move);
@@ -653,7 +660,6 @@ MoveFeatureList ExtractMoveFeatures(const Move move, const Position& pos,
   const Square own_ksq = pos.king_square(kColor);
   const Square opp_ksq = pos.king_square(~kColor);
 
-  const Score see_score = Swap::Evaluate(move, pos);
   const int see_sign = math::sign(int(see_score));
 
   // 直近4手
@@ -798,7 +804,7 @@ MoveFeatureList ExtractMoveFeatures(const Move move, const Position& pos,
       add_feature(kDistanceBetweenKingAndChuaiPiece(min_max(distance, 2, 4)));
     }
 
-    return feature_list;
+    return;
   }
 
 
@@ -807,7 +813,7 @@ MoveFeatureList ExtractMoveFeatures(const Move move, const Position& pos,
   //
   if (move.is_capture()) {
     // 取れる最高の駒を取る手（SEE>=0）
-    if (   pos_info.most_valuable_victim.test(to_bb)
+    if (   pos_info.most_valuable_victim().test(to_bb)
         && see_sign >= 0) {
       add_feature(kIsCaptureOfMostValuablePiece());
     }
@@ -979,7 +985,7 @@ MoveFeatureList ExtractMoveFeatures(const Move move, const Position& pos,
 
     // ピンしている駒に対する当たり [動かした駒][利きを付けた駒]
     if (see_sign < 0) {
-      for (Bitboard targets = new_attacks & pos_info.opponent_pinned_pieces;
+      for (Bitboard targets = new_attacks & pos_info.opponent_pinned_pieces();
            targets.any(); ) {
         Square target_sq = targets.pop_first_one();
         if (!line_bb(target_sq, opp_ksq).test(move.to())) {
@@ -1047,7 +1053,7 @@ MoveFeatureList ExtractMoveFeatures(const Move move, const Position& pos,
     Score threat_score = EvaluateThreat(move, pos);
 
     // 取られそうな最高の駒を逃げる手（SSE>=0）
-    if (   pos_info.most_valuable_threatened_piece.test(from_bb)
+    if (   pos_info.most_valuable_threatened_piece().test(from_bb)
         && see_sign >= 0
         && (pt != kPawn && pt != kLance)) {
       add_feature(kEscapeMoveOfMostValuablePiece());
@@ -1062,8 +1068,8 @@ MoveFeatureList ExtractMoveFeatures(const Move move, const Position& pos,
     // 駒が取られそうな場合に、合駒をして守る手 [動かした駒][守った駒]
     if (   see_sign == 0
         && move.is_drop()
-        && pos_info.most_valuable_threatened_piece.any()) {
-      Square victim_sq = pos_info.most_valuable_threatened_piece.first_one();
+        && pos_info.most_valuable_threatened_piece().any()) {
+      Square victim_sq = pos_info.most_valuable_threatened_piece().first_one();
       if (IsInterceptionDefense(move, victim_sq, pos)) {
         PieceType victim_pt = pos.piece_on(victim_sq).type();
         add_feature(kInterceptionDefense(pt, victim_pt));
@@ -1082,7 +1088,7 @@ MoveFeatureList ExtractMoveFeatures(const Move move, const Position& pos,
     }
 
     // 自玉の８近傍に利きを足す手（打つ手のみ）（味方の利きより相手の利きが多いマスに利きを足す）[駒の種類]
-    if (   new_attacks.test(pos_info.dangerous_king_neighborhood_squares)
+    if (   new_attacks.test(pos_info.dangerous_king_neighborhood_squares())
         && see_sign >= 0) {
       add_feature(kReinforcementOfOurCastle(pt));
     }
@@ -1094,7 +1100,7 @@ MoveFeatureList ExtractMoveFeatures(const Move move, const Position& pos,
   {
     // 敵玉８近傍に利きを足す手（飛び駒のみ）
     if (   move.piece().is_slider()
-        && new_attacks.test(pos_info.opponent_king_neighborhoods8)
+        && new_attacks.test(pos_info.opponent_king_neighborhoods8())
         && see_sign >= 0) {
       add_feature(kAttackToOppKingNeighbor8());
     }
@@ -1787,7 +1793,6 @@ MoveFeatureList ExtractMoveFeatures(const Move move, const Position& pos,
       break;
   }
 
-  return feature_list;
 }
 
 Array<float, kNumContinuousMoveFeatures> ExtractDynamicMoveFeatures(
@@ -1837,9 +1842,65 @@ Array<float, kNumContinuousMoveFeatures> ExtractDynamicMoveFeatures(
 
 MoveFeatureList ExtractMoveFeatures(Move move, const Position& pos,
                                     const PositionInfo& pos_info) {
-  return pos.side_to_move() == kBlack
-       ? ExtractMoveFeatures<kBlack>(move, pos, pos_info)
-       : ExtractMoveFeatures<kWhite>(move, pos, pos_info);
+  return ExtractMoveFeatures(move, pos, pos_info, Swap::Evaluate(move, pos));
+}
+
+MoveFeatureList ExtractMoveFeatures(Move move, const Position& pos,
+                                    const PositionInfo& pos_info,
+                                    Score see_score) {
+  MoveFeatureList feature_list;
+  if (pos.side_to_move() == kBlack) {
+    ExtractMoveFeaturesTo<kBlack>(move, pos, pos_info, see_score, feature_list);
+  } else {
+    ExtractMoveFeaturesTo<kWhite>(move, pos, pos_info, see_score, feature_list);
+  }
+  return feature_list;
+}
+
+namespace {
+
+/**
+ * MoveFeatureBatchの１手分の領域に、特徴を書き込むためのクラスです.
+ */
+struct MoveFeatureBatchWriter {
+  void push_back(MoveFeatureIndex index) {
+    indices.push_back(index);
+  }
+  std::vector<MoveFeatureIndex>& indices;
+  Array<float, kNumContinuousMoveFeatures>& continuous_values;
+};
+
+template<Color kColor>
+void ExtractMoveFeaturesOfAllMoves(const Position& pos,
+                                   const PositionInfo& pos_info,
+                                   const ExtMove* const begin,
+                                   const ExtMove* const end,
+                                   const Score* const see_scores,
+                                   MoveFeatureBatch* const batch) {
+  const size_t num_moves = end - begin;
+  batch->indices.clear();
+  batch->num_moves = num_moves;
+  for (size_t move_id = 0; move_id < num_moves; ++move_id) {
+    batch->offsets[move_id] = static_cast<uint32_t>(batch->indices.size());
+    MoveFeatureBatchWriter writer{batch->indices, batch->continuous_values[move_id]};
+    ExtractMoveFeaturesTo<kColor>(begin[move_id].move, pos, pos_info,
+                                  see_scores[move_id], writer);
+  }
+  batch->offsets[num_moves] = static_cast<uint32_t>(batch->indices.size());
+}
+
+} // namespace
+
+void ExtractMoveFeatures(const Position& pos, const PositionInfo& pos_info,
+                         const ExtMove* begin, const ExtMove* end,
+                         const Score* see_scores, MoveFeatureBatch* batch) {
+  assert(end - begin <= Move::kMaxLegalMoves);
+  assert(batch != nullptr);
+  if (pos.side_to_move() == kBlack) {
+    ExtractMoveFeaturesOfAllMoves<kBlack>(pos, pos_info, begin, end, see_scores, batch);
+  } else {
+    ExtractMoveFeaturesOfAllMoves<kWhite>(pos, pos_info, begin, end, see_scores, batch);
+  }
 }
 
 PositionInfo::PositionInfo(const Position& pos,
@@ -1849,17 +1910,59 @@ PositionInfo::PositionInfo(const Position& pos,
     : history(history_stats),
       gains(gains_stats),
       countermoves_history(cmh),
-      followupmoves_history(fmh) {
+      followupmoves_history(fmh),
+      pos_(pos),
+      cache_(own_cache_) {
+}
+
+PositionInfo::PositionInfo(const Position& pos, const PositionInfoCache& cache,
+                           const HistoryStats& history_stats,
+                           const GainsStats& gains_stats,
+                           const HistoryStats* cmh, const HistoryStats* fmh)
+    : history(history_stats),
+      gains(gains_stats),
+      countermoves_history(cmh),
+      followupmoves_history(fmh),
+      pos_(pos),
+      cache_(cache) {
+}
+
+#if defined(POSITION_INFO_STATS)
+std::atomic<uint64_t> PositionInfoCache::num_lookups_[PositionInfoCache::kNumFields];
+std::atomic<uint64_t> PositionInfoCache::num_computations_[PositionInfoCache::kNumFields];
+
+void PositionInfoCache::PrintStats() {
+  static const char* const kFieldNames[kNumFields] = {
+    "attacked", "defended", "victim", "pinned", "threatened",
+    "threatened_mv", "last_move_attacks", "last_move_intercepts",
+    "dangerous_king_nbr", "drop_checks", "opp_king_nbr8", "opp_king_nbr24",
+    "opp_king_golds", "opp_king_silvers"
+  };
+  std::printf("PositionInfoCache: field computed/lookups (hit rate)\n");
+  for (int i = 0; i < kNumFields; ++i) {
+    const uint64_t lookups = num_lookups_[i].load(std::memory_order_relaxed);
+    const uint64_t computations = num_computations_[i].load(std::memory_order_relaxed);
+    std::printf("  %-20s %12" PRIu64 "/%12" PRIu64 " (%5.1f%%)\n",
+                kFieldNames[i], computations, lookups,
+                100.0 * (lookups - computations) / std::max(lookups, UINT64_C(1)));
+  }
+}
+
+void PositionInfoCache::ClearStats() {
+  for (int i = 0; i < kNumFields; ++i) {
+    num_lookups_[i].store(0, std::memory_order_relaxed);
+    num_computations_[i].store(0, std::memory_order_relaxed);
+  }
+}
+#endif
+
+Bitboard PositionInfoCache::Compute(const Field field, const Position& pos) const {
   const Color stm = pos.side_to_move();
   const Square own_ksq = pos.king_square(stm);
   const Square opp_ksq = pos.king_square(~stm);
   const Bitboard own_pieces = pos.pieces(stm);
   const Bitboard opp_pieces = pos.pieces(~stm);
 
-  // 利きが付いているマス
-  attacked_squares = pos.extended_board().GetControlledSquares(~stm);
-  defended_squares = pos.extended_board().GetControlledSquares(stm);
-
   auto find_most_valuable_pieces = [&](Bitboard pieces) -> Bitboard {
     Score best_value = kScoreZero;
     PieceType best_type = kNoPieceType;
@@ -1874,95 +1977,134 @@ PositionInfo::PositionInfo(const Position& pos,
     return best_type == kNoPieceType ? Bitboard() : (pieces & pos.pieces(best_type));
   };
 
-  // 当たりをかけている、最も価値の高い敵の駒
-  most_valuable_victim = find_most_valuable_pieces(defended_squares & opp_pieces);
-
-  // ピンしている相手の駒
-  {
-    // 1. ピンしている味方の駒の候補を求める
-    Bitboard pinners;
-    pinners |= max_attacks_bb(kBlackRook, opp_ksq) & pos.pieces(kRook, kDragon);
-    pinners |= max_attacks_bb(kBlackBishop, opp_ksq) & pos.pieces(kBishop, kHorse);
-    pinners |= max_attacks_bb(Piece(stm, kLance), opp_ksq) & pos.pieces(kLance);
-    pinners = (pinners & own_pieces).andnot(neighborhood8_bb(opp_ksq));
-
-    // 2. ピンされている相手の駒を求める
-    pinners.ForEach([&](Square pinner_sq) {
-      Bitboard obstructing_pieces = pos.pieces() & between_bb(opp_ksq, pinner_sq);
-      if (obstructing_pieces.count() == 1) {
-        opponent_pinned_pieces |= (obstructing_pieces & opp_pieces);
-      }
-    });
-  }
-
-  // 当たりになっている味方の駒
-  threatened_pieces = attacked_squares & own_pieces;
+  switch (field) {
+    // 利きが付いているマス
+    case kAttackedSquares:
+      return pos.extended_board().GetControlledSquares(~stm);
+
+    case kDefendedSquares:
+      return pos.extended_board().GetControlledSquares(stm);
+
+    // 当たりをかけている、最も価値の高い敵の駒
+    case kMostValuableVictim:
+      return find_most_valuable_pieces(Get(kDefendedSquares, pos) & opp_pieces);
+
+    // ピンしている相手の駒
+    case kOpponentPinnedPieces: {
+      // 1. ピンしている味方の駒の候補を求める
+      Bitboard pinners;
+      pinners |= max_attacks_bb(kBlackRook, opp_ksq) & pos.pieces(kRook, kDragon);
+      pinners |= max_attacks_bb(kBlackBishop, opp_ksq) & pos.pieces(kBishop, kHorse);
+      pinners |= max_attacks_bb(Piece(stm, kLance), opp_ksq) & pos.pieces(kLance);
+      pinners = (pinners & own_pieces).andnot(neighborhood8_bb(opp_ksq));
+
+      // 2. ピンされている相手の駒を求める
+      Bitboard opponent_pinned_pieces;
+      pinners.ForEach([&](Square pinner_sq) {
+        Bitboard obstructing_pieces = pos.pieces() & between_bb(opp_ksq, pinner_sq);
+        if (obstructing_pieces.count() == 1) {
+          opponent_pinned_pieces |= (obstructing_pieces & opp_pieces);
+        }
+      });
+      return opponent_pinned_pieces;
+    }
 
-  // 当たりになっている駒で、最も価値の高い味方の駒
-  most_valuable_threatened_piece = find_most_valuable_pieces(threatened_pieces);
+    // 当たりになっている味方の駒
+    case kThreatenedPieces:
+      return Get(kAttackedSquares, pos) & own_pieces;
 
-  if (pos.last_move().is_real_move()) {
-    Move last_move = pos.last_move();
-    Piece attacker = last_move.piece();
-    Square attacker_sq = last_move.to();;
+    // 当たりになっている駒で、最も価値の高い味方の駒
+    case kMostValuableThreatenedPiece:
+      return find_most_valuable_pieces(Get(kThreatenedPieces, pos));
 
     // 直前に動いた駒で取られそうな、最も価値の高い味方の駒
-    Bitboard attacked_by_last_move = AttacksFrom(attacker, attacker_sq, pos.pieces());
-    pieces_attacked_by_last_move =
-        find_most_valuable_pieces(attacked_by_last_move & own_pieces);
+    case kPiecesAttackedByLastMove: {
+      if (!pos.last_move().is_real_move()) {
+        return Bitboard();
+      }
+      Move last_move = pos.last_move();
+      Bitboard attacked_by_last_move = AttacksFrom(last_move.piece(), last_move.to(), pos.pieces());
+      return find_most_valuable_pieces(attacked_by_last_move & own_pieces);
+    }
 
     // 直前に動いた駒で取られそうな味方の駒を、合駒して守る手
-    pieces_attacked_by_last_move.ForEach([&](Square sq) {
-      intercept_attacks_by_last_move |= between_bb(attacker_sq, sq);
-    });
-  }
-
-  {
-    // 味方の利きについては、玉の利きを除くため、利き数から1を引く
-    const ExtendedBoard& ext_board = pos.extended_board();
-    EightNeighborhoods own_controls = ext_board.GetEightNeighborhoodControls(stm, own_ksq).Subtract(1);
-    EightNeighborhoods opp_controls = ext_board.GetEightNeighborhoodControls(~stm, own_ksq);
+    case kInterceptAttacksByLastMove: {
+      Bitboard intercept_attacks_by_last_move;
+      if (pos.last_move().is_real_move()) {
+        Square attacker_sq = pos.last_move().to();
+        Get(kPiecesAttackedByLastMove, pos).ForEach([&](Square sq) {
+          intercept_attacks_by_last_move |= between_bb(attacker_sq, sq);
+        });
+      }
+      return intercept_attacks_by_last_move;
+    }
 
     // 自玉の8近傍で、敵の利きがあり、かつ敵の利きが味方の利き数を上回っているマス
-    for (int i = 0; i < 8; ++i) {
-      Direction dir = static_cast<Direction>(i);
-      Square delta = Square::direction_to_delta(dir);
-      Square sq = own_ksq + delta;
-      if (sq.IsOk() && Square::distance(own_ksq, sq) <= 1) {
-        if (opp_controls.at(dir) > own_controls.at(dir)) {
-          dangerous_king_neighborhood_squares.set(sq);
+    case kDangerousKingNeighborhoodSquares: {
+      // 味方の利きについては、玉の利きを除くため、利き数から1を引く
+      const ExtendedBoard& ext_board = pos.extended_board();
+      EightNeighborhoods own_controls = ext_board.GetEightNeighborhoodControls(stm, own_ksq).Subtract(1);
+      EightNeighborhoods opp_controls = ext_board.GetEightNeighborhoodControls(~stm, own_ksq);
+      Bitboard dangerous_king_neighborhood_squares;
+      for (int i = 0; i < 8; ++i) {
+        Direction dir = static_cast<Direction>(i);
+        Square delta = Square::direction_to_delta(dir);
+        Square sq = own_ksq + delta;
+        if (sq.IsOk() && Square::distance(own_ksq, sq) <= 1) {
+          if (opp_controls.at(dir) > own_controls.at(dir)) {
+            dangerous_king_neighborhood_squares.set(sq);
+          }
         }
       }
+      return dangerous_king_neighborhood_squares;
     }
 
     // 相手が持ち駒で自玉に有効王手をかけることができるマス
-    if (pos.hand(~stm).has_any_piece_except(kKnight)) {
-      Bitboard defended = direction_bb(own_ksq, own_controls.more_than(0));
-      Bitboard drop_targets = attacked_squares.andnot(defended | pos.pieces());
-      if (neighborhood8_bb(own_ksq).test(drop_targets)) {
-        Hand h = pos.hand(~stm);
-        Bitboard checks;
-        if (h.has(kPawn  )) checks |= min_attacks_bb(Piece(stm, kPawn  ), own_ksq);
-        if (h.has(kLance )) checks |= min_attacks_bb(Piece(stm, kLance ), own_ksq);
-        if (h.has(kSilver)) checks |= min_attacks_bb(Piece(stm, kSilver), own_ksq);
-        if (h.has(kGold  )) checks |= min_attacks_bb(Piece(stm, kGold  ), own_ksq);
-        if (h.has(kBishop)) checks |= min_attacks_bb(Piece(stm, kBishop), own_ksq);
-        if (h.has(kRook  )) checks |= min_attacks_bb(Piece(stm, kRook  ), own_ksq);
-        opponent_effective_drop_checks = (drop_targets & checks);
+    case kOpponentEffectiveDropChecks: {
+      Bitboard opponent_effective_drop_checks;
+      const Bitboard& attacked_squares = Get(kAttackedSquares, pos);
+      if (pos.hand(~stm).has_any_piece_except(kKnight)) {
+        // 味方の利きについては、玉の利きを除くため、利き数から1を引く
+        const ExtendedBoard& ext_board = pos.extended_board();
+        EightNeighborhoods own_controls = ext_board.GetEightNeighborhoodControls(stm, own_ksq).Subtract(1);
+        Bitboard defended = direction_bb(own_ksq, own_controls.more_than(0));
+        Bitboard drop_targets = attacked_squares.andnot(defended | pos.pieces());
+        if (neighborhood8_bb(own_ksq).test(drop_targets)) {
+          Hand h = pos.hand(~stm);
+          Bitboard checks;
+          if (h.has(kPawn  )) checks |= min_attacks_bb(Piece(stm, kPawn  ), own_ksq);
+          if (h.has(kLance )) checks |= min_attacks_bb(Piece(stm, kLance ), own_ksq);
+          if (h.has(kSilver)) checks |= min_attacks_bb(Piece(stm, kSilver), own_ksq);
+          if (h.has(kGold  )) checks |= min_attacks_bb(Piece(stm, kGold  ), own_ksq);
+          if (h.has(kBishop)) checks |= min_attacks_bb(Piece(stm, kBishop), own_ksq);
+          if (h.has(kRook  )) checks |= min_attacks_bb(Piece(stm, kRook  ), own_ksq);
+          opponent_effective_drop_checks = (drop_targets & checks);
+        }
       }
+      if (pos.hand(~stm).has(kKnight)) {
+        Bitboard knight_checks = step_attacks_bb(Piece(stm, kKnight), own_ksq);
+        Bitboard targets = attacked_squares.andnot(Get(kDefendedSquares, pos) | pos.pieces());
+        opponent_effective_drop_checks |= (targets & knight_checks);
+      }
+      return opponent_effective_drop_checks;
     }
-    if (pos.hand(~stm).has(kKnight)) {
-      Bitboard knight_checks = step_attacks_bb(Piece(stm, kKnight), own_ksq);
-      Bitboard targets = attacked_squares.andnot(defended_squares | pos.pieces());
-      opponent_effective_drop_checks |= (targets & knight_checks);
-    }
-  }
 
-  // 敵玉の8近傍、24近傍
-  opponent_king_neighborhoods8 = neighborhood8_bb(opp_ksq);
-  opponent_king_neighborhoods24 = neighborhood24_bb(opp_ksq);
+    // 敵玉の8近傍、24近傍
+    case kOpponentKingNeighborhoods8:
+      return neighborhood8_bb(opp_ksq);
+
+    case kOpponentKingNeighborhoods24:
+      return neighborhood24_bb(opp_ksq);
 
-  // 敵玉24近傍にある敵の金・銀
-  opponent_king_neighborhood_golds = pos.golds(~stm) & opponent_king_neighborhoods24;
-  opponent_king_neighborhood_silvers = pos.pieces((~stm, kSilver)) & opponent_king_neighborhoods24;
+    // 敵玉24近傍にある敵の金・銀
+    case kOpponentKingNeighborhoodGolds:
+      return pos.golds(~stm) & Get(kOpponentKingNeighborhoods24, pos);
+
+    case kOpponentKingNeighborhoodSilvers:
+      return pos.pieces((~stm, kSilver)) & Get(kOpponentKingNeighborhoods24, pos);
+
+    default:
+      assert(0);
+      return Bitboard();
+  }
 }
@@ -20,6 +20,7 @@
 #ifndef MOVE_FEATURE_H_
 #define MOVE_FEATURE_H_
 
+#include <atomic>
 #include <vector>
 #include "common/array.h"
 #include "bitboard.h"
@@ -54,17 +55,138 @@ struct MoveFeatureList : std::vector<MoveFeatureIndex> {
   Array<float, kNumContinuousMoveFeatures> continuous_values;
 };
 
+/**
+ * 複数の指し手の特徴を、１つの連続した領域にまとめて格納するためのバッファです.
+ *
+ * 指し手ごとにMoveFeatureListを作る場合と異なり、同じバッファを使い回せば、特徴抽出の際にメモリ確保が発生しません。
+ * i番目の指し手の特徴は、indices[offsets[i]]からindices[offsets[i+1]]の手前までに格納されています。
+ */
+struct MoveFeatureBatch {
+  const MoveFeatureIndex* begin(size_t move_id) const {
+    assert(move_id < num_moves);
+    return indices.data() + offsets[move_id];
+  }
+
+  const MoveFeatureIndex* end(size_t move_id) const {
+    assert(move_id < num_moves);
+    return indices.data() + offsets[move_id + 1];
+  }
+
+  /** すべての指し手の特徴 */
+  std::vector<MoveFeatureIndex> indices;
+
+  /** 各指し手の特徴の、indices内での開始位置 */
+  Array<uint32_t, Move::kMaxLegalMoves + 1> offsets;
+
+  /** 各指し手の、連続値をとる特徴 */
+  Array<Array<float, kNumContinuousMoveFeatures>, Move::kMaxLegalMoves> continuous_values;
+
+  /** 格納されている指し手の数 */
+  size_t num_moves = 0;
+};
+
 extern const int kNumBinaryMoveFeatures;
 extern const int kNumMoveFeatures;
 
+/**
+ * 指し手の特徴を抽出する際に用いる局面の情報（ビットボード）を、初めて必要になった時点で計算して、記憶しておくクラスです.
+ *
+ * Nodeの各手数ごとに１つずつ持たせておくことで、同じ局面で実現確率の計算が繰り返された場合などに、
+ * 計算済みの情報を使い回すことができます。
+ * 局面が変わった場合には、Reset()を呼ぶか、新たに作り直す必要があります。
+ */
+class PositionInfoCache {
+ public:
+  enum Field {
+    kAttackedSquares,
+    kDefendedSquares,
+    kMostValuableVictim,
+    kOpponentPinnedPieces,
+    kThreatenedPieces,
+    kMostValuableThreatenedPiece,
+    kPiecesAttackedByLastMove,
+    kInterceptAttacksByLastMove,
+    kDangerousKingNeighborhoodSquares,
+    kOpponentEffectiveDropChecks,
+    kOpponentKingNeighborhoods8,
+    kOpponentKingNeighborhoods24,
+    kOpponentKingNeighborhoodGolds,
+    kOpponentKingNeighborhoodSilvers,
+    kNumFields
+  };
+
+  /**
+   * 記憶している情報をすべて破棄します.
+   */
+  void Reset() {
+    computed_ = 0;
+  }
+
+  /**
+   * 指定された情報を返します（まだ計算されていなければ、ここで計算します）.
+   * @param field 取得したい情報の種類
+   * @param pos   情報を計算する局面（前回のReset()以降、同じ局面でなければなりません）
+   */
+  const Bitboard& Get(Field field, const Position& pos) const {
+#if defined(POSITION_INFO_STATS)
+    num_lookups_[field].fetch_add(1, std::memory_order_relaxed);
+#endif
+    if (!(computed_ & (1u << field))) {
+      values_[field] = Compute(field, pos);
+      computed_ |= (1u << field);
+#if defined(POSITION_INFO_STATS)
+      num_computations_[field].fetch_add(1, std::memory_order_relaxed);
+#endif
+    }
+    return values_[field];
+  }
+
+#if defined(POSITION_INFO_STATS)
+  /**
+   * 各情報の参照回数と計算回数（全スレッドの合計）を、標準出力に表示します（開発用. --benchの最後に表示されます）.
+   */
+  static void PrintStats();
+
+  /**
+   * 参照回数と計算回数をゼロクリアします.
+   */
+  static void ClearStats();
+#endif
+
+ private:
+  Bitboard Compute(Field field, const Position& pos) const;
+
+#if defined(POSITION_INFO_STATS)
+  static std::atomic<uint64_t> num_lookups_[kNumFields];
+  static std::atomic<uint64_t> num_computations_[kNumFields];
+#endif
+
+  /** 計算済みの情報を表すビットフラグ */
+  mutable uint32_t computed_ = 0;
+
+  /** 計算済みの情報 */
+  mutable Array<Bitboard, kNumFields> values_;
+};
+
 /**
  * 指し手の特徴を抽出する際に用いる、局面の情報です.
+ * 局面のビットボード情報は、PositionInfoCacheにより、初めて参照された時点で計算されます。
  */
 struct PositionInfo {
   PositionInfo(const Position& pos, const HistoryStats& history_stats,
                const GainsStats& gains_stats, const HistoryStats* cmh,
                const HistoryStats* fmh);
 
+  /**
+   * 外部（Nodeなど）が持っているPositionInfoCacheを利用して、初期化を行います.
+   */
+  PositionInfo(const Position& pos, const PositionInfoCache& cache,
+               const HistoryStats& history_stats, const GainsStats& gains_stats,
+               const HistoryStats* cmh, const HistoryStats* fmh);
+
+  PositionInfo(const PositionInfo&) = delete;
+  PositionInfo& operator=(const PositionInfo&) = delete;
+
   /** history値の統計 */
   const HistoryStats& history;
 
@@ -78,46 +200,86 @@ struct PositionInfo {
   const HistoryStats* followupmoves_history;
 
   /** 敵の利きが付いているマス */
-  Bitboard attacked_squares;
+  const Bitboard& attacked_squares() const {
+    return Get(PositionInfoCache::kAttackedSquares);
+  }
 
   /** 味方の利きが付いているマス */
-  Bitboard defended_squares;
+  const Bitboard& defended_squares() const {
+    return Get(PositionInfoCache::kDefendedSquares);
+  }
 
   /** 当たりをかけている、最も価値の高い敵の駒 */
-  Bitboard most_valuable_victim;
+  const Bitboard& most_valuable_victim() const {
+    return Get(PositionInfoCache::kMostValuableVictim);
+  }
 
   /** ピンしている相手の駒 */
-  Bitboard opponent_pinned_pieces;
+  const Bitboard& opponent_pinned_pieces() const {
+    return Get(PositionInfoCache::kOpponentPinnedPieces);
+  }
 
   /** 当たりになっている味方の駒 */
-  Bitboard threatened_pieces;
+  const Bitboard& threatened_pieces() const {
+    return Get(PositionInfoCache::kThreatenedPieces);
+  }
 
   /** 当たりになっている駒で、最も価値の高い味方の駒 */
-  Bitboard most_valuable_threatened_piece;
+  const Bitboard& most_valuable_threatened_piece() const {
+    return Get(PositionInfoCache::kMostValuableThreatenedPiece);
+  }
 
   /** 直前に動いた駒で取られそうな、最も価値の高い味方の駒 */
-  Bitboard pieces_attacked_by_last_move;
+  const Bitboard& pieces_attacked_by_last_move() const {
+    return Get(PositionInfoCache::kPiecesAttackedByLastMove);
+  }
 
   /** 直前に動いた駒で取られそうな味方の駒を、合駒して守る手 */
-  Bitboard intercept_attacks_by_last_move;
+  const Bitboard& intercept_attacks_by_last_move() const {
+    return Get(PositionInfoCache::kInterceptAttacksByLastMove);
+  }
 
   /** 自玉の8近傍で、敵の利きがあり、かつ敵の利きが味方の利き数を上回っているマス */
-  Bitboard dangerous_king_neighborhood_squares;
+  const Bitboard& dangerous_king_neighborhood_squares() const {
+    return Get(PositionInfoCache::kDangerousKingNeighborhoodSquares);
+  }
 
   /** 相手が持ち駒で自玉に有効王手をかけることができるマス */
-  Bitboard opponent_effective_drop_checks;
+  const Bitboard& opponent_effective_drop_checks() const {
+    return Get(PositionInfoCache::kOpponentEffectiveDropChecks);
+  }
 
   /** 敵玉の8近傍のマス */
-  Bitboard opponent_king_neighborhoods8;
+  const Bitboard& opponent_king_neighborhoods8() const {
+    return Get(PositionInfoCache::kOpponentKingNeighborhoods8);
+  }
 
   /** 敵玉の24近傍のマス */
-  Bitboard opponent_king_neighborhoods24;
+  const Bitboard& opponent_king_neighborhoods24() const {
+    return Get(PositionInfoCache::kOpponentKingNeighborhoods24);
+  }
 
   /** 敵玉24近傍にある敵の金 */
-  Bitboard opponent_king_neighborhood_golds;
+  const Bitboard& opponent_king_neighborhood_golds() const {
+    return Get(PositionInfoCache::kOpponentKingNeighborhoodGolds);
+  }
 
   /** 敵玉24近傍にある敵の銀 */
-  Bitboard opponent_king_neighborhood_silvers;
+  const Bitboard& opponent_king_neighborhood_silvers() const {
+    return Get(PositionInfoCache::kOpponentKingNeighborhoodSilvers);
+  }
+
+ private:
+  const Bitboard& Get(PositionInfoCache::Field field) const {
+    return cache_.Get(field, pos_);
+  }
+
+  const Position& pos_;
+
+  /** 外部のキャッシュが与えられなかった場合に用いるキャッシュ */
+  PositionInfoCache own_cache_;
+
+  const PositionInfoCache& cache_;
 };
 
 /**
@@ -143,6 +305,25 @@ struct PositionInfo {
 MoveFeatureList ExtractMoveFeatures(const Move move, const Position& pos,
                                     const PositionInfo& pos_info);
 
+/**
+ * 指し手の特徴を抽出します（SEE値を、Swap::EvaluateMoves()等で計算済みの場合）.
+ * @param see_score 指し手のSEE値（Swap::Evaluate(move, pos)の値）
+ */
+MoveFeatureList ExtractMoveFeatures(const Move move, const Position& pos,
+                                    const PositionInfo& pos_info,
+                                    Score see_score);
+
+/**
+ * 与えられたすべての指し手について、特徴をまとめて抽出します.
+ * @param begin      指し手のリストの先頭
+ * @param end        指し手のリストの末尾
+ * @param see_scores 各指し手のSEE値（Swap::EvaluateMoves()の結果）
+ * @param batch      抽出した特徴を書き込む場所（以前の内容は消去されます）
+ */
+void ExtractMoveFeatures(const Position& pos, const PositionInfo& pos_info,
+                         const ExtMove* begin, const ExtMove* end,
+                         const Score* see_scores, MoveFeatureBatch* batch);
+
 /**
  * 探索中に動的に値が変わる指し手の特徴（ヒストリー値など）を抽出します。
  */
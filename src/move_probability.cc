@@ -19,12 +19,21 @@
 
 #include "move_probability.h"
 
+#include <algorithm>
+#include <cmath>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
 #include <fstream>
+#include <mutex>
+#include <queue>
+#include <string>
 #include <thread>
 #include <omp.h>
 #include "common/math.h"
 #include "common/pack.h"
 #include "common/progress_timer.h"
+#include "common/simple_timer.h"
 #include "gamedb.h"
 #include "movegen.h"
 #include "move_feature.h"
@@ -36,9 +45,14 @@
 namespace {
 
 // 学習の基本設定
-constexpr int kNumIterations  = 256;   // パラメタ更新の反復回数
+constexpr int kNumIterations  = 256;   // 教師データ全体を用いた学習の反復回数
 constexpr int kNumTeacherData = 30000;  // 学習に利用する対局数
 constexpr int kNumTestData    = 1000;  // 交差検定で用いるサンプル数
+constexpr int kMiniBatchSize  = 65536; // １回のパラメタ更新に用いる局面数
+
+// 指し手の特徴を保存するファイル（シャード）の設定
+constexpr size_t kNumPrefetchedBlocks = 4; // 学習中に先読みしておくミニバッチの数
+constexpr size_t kShardBufferSize = 1 << 20; // ファイルへ書き出す前にバッファリングするバイト数
 
 // 損失関数のペナルティに関する設定
 constexpr float kL1Penalty = 0.0f;    // L1正則化係数
@@ -147,16 +161,130 @@ std::valarray<double> ComputeMoveProbabilities(const PositionSample& sample) {
   return softmax(move_scores);
 }
 
+/**
+ * 指数関数の近似値を、std::exp()よりも高速に計算します（相対誤差は1e-6程度）.
+ * 2^x = 2^n * 2^f（nは整数、|f| <= 0.5）と分解し、2^fをテイラー展開で近似しています。
+ * 分岐を含まないので、ループ内で用いるとコンパイラによるベクトル化が期待できます。
+ */
+inline float FastExp(float x) {
+  const float t = std::max(x, -87.0f) * 1.44269504f; // log2(e)
+  const float n = std::floor(t + 0.5f);
+  const float f = t - n;
+  float p = 1.54035304e-4f;
+  p = p * f + 1.33335581e-3f;
+  p = p * f + 9.61812911e-3f;
+  p = p * f + 5.55041087e-2f;
+  p = p * f + 2.40226507e-1f;
+  p = p * f + 6.93147181e-1f;
+  p = p * f + 1.0f;
+  const int32_t bits = (static_cast<int32_t>(n) + 127) << 23;
+  float scale;
+  std::memcpy(&scale, &bits, sizeof(scale));
+  return p * scale;
+}
+
+/**
+ * ソフトマックス関数を、float型のままで計算します.
+ */
+void ComputeSoftmax(const float* const x, size_t size, float* const y) {
+  const float max_x = *std::max_element(x, x + size);
+  float sum = 0.0f;
+  for (size_t i = 0; i < size; ++i) {
+    y[i] = FastExp(x[i] - max_x);
+    sum += y[i];
+  }
+  const float inverse_sum = 1.0f / sum;
+  for (size_t i = 0; i < size; ++i) {
+    y[i] *= inverse_sum;
+  }
+}
+
+/**
+ * 静的な指し手の特徴から、各指し手の得点を求めます.
+ * 特徴はMoveFeatureBatchに連続して格納されているので、重みの合計は１本のループで計算できます。
+ */
+void ComputeStaticMoveScores(const MoveFeatureBatch& batch,
+                             PackedWeight progress_coefficient,
+                             float* const static_move_scores) {
+  const PackedWeight see_weight = g_weights[kNumBinaryMoveFeatures + kSeeValue];
+  const PackedWeight global_see_weight = g_weights[kNumBinaryMoveFeatures + kGlobalSeeValue];
+
+  for (size_t move_id = 0; move_id < batch.num_moves; ++move_id) {
+    const MoveFeatureIndex* it = batch.begin(move_id);
+    const MoveFeatureIndex* const end = batch.end(move_id);
+
+    // 加算の依存関係を断ち切るため、２つに分けて重みを合計する
+    PackedWeight sum0(0.0f), sum1(0.0f);
+    for (; it + 1 < end; it += 2) {
+      sum0 += g_weights[it[0]];
+      sum1 += g_weights[it[1]];
+    }
+    if (it != end) {
+      sum0 += g_weights[*it];
+    }
+
+    // 連続値を取る特徴の重みも追加
+    const Array<float, kNumContinuousMoveFeatures>& values = batch.continuous_values[move_id];
+    sum0 += see_weight * values[kSeeValue];
+    sum1 += global_see_weight * values[kGlobalSeeValue];
+
+    // 進行度に応じて内分を取る
+    static_move_scores[move_id] = HorizontalAdd((sum0 + sum1) * progress_coefficient);
+  }
+}
+
+/**
+ * 静的な得点に、探索中に動的に値が変化する特徴（ヒストリー値など）の得点を加えて、確率を求めます.
+ */
+void ComputeDynamicProbabilities(const ExtMove* const begin, size_t num_moves,
+                                 const HistoryStats& history, const GainsStats& gains,
+                                 const HistoryStats* countermoves_history,
+                                 const HistoryStats* followupmoves_history,
+                                 PackedWeight progress_coefficient,
+                                 const float* const static_move_scores,
+                                 float* const probabilities) {
+  // 動的な特徴の重みは、あらかじめ進行度に応じて内分しておく
+  Array<float, kNumContinuousMoveFeatures> dynamic_weights;
+  for (size_t i = kHistoryValue; i <= kEvaluationGain; ++i) {
+    dynamic_weights[i] = HorizontalAdd(g_weights[kNumBinaryMoveFeatures + i] * progress_coefficient);
+  }
+
+  Array<float, Move::kMaxLegalMoves> move_scores;
+  for (size_t move_id = 0; move_id < num_moves; ++move_id) {
+    const Move move = begin[move_id].move;
+    float dynamic_score = 0.0f;
+
+    // 静かな手以外は、動的な特徴の値がすべて0になる
+    if (move.is_quiet()) {
+      Array<float, kNumContinuousMoveFeatures> continuous_features =
+          ExtractDynamicMoveFeatures(move, history, gains, countermoves_history,
+                                     followupmoves_history);
+      for (size_t i = kHistoryValue; i <= kEvaluationGain; ++i) {
+        dynamic_score += dynamic_weights[i] * continuous_features[i];
+      }
+    }
+
+    // 静的な特徴の得点と、動的な特徴の得点を合計する
+    move_scores[move_id] = static_move_scores[move_id] + dynamic_score;
+  }
+
+  // ソフトマックス関数を適用して、それぞれの指し手の確率を求める
+  ComputeSoftmax(move_scores.begin(), num_moves, probabilities);
+}
+
 #if !defined(MINIMUM)
 
-void ExtractGamesFromDatabase(std::vector<Game>* teacher_data,
+/**
+ * 棋譜DBから、テストデータと教師データを読み込みます.
+ * @return 棋譜DBが壊れていて、読み込みに失敗した場合は、false
+ */
+bool ExtractGamesFromDatabase(std::vector<Game>* teacher_data,
                               std::vector<Game>* test_data) {
   assert(teacher_data != nullptr);
   assert(test_data != nullptr);
 
   // 1. データベースファイルを開く
-  std::ifstream game_db_file(GameDatabase::kDefaultDatabaseFile);
-  GameDatabase game_db(game_db_file);
+  GameDatabase game_db;
 
   // 2. テストデータの読み込み
   // （まずテストデータから読み込むことで、教師データの数に関わらずテストデータを統一することができる）
@@ -165,6 +293,8 @@ void ExtractGamesFromDatabase(std::vector<Game>* teacher_data,
     if (   game_db.ReadOneGame(&game)
         && game.moves.size() < 256) {
       test_data->push_back(game);
+    } else if (game_db.failed()) {
+      return false;
     }
   }
 
@@ -174,25 +304,337 @@ void ExtractGamesFromDatabase(std::vector<Game>* teacher_data,
     if (   game_db.ReadOneGame(&game)
         && game.moves.size() < 256) {
       teacher_data->push_back(game);
+    } else if (game_db.failed()) {
+      return false;
     }
   }
+
+  return !game_db.failed();
 }
 
-void ComputeMoveFeatures(const std::vector<Game>& games,
-                         std::vector<PositionSample>* position_samples) {
-  assert(position_samples != nullptr);
+/**
+ * 指し手の特徴をファイルに保存する際の、１局面分のデータを表すブロックです.
+ *
+ * ファイル上では、各局面のデータは次の形式で保存されています。
+ *   - uint32_t: 以降のデータのバイト数
+ *   - 可変長整数: 合法手の数（先頭が棋譜の手）
+ *   - uint8_t: 王手の有無などのフラグ
+ *   - uint32_t: 棋譜の手
+ *   - 可変長整数: 棋譜の手のSEE値
+ *   - float: 進行度
+ *   - 各指し手ごとに、特徴の数（可変長整数）、直前の特徴のIDとの差分（可変長整数）、
+ *     連続値をとる特徴のうち0でないもののビットマスク（uint8_t）と、その値（float）
+ * 特徴のIDは、抽出された順番のまま差分をとるので、復元した際の特徴の順番も変わりません。
+ */
+struct SampleBlock {
+  size_t num_samples() const {
+    return offsets.empty() ? 0 : offsets.size() - 1;
+  }
+
+  void clear() {
+    data.clear();
+    offsets.assign(1, 0);
+  }
+
+  /** 局面のデータ（先頭のバイト数は除く） */
+  std::vector<char> data;
+
+  /** i番目の局面のデータは、data[offsets[i]]からdata[offsets[i+1]]の手前まで */
+  std::vector<size_t> offsets;
+};
+
+static_assert(kNumContinuousMoveFeatures <= 8,
+              "The mask of continuous values must fit in uint8_t.");
+
+inline void WriteVarint(uint32_t value, std::string* const out) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<char>((value & 0x7f) | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<char>(value));
+}
+
+inline uint32_t ReadVarint(const char** const p) {
+  uint32_t value = 0;
+  for (int shift = 0; ; shift += 7) {
+    uint8_t byte = static_cast<uint8_t>(*(*p)++);
+    value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return value;
+    }
+  }
+}
+
+inline uint32_t ZigZagEncode(int32_t value) {
+  return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+}
+
+inline int32_t ZigZagDecode(uint32_t value) {
+  return static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1);
+}
+
+template<typename T>
+inline void WriteRaw(T value, std::string* const out) {
+  out->append(reinterpret_cast<const char*>(&value), sizeof(T));
+}
+
+template<typename T>
+inline T ReadRaw(const char** const p) {
+  T value;
+  std::memcpy(&value, *p, sizeof(T));
+  *p += sizeof(T);
+  return value;
+}
+
+/**
+ * 局面のデータを、SampleBlockのコメントに記載した形式に変換して、outの末尾に追加します.
+ */
+void EncodePositionSample(const PositionSample& sample, std::string* const out) {
+  // 後でバイト数を書き込むために、場所だけ確保しておく
+  const size_t header_position = out->size();
+  WriteRaw<uint32_t>(0, out);
+
+  WriteVarint(sample.features.size(), out);
+  WriteRaw<uint8_t>(sample.in_check | (sample.gives_check << 1), out);
+  WriteRaw<uint32_t>(sample.teacher_move.ToUint32(), out);
+  WriteVarint(ZigZagEncode(sample.see_value_of_teacher_move), out);
+  WriteRaw<float>(sample.progress, out);
+
+  for (const MoveFeatureList& feature_list : sample.features) {
+    WriteVarint(feature_list.size(), out);
+    MoveFeatureIndex previous = 0;
+    for (MoveFeatureIndex feature_index : feature_list) {
+      WriteVarint(ZigZagEncode(feature_index - previous), out);
+      previous = feature_index;
+    }
+    uint8_t mask = 0;
+    for (size_t i = 0; i < feature_list.continuous_values.size(); ++i) {
+      mask |= (feature_list.continuous_values[i] != 0.0f) << i;
+    }
+    WriteRaw<uint8_t>(mask, out);
+    for (size_t i = 0; i < feature_list.continuous_values.size(); ++i) {
+      if (mask & (1 << i)) {
+        WriteRaw<float>(feature_list.continuous_values[i], out);
+      }
+    }
+  }
+
+  const uint32_t size = out->size() - header_position - sizeof(uint32_t);
+  std::memcpy(&(*out)[header_position], &size, sizeof(size));
+}
+
+/**
+ * EncodePositionSample()で変換されたデータを、元に戻します.
+ * sampleが以前に確保したメモリは再利用されるので、同じオブジェクトを使い回せばメモリの確保はほとんど発生しません。
+ */
+void DecodePositionSample(const char* p, PositionSample* const sample) {
+  const size_t num_moves = ReadVarint(&p);
+  const uint8_t flags = ReadRaw<uint8_t>(&p);
+  sample->in_check = flags & 1;
+  sample->gives_check = flags & 2;
+  sample->teacher_move = Move::FromUint32(ReadRaw<uint32_t>(&p));
+  sample->see_value_of_teacher_move = static_cast<Score>(ZigZagDecode(ReadVarint(&p)));
+  sample->progress = ReadRaw<float>(&p);
+
+  sample->features.resize(num_moves);
+  for (MoveFeatureList& feature_list : sample->features) {
+    feature_list.resize(ReadVarint(&p));
+    MoveFeatureIndex previous = 0;
+    for (MoveFeatureIndex& feature_index : feature_list) {
+      feature_index = previous + ZigZagDecode(ReadVarint(&p));
+      previous = feature_index;
+    }
+    const uint8_t mask = ReadRaw<uint8_t>(&p);
+    for (size_t i = 0; i < feature_list.continuous_values.size(); ++i) {
+      feature_list.continuous_values[i] = (mask & (1 << i)) ? ReadRaw<float>(&p) : 0.0f;
+    }
+  }
+}
+
+/**
+ * SampleBlockに含まれるi番目の局面を復元します.
+ * 復元先は各スレッドが１つずつ持っているので、次に同じスレッドからこの関数を呼ぶまで有効です。
+ */
+const PositionSample& GetPositionSample(const SampleBlock& block, size_t i) {
+  static thread_local PositionSample sample;
+  DecodePositionSample(block.data.data() + block.offsets[i], &sample);
+  return sample;
+}
+
+/**
+ * 指し手の特徴のファイル（シャード）を順番に読み込み、ミニバッチ単位で先読みするクラスです.
+ *
+ * ファイルの読み込みは専用のスレッドで行い、先読みするミニバッチの数を制限しているので、
+ * 全シャードの合計がメモリに収まらない場合でも、一定のメモリで学習を行うことができます。
+ * 局面データの復元（DecodePositionSample()）は、学習を行う側のスレッドで並列に行います。
+ */
+class SampleShardStream {
+ public:
+  SampleShardStream(const std::vector<std::string>& file_names,
+                    size_t samples_per_block)
+      : file_names_(file_names),
+        samples_per_block_(samples_per_block),
+        blocks_(kNumPrefetchedBlocks + 1) {
+    for (SampleBlock& block : blocks_) {
+      free_blocks_.push(&block);
+    }
+    thread_ = std::thread([this](){ ReadLoop(); });
+  }
+
+  ~SampleShardStream() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stop_ = true;
+    }
+    condition_.notify_all();
+    thread_.join();
+  }
+
+  /**
+   * 次のミニバッチを返します（読み込みが終わっていない場合は、読み込みが終わるまで待ちます）.
+   * 前回返したミニバッチは、この関数を呼んだ時点で無効になります。
+   * @return すべてのファイルを読み終えた場合は、nullptr
+   */
+  const SampleBlock* Next() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (current_block_ != nullptr) {
+      free_blocks_.push(current_block_);
+      current_block_ = nullptr;
+      condition_.notify_all();
+    }
+    condition_.wait(lock, [this](){ return !filled_blocks_.empty() || finished_; });
+    if (filled_blocks_.empty()) {
+      return nullptr;
+    }
+    current_block_ = filled_blocks_.front();
+    filled_blocks_.pop();
+    return current_block_;
+  }
+
+ private:
+  void ReadLoop() {
+    std::vector<std::string>::const_iterator file_name = file_names_.begin();
+    std::FILE* file = nullptr;
+
+    for (;;) {
+      // 1. 空いているミニバッチを取得する
+      SampleBlock* block;
+      {
+        std::unique_lock<std::mutex> lock(mutex_);
+        condition_.wait(lock, [this](){ return !free_blocks_.empty() || stop_; });
+        if (stop_) {
+          break;
+        }
+        block = free_blocks_.front();
+        free_blocks_.pop();
+      }
+
+      // 2. ミニバッチが一杯になるまで局面を読み込む（複数のファイルにまたがっても構わない）
+      block->clear();
+      while (block->num_samples() < samples_per_block_) {
+        if (file == nullptr) {
+          if (file_name == file_names_.end()) {
+            break;
+          }
+          file = std::fopen((file_name++)->c_str(), "rb");
+          if (file == nullptr) {
+            std::printf("info string Failed to open %s.\n", (file_name - 1)->c_str());
+            continue;
+          }
+        }
+        uint32_t size;
+        if (std::fread(&size, sizeof(size), 1, file) != 1) {
+          std::fclose(file);
+          file = nullptr;
+          continue;
+        }
+        const size_t offset = block->data.size();
+        block->data.resize(offset + size);
+        if (std::fread(&block->data[offset], 1, size, file) != size) {
+          std::printf("info string A shard file is truncated.\n");
+          block->data.resize(offset);
+          std::fclose(file);
+          file = nullptr;
+          continue;
+        }
+        block->offsets.push_back(block->data.size());
+      }
+
+      // 3. 読み込んだミニバッチを、学習を行う側に渡す
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (block->num_samples() > 0) {
+        filled_blocks_.push(block);
+      } else {
+        free_blocks_.push(block);
+        finished_ = true;
+      }
+      condition_.notify_all();
+      if (finished_) {
+        break;
+      }
+    }
+
+    if (file != nullptr) {
+      std::fclose(file);
+    }
+  }
 
+  const std::vector<std::string> file_names_;
+  const size_t samples_per_block_;
+  std::vector<SampleBlock> blocks_;
+  std::queue<SampleBlock*> free_blocks_;
+  std::queue<SampleBlock*> filled_blocks_;
+  SampleBlock* current_block_ = nullptr;
+  bool finished_ = false;
+  bool stop_ = false;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+  std::thread thread_;
+};
+
+/**
+ * 棋譜の各局面について指し手の特徴を求め、ファイル（シャード）に保存します.
+ *
+ * 各スレッドが別々のファイルに書き込むので、排他制御は不要です。
+ * @param games       棋譜
+ * @param file_prefix 保存するファイル名の先頭部分（"_000.bin"などのスレッド番号が続きます）
+ * @return 保存したファイル名のリスト
+ */
+std::vector<std::string> ComputeMoveFeatures(const std::vector<Game>& games,
+                                             const std::string& file_prefix) {
   const Position kStartPosition = Position::CreateStartPosition();
+  const int num_threads = omp_get_max_threads();
+
+  // 1. スレッドごとに、書き込み用のファイルを準備する
+  std::vector<std::string> file_names;
+  std::vector<std::FILE*> files;
+  std::vector<std::string> buffers(num_threads);
+  for (int i = 0; i < num_threads; ++i) {
+    char file_name[256];
+    std::snprintf(file_name, sizeof(file_name), "%s_%03d.bin", file_prefix.c_str(), i);
+    file_names.push_back(file_name);
+    files.push_back(std::fopen(file_name, "wb"));
+    if (files.back() == nullptr) {
+      std::printf("info string Failed to open %s.\n", file_name);
+      std::exit(EXIT_FAILURE);
+    }
+  }
 
   ProgressTimer timer(games.size());
+  uint64_t num_samples = 0, num_bytes = 0;
 
-#pragma omp parallel for schedule(dynamic)
+  // 2. 各局面の指し手の特徴を求めて、ファイルに書き出す
+#pragma omp parallel for reduction(+:num_samples, num_bytes) schedule(dynamic)
   for (size_t game_id = 0; game_id < games.size(); ++game_id) {
     const Game& game = games.at(game_id);
     SharedData shared_data;
     shared_data.hash_table.SetSize(16);
     Node node(kStartPosition);
     Search search(shared_data);
+    PositionSample sample;
+    MoveFeatureBatch batch;
+    std::string& buffer = buffers.at(omp_get_thread_num());
+    std::FILE* file = files.at(omp_get_thread_num());
     timer.IncrementCounter();
     timer.PrintProgress("");
 
@@ -274,7 +716,6 @@ void ComputeMoveFeatures(const std::vector<Game>& games,
 #endif
 
       // すべての合法手について、指し手の特徴を求める
-      PositionSample sample;
       PositionInfo pos_info(node, search.history(), search.gains(),
                             countermoves_history, followupmoves_history);
       sample.in_check = node.in_check();
@@ -282,16 +723,22 @@ void ComputeMoveFeatures(const std::vector<Game>& games,
       sample.teacher_move = teacher_move;
       sample.see_value_of_teacher_move = Swap::Evaluate(teacher_move, node);
       sample.progress = Progress::EstimateProgress(node);
-      for (ExtMove em : legal_moves) {
-        sample.features.push_back(ExtractMoveFeatures(em.move, node, pos_info));
-        sample.features.back().shrink_to_fit();
+      Array<Score, Move::kMaxLegalMoves> see_scores;
+      Swap::EvaluateMoves(node, legal_moves.begin(), legal_moves.end(), see_scores.begin());
+      ExtractMoveFeatures(node, pos_info, legal_moves.begin(), legal_moves.end(),
+                          see_scores.begin(), &batch);
+      sample.features.resize(batch.num_moves);
+      for (size_t i = 0; i < batch.num_moves; ++i) {
+        sample.features[i].assign(batch.begin(i), batch.end(i));
+        sample.features[i].continuous_values = batch.continuous_values[i];
       }
 
-      // 指し手の特徴を保存する（position_samplesは共有変数なので、排他制御を行う）
-#pragma omp critical
-      {
-        position_samples->push_back(sample);
-        position_samples->back().features.shrink_to_fit();
+      // 指し手の特徴を、このスレッド専用のファイルに書き出す
+      EncodePositionSample(sample, &buffer);
+      num_samples += 1;
+      if (buffer.size() >= kShardBufferSize) {
+        num_bytes += std::fwrite(buffer.data(), 1, buffer.size(), file);
+        buffer.clear();
       }
 
       // 棋譜の手にそって進める
@@ -299,9 +746,21 @@ void ComputeMoveFeatures(const std::vector<Game>& games,
       node.Evaluate(); // 評価関数の差分計算を行うために必要
     }
   }
+
+  // 3. バッファに残っているデータを書き出して、ファイルを閉じる
+  for (int i = 0; i < num_threads; ++i) {
+    num_bytes += std::fwrite(buffers[i].data(), 1, buffers[i].size(), files[i]);
+    std::fclose(files[i]);
+  }
+
+  std::printf("\nsaved %llu positions to %d shards (%.1f MB).\n",
+              static_cast<unsigned long long>(num_samples), num_threads,
+              num_bytes / (1024.0 * 1024.0));
+
+  return file_names;
 }
 
-void ComputeGradients(const std::vector<PositionSample>& position_samples,
+void ComputeGradients(const SampleBlock& block,
                       std::vector<Weights>& thread_local_gradients,
                       Weights* const gradients,
                       LearningStats* const stats) {
@@ -313,8 +772,8 @@ void ComputeGradients(const std::vector<PositionSample>& position_samples,
   int num_moves = 0;
 
   // 1. 各局面の微分値を一つ一つ計算する（複数スレッドで分散処理を行う）
-#pragma omp parallel for reduction(+:loss, prediction, num_moves) schedule(dynamic)
-  for (size_t pos_id = 0; pos_id < position_samples.size(); ++pos_id) {
+#pragma omp parallel for reduction(+:loss, prediction, num_moves) schedule(dynamic, 64)
+  for (size_t pos_id = 0; pos_id < block.num_samples(); ++pos_id) {
     // 勾配をアップデートするための関数を準備する
     auto update = [&](PackedWeight delta, const MoveFeatureList& feature_list) {
       Weights& g = thread_local_gradients.at(omp_get_thread_num());
@@ -330,7 +789,7 @@ void ComputeGradients(const std::vector<PositionSample>& position_samples,
     };
 
     // 各指し手の確率を求める
-    const PositionSample& sample = position_samples.at(pos_id);
+    const PositionSample& sample = GetPositionSample(block, pos_id);
     std::valarray<double> probabilities = ComputeMoveProbabilities(sample);
 
     // 勾配のアップデートを行う
@@ -355,11 +814,11 @@ void ComputeGradients(const std::vector<PositionSample>& position_samples,
     }
   }
 
-  // 統計情報の出力
-  stats->logistic_loss = loss;
-  stats->num_moves_learned = num_moves;
-  stats->num_teacher_positions = position_samples.size();
-  stats->prediction = prediction / static_cast<double>(position_samples.size());
+  // 統計情報の出力（ミニバッチごとに加算していき、predictionは最後に局面数で割る）
+  stats->logistic_loss += loss;
+  stats->num_moves_learned += num_moves;
+  stats->num_teacher_positions += block.num_samples();
+  stats->prediction += prediction;
 }
 
 void UpdateWeights(const Weights& gradients, Weights& accumulated_gradients,
@@ -410,15 +869,14 @@ void UpdateWeights(const Weights& gradients, Weights& accumulated_gradients,
   stats->tikhonov_loss = tikhonov;
 }
 
-void ComputeAccuracy(const std::vector<PositionSample>& position_samples,
-                     LearningStats* const stats) {
+void ComputeAccuracy(const SampleBlock& block, LearningStats* const stats) {
   assert(stats != nullptr);
 
   int num_moves = 0;
 
-#pragma omp parallel for reduction(+:num_moves) schedule(dynamic)
-  for (size_t pos_id = 0; pos_id < position_samples.size(); ++pos_id) {
-    const PositionSample& sample = position_samples.at(pos_id);
+#pragma omp parallel for reduction(+:num_moves) schedule(dynamic, 64)
+  for (size_t pos_id = 0; pos_id < block.num_samples(); ++pos_id) {
+    const PositionSample& sample = GetPositionSample(block, pos_id);
     std::valarray<double> probabilities = ComputeMoveProbabilities(sample);
     double point = probabilities[0] == probabilities.max()
                  ? 1.0 / std::count(&probabilities[0], &probabilities[probabilities.size()-1], probabilities[0])
@@ -480,8 +938,8 @@ void ComputeAccuracy(const std::vector<PositionSample>& position_samples,
     }
   }
 
-  stats->num_moves_tested = num_moves;
-  stats->num_test_positions = position_samples.size();
+  stats->num_moves_tested += num_moves;
+  stats->num_test_positions += block.num_samples();
 }
 
 void PrintMoveProbabilities(Position pos) {
@@ -496,8 +954,10 @@ void PrintMoveProbabilities(Position pos) {
   PositionSample sample;
   PositionInfo pos_info(pos, history, gains, &history, &history);
   sample.progress = Progress::EstimateProgress(pos);
-  for (ExtMove em : legal_moves) {
-    sample.features.push_back(ExtractMoveFeatures(em.move, pos, pos_info));
+  Array<Score, Move::kMaxLegalMoves> see_scores;
+  Swap::EvaluateMoves(pos, legal_moves.begin(), legal_moves.end(), see_scores.begin());
+  for (size_t i = 0; i < legal_moves.size(); ++i) {
+    sample.features.push_back(ExtractMoveFeatures(legal_moves[i].move, pos, pos_info, see_scores[i]));
   }
   std::valarray<double> probabilities = ComputeMoveProbabilities(sample);
 
@@ -536,7 +996,9 @@ void MoveProbability::Learn() {
   std::printf("start reading games.\n");
   std::vector<Game> teacher_data; // 教師データ（学習対象とする棋譜）
   std::vector<Game> test_data;    // テストデータ（教師データとは別の棋譜。一致率確認用。）
-  ExtractGamesFromDatabase(&teacher_data, &test_data);
+  if (!ExtractGamesFromDatabase(&teacher_data, &test_data)) {
+    return; // 壊れた棋譜DBから、一部の棋譜だけで学習することはしない
+  }
   std::printf("finish reading games.\n");
 
   // 変数の準備
@@ -553,12 +1015,12 @@ void MoveProbability::Learn() {
     thread_local_gradients.emplace_back(kNumMoveFeatures);
   }
 
-  // 指し手の特徴をあらかじめ求めておく
+  // 指し手の特徴をあらかじめ求めて、ファイルに保存しておく
   // （評価関数の学習とは異なり、反復中にPVが変化するといったことがないため）
-  std::vector<PositionSample> teacher_position_samples;
-  std::vector<PositionSample> test_position_samples;
-  ComputeMoveFeatures(teacher_data, &teacher_position_samples);
-  ComputeMoveFeatures(test_data, &test_position_samples);
+  std::printf("start computing move features.\n");
+  std::vector<std::string> teacher_shards = ComputeMoveFeatures(teacher_data, "probability_teacher");
+  std::vector<std::string> test_shards = ComputeMoveFeatures(test_data, "probability_test");
+  std::printf("finish computing move features.\n");
 
   LearningStats last_stats;
 
@@ -566,22 +1028,29 @@ void MoveProbability::Learn() {
     // 統計情報を保存するための変数を準備する
     LearningStats stats;
 
-    // 勾配をリセットする
+    // 保存しておいた指し手の特徴を、ミニバッチごとに読み込みながら学習する
+    SampleShardStream teacher_stream(teacher_shards, kMiniBatchSize);
+    while (const SampleBlock* block = teacher_stream.Next()) {
+      // 勾配をリセットする
 #pragma omp parallel for schedule(static)
-    for (size_t i = 0; i < thread_local_gradients.size(); ++i) {
-      thread_local_gradients.at(i) = PackedWeight(0.0f);
-    }
+      for (size_t i = 0; i < thread_local_gradients.size(); ++i) {
+        thread_local_gradients.at(i) = PackedWeight(0.0f);
+      }
 
-    // Step 1. 勾配を計算する
-    ComputeGradients(teacher_position_samples, thread_local_gradients,
-                     &gradients, &stats);
+      // Step 1. 勾配を計算する
+      ComputeGradients(*block, thread_local_gradients, &gradients, &stats);
 
-    // Step 2. 勾配を利用して、重みを更新する（Gradient Descent）
-    UpdateWeights(gradients, accumulated_gradients, accumulated_deltas,
-                  momentum, &stats);
+      // Step 2. 勾配を利用して、重みを更新する（Gradient Descent）
+      UpdateWeights(gradients, accumulated_gradients, accumulated_deltas,
+                    momentum, &stats);
+    }
+    stats.prediction /= std::max(stats.num_teacher_positions, 1);
 
     // Step 3. 学習用棋譜とは別の棋譜を利用して、一致率を調べる
-    ComputeAccuracy(test_position_samples, &stats);
+    SampleShardStream test_stream(test_shards, kMiniBatchSize);
+    while (const SampleBlock* block = test_stream.Next()) {
+      ComputeAccuracy(*block, &stats);
+    }
 
     // Step 4. 統計情報を表示する
     std::printf("%d Loss=%f L1=%f L2=%f Prediction=%f Accuracy=%f pos=%d moves=%d\n",
@@ -597,6 +1066,14 @@ void MoveProbability::Learn() {
     last_stats = stats;
   }
 
+  // すべてのイテレーションで読み終えたので、指し手の特徴を保存したシャードファイルを削除する
+  for (const std::string& shard_name : teacher_shards) {
+    std::remove(shard_name.c_str());
+  }
+  for (const std::string& shard_name : test_shards) {
+    std::remove(shard_name.c_str());
+  }
+
   // 詳細な一致率データを表示する
   auto print_accuracy = [](const char* name, const Array<AccuracyStats, 3>& s) {
     std::printf("%20s   %0.3f   %0.3f   %0.3f   %0.5f\n",
@@ -641,6 +1118,93 @@ void MoveProbability::Learn() {
   }
 }
 
+void MoveProbability::Benchmark(const int num_calls) {
+  std::printf("Start Move Probability Benchmark!\n\n");
+
+  HistoryStats history;
+  GainsStats gains;
+  history.Clear();
+  gains.Clear();
+
+  // テスト局面（初期局面と、いわゆる「指し手生成祭り」局面）
+  const Position startpos = Position::CreateStartPosition();
+  const Position festivalpos = Position::FromSfen(
+      "l6nl/5+P1gk/2np1S3/p1p4Pp/3P2Sp1/1PPb2P1P/P5GS1/R8/LN4bKL w RGgsn5p 1");
+
+  for (const Position& pos : {startpos, festivalpos}) {
+    std::printf("Position=%s\n", pos.ToSfen().c_str());
+
+    SimpleMoveList<kAllMoves, true> legal_moves(pos);
+    const size_t num_moves = legal_moves.size();
+    auto print_result = [&](const char* method, double elapsed) {
+      elapsed = std::max(elapsed, 0.001);
+      std::printf("%-9s Moves=%3zu Time=%.3fsec Speed=%.0fprobabilities/sec\n",
+                  method, num_moves, elapsed, num_calls * num_moves / elapsed);
+    };
+
+    // 1. 従来の方法
+    std::valarray<double> reference;
+    {
+      SimpleTimer timer;
+      for (int i = 0; i < num_calls; ++i) {
+        PositionSample sample;
+        PositionInfo pos_info(pos, history, gains, nullptr, nullptr);
+        sample.progress = Progress::EstimateProgress(pos);
+        Array<Score, Move::kMaxLegalMoves> see_scores;
+        Swap::EvaluateMoves(pos, legal_moves.begin(), legal_moves.end(), see_scores.begin());
+        for (size_t j = 0; j < num_moves; ++j) {
+          sample.features.push_back(ExtractMoveFeatures(legal_moves[j].move, pos, pos_info, see_scores[j]));
+        }
+        reference = ComputeMoveProbabilities(sample);
+      }
+      print_result("PerMove", timer.GetElapsedSeconds());
+    }
+
+    // 2. 全指し手の特徴をまとめて処理する方法（キャッシュなし）
+    Array<float, Move::kMaxLegalMoves> uncached;
+    {
+      MoveFeatureBatch batch;
+      SimpleTimer timer;
+      for (int i = 0; i < num_calls; ++i) {
+        const PackedWeight coefficient = GetProgressCoefficient(Progress::EstimateProgress(pos));
+        PositionInfo pos_info(pos, history, gains, nullptr, nullptr);
+        Array<Score, Move::kMaxLegalMoves> see_scores;
+        Swap::EvaluateMoves(pos, legal_moves.begin(), legal_moves.end(), see_scores.begin(),
+                            pos_info.attacked_squares());
+        ExtractMoveFeatures(pos, pos_info, legal_moves.begin(), legal_moves.end(),
+                            see_scores.begin(), &batch);
+        Array<float, Move::kMaxLegalMoves> static_move_scores;
+        ComputeStaticMoveScores(batch, coefficient, static_move_scores.begin());
+        ComputeDynamicProbabilities(legal_moves.begin(), num_moves, history, gains,
+                                    nullptr, nullptr, coefficient,
+                                    static_move_scores.begin(), uncached.begin());
+      }
+      print_result("Batch", timer.GetElapsedSeconds());
+    }
+
+    // 3. 全指し手の特徴をまとめて処理する方法（キャッシュあり）
+    Array<float, Move::kMaxLegalMoves> cached;
+    {
+      ClearCacheTable();
+      SimpleTimer timer;
+      for (int i = 0; i < num_calls; ++i) {
+        ComputeProbabilitiesWithCache(pos, history, gains, nullptr, nullptr,
+                                      legal_moves.begin(), legal_moves.end(),
+                                      cached.begin());
+      }
+      print_result("Cached", timer.GetElapsedSeconds());
+    }
+
+    // 4. 計算結果の差を表示する
+    double max_error = 0.0;
+    for (size_t j = 0; j < num_moves; ++j) {
+      max_error = std::max(max_error, std::abs(reference[j] - uncached[j]));
+      max_error = std::max(max_error, std::abs(reference[j] - cached[j]));
+    }
+    std::printf("MaxError=%.2e\n\n", max_error);
+  }
+}
+
 #endif /* !defined(MINIMUM) */
 
 ProbabilityCacheTable MoveProbability::cache_table_;
@@ -657,8 +1221,10 @@ std::unordered_map<uint32_t, float> MoveProbability::ComputeProbabilities(
   PositionSample sample;
   PositionInfo pos_info(pos, history, gains, countermoves_history, followupmoves_history);
   sample.progress = Progress::EstimateProgress(pos);
-  for (ExtMove em : legal_moves) {
-    sample.features.push_back(ExtractMoveFeatures(em.move, pos, pos_info));
+  Array<Score, Move::kMaxLegalMoves> see_scores;
+  Swap::EvaluateMoves(pos, legal_moves.begin(), legal_moves.end(), see_scores.begin());
+  for (size_t i = 0; i < legal_moves.size(); ++i) {
+    sample.features.push_back(ExtractMoveFeatures(legal_moves[i].move, pos, pos_info, see_scores[i]));
   }
 
   // 確率を計算する
@@ -673,163 +1239,148 @@ std::unordered_map<uint32_t, float> MoveProbability::ComputeProbabilities(
   return move_probabilities;
 }
 
-/**
-  * 指し手が指される確率を計算します（キャッシュ機能付き）.
-  *
-  * 一度確率を計算した局面であれば、キャッシュを用いて確率の計算が高速化されます。
-  * なお、キャッシュを用いた場合であっても、探索情報については、最新のものが反映されます。
-  */
- std::valarray<double> MoveProbability::ComputeProbabilitiesWithCache(
-     const Position& pos, const HistoryStats& history, const GainsStats& gains,
-     const HistoryStats* countermoves_history,
-     const HistoryStats* followupmoves_history) {
-
-   // 0. ソフトマックス関数の準備
-   auto softmax = [](const std::valarray<double>& x) -> std::valarray<double> {
-     std::valarray<double> temp = std::exp(x - x.max());
-     return temp / temp.sum();
-   };
-
-   // 1. 進行度に応じた係数を求める
-   const double progress = Progress::EstimateProgress(pos);
-   const PackedWeight progress_coefficient = GetProgressCoefficient(progress);
-
-   // 2. 合法手を生成する
-   SimpleMoveList<kAllMoves, true> legal_moves(pos);
-   assert(legal_moves.size() >= 1);
-
-   // 3. 静的な指し手の特徴から、指し手に点数を付ける
-   std::valarray<float> static_move_scores(legal_moves.size());
-   const Key64 cache_key = ProbabilityCacheTable::ComputeKey(pos);
-   cache_table_.Lock(cache_key);
-   const ProbabilityCacheTable::Entry* entry = cache_table_.LookUp(cache_key);
-   if (entry != nullptr) {
-     // すでに計算済みだった場合は、キャッシュから持ってくる
-     static_move_scores = entry->data;
-   } else {
-     // キャッシュになければ、ここで特徴抽出から始める必要があるので、いったんロックを外す
-     cache_table_.Unlock(cache_key);
-
-     // 局面情報を収集する
-     PositionSample sample;
-     PositionInfo pos_info(pos, history, gains, countermoves_history, followupmoves_history);
-
-     // 各指し手ごとに、静的な特徴を抽出する
-     for (size_t move_id = 0; move_id < legal_moves.size(); ++move_id) {
-       const Move move = legal_moves[move_id].move;
-
-       // 特徴を抽出する
-       MoveFeatureList features = ExtractMoveFeatures(move, pos, pos_info);
-
-       // 静的な指し手の重みを合計する
-       PackedWeight sum(0.0f);
-       for (MoveFeatureIndex feature_index : features) {
-         sum += g_weights[feature_index];
-       }
-
-       // 連続値を取る特徴の重みも追加
-       sum += g_weights[kNumBinaryMoveFeatures + kSeeValue] * features.continuous_values[kSeeValue];
-       sum += g_weights[kNumBinaryMoveFeatures + kGlobalSeeValue] * features.continuous_values[kGlobalSeeValue];
-
-       // 進行度に応じて内分を取る
-       PackedWeight static_score = sum * progress_coefficient;
-       static_move_scores[move_id] = HorizontalAdd(static_score);
-     }
+void MoveProbability::ComputeProbabilitiesWithCache(
+    const Position& pos, const HistoryStats& history, const GainsStats& gains,
+    const HistoryStats* countermoves_history,
+    const HistoryStats* followupmoves_history,
+    const ExtMove* const begin, const ExtMove* const end,
+    float* const probabilities,
+    const PositionInfoCache* const position_info_cache) {
+  const size_t num_moves = end - begin;
+  assert(num_moves >= 1);
+
+  // 1. 進行度に応じた係数を求める
+  const double progress = Progress::EstimateProgress(pos);
+  const PackedWeight progress_coefficient = GetProgressCoefficient(progress);
+
+  // 2. 静的な指し手の特徴から、指し手に点数を付ける
+  Array<float, Move::kMaxLegalMoves> static_move_scores;
+  const Key64 cache_key = ProbabilityCacheTable::ComputeKey(pos);
+  if (!cache_table_.LookUp(cache_key, num_moves, static_move_scores.begin())) {
+    // キャッシュになければ、特徴抽出から始める必要がある
+    // （特徴を格納するバッファは、メモリ確保を避けるため、スレッドごとに使い回す）
+    static thread_local MoveFeatureBatch batch;
+    PositionInfoCache local_cache;
+    PositionInfo pos_info(pos, position_info_cache ? *position_info_cache : local_cache,
+                          history, gains, countermoves_history, followupmoves_history);
+
+    // 全指し手のSEE値を、移動先のマスごとにまとめて計算する
+    // （相手の利きがないマスへの駒打ちは、局面情報を利用して、駒交換の計算を省略する）
+    Array<Score, Move::kMaxLegalMoves> see_scores;
+    Swap::EvaluateMoves(pos, begin, end, see_scores.begin(), pos_info.attacked_squares());
+
+    // 全指し手の特徴をまとめて抽出し、重みを合計する
+    ExtractMoveFeatures(pos, pos_info, begin, end, see_scores.begin(), &batch);
+    ComputeStaticMoveScores(batch, progress_coefficient, static_move_scores.begin());
+
+    // キャッシュに保存する
+    cache_table_.Save(cache_key, num_moves, static_move_scores.begin());
+  }
 
-     // キャッシュに保存する
-     cache_table_.Lock(cache_key);
-     cache_table_.Save(cache_key, static_move_scores);
-   }
-   cache_table_.Unlock(cache_key);
+  // 3. 動的な特徴の得点を加えて、ソフトマックス関数により確率を求める
+  ComputeDynamicProbabilities(begin, num_moves, history, gains,
+                              countermoves_history, followupmoves_history,
+                              progress_coefficient, static_move_scores.begin(),
+                              probabilities);
+}
 
-   // 4. 探索中に動的に値が変化する特徴（ヒストリー値など）について、得点を計算する
-   std::valarray<double> move_scores(legal_moves.size());
-   for (size_t move_id = 0; move_id < legal_moves.size(); ++move_id) {
-     const Move move = legal_moves[move_id].move;
+bool ProbabilityCacheTable::LookUp(Key64 key, size_t num_moves,
+                                   float* const data) const {
+  Bucket& bucket = table_[key & key_mask_];
 
-     // 動的な特徴を抽出する
-    Array<float, kNumContinuousMoveFeatures> continuous_features =
-        ExtractDynamicMoveFeatures(move, history, gains, countermoves_history,
-                                   followupmoves_history);
+  // 書き込み中であれば、待たずに諦める
+  const uint32_t sequence = bucket.sequence.load(std::memory_order_acquire);
+  if (sequence & 1) {
+    return false;
+  }
 
+  for (Entry& entry : bucket.entries) {
+    if (key == entry.key && num_moves == entry.num_moves) {
+      std::copy(entry.data.begin(), entry.data.begin() + num_moves, data);
 
-     // 動的な指し手の特徴に関して、重みを加算する
-     PackedWeight sum(0.0f);
-     for (size_t i = kHistoryValue; i <= kEvaluationGain; ++i) {
-       float value = continuous_features[i];
-       sum += g_weights[kNumBinaryMoveFeatures + i] * value;
-     }
+      // 読み出している間に他のスレッドが書き換えていた場合は、読み出した内容を破棄する
+      std::atomic_thread_fence(std::memory_order_acquire);
+      if (bucket.sequence.load(std::memory_order_relaxed) != sequence) {
+        return false;
+      }
 
-     // 進行度に応じて内分を取る
-     PackedWeight score = sum * progress_coefficient;
-     float dynamic_score = HorizontalAdd(score);
+      entry.age.store(age_, std::memory_order_relaxed);            // 情報の鮮度を更新
+      entry.num_lookups.fetch_add(1, std::memory_order_relaxed); // 参照数を１増やす
+      return true;
+    }
+  }
+  return false;
+}
 
-     // 静的な特徴の得点と、動的な特徴の得点を合計する
-     move_scores[move_id] = static_move_scores[move_id] + dynamic_score;
-   }
+void ProbabilityCacheTable::Save(Key64 key, size_t num_moves,
+                                 const float* const data) {
+  if (num_moves > kMaxMoves) {
+    return;
+  }
 
-   // 5. ソフトマックス関数を適用して、それぞれの指し手の確率を求める
-   return softmax(move_scores);
-}
+  // 1. カウンタを奇数にして、書き込み中であることを示す（他のスレッドが書き込み中であれば、保存を諦める）
+  Bucket& bucket = table_[key & key_mask_];
+  uint32_t sequence = bucket.sequence.load(std::memory_order_relaxed);
+  if (   (sequence & 1)
+      || !bucket.sequence.compare_exchange_strong(sequence, sequence + 1,
+                                                  std::memory_order_acq_rel)) {
+    return;
+  }
 
-const ProbabilityCacheTable::Entry* ProbabilityCacheTable::LookUp(Key64 key) const {
-   for (Entry& entry : table_[key & key_mask_]) {
-     if (key == entry.key) {
-       entry.age = age_;    // 情報の鮮度を更新
-       entry.num_lookups++; // 参照数を１増やす
-       return &entry;
-     }
-   }
-   return nullptr;
- }
+  // 2. 保存先を探す
+  Entry* save_point = bucket.entries.begin();
+  for (Entry& entry : bucket.entries) {
+    // a. 空きエントリや完全一致エントリが見つかった場合
+    if (entry.key == Key64(0) || entry.key == key) {
+      save_point = &entry;
+      break;
+    }
+    // b. 置き換える場合（既存の情報が古い場合、参照数が少ない場合）
+    if (   entry.age.load(std::memory_order_relaxed) != age_
+        ||   entry.num_lookups.load(std::memory_order_relaxed)
+           < save_point->num_lookups.load(std::memory_order_relaxed)) {
+      save_point = &entry;
+    }
+  }
 
- void ProbabilityCacheTable::Save(Key64 key, const std::valarray<float>& data) {
-   // 1. 保存先を探す
-   Bucket& bucket = table_[key & key_mask_];
-   Entry* save_point = bucket.begin();
-   for (Entry& entry : bucket) {
-     // a. 空きエントリや完全一致エントリが見つかった場合
-     if (entry.key == Key64(0) || entry.key == key) {
-       save_point = &entry;
-       break;
-     }
-     // b. 置き換える場合（既存の情報が古い場合、参照数が少ない場合）
-     if (   entry.age != age_
-         || entry.num_lookups < save_point->num_lookups) {
-       save_point = &entry;
-     }
-   }
+  // 3. 情報を保存する
+  save_point->key = key;
+  std::copy(data, data + num_moves, save_point->data.begin());
+  save_point->num_moves = static_cast<uint32_t>(num_moves);
+  save_point->num_lookups.store(0, std::memory_order_relaxed);
+  save_point->age.store(age_, std::memory_order_relaxed);
 
-   // 2. 情報を保存する
-   save_point->key = key;
-   save_point->data = data;
-   save_point->num_lookups = 0;
-   save_point->age = age_;
- }
+  // 4. カウンタを偶数に戻して、書き込みが完了したことを示す
+  bucket.sequence.store(sequence + 2, std::memory_order_release);
+}
 
- void ProbabilityCacheTable::SetSize(size_t size) {
-   // 要素数をセット（必ず２の累乗になるようにする）
-   size_ = static_cast<size_t>(1) << bitop::bsr64(size);
-   key_mask_ = size_ - 1;
+void ProbabilityCacheTable::SetSize(size_t megabytes) {
+  // 要素数をセット（指定されたメモリ量を超えないように、２の累乗に切り捨てる）
+  const size_t num_buckets = std::max(megabytes * 1024 * 1024 / sizeof(Bucket),
+                                      static_cast<size_t>(1));
+  size_ = static_cast<size_t>(1) << bitop::bsr64(num_buckets);
+  key_mask_ = size_ - 1;
 
-   // 要素数分のメモリ領域を確保
-   table_.reset(new Bucket[size_]);
+  // 要素数分のメモリ領域を確保
+  table_.reset(new Bucket[size_]);
 
-   // 初期化
-   age_ = 0;
- }
+  // 初期化
+  age_ = 0;
+  Clear();
+}
 
- void ProbabilityCacheTable::Clear() {
-   for (size_t i = 0; i < size_; ++i) {
-     Bucket& bucket = table_[i];
-     for (size_t j = 0; j < bucket.size(); ++j) {
-       bucket[j].key = Key64(0);
-       bucket[j].data.resize(0);
-       bucket[j].num_lookups = 0;
-       bucket[j].age = 0;
-     }
-   }
- }
+void ProbabilityCacheTable::Clear() {
+  for (size_t i = 0; i < size_; ++i) {
+    Bucket& bucket = table_[i];
+    bucket.sequence.store(0, std::memory_order_relaxed);
+    for (Entry& entry : bucket.entries) {
+      entry.key = Key64(0);
+      entry.num_lookups.store(0, std::memory_order_relaxed);
+      entry.age.store(0, std::memory_order_relaxed);
+      entry.num_moves = 0;
+    }
+  }
+}
 
  /**
   * 実現確率のキャッシュに用いるハッシュテーブルのキーを返します.
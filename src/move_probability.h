@@ -20,8 +20,8 @@
 #ifndef MOVE_PROBABILITY_H_
 #define MOVE_PROBABILITY_H_
 
+#include <atomic>
 #include <memory>
-#include <mutex>
 #include <unordered_map>
 #include <valarray>
 #include <vector>
@@ -31,20 +31,41 @@ class Position;
 /**
  * 実現確率の途中計算結果をキャッシュするためのテーブルです.
  * このテーブルを用いることにより、探索の高速化が実現できます。
+ *
+ * 各エントリは、指し手の得点を保存するための固定長の領域を持っているため、保存・参照時にメモリの確保は行いません。
+ * 排他制御には、バケットごとのシーケンスカウンタ（seqlock）を用いています。
+ *   - 参照: 読み出し前後でカウンタが変化していなければ成功とします（書き込みを待つことはありません）
+ *   - 保存: カウンタを奇数にしてから書き込みます（他のスレッドが書き込み中の場合は、保存を諦めます）
+ * 参照時に更新する鮮度（age）と参照数（num_lookups）は、置き換えの目安にすぎないので、relaxedなatomic変数にしています。
  */
 class ProbabilityCacheTable {
  public:
-  // 標準で確保する要素数（32768は、１スレッドなら30秒程度の探索で使い切る程度の大きさを想定。）
-  static constexpr size_t kDefaultSize = 32768; // 2^15
+  /** 標準で確保するメモリ量（全スレッドで共有するテーブル全体の大きさ、単位はMB）. */
+  static constexpr size_t kDefaultSize = 256;
 
+  /**
+   * １エントリに保存できる指し手の最大数です.
+   * 合法手がこれより多い局面は非常にまれなので、そのような局面はキャッシュしないことにしています。
+   */
+  static constexpr size_t kMaxMoves = 256;
+
+  /**
+   * エントリです（指し手の得点は、kMaxMoves個分のfloatを、エントリ内に直接持っています）.
+   * １エントリは約1KB、１バケットは約4KBなので、1MBあたり、約1000局面分を保存できます。
+   */
   struct Entry {
     Key64 key;
-    std::valarray<float> data;
-    uint32_t num_lookups = 0;
-    uint32_t age = 0;
+    std::atomic<uint32_t> num_lookups;
+    std::atomic<uint32_t> age;
+    uint32_t num_moves;
+    Array<float, kMaxMoves> data;
   };
 
-  typedef Array<Entry, 4> Bucket;
+  struct Bucket {
+    /** 書き込み中は奇数になるカウンタ. */
+    std::atomic<uint32_t> sequence;
+    Array<Entry, 4> entries;
+  };
 
   /**
    * 標準である程度の要素数を確保します.
@@ -54,24 +75,28 @@ class ProbabilityCacheTable {
   }
 
   /**
-   * 参照します。
-   * @param key 実現確率参照用のキー（ComputeKey()メソッドで計算してください。）
-   * @return 要素へのポインタ。見つからない場合は、nullptrが返されます。
+   * 参照します.
+   * @param key       実現確率参照用のキー（ComputeKey()メソッドで計算してください。）
+   * @param num_moves 保存されているはずの指し手の数
+   * @param data      見つかった場合に、データをコピーする先（num_moves個の要素を持つ必要があります）
+   * @return 見つかり、かつ読み出し中に書き換えが行われなかった場合は、true
    */
-  const Entry* LookUp(Key64 key) const;
+  bool LookUp(Key64 key, size_t num_moves, float* data) const;
 
   /**
    * 保存します.
-   * @param key 実現確率参照用のキー（ComputeKey()メソッドで計算してください。）
-   * @param data キャッシュ対象となるデータ
+   * @param key       実現確率参照用のキー（ComputeKey()メソッドで計算してください。）
+   * @param num_moves 保存する指し手の数
+   * @param data      キャッシュ対象となるデータ
    */
-  void Save(Key64 key, const std::valarray<float>& data);
+  void Save(Key64 key, size_t num_moves, const float* data);
 
   /**
-   * テーブルの要素数をセットします.
-   * このメソッドを呼ぶことにより、初めてメモリ領域が要素数分確保されます。
+   * テーブル全体のサイズを、メガバイト単位でセットします.
+   * バケット数は、指定されたサイズを超えないように、２の累乗に切り捨てられます。
+   * このメソッドを呼ぶことにより、初めてメモリ領域が確保されます。
    */
-  void SetSize(size_t size);
+  void SetSize(size_t megabytes);
 
   /**
    * キャッシュテーブルのageを一つ増やします.
@@ -85,20 +110,6 @@ class ProbabilityCacheTable {
    */
   void Clear();
 
-  /**
-    * 特定のキーを読み書きする場合に、排他制御を行うためのロックをします.
-    */
-   void Lock(Key64 key) {
-     mutexes_[key % mutexes_.size()].lock();
-   }
-
-   /**
-    * 特定のキーを読み書きが終わった段階で、ロックを外します.
-    */
-   void Unlock(Key64 key) {
-     mutexes_[key % mutexes_.size()].unlock();
-   }
-
    /**
     * このテーブルに保存するときに用いるキーを計算します.
     * @param pos キーを計算したい局面
@@ -118,9 +129,6 @@ class ProbabilityCacheTable {
 
   /** テーブルに入っている情報の古さ */
   uint32_t age_;
-
-  /** マルチスレッド時の排他制御用（１個だけだと手待ちが発生しやすいので、複数個用意してバラけさせる。） */
-  Array<std::mutex, 32> mutexes_;
 };
 
 /**
@@ -144,17 +152,24 @@ struct MoveProbability {
    *
    * 一度確率を計算した局面であれば、キャッシュを用いて確率の計算が高速化されます。
    * なお、キャッシュを用いた場合であっても、探索情報については、最新のものが反映されます。
+   *
+   * @param begin         合法手のリストの先頭（GenerateMoves<kAllMoves>()の結果から、非合法手を取り除いたもの）
+   * @param end           合法手のリストの末尾
+   * @param probabilities 各指し手の確率を書き込む場所（(end - begin)個の要素を持つ必要があります）
+   * @param position_info_cache 局面情報のキャッシュ（Node::position_info_cache()。nullptrの場合は使い捨てのものを用いる）
    */
-  static std::valarray<double> ComputeProbabilitiesWithCache(
+  static void ComputeProbabilitiesWithCache(
       const Position& pos, const HistoryStats& history, const GainsStats& gains,
       const HistoryStats* countermoves_history,
-      const HistoryStats* followupmoves_history);
+      const HistoryStats* followupmoves_history,
+      const ExtMove* begin, const ExtMove* end, float* probabilities,
+      const PositionInfoCache* position_info_cache = nullptr);
 
   /**
-   * キャッシュテーブルのサイズ（要素数）を設定します.
+   * キャッシュテーブル全体のサイズ（単位はMB。全スレッドで共有するので、スレッド数には比例しません）を設定します.
    */
-  static void SetCacheTableSize(size_t size) {
-    cache_table_.SetSize(size);
+  static void SetCacheTableSize(size_t megabytes) {
+    cache_table_.SetSize(megabytes);
   }
 
   /**
@@ -186,6 +201,14 @@ struct MoveProbability {
    */
   static void Learn();
 
+  /**
+   * 確率計算のベンチマークを行います.
+   * 従来の方法（指し手ごとに特徴リストを作成し、double型でソフトマックス関数を計算する方法）と、
+   * 全指し手の特徴をまとめて処理する方法（キャッシュなし・あり）とで、速度と計算結果の差を表示します。
+   * @param num_calls 各局面・各方法で確率を計算する回数
+   */
+  static void Benchmark(int num_calls);
+
   /**
    * 確率を計算するために必要なテーブルの初期化処理を行います.
    */
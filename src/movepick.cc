@@ -73,14 +73,14 @@ inline Score GetMvvLvaScore(Move move) {
 } // namespace
 
 // 通常探索用のコンストラクタ
-MovePicker::MovePicker(const Position& pos, const HistoryStats& history,
+MovePicker::MovePicker(const Node& node, const HistoryStats& history,
                        const GainsStats& gains, Depth depth, Move hash_move,
                        const Array<Move, 2>& killermoves,
                        //const Array<Move, 2>& countermoves,
                        //const Array<Move, 2>& followupmoves,
                        const Move cm,
                        Search::Stack* const ss, const Search& search, const PieceToHistory** ch, int ply)
-    : pos_(pos),
+    : pos_(node),
       history_(history),
       gains_(gains),
       ss_(ss),
@@ -91,7 +91,9 @@ MovePicker::MovePicker(const Position& pos, const HistoryStats& history,
       refutations_{ { killermoves[0], 0 },{ killermoves[1], 0 },{ cm, 0 } },
       search_(search),
       continuationHistory_(ch),
-      ply_(ply) {
+      ply_(ply),
+      node_(&node) {
+  const Position& pos = node;
   assert(hash_move.IsOk());
   assert(depth > kDepthZero);
   assert(ss != nullptr);
@@ -387,10 +389,13 @@ void MovePicker::GenerateNext(bool skipQuiets) {
       }
 
       // 指し手の実現確率を計算する
+      // （子ノードの展開でNodeの内部配列が再確保されうるので、キャッシュはこの時点で取得する）
       const HistoryStats* cmh = (ss_-1)->countermoves_history;
       const HistoryStats* fmh = (ss_-2)->countermoves_history;
-      std::valarray<double> probabilities = MoveProbability::ComputeProbabilitiesWithCache(
-          pos_, history_, gains_, cmh, fmh);
+      Array<float, Move::kMaxLegalMoves> probabilities;
+      MoveProbability::ComputeProbabilitiesWithCache(
+          pos_, history_, gains_, cmh, fmh, cur_, end_, probabilities.begin(),
+          node_ != nullptr ? &node_->position_info_cache() : nullptr);
 
       // 指し手の実現確率が高い順にソートする
       for (size_t i = 0; i < num_moves; ++i) {
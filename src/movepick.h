@@ -40,8 +40,9 @@ class MovePicker {
 
   /**
    * 通常探索用のコンストラクタです.
+   * 実現確率の計算には、nodeが持っている局面情報のキャッシュ（Node::position_info_cache()）を用います。
    */
-  MovePicker(const Position& pos, const HistoryStats& history,
+  MovePicker(const Node& node, const HistoryStats& history,
              const GainsStats& gains, Depth depth, Move hash_move,
              const Array<Move, 2>& killermoves,
              //const Array<Move, 2>& countermoves,
@@ -109,6 +110,8 @@ class MovePicker {
 
   int ply_;
 
+  /** 局面情報のキャッシュを持っているノード（通常探索用のコンストラクタでのみセットされる） */
+  const Node* node_ = nullptr;
 };
 
 #endif /* MOVEPICK_H_ */
@@ -19,6 +19,7 @@
 
 #include "node.h"
 
+#include <algorithm>
 #include "progress.h"
 
 void Node::Initialize() {
@@ -44,22 +45,32 @@ void Node::Initialize() {
   current->plies_from_null   = 0;
   assert((current-1)->plies_from_null == 0);
   assert((current-2)->continuous_checks == 0);
+
+  // 千日手検出用のハッシュ表を初期化し、現局面を登録する
+  std::fill(repetition_table_.begin(), repetition_table_.end(), -1);
+  PushRepetitionEntry();
 }
 
 bool Node::DetectRepetition(Score* score) const {
   assert(score != nullptr);
   assert(stack_.size() >= 3); // (stack_.end()-3)を参照するため
 
-  // 設定（何手まで遡って千日手の検出を行うか）
-  const int kMaxDetectionPly = 32;
-
+  const int current_index = static_cast<int>(stack_.size()) - 1;
   auto current = stack_.end() - 1;
   assert(current->plies_from_null >= 0);
-  const int end = std::min(current->plies_from_null, kMaxDetectionPly);
-
-  for (int i = 4; i <= end; i += 2) {
-    assert((current - i) >= stack_.begin());
-    if (current->board_key != (current - i)->board_key) {
+  assert(repetition_table_[RepetitionBucket(current->board_key)] == current_index);
+
+  // 同じバケットに属する局面を、新しいものから順にたどる（直前のnull moveより前には遡らない）
+  for (int index = current->previous_in_bucket; index >= 0;
+       index = stack_[index].previous_in_bucket) {
+    const int i = current_index - index;
+    if (i > current->plies_from_null) {
+      break;
+    }
+    // 手番が同じで、かつ４手以上前の局面のみを調べる
+    if (   i < 4
+        || i % 2 != 0
+        || current->board_key != (current - i)->board_key) {
       continue;
     }
     const Hand h = (current - i)->hand;
@@ -199,6 +210,7 @@ void Node::MakeMove(Move move, bool move_gives_check, Key64 key_after_move) {
     current->continuous_checks = 0;
   }
   current->plies_from_null = (current-1)->plies_from_null + 1;
+  PushRepetitionEntry();
 
   // ハッシュキーが正しくセットされているかチェック
   assert(current->board_key == ComputeBoardKey());
@@ -221,6 +233,7 @@ void Node::UnmakeMove(Move move) {
   Position::UnmakeMove(move);
 
   // スタックを１つ前にもどす
+  PopRepetitionEntry();
   stack_.pop_back();
 }
 
@@ -256,6 +269,7 @@ void Node::MakeNullMove() {
   assert(!in_check());
   current->continuous_checks = 0;
   current->plies_from_null = 0;
+  PushRepetitionEntry();
 
   // ハッシュキーが正しくセットされているかチェック
   assert(current->board_key == ComputeBoardKey());
@@ -265,6 +279,7 @@ void Node::MakeNullMove() {
 void Node::UnmakeNullMove() {
   assert(last_move() == kMoveNull);
   Position::UnmakeNullMove();
+  PopRepetitionEntry();
   stack_.pop_back();
 }
 
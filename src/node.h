@@ -21,7 +21,9 @@
 #define NODE_H_
 
 #include <vector>
+#include "common/array.h"
 #include "evaluation.h"
+#include "move_feature.h"
 #include "position.h"
 #include "psq.h"
 #include "zobrist.h"
@@ -68,6 +70,9 @@ class Node : public Position {
    *
    * 最後の2つは、Strong Horizon Effect Killer (SHEK) に関するものです。
    * これは、千日手処理そのものではなく、明らかに得な局面・明らかに損な局面への遷移を検出するための処理です。
+   *
+   * 盤上の駒のハッシュ値が同じ局面だけを連結リストでたどるため、直前のnull moveまでであれば、
+   * "position ... moves"で与えられた棋譜全体を含め、何手前まででも遡って検出できます。
    * （参考文献）
    *   - 橋本剛: 将棋プログラムTACOSのアルゴリズム, 『コンピュータ将棋の進歩５』, pp.56-60,
    *     共立出版, 2005.
@@ -85,6 +90,14 @@ class Node : public Position {
     return stack_.back().position_key;
   }
 
+  /**
+   * 盤上の駒と手番のみを考慮した、現在の局面のハッシュ値を返します.
+   * 持ち駒を含まないため、持ち駒の優越関係を利用する場合（千日手検出や詰みのキャッシュ）に用います。
+   */
+  Key64 board_key() const {
+    return stack_.back().board_key;
+  }
+
   /**
    * 指し手 move で１手進めた局面のハッシュキーを返します.
    * 例えば、置換表の投機的プリフェッチを行う際に用いられます。
@@ -155,8 +168,21 @@ class Node : public Position {
     return psq_list_;
   }
 
+  /**
+   * 現局面について、指し手の特徴抽出に用いる情報のキャッシュを返します.
+   * キャッシュの内容は、局面を進めたり戻したりしても、その手数の局面についてのみ有効です。
+   */
+  const PositionInfoCache& position_info_cache() const {
+    return stack_.back().position_info_cache;
+  }
+
  private:
 
+  /**
+   * 千日手検出用のハッシュ表のバケット数です（2の累乗である必要があります）.
+   */
+  static constexpr int kRepetitionTableSize = 1024;
+
   struct Stack {
     PsqControlList psq_control_list;
     EvalDetail eval_detail;
@@ -165,15 +191,44 @@ class Node : public Position {
     Hand hand;
     int plies_from_null   = 0;
     int continuous_checks = 0;
+    int previous_in_bucket = -1; // 同じバケットに属する、１つ前の局面のスタック上の位置
     bool eval_is_updated = false;
+    PositionInfoCache position_info_cache;
   };
 
   void Initialize();
 
+  /**
+   * 現在の局面を、千日手検出用のハッシュ表に登録します.
+   */
+  void PushRepetitionEntry() {
+    const int index = static_cast<int>(stack_.size()) - 1;
+    int& head = repetition_table_[RepetitionBucket(stack_[index].board_key)];
+    stack_[index].previous_in_bucket = head;
+    head = index;
+  }
+
+  /**
+   * 現在の局面を、千日手検出用のハッシュ表から取り除きます（PushRepetitionEntry()の逆操作）.
+   */
+  void PopRepetitionEntry() {
+    const Stack& current = stack_.back();
+    int& head = repetition_table_[RepetitionBucket(current.board_key)];
+    assert(head == static_cast<int>(stack_.size()) - 1);
+    head = current.previous_in_bucket;
+  }
+
+  static size_t RepetitionBucket(Key64 board_key) {
+    return static_cast<uint64_t>(board_key) & (kRepetitionTableSize - 1);
+  }
+
   Key64 ComputeKey(Move move) const;
 
   std::vector<Stack> stack_;
   PsqList psq_list_;
+
+  /** 盤上の駒のハッシュ値で分類した、各バケットの最新の局面のスタック上の位置（なければ-1）. */
+  Array<int, kRepetitionTableSize> repetition_table_;
 };
 
 #endif /* NODE_H_ */
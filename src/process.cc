@@ -19,36 +19,204 @@
 
 #if !defined(MINIMUM)
 
+#include <cerrno>
+#include <cstring>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include <fcntl.h>
+#include <sched.h>
 #include <signal.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 #include <sys/wait.h>
 
 #include "process.h"
 
+/**
+ * 全ての外部プロセスの標準出力を、１つのスレッドでまとめて監視して、読み込むためのクラスです.
+ */
+class ProcessIoLoop {
+ public:
+  static ProcessIoLoop& instance() {
+    static ProcessIoLoop io_loop;
+    return io_loop;
+  }
+
+  /**
+   * 外部プロセスの標準出力を、監視対象に加えます.
+   */
+  void Add(Process* process) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    processes_.insert(process);
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = process;
+    if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, process->fd_from_child_, &event) < 0) {
+      std::perror("epoll_ctl(EPOLL_CTL_ADD)");
+    }
+  }
+
+  /**
+   * 外部プロセスの標準出力を、監視対象から外します（これ以降、そのプロセスのデータは読み込まれません）.
+   */
+  void Remove(Process* process) {
+    std::unique_lock<std::mutex> lock(mutex_);
+    if (processes_.erase(process) != 0) {
+      epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, process->fd_from_child_, nullptr);
+    }
+  }
+
+ private:
+  ProcessIoLoop() {
+    epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+    wakeup_fd_ = eventfd(0, EFD_CLOEXEC);
+    epoll_event event;
+    event.events = EPOLLIN;
+    event.data.ptr = nullptr; // 終了の合図
+    epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, wakeup_fd_, &event);
+    thread_ = std::thread([this]() { Loop(); });
+  }
+
+  ~ProcessIoLoop() {
+    // 入出力スレッドに終了の合図を送る
+    const uint64_t one = 1;
+    if (write(wakeup_fd_, &one, sizeof(one)) < 0) {
+      std::perror("write(wakeup_fd)");
+    }
+    thread_.join();
+    close(wakeup_fd_);
+    close(epoll_fd_);
+  }
+
+  void Loop() {
+    const int kMaxEvents = 64;
+    epoll_event events[kMaxEvents];
+    std::vector<char> buffer(64 * 1024);
+
+    for (;;) {
+      int num_events = epoll_wait(epoll_fd_, events, kMaxEvents, -1);
+      if (num_events < 0) {
+        if (errno == EINTR) continue;
+        std::perror("epoll_wait");
+        return;
+      }
+
+      // 読み込み中にRemove()されないように、排他制御を行う
+      std::unique_lock<std::mutex> lock(mutex_);
+      for (int i = 0; i < num_events; ++i) {
+        Process* process = static_cast<Process*>(events[i].data.ptr);
+        if (process == nullptr) {
+          return;
+        }
+        // 同じepoll_wait()の結果の中で、先にEOFを受信して監視対象から外れたものは、スキップする
+        if (processes_.count(process) == 0) {
+          continue;
+        }
+        // 届いているデータを、バッファに入るだけまとめて読み込む
+        ssize_t size = read(process->fd_from_child_, buffer.data(), buffer.size());
+        if (size < 0 && (errno == EINTR || errno == EAGAIN)) {
+          continue;
+        }
+        if (size <= 0) {
+          // EOFを受信したか、エラーが発生した場合は、監視対象から外す
+          processes_.erase(process);
+          epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, process->fd_from_child_, nullptr);
+          process->OnDataReceived(buffer.data(), 0);
+        } else {
+          process->OnDataReceived(buffer.data(), size);
+        }
+      }
+    }
+  }
+
+  int epoll_fd_;
+  int wakeup_fd_;
+  std::mutex mutex_;
+  std::unordered_set<Process*> processes_;
+  std::thread thread_;
+};
+
+Process::~Process() {
+  if (fd_from_child_ >= 0) {
+    ProcessIoLoop::instance().Remove(this);
+    close(fd_from_child_);
+  }
+  if (fd_to_child_ >= 0) {
+    close(fd_to_child_);
+  }
+}
+
 bool Process::GetLine(std::string* const line) {
   line->clear();
-  for (char c; (c = std::fgetc(stream_from_child_)) != EOF;) {
-    // 改行コードが来たら終了する
-    if (c == '\n') return true;
-    // 末尾に一文字ずつ付け足していく
-    line->push_back(c);
+  std::unique_lock<std::mutex> lock(receive_mutex_);
+  receive_condition_.wait(lock, [&]() {
+    return !received_lines_.empty() || eof_received_;
+  });
+  if (received_lines_.empty()) {
+    return false;
   }
-  return false;
+  line->swap(received_lines_.front());
+  received_lines_.pop_front();
+  return true;
 }
 
-int Process::StartProcess(const char* const file, char* const argv[]) {
+void Process::OnDataReceived(const char* const data, const size_t size) {
+  std::unique_lock<std::mutex> lock(receive_mutex_);
+  if (size == 0) {
+    // EOFを受信した場合、改行で終わっていない最後の行があれば、それも受信した行とみなす
+    if (!partial_line_.empty()) {
+      received_lines_.push_back(std::move(partial_line_));
+      partial_line_.clear();
+    }
+    eof_received_ = true;
+  } else {
+    // 改行ごとに行を切り出す
+    const char* begin = data;
+    const char* const end = data + size;
+    for (const char* newline; (newline = static_cast<const char*>(std::memchr(begin, '\n', end - begin))); ) {
+      partial_line_.append(begin, newline);
+      received_lines_.push_back(std::move(partial_line_));
+      partial_line_.clear();
+      begin = newline + 1;
+    }
+    partial_line_.append(begin, end);
+  }
+  receive_condition_.notify_all();
+}
+
+void Process::Write(const char* data, size_t size) {
+  std::unique_lock<std::mutex> lock(write_mutex_);
+  while (size > 0) {
+    ssize_t written = write(fd_to_child_, data, size);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      std::perror("write() to child process failed");
+      return;
+    }
+    data += written;
+    size -= written;
+  }
+}
+
+int Process::StartProcess(const char* const file, char* const argv[],
+                          const std::vector<int>& cpu_ids) {
   const int kRead = 0, kWrite = 1;
 
   int pipe_from_child[2];
   int pipe_to_child[2];
 
+  // 他のスレッドが同時に起動する子プロセスに引き継がれないように、パイプはclose-on-execを付けて作成する
+  // （子プロセスの標準入出力に割り当てるときは、dup2()によってclose-on-execが外れる）
+
   // パイプの作成（親プロセス->子プロセス）
-  if (pipe(pipe_from_child) < 0) {
+  if (pipe2(pipe_from_child, O_CLOEXEC) < 0) {
     std::perror("failed to create pipe_from_chlid.\n");
     return -1;
   }
 
   // パイプの作成（子プロセス->親プロセス）
-  if (pipe(pipe_to_child) < 0) {
+  if (pipe2(pipe_to_child, O_CLOEXEC) < 0) {
     std::perror("failed to create pipe_to_child.\n");
     close(pipe_from_child[kRead]);
     close(pipe_from_child[kWrite]);
@@ -82,27 +250,40 @@ int Process::StartProcess(const char* const file, char* const argv[]) {
     close(pipe_to_child[kRead]);
     close(pipe_from_child[kWrite]);
 
+    // CPUが指定されている場合は、子プロセスをそのCPUに固定する（子プログラムにも引き継がれる）
+    if (!cpu_ids.empty()) {
+      cpu_set_t cpu_set;
+      CPU_ZERO(&cpu_set);
+      for (int cpu_id : cpu_ids) {
+        CPU_SET(cpu_id, &cpu_set);
+      }
+      if (sched_setaffinity(0, sizeof(cpu_set), &cpu_set) < 0) {
+        std::perror("sched_setaffinity() failed\n");
+      }
+    }
+
     // 子プロセスにおいて、子プログラムを起動する
     if (execvp(file, argv) < 0) {
-      // プロセス起動時にエラーが発生した場合
+      // プロセス起動時にエラーが発生した場合（子プロセスのまま親プロセスの処理を続けないように、ここで終了する）
       std::perror("execvp() failed\n");
-      close(pipe_to_child[kRead]);
-      close(pipe_from_child[kWrite]);
-      return -1;
+      _exit(127);
     }
   }
 
   // プロセスIDを記憶させる
   process_id_ = process_id;
 
-  // パイプをファイルストリームとして開く
-  stream_to_child_ = fdopen(pipe_to_child[kWrite], "w");
-  stream_from_child_ = fdopen(pipe_from_child[kRead], "r");
+  // 親プロセス側で使わないパイプを閉じる
+  close(pipe_to_child[kRead]);
+  close(pipe_from_child[kWrite]);
+
+  // パイプを記憶させる
+  fd_to_child_ = pipe_to_child[kWrite];
+  fd_from_child_ = pipe_from_child[kRead];
 
-  // バッファリングをオフにする
-  // 注意：バッファリングをオフにしないと、外部プロセスとの通信が即時に行われない場合がある
-  std::setvbuf(stream_to_child_, NULL, _IONBF, 0);
-  std::setvbuf(stream_from_child_, NULL, _IONBF, 0);
+  // 外部プロセスの標準出力を、入出力スレッドの監視対象に加える
+  // （読み込みは入出力スレッドがまとめて行い、ここでは受信キューに積まれた行を取り出すだけになる）
+  ProcessIoLoop::instance().Add(this);
 
   return process_id;
 }
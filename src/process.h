@@ -22,26 +22,45 @@
 
 #if !defined(MINIMUM)
 
+#include <condition_variable>
 #include <cstdio>
+#include <deque>
+#include <mutex>
 #include <string>
 #include <unistd.h>
+#include <vector>
 
 /**
  * プロセス間通信を行うためのクラスです.
  * unistd.hヘッダを利用しているため、原則としてUNIX系OSでのみ使用可能です。
+ *
+ * 外部プロセスの標準出力は、全プロセスで共有する１つの入出力スレッドがepollでまとめて監視しており、
+ * 届いたデータをまとめて読み込んで行単位に分割し、各プロセスの受信キューに積んでおきます。
+ * GetLine()は受信キューから１行取り出すだけなので、１文字ずつシステムコールを呼ぶことはありません。
+ * 外部プロセスへの書き込みは、１回の呼び出しにつき、１回のシステムコールで行います
+ * （複数のコマンドを改行で区切ってまとめて渡せば、それらを１回で書き込めます）。
+ * パイプでつながっていればよいので、ローカルのプロセスでも、sshで起動したリモートのプロセスでも、同じように使えます。
  */
 class Process {
  public:
+  Process() {}
+  ~Process();
+
+  Process(const Process&) = delete;
+  Process& operator=(const Process&) = delete;
+
   /**
    * 外部プロセスを起動します.
    * @param file 外部プロセスのファイル名
    * @param argv 外部プロセスに渡す引数の配列（配列の最後の要素は必ずNULLにする。execvp()のマニュアル参照。）
+   * @param cpu_ids 外部プロセスを実行するCPUの番号（空の場合は、CPUを限定しない）
    * @return 外部プロセスの起動に成功したときは、プロセスID。失敗したときは、-1。
    */
-  int StartProcess(const char* file, char* const argv[]);
+  int StartProcess(const char* file, char* const argv[],
+                   const std::vector<int>& cpu_ids = std::vector<int>());
 
   /**
-   * 外部プロセスの標準出力から１行読み込みます.
+   * 外部プロセスの標準出力から１行読み込みます（次の行が届くまで待機します）.
    * @param line 外部プロセスの標準出力から読み込んだ行
    * @return EOFまで読み込んだときは、false。まだ残りの行があるときは、true。
    */
@@ -52,15 +71,34 @@ class Process {
    */
   template<typename... Args>
   void Printf(const char* format, const Args&... args) {
-    std::fprintf(stream_to_child_, format, args...);
+    char buffer[1024];
+    int length = std::snprintf(buffer, sizeof(buffer), format, args...);
+    if (length < 0) {
+      return;
+    }
+    if (static_cast<size_t>(length) < sizeof(buffer)) {
+      Write(buffer, length);
+    } else {
+      std::string str(length + 1, '\0');
+      std::snprintf(&str[0], str.size(), format, args...);
+      Write(str.data(), length);
+    }
   }
 
   /**
    * 外部プロセスの標準入力に対し、１行書き込みます.
    */
   void PrintLine(const char* str) {
-    std::fprintf(stream_to_child_, "%s\n", str);
+    Write(std::string(str) + "\n");
+  }
+
+  /**
+   * 外部プロセスの標準入力に対し、文字列をそのまま書き込みます.
+   */
+  void Write(const std::string& str) {
+    Write(str.data(), str.size());
   }
+  void Write(const char* data, size_t size);
 
   /**
    * 外部プロセスが終了するまで待機します.
@@ -76,14 +114,32 @@ class Process {
   }
 
  private:
+  friend class ProcessIoLoop;
+
+  /**
+   * 入出力スレッドから呼ばれ、受信したデータを行単位に分割して、受信キューに積みます.
+   * @param data 受信したデータ（sizeが0の場合は、EOFを受信したことを表す）
+   */
+  void OnDataReceived(const char* data, size_t size);
+
   /** 外部プロセスのプロセスID */
-  pid_t process_id_;
+  pid_t process_id_ = -1;
+
+  /** 外部プロセスの標準入力につながれたパイプ（外部プロセスへの送信用） */
+  int fd_to_child_ = -1;
+
+  /** 外部プロセスの標準出力につながれたパイプ（外部プロセスからの受信用） */
+  int fd_from_child_ = -1;
 
-  /** 外部プロセスの標準入力につながれたストリーム（外部プロセスへの送信用） */
-  std::FILE* stream_to_child_;
+  /** 書き込みの排他制御用 */
+  std::mutex write_mutex_;
 
-  /** 外部プロセスの標準出力につながれたストリーム（外部プロセスからの受信用） */
-  std::FILE* stream_from_child_;
+  /** 受信した行のキューと、まだ改行が届いていない行の断片 */
+  std::deque<std::string> received_lines_;
+  std::string partial_line_;
+  bool eof_received_ = false;
+  std::mutex receive_mutex_;
+  std::condition_variable receive_condition_;
 };
 
 #endif /* !defined(MINIMUM) */
@@ -116,8 +116,7 @@ void Progress::LearnParameters() {
   const Position startpos = Position::CreateStartPosition();
 
   // 棋譜データの準備
-  std::ifstream game_db_file(GameDatabase::kDefaultDatabaseFile);
-  GameDatabase game_db(game_db_file);
+  GameDatabase game_db;
   std::vector<Game> games, samples;
   std::printf("start reading games.\n");
   for (int i = 0; i < kNumGames; ++i) {
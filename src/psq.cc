@@ -109,15 +109,7 @@ PsqList::PsqList(const Position& pos) : size_(0) {
   hand_[kWhite] = pos.hand(kWhite);
 
   // 2. 持ち駒のインデックスを追加
-  for (Color c : {kBlack, kWhite}) {
-    for (PieceType pt : Piece::all_hand_types()) {
-      for (int i = 1, n = pos.hand(c).count(pt); i <= n; ++i) {
-        list_[size_] = PsqPair::OfHand(c, pt, i);
-        hand_index_[c][pt][i] = size_;
-        ++size_;
-      }
-    }
-  }
+  AddHandPieces();
 
   // 3. 盤上の駒のインデックスを追加
   pos.pieces().andnot(pos.pieces(kKing)).Serialize([&](Square s) {
@@ -130,6 +122,37 @@ PsqList::PsqList(const Position& pos) : size_(0) {
   assert(IsOk());
 }
 
+PsqList::PsqList(const ArrayMap<Hand, Color>& hands, const ArrayMap<Piece, Square>& board)
+    : size_(0), hand_(hands) {
+  // 1. 持ち駒のインデックスを追加
+  AddHandPieces();
+
+  // 2. 盤上の駒のインデックスを追加（PsqList(const Position&)と同じく、マスの順に並べる）
+  for (Square s : Square::all_squares()) {
+    Piece piece = board[s];
+    if (piece != kNoPiece) {
+      assert(piece.type() != kKing);
+      list_[size_] = PsqPair::OfBoard(piece, s);
+      index_[s] = size_;
+      ++size_;
+    }
+  }
+
+  assert(IsOk());
+}
+
+void PsqList::AddHandPieces() {
+  for (Color c : {kBlack, kWhite}) {
+    for (PieceType pt : Piece::all_hand_types()) {
+      for (int i = 1, n = hand_[c].count(pt); i <= n; ++i) {
+        list_[size_] = PsqPair::OfHand(c, pt, i);
+        hand_index_[c][pt][i] = size_;
+        ++size_;
+      }
+    }
+  }
+}
+
 #if !defined(EVAL_NNUE)
 void PsqList::MakeMove(const Move move) {
 #else
@@ -251,6 +251,12 @@ class PsqList {
    */
   explicit PsqList(const Position& pos);
 
+  /**
+   * 持ち駒と、盤上の駒の配置から、インデックスリストを作成します（盤上の玉は、含めないでください）.
+   * Positionクラスを作成せずにリストだけを作りたい場合（ハフマン符号からの復号化など）に用います。
+   */
+  PsqList(const ArrayMap<Hand, Color>& hands, const ArrayMap<Piece, Square>& board);
+
   const PsqPair* begin() const {
     return list_.begin();
   }
@@ -296,6 +302,8 @@ class PsqList {
   static bool TwoListsHaveSameItems(const PsqList& list1, const PsqList& list2);
 
  private:
+  void AddHandPieces();
+
   static constexpr int kMaxSize = 38;
   size_t size_;
   ArrayMap<Hand, Color> hand_;
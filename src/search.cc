@@ -30,6 +30,7 @@
 #include "evaluation.h"
 #include "mate1ply.h"
 #include "mate3.h"
+#include "mate_n.h"
 #include "material.h"
 #include "move_probability.h"
 #include "movegen.h"
@@ -53,15 +54,42 @@ ContinuationHistory g_ary_continuationHistory[HISTORY_ARRAY_SIZE][2][2];
 
 namespace {
 
+/**
+ * i番目のHistoryをクリアします.
+ */
+void ClearHistoryArrays(const int i) {
+  g_ary_counterMoves[i].fill(Move::Create(0));
+  g_ary_mainHistory[i].fill(0);
+  g_ary_lowPlyHistory[i].fill(0);
+  g_ary_captureHistory[i].fill(0);
+
+  // ここは、未初期化のときに[SQ_ZERO][NO_PIECE]を指すので、ここを-1で初期化しておくことによって、
+  // history > 0 を条件にすれば自ずと未初期化のときは除外されるようになる。
+  for (bool inCheck : { false, true })
+    for (StatsType c : { NoCaptures, Captures })
+    {
+      for (auto& to : g_ary_continuationHistory[i][inCheck][c])
+        for (auto& h : to)
+          h->fill(0);
+      g_ary_continuationHistory[i][inCheck][c][SQ_ZERO][NO_PIECE]->fill(CounterMovePruneThreshold - 1);
+    }
+}
+
 // 開発時に参照する統計データ
-uint64_t g_mate3_tried = 0;
-uint64_t g_mate3_nodes = 0;
 uint64_t g_sum_move_counts = 0;
 uint64_t g_num_beta_cuts = 0;
 Array<uint64_t, 64> g_cuts_by_move;
 
 //Array<int16_t, 2, 2, 64, 64> g_reductions; // [pv][improving][depth][moveNumber]
 
+// ５手詰関数・７手詰関数を呼ぶ残り探索深さの閾値（これ未満の深さでは３手詰関数のみを呼ぶ）
+constexpr Depth kMate5Depth = 6 * kOnePly;
+constexpr Depth kMate7Depth = 10 * kOnePly;
+
+// ５手詰関数・７手詰関数の１回あたりの探索ノード数の上限
+constexpr uint64_t kMate5MaxNodes = 1000;
+constexpr uint64_t kMate7MaxNodes = 4000;
+
 constexpr uint64_t ttHitAverageWindow = 4096;
 constexpr uint64_t ttHitAverageResolution = 1024;
 
@@ -183,6 +211,61 @@ void Search::Init() {
 */
 }
 
+void HistoryTables::Clear() {
+  counter_moves.fill(Move::Create(0));
+  main_history.fill(0);
+  low_ply_history.fill(0);
+  capture_history.fill(0);
+  for (bool inCheck : { false, true })
+    for (StatsType c : { NoCaptures, Captures })
+    {
+      for (auto& to : continuation_history[inCheck][c])
+        for (auto& h : to)
+          h->fill(0);
+      continuation_history[inCheck][c][SQ_ZERO][NO_PIECE]->fill(CounterMovePruneThreshold - 1);
+    }
+  used_.reset();
+}
+
+void HistoryTables::ClearUsed() {
+  counter_moves.fill(Move::Create(0));
+  main_history.fill(0);
+  low_ply_history.fill(0);
+  capture_history.fill(0);
+
+  // continuation historyは、使われた部分だけをクリアする
+  for (size_t i = 0; i < used_.size(); ++i) {
+    if (!used_.test(i)) {
+      continue;
+    }
+    const size_t piece = i % PIECE_NB;
+    const size_t to = i / PIECE_NB % SQ_NB;
+    const size_t c = i / (PIECE_NB * SQ_NB) % 2;
+    const size_t inCheck = i / (PIECE_NB * SQ_NB * 2);
+    continuation_history[inCheck][c][to][piece]->fill(0);
+  }
+  used_.reset();
+
+  // 番兵は、使われたかどうかに関わらず、初期値に戻す（null moveの後などで、記録なしに更新されるため）
+  for (bool inCheck : { false, true })
+    for (StatsType c : { NoCaptures, Captures })
+      continuation_history[inCheck][c][SQ_ZERO][NO_PIECE]->fill(CounterMovePruneThreshold - 1);
+}
+
+void Search::ClearHistories() {
+  for (int i = 0; i < HISTORY_ARRAY_SIZE; i++) {
+    ClearHistoryArrays(i);
+  }
+}
+
+void Search::ClearHistory() {
+  if (histories_ != nullptr) {
+    histories_->ClearUsed();
+  } else {
+    ClearHistoryArrays(thread_id_ % HISTORY_ARRAY_SIZE);
+  }
+}
+
 Search::Search(SharedData& shared, size_t thread_id)
     : shared_(shared),
       thread_id_(thread_id) {
@@ -195,6 +278,18 @@ Search::Search(SharedData& shared, size_t thread_id)
   continuationHistory_ = &(g_ary_continuationHistory[thread_id_ % HISTORY_ARRAY_SIZE]);
 }
 
+Search::Search(SharedData& shared, size_t thread_id, HistoryTables* const histories)
+    : shared_(shared),
+      thread_id_(thread_id) {
+  assert(histories != nullptr);
+  histories_ = histories;
+  counterMoves_ = &histories->counter_moves;
+  mainHistory_ = &histories->main_history;
+  lowPlyHistory_ = &histories->low_ply_history;
+  captureHistory_ = &histories->capture_history;
+  continuationHistory_ = &histories->continuation_history;
+}
+
 std::vector<Move> Search::GetPv() const {
   assert(!root_moves_.empty());
   return std::max_element(root_moves_.begin(), root_moves_.end())->pv;
@@ -219,6 +314,12 @@ void Search::PrepareForNextSearch(int num_search_threads) {
   followupmoves_.Clear();
   gains_.Clear();
 
+  // やねうら王（Stockfish11）の探索で用いる状態も、前回の探索の影響が残らないようにリセットする
+  // （SimpleIterativeDeepening()はIterativeDeepening()と異なり、これらを初期化しないため）
+  ttHitAverage_ = ttHitAverageWindow * ttHitAverageResolution / 2;
+  nmpMinPly_ = 0;
+  nmpColor_ = kBlack;
+
   // マスタースレッドの場合は、スレッド間で共有する置換表と実現確率キャッシュの世代を更新する
   if (is_master_thread()) {
     shared_.hash_table.NextAge();
@@ -342,6 +443,11 @@ std::pair<Move, Score> Search::SimpleIterativeDeepening(const Position& pos) {
         || std::abs(root_moves_.front().score) >= kScoreKnownWin) {
       break;
     }
+
+    // 深さの上限 or ノード数の上限に達したら、そこで終了する
+    if (iteration >= depth_limit_ || num_nodes_searched_ >= nodes_limit_) {
+      break;
+    }
   }
 
   // 最善手と評価値を取得する
@@ -355,8 +461,7 @@ void Search::IterativeDeepening(Node& node, ThreadManager& thread_manager) {
   assert(!root_moves_.empty());
 
   // 統計データをリセットする
-  g_mate3_tried = 0;
-  g_mate3_nodes = 0;
+  mate_stats_ = MateStats();
   g_sum_move_counts = 0;
   g_num_beta_cuts = 0;
   g_cuts_by_move.clear();
@@ -514,6 +619,7 @@ void Search::IterativeDeepening(Node& node, ThreadManager& thread_manager) {
       }
     }
   }
+
 }
 
 std::vector<RootMove> Search::CreateRootMoves(const Position& root_position,
@@ -778,22 +884,50 @@ Score Search::MainSearch(Node& node, Score alpha, Score beta, const Depth depth,
     return eval;
   }
 
+  // ７手以内・５手以内の詰みを調べる（残り探索深さが十分にある場合のみ）
+  // なお、５手詰関数・７手詰関数は３手以内の詰みも見つけるので、その場合は３手詰関数は呼ばない
+  if (   !kIsRoot
+      && depth >= kMate5Depth
+      && (entry == nullptr || !entry->skip_mate3())) {
+    mate_stats_.mate_n_tried++;
+    uint64_t mnodes = node.nodes_searched();
+    const int max_plies = depth >= kMate7Depth ? 7 : 5;
+    const uint64_t max_nodes = depth >= kMate7Depth ? kMate7MaxNodes : kMate5MaxNodes;
+    MateNResult mresult;
+    bool aborted = false;
+    if (IsMateInNPlies(node, node.board_key(), max_plies, max_nodes,
+                       &mate_cache_, &mresult, &aborted)) {
+      mate_stats_.mate_n_found++;
+      mate_stats_.mate_n_nodes += node.nodes_searched() - mnodes;
+      Score score = score_mate_in(ply + mresult.mate_distance);
+      ss->current_move = mresult.mate_move;
+      shared_.hash_table.Save(pos_key, ss->current_move, ScoreToTt(score, ply), depth,
+                      kBoundExact, ss->static_score, true, ttPv);
+      return score;
+    }
+    mate_stats_.mate_n_nodes += node.nodes_searched() - mnodes;
+
+    // 探索量の上限で打ち切られた場合は、３手以内の詰みを見逃さないよう、３手詰関数でも調べる
+    mate3_tried = !aborted;
+  }
+
   // ３手以内の詰みを調べる
   if (   !kIsRoot
+      && !mate3_tried
       && (entry == nullptr || !entry->skip_mate3())) {
     mate3_tried = true;
-    g_mate3_tried++;
+    mate_stats_.mate3_tried++;
     uint64_t m3nodes = node.nodes_searched();
     Mate3Result m3result;
     if (IsMateInThreePlies(node, &m3result)) {
-      g_mate3_nodes += node.nodes_searched() - m3nodes;
+      mate_stats_.mate3_nodes += node.nodes_searched() - m3nodes;
       Score score = score_mate_in(ply + m3result.mate_distance);
       ss->current_move = m3result.mate_move;
       shared_.hash_table.Save(pos_key, ss->current_move, ScoreToTt(score, ply), depth,
                       kBoundExact, ss->static_score, true, ttPv);
       return score;
     }
-    g_mate3_nodes += node.nodes_searched() - m3nodes;
+    mate_stats_.mate3_nodes += node.nodes_searched() - m3nodes;
   }
 
   // -----------------------
@@ -903,7 +1037,7 @@ Score Search::MainSearch(Node& node, Score alpha, Score beta, const Depth depth,
 
         ss->current_move = move;
         ss->countermoves_history = shared_.countermoves_history[move];
-        ss->continuationHistory = &(*this->continuationHistory_)[ss->inCheck][captureOrPawnPromotion][move.to()][move.piece_after_move()];
+        ss->continuationHistory = continuation_history_at(ss->inCheck, captureOrPawnPromotion, move.to(), move.piece_after_move());
 
         node.MakeMove(move, node.MoveGivesCheck(move), key_after_move);
 
@@ -1195,7 +1329,7 @@ moves_loop: // 王手がかかっている場合は、ここからスタート
     // 現在このスレッドで探索している指し手を保存しておく。
     ss->current_move = move;
     ss->countermoves_history = shared_.countermoves_history[move];
-    ss->continuationHistory = &(*this->continuationHistory_)[ss->inCheck][captureOrPawnPromotion][movedSq][movedPiece];
+    ss->continuationHistory = continuation_history_at(ss->inCheck, captureOrPawnPromotion, movedSq, movedPiece);
 
     //if (move_is_quiet && quiet_count < 64) {
     //  quiets_searched[quiet_count++] = move;
@@ -1688,7 +1822,7 @@ Score Search::QuiecenceSearch(Node& node, Score alpha, Score beta,
     }
 
     ss->current_move = move;
-    ss->continuationHistory = &(*this->continuationHistory_)[ss->inCheck][captureOrPawnPromotion][move.to()][move.piece_after_move()];
+    ss->continuationHistory = continuation_history_at(ss->inCheck, captureOrPawnPromotion, move.to(), move.piece_after_move());
 
     // Zobristハッシュキーを更新して、子局面の置換表をプリフェッチする
     Key64 key_after_move = node.key_after(move);
@@ -1742,17 +1876,17 @@ Score Search::QuiecenceSearch(Node& node, Score alpha, Score beta,
   if (   !kInCheck
       && (tte == nullptr || !tte->skip_mate3())) {
     Mate3Result m3result;
-    g_mate3_tried++;
+    mate_stats_.mate3_tried++;
     uint64_t m3nodes = node.nodes_searched();
     if (IsMateInThreePlies(node, &m3result)) {
-      g_mate3_nodes += node.nodes_searched() - m3nodes;
+      mate_stats_.mate3_nodes += node.nodes_searched() - m3nodes;
       Score score = score_mate_in(ply + m3result.mate_distance);
       ss->current_move = m3result.mate_move;
       shared_.hash_table.Save(pos_key, ss->current_move, ScoreToTt(score, ply),
                       kDepthZero, kBoundExact, ss->static_score, true, kIsPv);
       return score;
     } else {
-      g_mate3_nodes += node.nodes_searched() - m3nodes;
+      mate_stats_.mate3_nodes += node.nodes_searched() - m3nodes;
     }
   }
 
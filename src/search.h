@@ -27,10 +27,12 @@
 #define SEARCH_H_
 
 #include <atomic>
+#include <bitset>
 #include <vector>
 #include <utility>
 #include "common/array.h"
 #include "common/arraymap.h"
+#include "mate_n.h"
 #include "move.h"
 #include "node.h"
 #include "pvtable.h"
@@ -45,6 +47,41 @@ class ThreadManager;
  */
 constexpr int kMaxSearchThreads = 64;
 
+/**
+ * やねうら王（Stockfish11）のHistory一式です.
+ *
+ * 通常の探索では、スレッドIDごとに共有される大域的な配列を用いますが、多数のスレッドがそれぞれ独立に
+ * 探索を繰り返す場合（教師局面の生成など）は、スレッドごとにこのオブジェクトを確保してSearchに渡します。
+ * continuation historyは大きいので、前回のクリア以降に使われた部分を記録しておき、その部分だけをクリアします。
+ */
+struct HistoryTables {
+  CounterMoveHistory counter_moves;
+  ButterflyHistory main_history;
+  LowPlyHistory low_ply_history;
+  CapturePieceToHistory capture_history;
+  ContinuationHistory continuation_history[2][2];
+
+  /**
+   * すべてのHistoryをクリアします.
+   */
+  void Clear();
+
+  /**
+   * 前回のクリア以降に使われた部分だけをクリアします（結果はClear()と同じになります）.
+   */
+  void ClearUsed();
+
+  /**
+   * continuation_history[in_check][capture][to][piece] が使われたことを記録します.
+   */
+  void MarkUsed(bool in_check, bool capture, Square to, Piece piece) {
+    used_.set(((size_t(in_check) * 2 + size_t(capture)) * SQ_NB + int(to)) * PIECE_NB + int(piece));
+  }
+
+ private:
+  std::bitset<2 * 2 * SQ_NB * PIECE_NB> used_;
+};
+
 /**
  * アルファベータ探索を行うためのクラスです.
  */
@@ -72,10 +109,45 @@ class Search {
     bool inCheck;
   };
 
+  /** 詰み探索の統計データ. */
+  struct MateStats {
+    MateStats& operator+=(const MateStats& rhs) {
+      mate3_tried += rhs.mate3_tried;
+      mate3_nodes += rhs.mate3_nodes;
+      mate_n_tried += rhs.mate_n_tried;
+      mate_n_found += rhs.mate_n_found;
+      mate_n_nodes += rhs.mate_n_nodes;
+      return *this;
+    }
+
+    uint64_t mate3_tried = 0;
+    uint64_t mate3_nodes = 0;
+    uint64_t mate_n_tried = 0;
+    uint64_t mate_n_found = 0;
+    uint64_t mate_n_nodes = 0;
+  };
+
   static void Init();
 
+  /**
+   * 全スレッド分の、やねうら王（Stockfish11）のHistoryをクリアします.
+   */
+  static void ClearHistories();
+
+  /**
+   * このSearchオブジェクトが用いる、やねうら王（Stockfish11）のHistoryだけをクリアします.
+   * コンストラクタでHistoryTablesを渡した場合は、前回のクリア以降に使われた部分だけをクリアします。
+   */
+  void ClearHistory();
+
   Search(SharedData& shared, size_t thread_id = 0);
 
+  /**
+   * 呼び出し側が確保したHistoryを用いて探索するSearchオブジェクトを作成します.
+   * 複数のスレッドで独立に探索する場合は、スレッドごとに別のHistoryTablesを渡してください。
+   */
+  Search(SharedData& shared, size_t thread_id, HistoryTables* histories);
+
   /**
    * 反復深化による探索を行います.
    * 注意：この関数を呼ぶ前に、予めset_root_moves()関数を呼び、root_moves_をセットしておいてください。
@@ -97,6 +169,7 @@ class Search {
   /**
    * シンプルな反復深化探索を行います.
    * 主に教師局面の生成に用いることを想定しています.
+   * set_depth_limit()やset_nodes_limit()で制限を設けた場合は、各イテレーションの終了時に、制限に達したか否かを判定します。
    * @param pos 探索を行う局面
    * @return 最善手と評価値のペア
    */
@@ -114,6 +187,17 @@ class Search {
     return num_nodes_searched_;
   }
 
+  const MateStats& mate_stats() const {
+    return mate_stats_;
+  }
+
+  /**
+   * ５手詰・７手詰関数の結果のキャッシュをクリアします（新しい対局を始めるときに呼んでください）.
+   */
+  void ClearMateCache() {
+    mate_cache_.Clear();
+  }
+
   void set_learning_mode(bool is_learning) {
     learning_mode_ = is_learning;
   }
@@ -164,6 +248,19 @@ class Search {
   CapturePieceToHistory* captureHistory_;
   ContinuationHistory (*continuationHistory_)[2][2];
 
+  /** 呼び出し側から渡されたHistory（大域的な配列を用いる場合は、nullptr） */
+  HistoryTables* histories_ = nullptr;
+
+  /**
+   * 指し手に対応するcontinuation historyを返します（HistoryTablesを用いている場合は、使われたことを記録します）.
+   */
+  PieceToHistory* continuation_history_at(bool in_check, bool capture, Square to, Piece piece) {
+    if (histories_ != nullptr) {
+      histories_->MarkUsed(in_check, capture, to, piece);
+    }
+    return &(*continuationHistory_)[in_check][capture][to][piece];
+  }
+
   uint64_t ttHitAverage_;
 
   // nmpMinPly : null moveの前回の適用ply
@@ -229,6 +326,12 @@ class Search {
   GainsStats gains_;
   std::vector<RootMove> root_moves_;
 
+  /** ５手詰・７手詰関数の結果を記憶しておくキャッシュ（スレッドごとに１つ） */
+  MateCache mate_cache_;
+
+  /** 詰み探索のコストと、それによって得られたカットの回数（開発用。スレッドごとに集計する） */
+  MateStats mate_stats_;
+
   int depth_limit_ = kMaxPly;
   uint64_t nodes_limit_ = UINT64_MAX;
 
@@ -19,6 +19,7 @@
 
 #include "swap.h"
 
+#include <algorithm>
 #include "common/array.h"
 #include "material.h"
 #include "position.h"
@@ -55,6 +56,216 @@ PieceType FindLeastValuableAttacker(const Position& pos, Bitboard pieces,
   return kKing;
 }
 
+/**
+ * 駒を取り合う順序（FindLeastValuableAttacker()で調べる順番と同じ）です.
+ */
+constexpr PieceType kExchangeOrder[] = {
+  kPawn, kLance, kKnight, kPPawn, kPLance, kSilver, kPKnight, kPSilver,
+  kGold, kBishop, kRook, kHorse, kDragon, kKing,
+};
+
+/**
+ * あるマスへの駒交換の計算に必要な情報を、そのマスに移動する指し手の間で共有するためのクラスです.
+ *
+ * 最初の１手の後に続く取り合いの順番（どの駒で取り返すか、成るか）は、動かした駒の種類には依存せず、
+ * 移動元のマス（駒を打つ手の場合は、どの駒を打っても同じ）だけで決まります。
+ * そこで、取り合いの順番を移動元のマスごとに一度だけ求めて記憶しておき、各指し手のSEE値は、
+ * 記憶しておいた順番を使ったミニマックス計算のみで求めています。
+ * また、取り合いに参加しうる駒（移動先に利いている駒と、盤上の飛び駒）を安い順に並べておくことで、
+ * 最も安い駒を探す処理を、短い配列の走査で済ませています。
+ */
+class SquareSwap {
+ public:
+  SquareSwap(const Position& pos, Square to)
+      : pos_(pos),
+        to_(to),
+        attackers_(pos.AttackersTo(to, pos.pieces())),
+        sliders_(pos.pieces(kLance, kBishop, kRook, kHorse, kDragon)) {
+  }
+
+  Score Evaluate(Move move);
+
+ private:
+  /**
+   * 最初の１手の後に続く、取り合いの順番です.
+   */
+  struct Sequence {
+    /** 最初の１手の移動元のマス（駒を打つ手の場合は、移動先のマス） */
+    Square from;
+    /** 取り返す手の数 */
+    int length;
+    /** 最後に玉で取り返した後、さらに相手の駒が利いている場合はtrue */
+    bool ends_with_king;
+    /**
+     * k回目に取り返す手による駒割りの増分のうち、最初の１手の駒に依存しない部分です.
+     * （terms[1]は成る価値のみ、terms[k] (k >= 2) は、(k-1)回目に取り返した駒の交換値と成る価値の和）
+     */
+    Array<Score, 40> terms;
+  };
+
+  struct Candidate {
+    uint8_t square; // Squareのデフォルトコンストラクタによる初期化を避けるため、整数で保持する
+    PieceType type;
+  };
+
+  /**
+   * 駒を取り除いたマスの背後から、飛び駒の利きが新たに通る可能性がある場合は、trueを返します.
+   */
+  bool MayRevealSlider(Square removed_sq) const {
+    return (line_bb(to_, removed_sq) & sliders_).any();
+  }
+
+  const Sequence& GetSequence(Square from);
+  void ComputeSequence(Sequence* seq);
+  void SortCandidates();
+
+  static constexpr int kMaxSequences = 8;
+
+  const Position& pos_;
+  const Square to_;
+  const Bitboard attackers_;
+  const Bitboard sliders_;
+  Array<Sequence, kMaxSequences> sequences_;
+  int num_sequences_ = 0;
+  Array<Candidate, 40> candidates_;
+  int num_candidates_ = -1; // 未計算の場合は-1
+};
+
+void SquareSwap::SortCandidates() {
+  const Bitboard candidates = attackers_ | sliders_;
+  num_candidates_ = 0;
+  for (PieceType pt : kExchangeOrder) {
+    (candidates & pos_.pieces(pt)).ForEach([&](Square sq) {
+      assert(num_candidates_ < int(candidates_.size()));
+      candidates_[num_candidates_++] = Candidate{uint8_t(sq), pt};
+    });
+  }
+}
+
+const SquareSwap::Sequence& SquareSwap::GetSequence(const Square from) {
+  for (int i = 0; i < num_sequences_; ++i) {
+    if (sequences_[i].from == from) {
+      return sequences_[i];
+    }
+  }
+  // 記憶しておく数を超えた場合は、最後の要素を上書きする
+  int index = std::min(num_sequences_, kMaxSequences - 1);
+  num_sequences_ = index + 1;
+  sequences_[index].from = from;
+  ComputeSequence(&sequences_[index]);
+  return sequences_[index];
+}
+
+void SquareSwap::ComputeSequence(Sequence* const seq) {
+  seq->length = 0;
+  seq->ends_with_king = false;
+
+  // 最初の１手の後に、移動先のマスに利いている相手の駒を求める
+  Square from = seq->from;
+  Color stm = ~pos_.side_to_move();
+  Bitboard occ = pos_.pieces().andnot(square_bb(from));
+  Bitboard attackers = attackers_;
+  if (from != to_ && MayRevealSlider(from)) {
+    attackers |= pos_.SlidersAttackingTo(to_, occ);
+  }
+  attackers &= occ;
+  Bitboard stm_attackers = attackers & pos_.pieces(stm);
+  if (stm_attackers.none()) {
+    return;
+  }
+
+  if (num_candidates_ < 0) {
+    SortCandidates();
+  }
+
+  // 取る手が存在しなくなるまで、取り合いを続ける
+  Score previous_capture = kScoreZero;
+  while (true) {
+    assert(stm_attackers.any());
+
+    // 最も安い駒を見つける（候補は安い順に並んでいる）
+    int i = 0;
+    while (!stm_attackers.test(Square(candidates_[i].square))) {
+      ++i;
+      assert(i < num_candidates_);
+    }
+    from = Square(candidates_[i].square);
+    PieceType captured = candidates_[i].type;
+
+    // 成ることができる場合は、必ず成ると仮定する
+    Score term = previous_capture;
+    if (   IsPromotablePieceType(captured)
+        && promotion_zone_bb(stm).test(square_bb(from) | square_bb(to_))) {
+      term += Material::promotion_value(captured);
+      captured = GetPromotedType(captured);
+    }
+    seq->terms[++seq->length] = term;
+    previous_capture = Material::exchange_value(captured);
+
+    // 指し手に沿って、将棋盤を動かす
+    occ.reset(from);
+    stm = ~stm;
+    if (MayRevealSlider(from)) {
+      attackers |= pos_.SlidersAttackingTo(to_, occ);
+    }
+    attackers &= occ;
+    stm_attackers = attackers & pos_.pieces(stm);
+
+    // 取る手がなくなったら、終了する
+    if (stm_attackers.none()) {
+      break;
+    }
+
+    // 相手の玉を取る手を指してしまう前に、終了する
+    if (captured == kKing) {
+      seq->ends_with_king = true;
+      break;
+    }
+  }
+  assert(seq->length + 2 <= int(seq->terms.size()));
+}
+
+Score SquareSwap::Evaluate(const Move move) {
+  assert(move.to() == to_);
+
+  // 最初の１手について、駒割りの増分を求める
+  Array<Score, 40> gain;
+  gain[0] = Material::exchange_value(move.captured_piece_type());
+  if (move.is_promotion()) {
+    gain[0] += Material::promotion_value(move.piece_type());
+  }
+
+  // 移動先に利いている相手の駒がなく、移動元の背後からの飛び駒の利きもなければ、直ちにリターンする
+  const Color opponent = ~pos_.side_to_move();
+  if (   !attackers_.test(pos_.pieces(opponent))
+      && (move.is_drop() || !MayRevealSlider(move.from()))) {
+    return gain[0];
+  }
+
+  // 移動元のマスに対応する、取り合いの順番を求める
+  const Sequence& seq = GetSequence(move.is_drop() ? to_ : move.from());
+  if (seq.length == 0) {
+    return gain[0];
+  }
+
+  // 取り合いに沿って、駒割りの増分を求める
+  gain[1] = Material::exchange_value(move.piece_type_after_move()) + seq.terms[1] - gain[0];
+  for (int k = 2; k <= seq.length; ++k) {
+    gain[k] = seq.terms[k] - gain[k - 1];
+  }
+  int depth = seq.length + 1;
+  if (seq.ends_with_king) {
+    gain[depth++] = static_cast<Score>(9999);
+  }
+
+  // ミニマックス計算をして、SEE値を求める
+  while (--depth) {
+    gain[depth - 1] = std::min(-gain[depth], gain[depth - 1]);
+  }
+
+  return gain[0];
+}
+
 /**
  * GlobalSwap内で用いられる、局面データです.
  * 必要最低限のデータに絞ることで、PositionクラスよりもMakeMoveが高速になっています。
@@ -259,6 +470,77 @@ Score Swap::Evaluate(const Move move, const Position& pos) {
   return gain[0];
 }
 
+void Swap::EvaluateBatch(const Position& pos, const Square to,
+                         const Move* const moves, const size_t num_moves,
+                         Score* const values) {
+  if (num_moves == 0) {
+    return;
+  }
+  SquareSwap square_swap(pos, to);
+  for (size_t i = 0; i < num_moves; ++i) {
+    values[i] = square_swap.Evaluate(moves[i]);
+  }
+}
+
+void Swap::EvaluateMoves(const Position& pos, const ExtMove* const begin,
+                         const ExtMove* const end, Score* const values) {
+  EvaluateMoves(pos, begin, end, values, Bitboard().set());
+}
+
+void Swap::EvaluateMoves(const Position& pos, const ExtMove* const begin,
+                         const ExtMove* const end, Score* const values,
+                         const Bitboard& attacked_squares) {
+  assert(end - begin <= Move::kMaxLegalMoves);
+
+  // 移動先のマスごとに、指し手の連結リストを作る
+  const int kNone = -1;
+  const int num_moves = static_cast<int>(end - begin);
+  ArrayMap<int, Square> head;
+  Array<int, Move::kMaxLegalMoves> next;
+  Bitboard targets;
+  for (int i = num_moves - 1; i >= 0; --i) {
+    Square to = begin[i].move.to();
+    if (targets.test(to)) {
+      next[i] = head[to];
+    } else {
+      targets.set(to);
+      next[i] = kNone;
+    }
+    head[to] = i;
+  }
+
+  // 移動先のマスごとに、駒交換の情報を共有しながらSEE値を計算する
+  targets.ForEach([&](Square to) {
+    // 相手の利きがないマスへの駒打ちは、取り返されることがないので、SEE値は0になる
+    if (!attacked_squares.test(to)) {
+      for (int* link = &head[to]; *link != kNone; ) {
+        if (begin[*link].move.is_drop()) {
+          values[*link] = kScoreZero;
+          *link = next[*link];
+        } else {
+          link = &next[*link];
+        }
+      }
+      if (head[to] == kNone) {
+        return;
+      }
+    }
+
+    // 移動先が同じ手が２手以下の場合は、共有による節約が前処理のコストを下回るので、通常の方法で計算する
+    const int second = next[head[to]];
+    if (second == kNone || next[second] == kNone) {
+      for (int i = head[to]; i != kNone; i = next[i]) {
+        values[i] = Evaluate(begin[i].move, pos);
+      }
+      return;
+    }
+    SquareSwap square_swap(pos, to);
+    for (int i = head[to]; i != kNone; i = next[i]) {
+      values[i] = square_swap.Evaluate(begin[i].move);
+    }
+  });
+}
+
 bool Swap::IsWinning(Move move, const Position& pos) {
   Score gain = Material::value(move.captured_piece_type());
   Score loss = Material::value(move.piece_type());
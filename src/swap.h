@@ -20,6 +20,7 @@
 #ifndef SWAP_H_
 #define SWAP_H_
 
+#include "bitboard.h"
 #include "move.h"
 class Position;
 
@@ -33,6 +34,36 @@ class Swap {
    */
   static Score Evaluate(Move move, const Position& pos);
 
+  /**
+   * 同じマスに移動する複数の指し手について、駒交換の損得（SEE値）をまとめて計算します.
+   *
+   * 移動先のマスに利いている駒の集合と、駒を取り合う順序の候補は、すべての指し手で共有されます。
+   * 結果は、指し手ごとにEvaluate()を呼んだ場合と一致します。
+   * @param to        指し手の移動先のマス（すべての指し手で同じであること）
+   * @param moves     指し手の配列
+   * @param num_moves 指し手の数
+   * @param values    SEE値を保存する配列（num_moves個の要素が必要）
+   */
+  static void EvaluateBatch(const Position& pos, Square to, const Move* moves,
+                            size_t num_moves, Score* values);
+
+  /**
+   * 指し手リストに含まれるすべての手について、SEE値をまとめて計算します.
+   * 移動先のマスが同じ手ごとにまとめて、EvaluateBatch()と同じ方法で計算を行います。
+   * @param values SEE値を保存する配列（指し手リストと同じ順番で保存されます）
+   */
+  static void EvaluateMoves(const Position& pos, const ExtMove* begin,
+                            const ExtMove* end, Score* values);
+
+  /**
+   * 相手の利きがあるマス（PositionInfo::attacked_squares()等）が計算済みの場合に用いる、EvaluateMoves()です.
+   * 相手の利きがないマスへの駒打ちは、駒交換が起こらないので、SEE値を0として計算を省略します。
+   * @param attacked_squares 相手の利きがあるマス
+   */
+  static void EvaluateMoves(const Position& pos, const ExtMove* begin,
+                            const ExtMove* end, Score* values,
+                            const Bitboard& attacked_squares);
+
   /**
    * 駒交換が得になる場合（SEE値 > 0 の場合）に、trueを返します.
    */
@@ -0,0 +1,803 @@
+/*
+ * 技巧 (Gikou), a USI shogi (Japanese chess) playing engine.
+ * Copyright (C) 2016-2017 Yosuke Demura
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if !defined(MINIMUM)
+
+#include "teacher_archive.h"
+
+#include <cassert>
+#include <cinttypes>
+#include <cstring>
+#include <algorithm>
+#include <fcntl.h>
+#include <omp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "common/array.h"
+
+namespace {
+
+constexpr char kArchiveMagic[8] = {'G', 'K', 'T', 'E', 'A', 'C', 'H', 'R'};
+constexpr uint32_t kArchiveVersion = 1;
+
+/** 一度にまとめて圧縮するブロック数（この単位で、複数のスレッドに圧縮を分担させる） */
+constexpr size_t kBlocksPerFlush = 64;
+
+/** PVデータの長さの上限（壊れたファイルを読み込んだ場合に、巨大なメモリ確保を防ぐため） */
+constexpr uint32_t kMaxPvDataSize = 1 << 16;
+
+/**
+ * アーカイブのヘッダです.
+ */
+struct ArchiveHeader {
+  char magic[8];
+  uint32_t version;
+  uint32_t record_type;
+  uint64_t num_records;
+  uint64_t num_blocks;
+  uint64_t index_offset;
+};
+
+/** ブロックの先頭に置くフラグ：局面と評価値を、直前のレコードとの差分で保存している */
+constexpr uint8_t kDeltaCoding = 1;
+
+/**
+ * 適応的な二値算術符号の符号化器です（いわゆるレンジコーダ）.
+ *
+ * 各ビットが0である確率を、それぞれのビットに対応する「確率モデル」（12ビットの固定小数点数）で推定しながら、符号化します。
+ * 確率モデルは、ビットを符号化するたびに、実際に出現したビットに近づくように更新されます。
+ *
+ * （参考文献）
+ *   - G. N. N. Martin: Range encoding: an algorithm for removing redundancy
+ *     from a digitised message, Video & Data Recording Conference, 1979.
+ *   - Igor Pavlov: LZMA SDK, http://www.7-zip.org/sdk.html.
+ */
+class RangeEncoder {
+ public:
+  static constexpr int kNumProbabilityBits = 12;
+  static constexpr uint16_t kInitialProbability = 1 << (kNumProbabilityBits - 1);
+
+  explicit RangeEncoder(std::string* output)
+      : output_(output) {
+  }
+
+  void EncodeBit(uint16_t* const probability, const uint32_t bit) {
+    const uint32_t bound = (range_ >> kNumProbabilityBits) * (*probability);
+    if (bit == 0) {
+      range_ = bound;
+      *probability += ((1 << kNumProbabilityBits) - *probability) >> kAdaptationShift;
+    } else {
+      low_ += bound;
+      range_ -= bound;
+      *probability -= *probability >> kAdaptationShift;
+    }
+    Normalize();
+  }
+
+  /**
+   * 確率モデルを用いずに（0と1の確率を等しいとみなして）、下位num_bitsビットを符号化します.
+   */
+  void EncodeDirectBits(const uint32_t value, const int num_bits) {
+    for (int i = num_bits - 1; i >= 0; --i) {
+      range_ >>= 1;
+      if ((value >> i) & 1) {
+        low_ += range_;
+      }
+      Normalize();
+    }
+  }
+
+  /**
+   * 符号化を終了して、残りのデータを書き出します.
+   */
+  void Flush() {
+    for (int i = 0; i < 5; ++i) {
+      ShiftLow();
+    }
+  }
+
+ private:
+  static constexpr int kAdaptationShift = 5;
+
+  void Normalize() {
+    while (range_ < (1u << 24)) {
+      range_ <<= 8;
+      ShiftLow();
+    }
+  }
+
+  void ShiftLow() {
+    if (static_cast<uint32_t>(low_) < 0xFF000000u || (low_ >> 32) != 0) {
+      const uint8_t carry = static_cast<uint8_t>(low_ >> 32);
+      uint8_t temp = cache_;
+      do {
+        output_->push_back(static_cast<char>(temp + carry));
+        temp = 0xFF;
+      } while (--cache_size_ != 0);
+      cache_ = static_cast<uint8_t>(low_ >> 24);
+    }
+    ++cache_size_;
+    low_ = (low_ & 0x00FFFFFF) << 8;
+  }
+
+  std::string* const output_;
+  uint64_t low_ = 0;
+  uint32_t range_ = 0xFFFFFFFF;
+  uint8_t cache_ = 0;
+  uint64_t cache_size_ = 1;
+};
+
+/**
+ * RangeEncoderで符号化されたデータを復号します.
+ */
+class RangeDecoder {
+ public:
+  RangeDecoder(const uint8_t* begin, const uint8_t* end)
+      : current_(begin), end_(end) {
+    for (int i = 0; i < 5; ++i) {
+      code_ = (code_ << 8) | NextByte();
+    }
+  }
+
+  uint32_t DecodeBit(uint16_t* const probability) {
+    const uint32_t bound = (range_ >> RangeEncoder::kNumProbabilityBits) * (*probability);
+    uint32_t bit;
+    if (code_ < bound) {
+      range_ = bound;
+      *probability += ((1 << RangeEncoder::kNumProbabilityBits) - *probability) >> kAdaptationShift;
+      bit = 0;
+    } else {
+      code_ -= bound;
+      range_ -= bound;
+      *probability -= *probability >> kAdaptationShift;
+      bit = 1;
+    }
+    Normalize();
+    return bit;
+  }
+
+  uint32_t DecodeDirectBits(const int num_bits) {
+    uint32_t value = 0;
+    for (int i = 0; i < num_bits; ++i) {
+      range_ >>= 1;
+      uint32_t bit = code_ >= range_ ? 1 : 0;
+      code_ -= range_ & (0u - bit);
+      value = (value << 1) | bit;
+      Normalize();
+    }
+    return value;
+  }
+
+  /**
+   * 符号化されたデータの末尾を超えて読み込もうとした場合は、trueを返します（データが壊れている）.
+   */
+  bool overrun() const {
+    return overrun_;
+  }
+
+ private:
+  static constexpr int kAdaptationShift = 5;
+
+  uint8_t NextByte() {
+    if (current_ < end_) {
+      return *current_++;
+    }
+    overrun_ = true;
+    return 0;
+  }
+
+  void Normalize() {
+    while (range_ < (1u << 24)) {
+      range_ <<= 8;
+      code_ = (code_ << 8) | NextByte();
+    }
+  }
+
+  const uint8_t* current_;
+  const uint8_t* const end_;
+  uint32_t range_ = 0xFFFFFFFF;
+  uint32_t code_ = 0;
+  bool overrun_ = false;
+};
+
+/**
+ * kNumBitsビットの値を、上位ビットから順に、それまでのビットを文脈として符号化するための確率モデルです.
+ */
+template<int kNumBits>
+class BitTreeModel {
+ public:
+  BitTreeModel() {
+    std::fill(probabilities_.begin(), probabilities_.end(), RangeEncoder::kInitialProbability);
+  }
+
+  void Encode(RangeEncoder* const encoder, const uint32_t value) {
+    uint32_t node = 1;
+    for (int i = kNumBits - 1; i >= 0; --i) {
+      const uint32_t bit = (value >> i) & 1;
+      encoder->EncodeBit(&probabilities_[node], bit);
+      node = (node << 1) | bit;
+    }
+  }
+
+  uint32_t Decode(RangeDecoder* const decoder) {
+    uint32_t node = 1;
+    for (int i = 0; i < kNumBits; ++i) {
+      node = (node << 1) | decoder->DecodeBit(&probabilities_[node]);
+    }
+    return node - (1u << kNumBits);
+  }
+
+ private:
+  Array<uint16_t, 1 << kNumBits> probabilities_;
+};
+
+/**
+ * 指し手（Move::ToUint32()の26ビット）を符号化するための確率モデルです.
+ *
+ * 移動先＋成り（8ビット）、移動元＋打つ手のフラグ（8ビット）、動かす駒（5ビット）、取る駒（5ビット）に分けて、
+ * それぞれを別々のモデルで符号化します。
+ */
+class MoveModel {
+ public:
+  void Encode(RangeEncoder* const encoder, const Move move) {
+    const uint32_t value = move.ToUint32();
+    destination_.Encode(encoder, value & 0xFF);
+    source_.Encode(encoder, (value >> 8) & 0xFF);
+    piece_.Encode(encoder, (value >> 16) & 0x1F);
+    captured_.Encode(encoder, (value >> 21) & 0x1F);
+  }
+
+  Move Decode(RangeDecoder* const decoder) {
+    uint32_t value = destination_.Decode(decoder);
+    value |= source_.Decode(decoder) << 8;
+    value |= piece_.Decode(decoder) << 16;
+    value |= captured_.Decode(decoder) << 21;
+    return Move::FromUint32(value);
+  }
+
+ private:
+  BitTreeModel<8> destination_;
+  BitTreeModel<8> source_;
+  BitTreeModel<5> piece_;
+  BitTreeModel<5> captured_;
+};
+
+/**
+ * 符号なし整数を符号化するための確率モデルです.
+ * 有効なビット数（0〜32）を確率モデルで符号化した後、最上位ビットを除く残りのビットをそのまま符号化します。
+ */
+class NumberModel {
+ public:
+  void Encode(RangeEncoder* const encoder, const uint32_t value) {
+    const int num_bits = value == 0 ? 0 : 32 - __builtin_clz(value);
+    num_bits_.Encode(encoder, num_bits);
+    if (num_bits >= 2) {
+      encoder->EncodeDirectBits(value, num_bits - 1);
+    }
+  }
+
+  uint32_t Decode(RangeDecoder* const decoder) {
+    const int num_bits = std::min<int>(num_bits_.Decode(decoder), 32);
+    if (num_bits == 0) {
+      return 0;
+    }
+    const uint32_t top = 1u << (num_bits - 1);
+    return top | (num_bits >= 2 ? decoder->DecodeDirectBits(num_bits - 1) : 0);
+  }
+
+ private:
+  BitTreeModel<6> num_bits_;
+};
+
+/**
+ * ブロックのデータが壊れていないかを確かめるための、チェックサム（FNV-1a）を計算します.
+ */
+uint32_t ComputeChecksum(const uint8_t* const data, const size_t size) {
+  uint32_t hash = 2166136261u;
+  for (size_t i = 0; i < size; ++i) {
+    hash = (hash ^ data[i]) * 16777619u;
+  }
+  return hash;
+}
+
+/**
+ * 符号付き整数を、絶対値の小さい順に符号なし整数へ対応付けます（zigzag符号化）.
+ */
+inline uint32_t ZigzagEncode(const int32_t value) {
+  return (static_cast<uint32_t>(value) << 1) ^ static_cast<uint32_t>(value >> 31);
+}
+
+inline int32_t ZigzagDecode(const uint32_t value) {
+  return static_cast<int32_t>(value >> 1) ^ -static_cast<int32_t>(value & 1);
+}
+
+/**
+ * 局面のハフマン符号（256ビット）を、直前の局面のハフマン符号を文脈として符号化するための確率モデルです.
+ *
+ * 各ビットを、「何ビット目か」と「直前の局面の同じビット」の組ごとに異なる確率で符号化します。
+ * 同じ対局から続けて採られた局面のように、直前の局面と似ている場合には、ほとんどのビットが一致するので、よく圧縮できます。
+ */
+class HuffmanCodeModel {
+ public:
+  HuffmanCodeModel() {
+    for (auto& p : probabilities_) {
+      std::fill(p.begin(), p.end(), RangeEncoder::kInitialProbability);
+    }
+  }
+
+  void Encode(RangeEncoder* const encoder, const HuffmanCode& code) {
+    for (int i = 0; i < kNumBits; ++i) {
+      const uint32_t bit = GetBit(code, i);
+      encoder->EncodeBit(&probabilities_[i][GetBit(previous_, i)], bit);
+    }
+    previous_ = code;
+  }
+
+  HuffmanCode Decode(RangeDecoder* const decoder) {
+    Array<uint64_t, 4> array;
+    array.clear();
+    for (int i = 0; i < kNumBits; ++i) {
+      const uint64_t bit = decoder->DecodeBit(&probabilities_[i][GetBit(previous_, i)]);
+      array[i / 64] |= bit << (i % 64);
+    }
+    previous_ = HuffmanCode(array);
+    return previous_;
+  }
+
+ private:
+  static constexpr int kNumBits = 256;
+
+  static uint32_t GetBit(const HuffmanCode& code, const int i) {
+    return (code.array()[i / 64] >> (i % 64)) & 1;
+  }
+
+  Array<Array<uint16_t, 2>, kNumBits> probabilities_;
+  HuffmanCode previous_{Array<uint64_t, 4>{}};
+};
+
+/**
+ * 局面のブロックを符号化します.
+ *
+ * delta_codingがfalseの場合は、ハフマン符号をそのまま保存し、指し手と評価値のみをレンジコーダで圧縮します。
+ * delta_codingがtrueの場合は、ハフマン符号と評価値を、直前の局面との差分（HuffmanCodeModel）として圧縮します。
+ */
+std::string EncodePositions(const TeacherPosition* const positions,
+                            const size_t num_positions,
+                            const bool delta_coding) {
+  std::string output;
+  output.push_back(delta_coding ? kDeltaCoding : 0);
+
+  // 1. 差分で保存しない場合は、ハフマン符号を（すでに圧縮されているので）そのまま保存する
+  if (!delta_coding) {
+    for (size_t i = 0; i < num_positions; ++i) {
+      output.append(reinterpret_cast<const char*>(&positions[i].huffman_code),
+                    sizeof(HuffmanCode));
+    }
+  }
+
+  // 2. 指し手と評価値（と、差分で保存する場合のハフマン符号）を、レンジコーダで圧縮する
+  RangeEncoder encoder(&output);
+  HuffmanCodeModel huffman_code_model;
+  MoveModel move_model;
+  NumberModel score_model;
+  int32_t previous_score = 0;
+  for (size_t i = 0; i < num_positions; ++i) {
+    const int32_t score = static_cast<int32_t>(positions[i].score);
+    if (delta_coding) {
+      huffman_code_model.Encode(&encoder, positions[i].huffman_code);
+    }
+    move_model.Encode(&encoder, positions[i].move);
+    score_model.Encode(&encoder, ZigzagEncode(delta_coding ? score - previous_score : score));
+    previous_score = score;
+  }
+  encoder.Flush();
+
+  return output;
+}
+
+/**
+ * PVデータのブロックを符号化します.
+ */
+std::string EncodePvs(const TeacherPv* const pvs, const size_t num_pvs) {
+  std::string output;
+  output.push_back(0);
+
+  // 1. ハフマン符号と進行度は、そのまま保存する
+  for (size_t i = 0; i < num_pvs; ++i) {
+    output.append(reinterpret_cast<const char*>(&pvs[i].huffman_code),
+                  sizeof(HuffmanCode));
+  }
+  for (size_t i = 0; i < num_pvs; ++i) {
+    output.append(reinterpret_cast<const char*>(&pvs[i].progress),
+                  sizeof(float));
+  }
+
+  // 2. 対局結果と指し手列を、レンジコーダで圧縮する
+  RangeEncoder encoder(&output);
+  BitTreeModel<2> result_model;
+  NumberModel length_model;
+  MoveModel move_model;
+  for (size_t i = 0; i < num_pvs; ++i) {
+    result_model.Encode(&encoder, static_cast<uint32_t>(pvs[i].game_result));
+    length_model.Encode(&encoder, pvs[i].pv_data.size());
+    for (Move move : pvs[i].pv_data) {
+      move_model.Encode(&encoder, move);
+    }
+  }
+  encoder.Flush();
+
+  return output;
+}
+
+} // namespace
+
+TeacherArchive::~TeacherArchive() {
+  if (data_ != nullptr) {
+    munmap(const_cast<uint8_t*>(data_), mapped_size_);
+  }
+}
+
+bool TeacherArchive::IsArchive(const char* const file_name) {
+  std::FILE* fp = std::fopen(file_name, "rb");
+  if (fp == nullptr) {
+    return false;
+  }
+  char magic[sizeof(kArchiveMagic)];
+  bool is_archive = std::fread(magic, sizeof(magic), 1, fp) == 1
+                 && std::memcmp(magic, kArchiveMagic, sizeof(magic)) == 0;
+  std::fclose(fp);
+  return is_archive;
+}
+
+bool TeacherArchive::Open(const char* const file_name) {
+  assert(!is_open());
+
+  // 1. ファイルをメモリマップする
+  int fd = open(file_name, O_RDONLY);
+  if (fd == -1) {
+    std::printf("Failed to open %s.\n", file_name);
+    return false;
+  }
+  struct stat file_stat;
+  if (fstat(fd, &file_stat) == -1 || file_stat.st_size < static_cast<off_t>(sizeof(ArchiveHeader))) {
+    std::printf("%s is not a teacher archive.\n", file_name);
+    close(fd);
+    return false;
+  }
+  const size_t file_size = file_stat.st_size;
+  void* address = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+  close(fd);
+  if (address == MAP_FAILED) {
+    std::printf("Failed to map %s.\n", file_name);
+    return false;
+  }
+  madvise(address, file_size, MADV_RANDOM);
+  const uint8_t* data = static_cast<const uint8_t*>(address);
+
+  // 2. ヘッダとインデックスを検証する
+  ArchiveHeader header;
+  std::memcpy(&header, data, sizeof(header));
+  bool ok = std::memcmp(header.magic, kArchiveMagic, sizeof(kArchiveMagic)) == 0
+         && header.version == kArchiveVersion
+         && (header.record_type == kPositions || header.record_type == kPvs)
+         && header.index_offset >= sizeof(ArchiveHeader)
+         && header.index_offset <= file_size
+         && header.num_blocks <= (file_size - header.index_offset) / sizeof(BlockIndexEntry);
+  if (ok) {
+    index_.resize(header.num_blocks);
+    std::memcpy(index_.data(), data + header.index_offset, index_.size() * sizeof(BlockIndexEntry));
+    uint64_t num_records = 0;
+    for (size_t i = 0; i < index_.size() && ok; ++i) {
+      const BlockIndexEntry& entry = index_[i];
+      const bool is_last = i + 1 == index_.size();
+      ok = entry.offset >= sizeof(ArchiveHeader)
+        && entry.offset <= header.index_offset
+        && entry.size <= header.index_offset - entry.offset
+        && entry.num_records >= 1
+        && (is_last ? entry.num_records <= kBlockSize : entry.num_records == kBlockSize);
+      num_records += entry.num_records;
+    }
+    ok = ok && num_records == header.num_records;
+  }
+  if (!ok) {
+    std::printf("%s is broken.\n", file_name);
+    index_.clear();
+    munmap(address, file_size);
+    return false;
+  }
+
+  data_ = data;
+  mapped_size_ = file_size;
+  record_type_ = static_cast<RecordType>(header.record_type);
+  num_records_ = header.num_records;
+  return true;
+}
+
+bool TeacherArchive::ChecksumIsValid(const size_t block_id) const {
+  return ComputeChecksum(block_data(block_id), block_bytes(block_id)) == index_.at(block_id).checksum;
+}
+
+bool TeacherArchive::DecodeBlock(const size_t block_id,
+                                 std::vector<TeacherPosition>* const positions) const {
+  assert(record_type_ == kPositions);
+  assert(positions != nullptr);
+
+  const size_t num_positions = block_length(block_id);
+  const uint8_t* begin = block_data(block_id);
+  const uint8_t* end = begin + block_bytes(block_id);
+  positions->resize(num_positions);
+  if (begin == end || !ChecksumIsValid(block_id)) {
+    return false;
+  }
+
+  // 1. ハフマン符号をそのまま保存している場合は、コピーする
+  const bool delta_coding = (*begin++ & kDeltaCoding) != 0;
+  if (!delta_coding) {
+    if (size_t(end - begin) < num_positions * sizeof(HuffmanCode)) {
+      return false;
+    }
+    for (size_t i = 0; i < num_positions; ++i) {
+      std::memcpy(&(*positions)[i].huffman_code, begin, sizeof(HuffmanCode));
+      begin += sizeof(HuffmanCode);
+    }
+  }
+
+  // 2. 指し手と評価値（と、差分で保存している場合のハフマン符号）を復号する
+  RangeDecoder decoder(begin, end);
+  HuffmanCodeModel huffman_code_model;
+  MoveModel move_model;
+  NumberModel score_model;
+  int32_t previous_score = 0;
+  for (size_t i = 0; i < num_positions; ++i) {
+    TeacherPosition& position = (*positions)[i];
+    if (delta_coding) {
+      position.huffman_code = huffman_code_model.Decode(&decoder);
+    }
+    position.move = move_model.Decode(&decoder);
+    const int32_t value = ZigzagDecode(score_model.Decode(&decoder));
+    const int32_t score = delta_coding ? previous_score + value : value;
+    position.score = static_cast<Score>(score);
+    previous_score = score;
+  }
+
+  return !decoder.overrun();
+}
+
+bool TeacherArchive::DecodeBlock(const size_t block_id,
+                                 std::vector<TeacherPv>* const pvs) const {
+  assert(record_type_ == kPvs);
+  assert(pvs != nullptr);
+
+  const size_t num_pvs = block_length(block_id);
+  const uint8_t* begin = block_data(block_id);
+  const uint8_t* end = begin + block_bytes(block_id);
+  pvs->resize(num_pvs);
+  if (   size_t(end - begin) < 1 + num_pvs * (sizeof(HuffmanCode) + sizeof(float))
+      || !ChecksumIsValid(block_id)) {
+    return false;
+  }
+
+  // 1. ハフマン符号と進行度をコピーする
+  ++begin; // フラグ（現在は未使用）
+  for (size_t i = 0; i < num_pvs; ++i) {
+    std::memcpy(&(*pvs)[i].huffman_code, begin, sizeof(HuffmanCode));
+    begin += sizeof(HuffmanCode);
+  }
+  for (size_t i = 0; i < num_pvs; ++i) {
+    std::memcpy(&(*pvs)[i].progress, begin, sizeof(float));
+    begin += sizeof(float);
+  }
+
+  // 2. 対局結果と指し手列を復号する
+  RangeDecoder decoder(begin, end);
+  BitTreeModel<2> result_model;
+  NumberModel length_model;
+  MoveModel move_model;
+  for (size_t i = 0; i < num_pvs; ++i) {
+    TeacherPv& pv = (*pvs)[i];
+    pv.game_result = static_cast<Game::Result>(result_model.Decode(&decoder));
+    const uint32_t pv_data_size = length_model.Decode(&decoder);
+    if (pv_data_size > kMaxPvDataSize || decoder.overrun()) {
+      return false;
+    }
+    pv.pv_data.resize(pv_data_size);
+    for (Move& move : pv.pv_data) {
+      move = move_model.Decode(&decoder);
+    }
+  }
+
+  return !decoder.overrun();
+}
+
+bool TeacherArchive::DecodeAll(std::vector<TeacherPosition>* const positions) const {
+  assert(positions != nullptr);
+
+  positions->resize(num_records_);
+  bool ok = true;
+#pragma omp parallel for schedule(dynamic) reduction(&&:ok)
+  for (size_t block_id = 0; block_id < num_blocks(); ++block_id) {
+    std::vector<TeacherPosition> block;
+    ok = DecodeBlock(block_id, &block) && ok;
+    std::copy(block.begin(), block.end(), positions->begin() + block_id * kBlockSize);
+  }
+  return ok;
+}
+
+bool TeacherArchive::ConvertFromFlatFile(const char* const input_file_name,
+                                         const char* const output_file_name,
+                                         const RecordType record_type) {
+  std::FILE* input = std::fopen(input_file_name, "rb");
+  if (input == nullptr) {
+    std::printf("Failed to open %s.\n", input_file_name);
+    return false;
+  }
+
+  TeacherArchiveWriter writer(record_type);
+  if (!writer.Open(output_file_name)) {
+    std::fclose(input);
+    return false;
+  }
+
+  // 変換元のファイルを先頭から順に読み込んで、アーカイブに追加する
+  uint64_t num_records = 0;
+  if (record_type == kPositions) {
+    std::vector<TeacherPosition> buffer(kBlockSize * kBlocksPerFlush);
+    size_t count;
+    while ((count = std::fread(buffer.data(), sizeof(TeacherPosition), buffer.size(), input)) > 0) {
+      for (size_t i = 0; i < count; ++i) {
+        writer.Add(buffer[i]);
+      }
+      num_records += count;
+    }
+  } else {
+    TeacherPv pv;
+    while (pv.ReadFromFile(input)) {
+      writer.Add(pv);
+      ++num_records;
+    }
+  }
+  const uint64_t input_size = std::ftell(input);
+  std::fclose(input);
+
+  if (!writer.Close()) {
+    std::printf("Failed to write %s.\n", output_file_name);
+    return false;
+  }
+
+  std::printf("Converted %" PRIu64 " records: %.1f MB -> %.1f MB (%.1f%%).\n",
+              num_records, input_size / (1024.0 * 1024.0),
+              writer.num_bytes_written() / (1024.0 * 1024.0),
+              100.0 * writer.num_bytes_written() / std::max<uint64_t>(input_size, 1));
+  return true;
+}
+
+TeacherArchiveWriter::~TeacherArchiveWriter() {
+  if (file_ != nullptr) {
+    Close();
+  }
+}
+
+bool TeacherArchiveWriter::Open(const char* const file_name) {
+  assert(file_ == nullptr);
+  file_ = std::fopen(file_name, "wb");
+  if (file_ == nullptr) {
+    std::printf("Failed to open %s.\n", file_name);
+    return false;
+  }
+
+  // ヘッダは、ファイルを閉じる際に書き直す
+  ArchiveHeader header = {};
+  ok_ = std::fwrite(&header, sizeof(header), 1, file_) == 1;
+  num_bytes_written_ = sizeof(header);
+  return ok_;
+}
+
+void TeacherArchiveWriter::Add(const TeacherPosition& position) {
+  assert(record_type_ == TeacherArchive::kPositions);
+  pending_positions_.push_back(position);
+  if (pending_positions_.size() >= TeacherArchive::kBlockSize * kBlocksPerFlush) {
+    FlushBlocks(false);
+  }
+}
+
+void TeacherArchiveWriter::Add(const TeacherPv& pv) {
+  assert(record_type_ == TeacherArchive::kPvs);
+  pending_pvs_.push_back(pv);
+  if (pending_pvs_.size() >= TeacherArchive::kBlockSize * kBlocksPerFlush) {
+    FlushBlocks(false);
+  }
+}
+
+void TeacherArchiveWriter::FlushBlocks(const bool flush_all) {
+  constexpr size_t kBlockSize = TeacherArchive::kBlockSize;
+  const size_t num_pending = record_type_ == TeacherArchive::kPositions
+                           ? pending_positions_.size()
+                           : pending_pvs_.size();
+  const size_t num_blocks = flush_all
+                          ? (num_pending + kBlockSize - 1) / kBlockSize
+                          : num_pending / kBlockSize;
+
+  // 1. 各ブロックを、複数のスレッドで並列に圧縮する
+  std::vector<std::string> blocks(num_blocks);
+#pragma omp parallel for schedule(dynamic)
+  for (size_t i = 0; i < num_blocks; ++i) {
+    const size_t begin = i * kBlockSize;
+    const size_t length = std::min(kBlockSize, num_pending - begin);
+    if (record_type_ == TeacherArchive::kPositions) {
+      // 評価値は、そのまま保存する場合と、差分で保存する場合のうち、小さくなる方を選ぶ
+      const TeacherPosition* positions = pending_positions_.data() + begin;
+      std::string plain = EncodePositions(positions, length, false);
+      std::string delta = EncodePositions(positions, length, true);
+      blocks[i] = delta.size() < plain.size() ? std::move(delta) : std::move(plain);
+    } else {
+      blocks[i] = EncodePvs(pending_pvs_.data() + begin, length);
+    }
+  }
+
+  // 2. 圧縮したブロックを、順番にファイルに書き込む
+  for (size_t i = 0; i < num_blocks; ++i) {
+    TeacherArchive::BlockIndexEntry entry;
+    entry.offset = num_bytes_written_;
+    entry.size = blocks[i].size();
+    entry.num_records = std::min(kBlockSize, num_pending - i * kBlockSize);
+    entry.checksum = ComputeChecksum(reinterpret_cast<const uint8_t*>(blocks[i].data()), blocks[i].size());
+    entry.reserved = 0;
+    ok_ = ok_ && std::fwrite(blocks[i].data(), 1, blocks[i].size(), file_) == blocks[i].size();
+    num_bytes_written_ += blocks[i].size();
+    num_records_ += entry.num_records;
+    index_.push_back(entry);
+  }
+
+  // 3. 書き込んだレコードを取り除く
+  const size_t num_flushed = std::min(num_blocks * kBlockSize, num_pending);
+  if (record_type_ == TeacherArchive::kPositions) {
+    pending_positions_.erase(pending_positions_.begin(), pending_positions_.begin() + num_flushed);
+  } else {
+    pending_pvs_.erase(pending_pvs_.begin(), pending_pvs_.begin() + num_flushed);
+  }
+}
+
+bool TeacherArchiveWriter::Close() {
+  assert(file_ != nullptr);
+
+  // 1. 残っているレコードを書き込む
+  FlushBlocks(true);
+
+  // 2. インデックスを書き込む
+  ArchiveHeader header;
+  std::memcpy(header.magic, kArchiveMagic, sizeof(kArchiveMagic));
+  header.version = kArchiveVersion;
+  header.record_type = record_type_;
+  header.num_records = num_records_;
+  header.num_blocks = index_.size();
+  header.index_offset = num_bytes_written_;
+  const size_t index_bytes = index_.size() * sizeof(TeacherArchive::BlockIndexEntry);
+  ok_ = ok_ && (index_.empty() || std::fwrite(index_.data(), index_bytes, 1, file_) == 1);
+  num_bytes_written_ += index_bytes;
+
+  // 3. ヘッダを書き直す
+  ok_ = ok_ && std::fseek(file_, 0, SEEK_SET) == 0
+            && std::fwrite(&header, sizeof(header), 1, file_) == 1;
+  ok_ = (std::fclose(file_) == 0) && ok_;
+  file_ = nullptr;
+  return ok_;
+}
+
+#endif // !defined(MINIMUM)
@@ -0,0 +1,218 @@
+/*
+ * 技巧 (Gikou), a USI shogi (Japanese chess) playing engine.
+ * Copyright (C) 2016-2017 Yosuke Demura
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TEACHER_ARCHIVE_H_
+#define TEACHER_ARCHIVE_H_
+
+#if !defined(MINIMUM)
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+#include "teacher_data.h"
+
+/**
+ * 教師データ（TeacherPositionまたはTeacherPv）を、ブロック単位で圧縮して保存したファイル（アーカイブ）を読み込むためのクラスです.
+ *
+ * ファイルの構成は、以下のとおりです。
+ *   1. ヘッダ（レコードの種類、レコード数、ブロック数、インデックスの位置）
+ *   2. 圧縮されたブロック（kBlockSize個ずつのレコード。最後のブロックのみ、それより少なくなることがある）
+ *   3. インデックス（各ブロックのファイル上の位置、大きさ、チェックサム）
+ *
+ * 各ブロックは独立に復元できるので、任意のレコードへのランダムアクセスや、複数スレッドでの並列な復元が可能です。
+ * ブロック内では、指し手と評価値（PVの場合は指し手列）を、適応的な二値算術符号（レンジコーダ）で圧縮しています。
+ * 局面のハフマン符号は、通常はそのまま保存しますが、自己対戦棋譜の局面のように、直前のレコードと似た局面が続くブロックでは、
+ * 評価値とともに直前のレコードとの差分として圧縮した方が小さくなるので、そちらを選びます。
+ * 各ブロックにはチェックサムが付いているので、ファイルが壊れている場合は、復元時に検出されます。
+ */
+class TeacherArchive {
+ public:
+  /**
+   * アーカイブに保存されているレコードの種類です.
+   */
+  enum RecordType : uint32_t {
+    /** TeacherPositionの配列 */
+    kPositions = 0,
+
+    /** TeacherPvの配列 */
+    kPvs       = 1,
+  };
+
+  /** １ブロックあたりのレコード数 */
+  static constexpr size_t kBlockSize = 1024;
+
+  TeacherArchive() {}
+  ~TeacherArchive();
+
+  TeacherArchive(const TeacherArchive&) = delete;
+  TeacherArchive& operator=(const TeacherArchive&) = delete;
+
+  /**
+   * ファイルがアーカイブ形式であれば（先頭にアーカイブのヘッダがあれば）、trueを返します.
+   */
+  static bool IsArchive(const char* file_name);
+
+  /**
+   * アーカイブを読み込み専用でメモリマップして、ヘッダとインデックスを検証します.
+   * @return ファイルを開くことができ、ヘッダとインデックスが正しければ、true
+   */
+  bool Open(const char* file_name);
+
+  bool is_open() const {
+    return data_ != nullptr;
+  }
+
+  RecordType record_type() const {
+    return record_type_;
+  }
+
+  uint64_t num_records() const {
+    return num_records_;
+  }
+
+  size_t num_blocks() const {
+    return index_.size();
+  }
+
+  /**
+   * ブロックに含まれるレコード数を返します.
+   */
+  size_t block_length(size_t block_id) const {
+    return index_.at(block_id).num_records;
+  }
+
+  /**
+   * 圧縮されたブロックの、メモリマップ上の先頭を返します（先読みや、ページの解放に用います）.
+   */
+  const uint8_t* block_data(size_t block_id) const {
+    return data_ + index_.at(block_id).offset;
+  }
+
+  /**
+   * 圧縮されたブロックの、バイト数を返します.
+   */
+  size_t block_bytes(size_t block_id) const {
+    return index_.at(block_id).size;
+  }
+
+  /**
+   * 指定されたブロックに含まれる局面を復元します（record_type()がkPositionsの場合）.
+   * 複数のスレッドから、同時に呼び出すことができます。
+   * @param positions 復元した局面を保存する場所（以前の内容は消去されます）
+   * @return ブロックを正しく復元できた場合は、true
+   */
+  bool DecodeBlock(size_t block_id, std::vector<TeacherPosition>* positions) const;
+
+  /**
+   * 指定されたブロックに含まれるPVデータを復元します（record_type()がkPvsの場合）.
+   */
+  bool DecodeBlock(size_t block_id, std::vector<TeacherPv>* pvs) const;
+
+  /**
+   * すべての局面を、複数のスレッドで並列に復元します.
+   */
+  bool DecodeAll(std::vector<TeacherPosition>* positions) const;
+
+  /**
+   * 従来の形式の教師データのファイル（teacher_positions.bin等）を、アーカイブ形式に変換します.
+   * @param input_file_name  変換元のファイル（TeacherPositionの配列、またはTeacherPv::WriteToFile()で書き出したもの）
+   * @param output_file_name 変換先のファイル
+   * @param record_type      変換元のファイルに含まれるレコードの種類
+   */
+  static bool ConvertFromFlatFile(const char* input_file_name,
+                                  const char* output_file_name,
+                                  RecordType record_type);
+
+ private:
+  struct BlockIndexEntry {
+    uint64_t offset;
+    uint32_t size;
+    uint32_t num_records;
+    uint32_t checksum;
+    uint32_t reserved;
+  };
+
+  bool ChecksumIsValid(size_t block_id) const;
+
+  const uint8_t* data_ = nullptr;
+  size_t mapped_size_ = 0;
+  RecordType record_type_ = kPositions;
+  uint64_t num_records_ = 0;
+  std::vector<BlockIndexEntry> index_;
+
+  friend class TeacherArchiveWriter;
+};
+
+/**
+ * 教師データを、アーカイブ形式のファイルに書き込むためのクラスです.
+ *
+ * 追加されたレコードは、いくつかのブロック分がたまるごとに、複数のスレッドで並列に圧縮してから書き込みます。
+ */
+class TeacherArchiveWriter {
+ public:
+  explicit TeacherArchiveWriter(TeacherArchive::RecordType record_type)
+      : record_type_(record_type) {
+  }
+
+  ~TeacherArchiveWriter();
+
+  TeacherArchiveWriter(const TeacherArchiveWriter&) = delete;
+  TeacherArchiveWriter& operator=(const TeacherArchiveWriter&) = delete;
+
+  /**
+   * 書き込み用にファイルを開きます.
+   */
+  bool Open(const char* file_name);
+
+  /**
+   * レコードを追加します（ファイルを開いたときのレコードの種類と一致していること）.
+   */
+  void Add(const TeacherPosition& position);
+  void Add(const TeacherPv& pv);
+
+  /**
+   * 残っているレコードとインデックスを書き込んで、ファイルを閉じます.
+   * @return すべての書き込みが成功した場合は、true
+   */
+  bool Close();
+
+  /**
+   * これまでに書き込んだ（圧縮後の）バイト数を返します.
+   */
+  uint64_t num_bytes_written() const {
+    return num_bytes_written_;
+  }
+
+ private:
+  void FlushBlocks(bool flush_all);
+
+  const TeacherArchive::RecordType record_type_;
+  std::FILE* file_ = nullptr;
+  bool ok_ = true;
+  uint64_t num_records_ = 0;
+  uint64_t num_bytes_written_ = 0;
+  std::vector<TeacherArchive::BlockIndexEntry> index_;
+  std::vector<TeacherPosition> pending_positions_;
+  std::vector<TeacherPv> pending_pvs_;
+};
+
+#endif // !defined(MINIMUM)
+
+#endif /* TEACHER_ARCHIVE_H_ */
@@ -21,9 +21,21 @@
 
 #include "teacher_data.h"
 
+#include <cinttypes>
+#include <cstdlib>
+#include <algorithm>
+#include <chrono>
 #include <fstream>
+#include <numeric>
+#include <queue>
 #include <random>
+#include <string>
+#include <fcntl.h>
 #include <omp.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "common/bloom_filter.h"
 #include "common/progress_timer.h"
 #include "position.h"
 #include "mate3.h"
@@ -31,6 +43,7 @@
 #include "move_probability.h"
 #include "search.h"
 #include "task_thread.h"
+#include "teacher_archive.h"
 
 namespace {
 
@@ -80,6 +93,7 @@ Position GenerateRandomPosition(const int ply, std::mt19937& rng) {
   HistoryStats history;
   GainsStats gains;
   Position pos;
+  history.Clear(); // HistoryStatsはコンストラクタで初期化されないので、生成結果を再現できるように明示的にクリアする
 
 restart:
   pos = Position::CreateStartPosition();
@@ -132,14 +146,531 @@ restart:
   return pos;
 }
 
+/**
+ * 教師局面を、通し番号とともにシャードファイルに保存するための形式です.
+ */
+struct NumberedTeacherPosition {
+  uint32_t pos_id;
+  TeacherPosition teacher;
+};
+
+/**
+ * スレッドごとのシャードファイルにまとめて書き出す、教師局面の数.
+ */
+constexpr size_t kShardBufferSize = 4096;
+
+/**
+ * スレッドごとに書き出したシャードファイルを、通し番号の順に並べて、１つのファイルにまとめます.
+ * 各シャードファイルの中では、通し番号が昇順に並んでいる必要があります。
+ * 通し番号の順に並べ直すので、スレッド数や各スレッドの処理順によらず、同じファイルが得られます。
+ * @return まとめた教師局面の数
+ */
+uint64_t MergeTeacherPositionShards(const std::vector<std::string>& shard_names,
+                                    const char* const output_name) {
+  std::FILE* output = std::fopen(output_name, "wb");
+  if (output == nullptr) {
+    std::printf("Failed to open %s.\n", output_name);
+    return 0;
+  }
+
+  // 各シャードファイルの先頭の局面を読み込む
+  std::vector<std::FILE*> shards;
+  std::vector<NumberedTeacherPosition> heads(shard_names.size());
+  auto greater = [&](size_t lhs, size_t rhs) {
+    return heads[lhs].pos_id > heads[rhs].pos_id;
+  };
+  std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> queue(greater);
+  for (size_t i = 0; i < shard_names.size(); ++i) {
+    shards.push_back(std::fopen(shard_names[i].c_str(), "rb"));
+    if (shards[i] != nullptr && std::fread(&heads[i], sizeof(heads[i]), 1, shards[i]) == 1) {
+      queue.push(i);
+    }
+  }
+
+  // 通し番号が最も小さい局面から順に書き出す（k-way merge）
+  uint64_t num_positions = 0;
+  std::vector<TeacherPosition> buffer;
+  while (!queue.empty()) {
+    const size_t i = queue.top();
+    queue.pop();
+    buffer.push_back(heads[i].teacher);
+    if (buffer.size() >= kShardBufferSize) {
+      num_positions += std::fwrite(buffer.data(), sizeof(TeacherPosition), buffer.size(), output);
+      buffer.clear();
+    }
+    if (std::fread(&heads[i], sizeof(heads[i]), 1, shards[i]) == 1) {
+      queue.push(i);
+    }
+  }
+  num_positions += std::fwrite(buffer.data(), sizeof(TeacherPosition), buffer.size(), output);
+  if (std::fflush(output) != 0 || fsync(fileno(output)) != 0) {
+    num_positions = 0; // ディスクに書き込めなかった場合は、シャードファイルを残せるように、失敗として扱う
+  }
+  std::fclose(output);
+
+  for (std::FILE* shard : shards) {
+    if (shard != nullptr) {
+      std::fclose(shard);
+    }
+  }
+
+  return num_positions;
+}
+
+/**
+ * 教師データの生成を、途中から再開するためのチェックポイントです.
+ *
+ * 一定間隔で、書き出し先のファイルをディスクに書き込んでから、その時点でのファイルの大きさとともに保存します。
+ * 再開するときは、ファイルをこの大きさに切り詰めて、それ以降の通し番号から生成をやり直します。
+ */
+struct GenerationCheckpoint {
+  bool WriteToFile(const char* file_name) const;
+  bool ReadFromFile(const char* file_name);
+
+  uint32_t seed = 0;
+  uint64_t next_id = 0;                 // 次に生成する通し番号
+  uint64_t num_tested = 0;              // 重複しているかを調べた局面数
+  uint64_t num_duplicates = 0;          // 重複として取り除いた局面数
+  std::vector<uint64_t> file_sizes;     // 書き出し先の各ファイルの大きさ（バイト）
+};
+
+constexpr char kGenerationCheckpointMagic[8] = {'G', 'K', 'T', 'E', 'A', 'C', 'H', '1'};
+
+bool GenerationCheckpoint::WriteToFile(const char* const file_name) const {
+  const std::string temp_file_name = std::string(file_name) + ".tmp";
+  std::FILE* fp = std::fopen(temp_file_name.c_str(), "wb");
+  if (fp == nullptr) {
+    return false;
+  }
+
+  bool ok = true;
+  auto write = [&](const void* data, size_t size) {
+    ok = ok && (size == 0 || std::fwrite(data, size, 1, fp) == 1);
+  };
+  const uint64_t num_files = file_sizes.size();
+  write(kGenerationCheckpointMagic, sizeof(kGenerationCheckpointMagic));
+  write(&seed, sizeof(seed));
+  write(&next_id, sizeof(next_id));
+  write(&num_tested, sizeof(num_tested));
+  write(&num_duplicates, sizeof(num_duplicates));
+  write(&num_files, sizeof(num_files));
+  write(file_sizes.data(), num_files * sizeof(uint64_t));
+
+  // ディスクへの書き込みが完了してから、リネームする
+  ok = ok && std::fflush(fp) == 0 && fsync(fileno(fp)) == 0;
+  ok = (std::fclose(fp) == 0) && ok;
+  return ok && std::rename(temp_file_name.c_str(), file_name) == 0;
+}
+
+bool GenerationCheckpoint::ReadFromFile(const char* const file_name) {
+  std::FILE* fp = std::fopen(file_name, "rb");
+  if (fp == nullptr) {
+    return false;
+  }
+
+  bool ok = true;
+  auto read = [&](void* data, size_t size) {
+    ok = ok && (size == 0 || std::fread(data, size, 1, fp) == 1);
+  };
+  char magic[sizeof(kGenerationCheckpointMagic)];
+  uint64_t num_files = 0;
+  read(magic, sizeof(magic));
+  ok = ok && std::equal(magic, magic + sizeof(magic), kGenerationCheckpointMagic);
+  read(&seed, sizeof(seed));
+  read(&next_id, sizeof(next_id));
+  read(&num_tested, sizeof(num_tested));
+  read(&num_duplicates, sizeof(num_duplicates));
+  read(&num_files, sizeof(num_files));
+  file_sizes.resize(ok ? num_files : 0);
+  read(file_sizes.data(), file_sizes.size() * sizeof(uint64_t));
+
+  std::fclose(fp);
+  return ok;
+}
+
+/**
+ * 教師データの書き出し先のファイルを開きます.
+ * 再開する場合は、チェックポイントの時点の大きさに切り詰めてから、追記します
+ * （チェックポイントより後に書き出された局面は、再開後にもう一度生成されるため）。
+ */
+std::FILE* OpenOutputFile(const char* const file_name, const bool resume, const uint64_t size) {
+  if (!resume || size == 0) {
+    return std::fopen(file_name, "wb");
+  }
+  if (truncate(file_name, size) != 0) {
+    return nullptr;
+  }
+  return std::fopen(file_name, "ab");
+}
+
+/**
+ * 重複局面を取り除くための、ブルームフィルタの列です.
+ *
+ * 以前の実行で保存したフィルタに、今回の局面も登録すると偽陽性が多くなりすぎる場合は、そのフィルタは参照のみに用い、
+ * 新しいフィルタを追加して登録していきます（ブルームフィルタは、登録済みのキーを保ったまま大きくすることができないため）。
+ * フィルタは「<ファイル名>」「<ファイル名>.1」「<ファイル名>.2」...の順に保存します。
+ */
+class DuplicateFilter {
+ public:
+  /** 登録を行うフィルタで許容する、偽陽性の確率の上限. */
+  static constexpr double kMaxFalsePositiveRate = 0.001;
+
+  /**
+   * 保存されているフィルタを読み込み、必要であれば、新しいフィルタを追加します.
+   * @param file_name         ブルームフィルタのファイル名
+   * @param expected_num_keys 今回登録する局面数の見込み
+   */
+  DuplicateFilter(const char* const file_name, const uint64_t expected_num_keys)
+      : file_name_(file_name) {
+    for (int i = 0; ; ++i) {
+      std::unique_ptr<BloomFilter> filter(new BloomFilter(expected_num_keys));
+      if (!filter->LoadFromFile(LayerFileName(i).c_str())) {
+        break;
+      }
+      std::printf("Loaded a duplicate filter from %s (%" PRIu64 " positions, "
+                  "false positive rate %.4f%%).\n",
+                  LayerFileName(i).c_str(), filter->num_keys(),
+                  100.0 * filter->EstimateFalsePositiveRate(filter->num_keys()));
+      filters_.push_back(std::move(filter));
+    }
+
+    // 今回の局面を登録すると偽陽性が多くなりすぎる場合は、新しいフィルタを追加する
+    if (!filters_.empty()) {
+      const BloomFilter& last = *filters_.back();
+      const double rate = last.EstimateFalsePositiveRate(last.num_keys() + expected_num_keys);
+      if (rate <= kMaxFalsePositiveRate) {
+        return;
+      }
+      std::printf("The duplicate filter would reach a false positive rate of %.4f%%. "
+                  "Add a new filter %s.\n", 100.0 * rate, LayerFileName(filters_.size()).c_str());
+    }
+    filters_.emplace_back(new BloomFilter(expected_num_keys));
+    std::printf("Created a new duplicate filter (%" PRIu64 " MB).\n",
+                filters_.back()->num_bits() / 8 / (1024 * 1024));
+  }
+
+  /**
+   * キーを登録します（最後のフィルタにのみ登録します）.
+   * @return いずれかのフィルタに、すでに登録されていた（と判定された）場合は、true
+   */
+  bool TestAndSet(const uint64_t key) {
+    for (size_t i = 0; i + 1 < filters_.size(); ++i) {
+      if (filters_[i]->Test(key)) {
+        return true;
+      }
+    }
+    return filters_.back()->TestAndSet(key);
+  }
+
+  /**
+   * 登録を行っているフィルタを保存します（他のスレッドが登録を行っている間に呼んでも構いません）.
+   */
+  bool Save() const {
+    return filters_.back()->SaveToFile(LayerFileName(filters_.size() - 1).c_str());
+  }
+
+  /**
+   * 登録を行っているフィルタの、現在の偽陽性の確率の見積もりを返します.
+   */
+  double EstimateFalsePositiveRate() const {
+    return filters_.back()->EstimateFalsePositiveRate(filters_.back()->num_keys());
+  }
+
+ private:
+  std::string LayerFileName(size_t layer) const {
+    return layer == 0 ? file_name_ : file_name_ + "." + std::to_string(layer);
+  }
+
+  std::string file_name_;
+  std::vector<std::unique_ptr<BloomFilter>> filters_;
+};
+
+/**
+ * 重複局面を取り除くためのブルームフィルタを準備します.
+ * ファイルがすでに存在する場合は、それを読み込むので、以前に生成した教師データとの重複も取り除くことができます。
+ * @param file_name         ブルームフィルタのファイル名（nullptrの場合は、重複局面を取り除かない）
+ * @param expected_num_keys 登録する局面数の見込み
+ */
+std::unique_ptr<DuplicateFilter> OpenDuplicateFilter(const char* const file_name,
+                                                     uint64_t expected_num_keys) {
+  if (file_name == nullptr) {
+    return nullptr;
+  }
+  return std::unique_ptr<DuplicateFilter>(new DuplicateFilter(file_name, expected_num_keys));
+}
+
+/**
+ * 生成の途中で、チェックポイントとブルームフィルタを保存します.
+ *
+ * 書き出し先のファイルをディスクに書き込み、チェックポイントを保存してから、最後にフィルタを保存します。
+ * この順番で保存することで、異常終了した場合でも、フィルタに登録された局面は必ずファイルに残っているので、
+ * 再開後に、失われた局面が重複として読み飛ばされることはありません。
+ * 全スレッドが書き出しを終えてから（並列処理の外で）呼んでください。
+ * @return 保存に成功した場合は、true（チェックポイントを保存できなかった場合は、フィルタも保存しない）
+ */
+bool SaveCheckpoint(const std::vector<std::FILE*>& files, const DuplicateFilter* const filter,
+                    const char* const checkpoint_file, GenerationCheckpoint* const checkpoint) {
+  checkpoint->file_sizes.clear();
+  for (std::FILE* file : files) {
+    struct stat file_stat;
+    if (   std::fflush(file) != 0 || fsync(fileno(file)) != 0
+        || fstat(fileno(file), &file_stat) != 0) {
+      return false;
+    }
+    checkpoint->file_sizes.push_back(file_stat.st_size);
+  }
+  if (!checkpoint->WriteToFile(checkpoint_file)) {
+    return false;
+  }
+  return filter == nullptr || filter->Save();
+}
+
+/**
+ * 重複局面の割合を表示して、ブルームフィルタをファイルに保存します.
+ */
+void SaveDuplicateFilter(const DuplicateFilter* const filter, const char* const file_name,
+                         uint64_t num_tested, uint64_t num_duplicates) {
+  if (filter == nullptr) {
+    return;
+  }
+  std::printf("Skipped %" PRIu64 " duplicate positions out of %" PRIu64 " (%.2f%%).\n",
+              num_duplicates, num_tested,
+              100.0 * num_duplicates / std::max(num_tested, UINT64_C(1)));
+  std::printf("Estimated false positive rate of the duplicate filter: %.4f%%.\n",
+              100.0 * filter->EstimateFalsePositiveRate());
+  if (filter->Save()) {
+    std::printf("Saved the duplicate filter to %s.\n", file_name);
+  } else {
+    std::printf("Failed to save the duplicate filter to %s.\n", file_name);
+  }
+}
+
 } // namespace
 
+TeacherPositionLoader::TeacherPositionLoader(const char* const file_name,
+                                             const uint32_t seed,
+                                             const uint64_t start)
+    : seed_(seed),
+      num_consumed_(start) {
+  static_assert(kBlockSize == TeacherArchive::kBlockSize,
+                "The block sizes of the loader and the archive must be the same.");
+
+  // 1. ファイルを読み込み専用でメモリマップする
+  if (TeacherArchive::IsArchive(file_name)) {
+    // a. ブロック単位で圧縮されたアーカイブの場合（局面は、ミニバッチを取り出す際に復元する）
+    archive_.reset(new TeacherArchive);
+    if (!archive_->Open(file_name)) {
+      return;
+    }
+    if (archive_->record_type() != TeacherArchive::kPositions || archive_->num_records() == 0) {
+      std::printf("%s has no positions.\n", file_name);
+      return;
+    }
+    num_positions_ = archive_->num_records();
+  } else {
+    // b. TeacherPositionを並べただけのファイルの場合
+    int fd = open(file_name, O_RDONLY);
+    if (fd == -1) {
+      std::printf("Failed to open %s.\n", file_name);
+      return;
+    }
+    struct stat file_stat;
+    if (fstat(fd, &file_stat) == -1 || file_stat.st_size < static_cast<off_t>(sizeof(TeacherPosition))) {
+      std::printf("%s has no positions.\n", file_name);
+      close(fd);
+      return;
+    }
+    mapped_size_ = file_stat.st_size;
+    void* address = mmap(nullptr, mapped_size_, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd); // メモリマップ後は、ファイルディスクリプタを閉じても構わない
+    if (address == MAP_FAILED) {
+      std::printf("Failed to map %s.\n", file_name);
+      return;
+    }
+    madvise(address, mapped_size_, MADV_RANDOM); // 先読みは自前で行う
+
+    positions_ = static_cast<const TeacherPosition*>(address);
+    num_positions_ = mapped_size_ / sizeof(TeacherPosition);
+  }
+  num_blocks_ = (num_positions_ + kBlockSize - 1) / kBlockSize;
+
+  // 2. 読み飛ばす局面が、何エポック目の何番目のブロックに含まれるかを求める
+  const uint64_t start_epoch = start / num_positions_;
+  size_t offset = start % num_positions_;
+  size_t start_block = 0;
+  std::vector<size_t> block_order = ShuffleBlocks(start_epoch);
+  while (offset >= BlockLength(block_order[start_block])) {
+    offset -= BlockLength(block_order[start_block++]);
+  }
+  first_block_offset_ = offset;
+
+  // 3. 先読み用のスレッドを開始する
+  prefetch_thread_ = std::thread([this, start_epoch, start_block](){
+    PrefetchLoop(start_epoch, start_block);
+  });
+}
+
+TeacherPositionLoader::~TeacherPositionLoader() {
+  if (prefetch_thread_.joinable()) {
+    stop_ = true;
+    prefetch_thread_.join();
+  }
+  if (positions_ != nullptr) {
+    munmap(const_cast<TeacherPosition*>(positions_), mapped_size_);
+  }
+}
+
+void TeacherPositionLoader::NextBatch(const size_t batch_size,
+                                      std::vector<const TeacherPosition*>* const batch) {
+  assert(is_open());
+  assert(batch != nullptr);
+
+  // 前回のミニバッチで使い切ったブロックのページを解放する
+  for (size_t block_id : finished_blocks_) {
+    ReleaseBlock(block_id);
+  }
+  finished_blocks_.clear();
+
+  // 1. ミニバッチに含める局面を、ブロックごとの区間として求める
+  struct Segment {
+    size_t block_id, begin, end;
+  };
+  std::vector<Segment> segments;
+  size_t num_positions = 0;
+  while (num_positions < batch_size) {
+    // 現在のブロックを使い切ったら、先読みが終わっている次のブロックに移る
+    if (position_in_block_ == kBlockSize) {
+      if (current_block_ < num_blocks_) {
+        finished_blocks_.push_back(current_block_);
+      }
+      while (!prefetched_blocks_.TryPop(&current_block_)) {
+        std::this_thread::yield(); // 先読みが追いついていない場合のみ、ここで待つ
+      }
+      position_in_block_ = first_block_offset_;
+      first_block_offset_ = 0;
+    }
+
+    const size_t length = BlockLength(current_block_);
+    if (position_in_block_ < length) {
+      const size_t count = std::min(length - position_in_block_, batch_size - num_positions);
+      segments.push_back(Segment{current_block_, position_in_block_, position_in_block_ + count});
+      position_in_block_ += count;
+      num_positions += count;
+      num_consumed_ += count;
+    } else {
+      position_in_block_ = kBlockSize; // ファイル末尾の、局面数が足りないブロック
+    }
+  }
+
+  // 2. アーカイブの場合は、必要なブロックを複数のスレッドで並列に復元する
+  if (archive_) {
+    decoded_blocks_.resize(segments.size());
+    std::vector<char> failed(segments.size(), false);
+#pragma omp parallel for schedule(dynamic)
+    for (size_t i = 0; i < segments.size(); ++i) {
+      failed[i] = !archive_->DecodeBlock(segments[i].block_id, &decoded_blocks_[i]);
+    }
+
+    // 壊れたブロックの局面で学習を続けることはできないので、学習を中止する
+    // （学習のチェックポイントが保存されていれば、ファイルを修復した後で、そこから再開できる）
+    for (size_t i = 0; i < segments.size(); ++i) {
+      if (failed[i]) {
+        std::printf("Failed to decode block %zu. The archive is broken, so stop learning.\n",
+                    segments[i].block_id);
+        std::exit(EXIT_FAILURE);
+      }
+    }
+  }
+
+  // 3. 局面へのポインタを並べる
+  batch->clear();
+  for (size_t i = 0; i < segments.size(); ++i) {
+    const Segment& segment = segments[i];
+    const TeacherPosition* block = archive_
+                                 ? decoded_blocks_[i].data()
+                                 : positions_ + segment.block_id * kBlockSize;
+    for (size_t j = segment.begin; j < segment.end; ++j) {
+      batch->push_back(block + j);
+    }
+  }
+}
+
+std::vector<size_t> TeacherPositionLoader::ShuffleBlocks(const uint64_t epoch) const {
+  // エポックごとに異なる種を使うことで、途中のエポックから再開した場合にも、同じ順番を再現できるようにする
+  std::seed_seq seed_sequence{seed_, static_cast<uint32_t>(epoch), static_cast<uint32_t>(epoch >> 32)};
+  std::mt19937 rng(seed_sequence);
+  std::vector<size_t> block_order(num_blocks_);
+  std::iota(block_order.begin(), block_order.end(), 0);
+  std::shuffle(block_order.begin(), block_order.end(), rng);
+  return block_order;
+}
+
+void TeacherPositionLoader::PrefetchLoop(uint64_t epoch, size_t start_block) {
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+
+  for (; !stop_; ++epoch, start_block = 0) {
+    // エポックごとに、ブロックの順番をシャッフルする
+    const std::vector<size_t> block_order = ShuffleBlocks(epoch);
+
+    for (size_t i = start_block; i < block_order.size() && !stop_; ++i) {
+      const size_t block_id = block_order[i];
+
+      // ブロックのページをメモリに読み込んでおく
+      const char* first, * last;
+      GetBlockRange(block_id, &first, &last);
+      const char* aligned = first - (reinterpret_cast<uintptr_t>(first) % page_size);
+      madvise(const_cast<char*>(aligned), last - aligned, MADV_WILLNEED);
+      volatile char sum = 0;
+      for (const char* p = aligned; p < last; p += page_size) {
+        sum += *p;
+      }
+
+      // 学習側に渡す（リングバッファが一杯の場合は、空くまで待つ）
+      while (!prefetched_blocks_.TryPush(block_id)) {
+        if (stop_) {
+          return;
+        }
+        std::this_thread::sleep_for(std::chrono::microseconds(100));
+      }
+    }
+  }
+}
+
+void TeacherPositionLoader::GetBlockRange(const size_t block_id,
+                                          const char** const first,
+                                          const char** const last) const {
+  if (archive_) {
+    *first = reinterpret_cast<const char*>(archive_->block_data(block_id));
+    *last = *first + archive_->block_bytes(block_id);
+  } else {
+    *first = reinterpret_cast<const char*>(positions_ + block_id * kBlockSize);
+    *last = reinterpret_cast<const char*>(positions_ + block_id * kBlockSize + BlockLength(block_id));
+  }
+}
+
+void TeacherPositionLoader::ReleaseBlock(const size_t block_id) {
+  // 使い終わったブロックのページを解放して、メモリ使用量がファイルの大きさに比例しないようにする
+  // （ブロックの境界と重なっているページは、隣のブロックで使う可能性があるので残しておく）
+  const size_t page_size = sysconf(_SC_PAGESIZE);
+  const char* first_byte, * last_byte;
+  GetBlockRange(block_id, &first_byte, &last_byte);
+  const uintptr_t first = reinterpret_cast<uintptr_t>(first_byte);
+  const uintptr_t last = reinterpret_cast<uintptr_t>(last_byte);
+  const uintptr_t aligned_first = (first + page_size - 1) / page_size * page_size;
+  const uintptr_t aligned_last = last / page_size * page_size;
+  if (aligned_first < aligned_last) {
+    madvise(reinterpret_cast<void*>(aligned_first), aligned_last - aligned_first, MADV_DONTNEED);
+  }
+}
+
 bool TeacherPv::ReadFromFile(std::FILE* stream) {
   std::fread(&huffman_code, sizeof(huffman_code), 1, stream);
   std::fread(&progress, sizeof(progress), 1, stream);
   std::fread(&game_result, sizeof(game_result), 1, stream);
-  int pv_data_size;
-  std::fread(&pv_data_size, sizeof(pv_data_size), 1, stream);
+  int pv_data_size = 0;
+  if (std::fread(&pv_data_size, sizeof(pv_data_size), 1, stream) != 1 || pv_data_size < 0) {
+    return false; // ファイルの末尾に達した
+  }
   pv_data.resize(pv_data_size);
   std::fread(&pv_data[0], sizeof(pv_data[0]), pv_data.size(), stream);
   pv_data.shrink_to_fit(); // メモリ使用量を節約する
@@ -168,90 +699,207 @@ std::vector<std::vector<Move>> TeacherPv::GetPvList() const {
   return pv_list;
 }
 
-void TeacherData::GenerateTeacherPositions() {
+void TeacherData::GenerateTeacherPositions(const uint32_t seed,
+                                           const char* const filter_file) {
   // 生成する教師局面の数
   const int kNumPositions = 30 * 1000 * 1000;
 
+  // 探索の打ち切り条件（探索時間ではなく探索量で制限することで、マシンの負荷によらず同じ結果が得られる）
+  const uint64_t kNodesLimit = 50000;
+  const int kDepthLimit = kMaxPly;
+
+  // チェックポイントを保存する間隔（局面数）
+  const int kCheckpointInterval = 1000 * 1000;
+  const char* const kCheckpointFile = "teacher_positions.checkpoint";
+
   // スレッド数の設定
   const int num_threads = std::max(1U, std::thread::hardware_concurrency());
   omp_set_num_threads(num_threads);
   std::printf("Set num_threads = %d\n", num_threads);
+  std::printf("Random seed = %u\n", seed);
+
+  // チェックポイントが残っていれば、そこから再開する（局面は通し番号から再現できるので、同じ種の場合に限る）
+  GenerationCheckpoint checkpoint;
+  const bool resume = checkpoint.ReadFromFile(kCheckpointFile);
+  if (resume && checkpoint.seed != seed) {
+    std::printf("%s was saved with seed %u. Use the same seed to resume, or remove it to start over.\n",
+                kCheckpointFile, checkpoint.seed);
+    return;
+  }
+  if (resume) {
+    std::printf("Resume from position %" PRIu64 ".\n", checkpoint.next_id);
+  }
+  checkpoint.seed = seed;
 
-  // スレッドごとの乱数生成器や置換表などを準備する
-  std::random_device rd;
-  std::vector<std::mt19937> random_number_generators;
+  // スレッドごとに、置換表を準備する
   std::vector<SharedData> shared_datas(num_threads);
-  std::vector<std::unique_ptr<TimerThread>> timer_threads;
-  for (int i = 0; i < num_threads; ++i) {
-    random_number_generators.emplace_back(rd());
-    shared_datas.at(i).hash_table.SetSize(2);
-    timer_threads.emplace_back(new TimerThread(shared_datas.at(i).signals));
-    timer_threads.back()->StartNewThread();
-    timer_threads.back()->WaitForReady();
+  for (SharedData& shared : shared_datas) {
+    shared.hash_table.SetSize(2);
   }
 
-  std::FILE* teacher_data_file = std::fopen("teacher_positions.bin", "wb");
-  ProgressTimer progress_timer(kNumPositions);
+  // スレッドごとに、書き込み用のシャードファイルを準備する
+  // （再開する場合は、前回の実行時のほうがスレッド数が多くても、すべてのシャードファイルを引き継ぐ）
+  const size_t num_shards = std::max<size_t>(num_threads, checkpoint.file_sizes.size());
+  checkpoint.file_sizes.resize(num_shards, 0);
+  std::vector<std::string> shard_names;
+  std::vector<std::FILE*> shards;
+  std::vector<std::vector<NumberedTeacherPosition>> buffers(num_threads);
+  for (size_t i = 0; i < num_shards; ++i) {
+    char file_name[256];
+    std::snprintf(file_name, sizeof(file_name), "teacher_positions_%03zu.bin", i);
+    shard_names.push_back(file_name);
+    shards.push_back(OpenOutputFile(file_name, resume, checkpoint.file_sizes[i]));
+    if (shards.back() == nullptr) {
+      std::printf("Failed to open %s.\n", file_name);
+      return;
+    }
+  }
 
-  // 教師局面の生成を繰り返す
-#pragma omp parallel for schedule(dynamic)
-  for (int pos_id = 0; pos_id < kNumPositions; ++pos_id) {
-    int thread_id = omp_get_thread_num();
-    SharedData& shared = shared_datas.at(thread_id);
-    std::mt19937& rng = random_number_generators.at(thread_id);
-    std::unique_ptr<TimerThread>& timer_thread = timer_threads.at(thread_id);
-
-    // 初期局面から数えて何手目の局面を生成するかを決定する
-    // プロの棋譜の終局手数をグラフ化してみると、概ね対数正規分布で近似できることが分かったので、
-    // ここでは、生成する局面の上限（game_length）を、対数正規分布に従った乱数で決定している。
-    std::lognormal_distribution<double> length_distribution(4.717, 0.249);
-    int game_length = std::max(static_cast<int>(length_distribution(rng)), 1);
-    int ply = std::uniform_int_distribution<int>(1, game_length)(rng);
-
-    // ランダムに局面を作成する（実現確率を用いて、初期局面からply手ランダムに動かす）
-    Position pos = GenerateRandomPosition(ply, rng);
-
-    // 探索の準備をする
-    Search search(shared);
-    shared.Clear();
-    search.PrepareForNextSearch();
-
-    // 別スレッドでの時間計測を開始する
-    timer_thread->set_time_limit(100);
-    timer_thread->ExecuteTask();
-
-    // 探索を行う
-    std::pair<Move, Score> pair = search.SimpleIterativeDeepening(pos);
-
-    // 教師データを保存する
-    TeacherPosition teacher;
-    teacher.huffman_code = HuffmanCode::EncodePosition(pos);
-    teacher.move = pair.first;
-    teacher.score = pair.second;
-
-    // 時間計測用のスレッドの処理が終了するのを待つ
-    timer_thread->WaitUntilTaskIsFinished();
-
-    // 生成した教師局面をファイルに保存する（排他制御を行う）
-#pragma omp critical
-    std::fwrite(&teacher, sizeof(teacher), 1, teacher_data_file);
+  // スレッドごとに、Historyを確保する
+  // （大域的なHistoryはHISTORY_ARRAY_SIZE個しかないので、スレッド数が多いと複数のスレッドで共有されてしまう）
+  std::vector<std::unique_ptr<HistoryTables>> histories(num_threads);
+  for (std::unique_ptr<HistoryTables>& history : histories) {
+    history.reset(new HistoryTables);
+    history->Clear();
+  }
 
-    // 進行状況を表示する
-    progress_timer.IncrementCounter();
-    progress_timer.PrintProgress("");
+  // 重複局面を取り除くためのブルームフィルタを準備する（全スレッドで共有する）
+  const int start_id = static_cast<int>(checkpoint.next_id);
+  std::unique_ptr<DuplicateFilter> duplicate_filter = OpenDuplicateFilter(filter_file,
+                                                                          kNumPositions - start_id);
+  uint64_t num_duplicates = checkpoint.num_duplicates;
+
+  ProgressTimer progress_timer(kNumPositions - start_id);
+  const auto start_time = std::chrono::steady_clock::now();
+
+  // 教師局面の生成を繰り返す（一定の局面数ごとに、全スレッドの終了を待って、チェックポイントを保存する）
+  for (int chunk_begin = start_id; chunk_begin < kNumPositions; chunk_begin += kCheckpointInterval) {
+    const int chunk_end = std::min(chunk_begin + kCheckpointInterval, kNumPositions);
+
+#pragma omp parallel for schedule(dynamic) reduction(+:num_duplicates)
+    for (int pos_id = chunk_begin; pos_id < chunk_end; ++pos_id) {
+      int thread_id = omp_get_thread_num();
+      SharedData& shared = shared_datas.at(thread_id);
+
+      // 乱数の種は、全体の種と局面の通し番号から決める（どのスレッドで生成しても、同じ局面になる）
+      std::seed_seq seed_sequence{seed, static_cast<uint32_t>(pos_id)};
+      std::mt19937 rng(seed_sequence);
+
+      // 初期局面から数えて何手目の局面を生成するかを決定する
+      // プロの棋譜の終局手数をグラフ化してみると、概ね対数正規分布で近似できることが分かったので、
+      // ここでは、生成する局面の上限（game_length）を、対数正規分布に従った乱数で決定している。
+      std::lognormal_distribution<double> length_distribution(4.717, 0.249);
+      int game_length = std::max(static_cast<int>(length_distribution(rng)), 1);
+      int ply = std::uniform_int_distribution<int>(1, game_length)(rng);
+
+      // ランダムに局面を作成する（実現確率を用いて、初期局面からply手ランダムに動かす）
+      Position pos = GenerateRandomPosition(ply, rng);
+
+      // すでに生成した局面と同じ局面であれば、探索を省略する
+      if (   duplicate_filter
+          && duplicate_filter->TestAndSet(static_cast<uint64_t>(pos.ComputePositionKey()))) {
+        ++num_duplicates;
+        progress_timer.IncrementCounter();
+        progress_timer.PrintProgress("");
+        continue;
+      }
+
+      // 探索の準備をする（前の局面の探索で得られたHistoryが残らないように、スレッド専用のHistoryをクリアする）
+      Search search(shared, thread_id, histories.at(thread_id).get());
+      shared.Clear();
+      search.ClearHistory();
+      search.PrepareForNextSearch();
+      search.set_nodes_limit(kNodesLimit);
+      search.set_depth_limit(kDepthLimit);
+
+      // 探索を行う
+      std::pair<Move, Score> pair = search.SimpleIterativeDeepening(pos);
+
+      // 教師データを、このスレッド専用のバッファに保存する（一杯になったら、シャードファイルに書き出す）
+      NumberedTeacherPosition numbered;
+      numbered.pos_id = pos_id;
+      numbered.teacher.huffman_code = HuffmanCode::EncodePosition(pos);
+      numbered.teacher.move = pair.first;
+      numbered.teacher.score = pair.second;
+      std::vector<NumberedTeacherPosition>& buffer = buffers.at(thread_id);
+      buffer.push_back(numbered);
+      if (buffer.size() >= kShardBufferSize) {
+        std::fwrite(buffer.data(), sizeof(NumberedTeacherPosition), buffer.size(), shards.at(thread_id));
+        buffer.clear();
+      }
+
+      // 進行状況を表示する
+      progress_timer.IncrementCounter();
+      progress_timer.PrintProgress("");
+    }
+
+    // バッファに残っている教師データを書き出してから、チェックポイントを保存する
+    for (int i = 0; i < num_threads; ++i) {
+      std::fwrite(buffers[i].data(), sizeof(NumberedTeacherPosition), buffers[i].size(), shards[i]);
+      buffers[i].clear();
+    }
+    checkpoint.next_id = chunk_end;
+    checkpoint.num_tested = chunk_end;
+    checkpoint.num_duplicates = num_duplicates;
+    if (!SaveCheckpoint(shards, duplicate_filter.get(), kCheckpointFile, &checkpoint)) {
+      std::printf("\nFailed to save a checkpoint to %s.\n", kCheckpointFile);
+    }
   }
 
-  std::fclose(teacher_data_file);
+  for (std::FILE* shard : shards) {
+    std::fclose(shard);
+  }
+
+  // 生成速度を表示する
+  const double elapsed_seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start_time).count();
+  const double positions_per_second = (kNumPositions - start_id) / std::max(elapsed_seconds, 1e-3);
+  std::printf("\nGenerated %d positions in %.1f sec (%.1f positions/sec/core).\n",
+              kNumPositions - start_id, elapsed_seconds, positions_per_second / num_threads);
+
+  // シャードファイルを１つのファイルにまとめる
+  std::printf("Merge the shards into teacher_positions.bin.\n");
+  uint64_t num_expected = 0;
+  for (uint64_t size : checkpoint.file_sizes) {
+    num_expected += size / sizeof(NumberedTeacherPosition);
+  }
+  uint64_t num_merged = MergeTeacherPositionShards(shard_names, "teacher_positions.bin");
+  std::printf("Wrote %" PRIu64 " positions to teacher_positions.bin.\n", num_merged);
+  if (num_merged != num_expected) {
+    std::printf("Expected %" PRIu64 " positions. Keep the shards and %s to retry the merge.\n",
+                num_expected, kCheckpointFile);
+    return;
+  }
+
+  SaveDuplicateFilter(duplicate_filter.get(), filter_file, kNumPositions, num_duplicates);
+
+  // 教師局面とフィルタを保存し終えてから、チェックポイントとシャードファイルを削除する
+  std::remove(kCheckpointFile);
+  for (const std::string& shard_name : shard_names) {
+    std::remove(shard_name.c_str());
+  }
 }
 
-void TeacherData::GenerateTeacherGames() {
+void TeacherData::GenerateTeacherGames(const char* const filter_file) {
   // 生成する自己対戦データの数（何回自己対戦を行うか）
   const int kNumGames = 3 * 1000 * 1000;
 
+  // チェックポイントを保存する間隔（対局数）
+  const int kCheckpointInterval = 100 * 1000;
+  const char* const kCheckpointFile = "teacher_games.checkpoint";
+
   // スレッド数の設定
   const int num_threads = std::max(1U, std::thread::hardware_concurrency());
   omp_set_num_threads(num_threads);
 
+  // チェックポイントが残っていれば、そこから再開する
+  GenerationCheckpoint checkpoint;
+  const bool resume = checkpoint.ReadFromFile(kCheckpointFile);
+  if (resume) {
+    std::printf("Resume from game %" PRIu64 ".\n", checkpoint.next_id);
+  }
+  checkpoint.file_sizes.resize(1, 0);
+
   // スレッドごとの乱数生成器や置換表などを準備する
   std::random_device rd;
   std::vector<std::mt19937> random_number_generators;
@@ -265,94 +913,127 @@ void TeacherData::GenerateTeacherGames() {
     timer_threads.back()->WaitForReady();
   }
 
-  std::FILE* teacher_games_file = std::fopen("teacher_games.bin", "wb");
-  ProgressTimer progress_timer(kNumGames);
+  // 重複局面を取り除くためのブルームフィルタを準備する（１局あたり、約10局面をサンプリングする）
+  const int start_id = static_cast<int>(checkpoint.next_id);
+  std::unique_ptr<DuplicateFilter> duplicate_filter = OpenDuplicateFilter(filter_file,
+                                                                          10 * (kNumGames - start_id));
+  uint64_t num_sampled = checkpoint.num_tested, num_duplicates = checkpoint.num_duplicates;
 
-  // 教師局面の生成を繰り返す
-#pragma omp parallel for schedule(dynamic)
-  for (int pos_id = 0; pos_id < kNumGames; ++pos_id) {
-    int thread_id = omp_get_thread_num();
-    SharedData& shared = shared_datas.at(thread_id);
-    std::mt19937& rng = random_number_generators.at(thread_id);
-    std::unique_ptr<TimerThread>& timer_thread = timer_threads.at(thread_id);
-
-    // ランダムに開始局面を作成する
-    int start_ply = std::uniform_int_distribution<int>(16, 31)(rng);
-    const Position start_position = GenerateRandomPosition(start_ply, rng);
-    Node node(start_position);
-    Search search(shared);
-
-    // 自己対戦を行う（最大256手まで）
-    std::vector<TeacherPosition> teacher_positions;
-    Game::Result game_result = Game::kDraw;
-    for (int ply = start_ply; ply < 256; ++ply) {
-      // 探索の準備をする
-      shared.Clear();
-      search.PrepareForNextSearch();
-
-      // 別スレッドでの時間計測を開始する
-      timer_thread->set_time_limit(std::uniform_int_distribution<>(8, 12)(rng));
-      timer_thread->ExecuteTask();
+  std::FILE* teacher_games_file = OpenOutputFile("teacher_games.bin", resume, checkpoint.file_sizes[0]);
+  if (teacher_games_file == nullptr) {
+    std::printf("Failed to open teacher_games.bin.\n");
+    return;
+  }
+  ProgressTimer progress_timer(kNumGames - start_id);
+
+  // 教師局面の生成を繰り返す（一定の対局数ごとに、全スレッドの終了を待って、チェックポイントを保存する）
+  for (int chunk_begin = start_id; chunk_begin < kNumGames; chunk_begin += kCheckpointInterval) {
+    const int chunk_end = std::min(chunk_begin + kCheckpointInterval, kNumGames);
+
+#pragma omp parallel for schedule(dynamic) reduction(+:num_sampled, num_duplicates)
+    for (int pos_id = chunk_begin; pos_id < chunk_end; ++pos_id) {
+      int thread_id = omp_get_thread_num();
+      SharedData& shared = shared_datas.at(thread_id);
+      std::mt19937& rng = random_number_generators.at(thread_id);
+      std::unique_ptr<TimerThread>& timer_thread = timer_threads.at(thread_id);
+
+      // ランダムに開始局面を作成する
+      int start_ply = std::uniform_int_distribution<int>(16, 31)(rng);
+      const Position start_position = GenerateRandomPosition(start_ply, rng);
+      Node node(start_position);
+      Search search(shared);
+
+      // 自己対戦を行う（最大256手まで）
+      std::vector<TeacherPosition> teacher_positions;
+      std::vector<uint64_t> teacher_keys;
+      Game::Result game_result = Game::kDraw;
+      for (int ply = start_ply; ply < 256; ++ply) {
+        // 探索の準備をする
+        shared.Clear();
+        search.PrepareForNextSearch();
+
+        // 別スレッドでの時間計測を開始する
+        timer_thread->set_time_limit(std::uniform_int_distribution<>(8, 12)(rng));
+        timer_thread->ExecuteTask();
+
+        // 探索を行う
+        std::pair<Move, Score> pair = search.SimpleIterativeDeepening(node);
+        Move best_move = pair.first;
+        Score score = pair.second;
+
+        // 時間計測用のスレッドの処理が終了するのを待つ
+        timer_thread->WaitUntilTaskIsFinished();
+
+        // 勝ち負けがはっきりしたときは、終了する
+        if (score >= kScoreKnownWin) {
+          game_result = node.side_to_move() == kBlack ? Game::kBlackWin : Game::kWhiteWin;
+          break;
+        } else if (score <= -kScoreKnownWin) {
+          game_result = node.side_to_move() == kBlack ? Game::kWhiteWin : Game::kBlackWin;
+          break;
+        }
 
-      // 探索を行う
-      std::pair<Move, Score> pair = search.SimpleIterativeDeepening(node);
-      Move best_move = pair.first;
-      Score score = pair.second;
+        // 千日手を検出したときは、終了する
+        Score repetition_score;
+        if (node.DetectRepetition(&repetition_score)) {
+          game_result = Game::kDraw;
+          break;
+        }
 
-      // 時間計測用のスレッドの処理が終了するのを待つ
-      timer_thread->WaitUntilTaskIsFinished();
+        // 一定の確率（現在は10%の確率）で、自己対戦中の局面をサンプリングする
+        if (std::uniform_int_distribution<int>(0, 9)(rng) == 0) {
+          TeacherPosition teacher;
+          teacher.huffman_code = HuffmanCode::EncodePosition(node);
+          teacher.move = best_move;
+          teacher.score = score;
+          teacher_positions.push_back(teacher);
+          teacher_keys.push_back(static_cast<uint64_t>(node.key()));
+        }
 
-      // 勝ち負けがはっきりしたときは、終了する
-      if (score >= kScoreKnownWin) {
-        game_result = node.side_to_move() == kBlack ? Game::kBlackWin : Game::kWhiteWin;
-        break;
-      } else if (score <= -kScoreKnownWin) {
-        game_result = node.side_to_move() == kBlack ? Game::kWhiteWin : Game::kBlackWin;
-        break;
+        // 探索で得られた最善手を用いて、局面を進める
+        node.MakeMove(best_move);
       }
 
-      // 千日手を検出したときは、終了する
-      Score repetition_score;
-      if (node.DetectRepetition(&repetition_score)) {
-        game_result = Game::kDraw;
-        break;
-      }
+      // ランダムにサンプリングされた教師局面をファイルに保存する
+      if (game_result == Game::kBlackWin || game_result == Game::kWhiteWin) {
+        // 教師局面に対局結果（どちらの手番が勝ったか）を保存する
+        Color winner = game_result == Game::kBlackWin ? kBlack : kWhite;
+        for (TeacherPosition& teacher : teacher_positions) {
+          Color side_to_move = teacher.huffman_code.side_to_move();
+          teacher.score = side_to_move == winner ? kScoreKnownWin : -kScoreKnownWin;
+        }
 
-      // 一定の確率（現在は10%の確率）で、自己対戦中の局面をサンプリングする
-      if (std::uniform_int_distribution<int>(0, 9)(rng) == 0) {
-        TeacherPosition teacher;
-        teacher.huffman_code = HuffmanCode::EncodePosition(node);
-        teacher.move = best_move;
-        teacher.score = score;
-        teacher_positions.push_back(teacher);
+        // 教師局面をファイルに保存する（排他制御を行う）
+        // ブルームフィルタには、ファイルに書き出す局面だけを登録する（引き分けで捨てた局面は、後で重複とみなさない）
+#pragma omp critical
+        for (size_t i = 0; i < teacher_positions.size(); ++i) {
+          ++num_sampled;
+          if (duplicate_filter && duplicate_filter->TestAndSet(teacher_keys[i])) {
+            ++num_duplicates; // すでにサンプリングした局面と同じ局面は、教師データに加えない
+            continue;
+          }
+          std::fwrite(&teacher_positions[i], sizeof(TeacherPosition), 1, teacher_games_file);
+        }
       }
 
-      // 探索で得られた最善手を用いて、局面を進める
-      node.MakeMove(best_move);
+      // 進行状況を表示する
+      progress_timer.IncrementCounter();
+      progress_timer.PrintProgress("");
     }
 
-    // ランダムにサンプリングされた教師局面をファイルに保存する
-    if (game_result == Game::kBlackWin || game_result == Game::kWhiteWin) {
-      // 教師局面に対局結果（どちらの手番が勝ったか）を保存する
-      Color winner = game_result == Game::kBlackWin ? kBlack : kWhite;
-      for (TeacherPosition& teacher : teacher_positions) {
-        Position pos = HuffmanCode::DecodePosition(teacher.huffman_code);
-        teacher.score = pos.side_to_move() == winner ? kScoreKnownWin : -kScoreKnownWin;
-      }
-
-      // 教師局面をファイルに保存する（排他制御を行う）
-#pragma omp critical
-      for (const TeacherPosition& teacher : teacher_positions) {
-        std::fwrite(&teacher, sizeof(teacher), 1, teacher_games_file);
-      }
+    // チェックポイントを保存する
+    checkpoint.next_id = chunk_end;
+    checkpoint.num_tested = num_sampled;
+    checkpoint.num_duplicates = num_duplicates;
+    if (!SaveCheckpoint({teacher_games_file}, duplicate_filter.get(), kCheckpointFile, &checkpoint)) {
+      std::printf("\nFailed to save a checkpoint to %s.\n", kCheckpointFile);
     }
-
-    // 進行状況を表示する
-    progress_timer.IncrementCounter();
-    progress_timer.PrintProgress("");
   }
 
   std::fclose(teacher_games_file);
+
+  SaveDuplicateFilter(duplicate_filter.get(), filter_file, num_sampled, num_duplicates);
+  std::remove(kCheckpointFile);
 }
 
 void TeacherData::GenerateTeacherPvs() {
@@ -367,13 +1048,11 @@ void TeacherData::GenerateTeacherPvs() {
 
   // データベースから棋譜を読み込む（学習用と、交差検定用の2つがある）
   std::printf("Extract the games from the database.\n");
-  std::vector<Game> games;
-  std::ifstream db_file(GameDatabase::kDefaultDatabaseFile);
-  GameDatabase game_db(db_file);
+  GameDatabase game_db;
   game_db.set_title_matches_only(true);
-  for (Game game; game_db.ReadOneGame(&game); ) {
-    games.push_back(game);
-    if (games.size() >= kNumGames) break;
+  std::vector<Game> games = game_db.ReadAllGames(kNumGames);
+  if (game_db.failed()) {
+    return;
   }
 
   // 乱数生成器をスレッドの数だけ準備する
@@ -22,11 +22,19 @@
 
 #if !defined(MINIMUM)
 
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
 #include <cstdio>
+#include <memory>
+#include <random>
+#include <thread>
 #include <vector>
+#include "common/ring_buffer.h"
 #include "gamedb.h"
 #include "huffman_code.h"
 #include "move.h"
+class TeacherArchive;
 
 /**
  * 教師局面のデータです.
@@ -74,6 +82,112 @@ struct TeacherPv {
   std::vector<Move> pv_data;
 };
 
+/**
+ * 教師局面のファイル（teacher_positions.bin等）から、シャッフルされたミニバッチを順番に取り出すためのクラスです.
+ *
+ * ファイルは読み込み専用でメモリマップするので、搭載メモリより大きなファイルでも扱うことができます。
+ * 局面は、ファイル上で連続するkBlockSize局面ずつの「ブロック」単位でシャッフルされ、エポックごとに並べ直されます。
+ * 先読み用のスレッドが、これから使うブロックをあらかじめメモリに読み込んでおき、
+ * ロックフリーのリングバッファで受け渡すので、学習中にファイルの読み込みを待つことはほとんどありません。
+ * 局面のハフマン符号は、ミニバッチを処理する各スレッドで復元してください。
+ *
+ * ブロック単位で圧縮されたアーカイブ（TeacherArchive）のファイルも、そのまま読み込むことができます。
+ * この場合、ミニバッチに含まれるブロックは、NextBatch()の中で複数のスレッドを用いて並列に復元されます。
+ */
+class TeacherPositionLoader {
+ public:
+  /** １ブロックあたりの局面数 */
+  static constexpr size_t kBlockSize = 1024;
+
+  /**
+   * ファイルをメモリマップして、先読みを開始します.
+   * @param file_name 教師局面のファイル名
+   * @param seed      ブロックをシャッフルするための乱数の種
+   * @param start     読み飛ばす局面数（num_consumed()の値を渡すと、同じ種で前回中断したところから再開できます）
+   */
+  TeacherPositionLoader(const char* file_name, uint32_t seed,
+                        uint64_t start = 0);
+
+  ~TeacherPositionLoader();
+
+  TeacherPositionLoader(const TeacherPositionLoader&) = delete;
+  TeacherPositionLoader& operator=(const TeacherPositionLoader&) = delete;
+
+  /**
+   * ファイルを開くことができた場合は、trueを返します.
+   */
+  bool is_open() const {
+    return num_positions_ != 0;
+  }
+
+  /**
+   * ファイルに含まれる局面数を返します.
+   */
+  size_t size() const {
+    return num_positions_;
+  }
+
+  /**
+   * 次のミニバッチを取り出します（エポックの終わりに達した場合は、次のエポックの最初から続けて取り出します）.
+   * アーカイブのブロックが壊れていて復元できなかった場合は、学習を続けられないので、プログラムを終了します。
+   * @param batch_size ミニバッチに含める局面の数
+   * @param batch      局面へのポインタを保存する場所（以前の内容は消去されます）
+   */
+  void NextBatch(size_t batch_size, std::vector<const TeacherPosition*>* batch);
+
+  /**
+   * これまでに取り出した局面の数を返します（コンストラクタで読み飛ばした局面数を含みます）.
+   */
+  uint64_t num_consumed() const {
+    return num_consumed_;
+  }
+
+  /**
+   * ブロックをシャッフルするための乱数の種を返します.
+   */
+  uint32_t seed() const {
+    return seed_;
+  }
+
+ private:
+  std::vector<size_t> ShuffleBlocks(uint64_t epoch) const;
+  void PrefetchLoop(uint64_t start_epoch, size_t start_block);
+
+  /** ブロックに含まれる局面数（ファイル末尾のブロックのみ、kBlockSizeより少なくなることがある） */
+  size_t BlockLength(size_t block_id) const {
+    return std::min(kBlockSize, num_positions_ - block_id * kBlockSize);
+  }
+  void GetBlockRange(size_t block_id, const char** first, const char** last) const;
+  void ReleaseBlock(size_t block_id);
+
+  const TeacherPosition* positions_ = nullptr;
+  size_t num_positions_ = 0;
+  size_t num_blocks_ = 0;
+  size_t mapped_size_ = 0;
+
+  /** 現在読み出し中のブロックと、その中での位置 */
+  size_t current_block_ = SIZE_MAX;
+  size_t position_in_block_ = kBlockSize;
+
+  /** 最初に取り出すブロックの中で、読み飛ばす局面数 */
+  size_t first_block_offset_ = 0;
+
+  uint32_t seed_ = 0;
+  uint64_t num_consumed_ = 0;
+
+  /** アーカイブを読み込む場合の、アーカイブと、現在のミニバッチに含まれるブロックを復元したもの */
+  std::unique_ptr<TeacherArchive> archive_;
+  std::vector<std::vector<TeacherPosition>> decoded_blocks_;
+
+  /** 前回のミニバッチで使い切ったブロック（次のミニバッチを取り出す際に、ページを解放する） */
+  std::vector<size_t> finished_blocks_;
+
+  /** 先読みが終わったブロックのID */
+  RingBuffer<size_t, 256> prefetched_blocks_;
+  std::atomic<bool> stop_{false};
+  std::thread prefetch_thread_;
+};
+
 /**
  * 教師データを作成するためのクラスです.
  */
@@ -82,8 +196,16 @@ class TeacherData {
 
   /**
    * 教師局面を生成します.
+   *
+   * 各局面の探索はノード数で打ち切り、乱数の種は局面ごとに全体の種から導くので、
+   * 同じ種を与えれば、スレッド数やマシンの負荷によらず、同じ教師局面のファイルが得られます。
+   * ただし、重複局面を取り除く場合は、どの通し番号の局面が重複として取り除かれるかが、各スレッドの処理順に依存します。
+   * 100万局面ごとにチェックポイント（teacher_positions.checkpoint）を保存するので、中断した場合は、
+   * 同じ種で実行し直せば、最後のチェックポイントから再開します。
+   * @param seed        乱数の種
+   * @param filter_file 重複局面を取り除くためのブルームフィルタのファイル名（nullptrの場合は、重複局面を取り除かない）
    */
-  static void GenerateTeacherPositions();
+  static void GenerateTeacherPositions(uint32_t seed, const char* filter_file = nullptr);
 
   /**
    * 自己対戦の勝敗データを生成します.
@@ -96,8 +218,12 @@ class TeacherData {
    * （参考文献）
    *   - 鶴岡慶雅, 横山大作, 丸山孝志, 高瀬亮, 大内拓実: 「激指」アピール文書（WCSC26）,
    *     http://www.computer-shogi.org/wcsc26/appeal/Gekisashi/appeal.txt, 2016.
+   *
+   * 10万局ごとにチェックポイント（teacher_games.checkpoint）を保存するので、中断した場合は、
+   * 実行し直せば、最後のチェックポイントから再開します。
+   * @param filter_file 重複局面を取り除くためのブルームフィルタのファイル名（nullptrの場合は、重複局面を取り除かない）
    */
-  static void GenerateTeacherGames();
+  static void GenerateTeacherGames(const char* filter_file = nullptr);
 
   /**
    * 教師となるPVデータを生成します.
@@ -19,6 +19,7 @@
 
 #include "thinking.h"
 
+#include <cinttypes>
 #include "book.h"
 #include "move_probability.h"
 #include "movegen.h"
@@ -29,15 +30,6 @@
 #include "usi.h"
 #include "usi_protocol.h"
 
-// やねうら王（Stockfish11）のHistory
-// ・本来はThreadに持つべき
-extern CounterMoveHistory g_ary_counterMoves[HISTORY_ARRAY_SIZE];
-extern ButterflyHistory g_ary_mainHistory[HISTORY_ARRAY_SIZE];
-extern LowPlyHistory g_ary_lowPlyHistory[HISTORY_ARRAY_SIZE];
-extern CapturePieceToHistory g_ary_captureHistory[HISTORY_ARRAY_SIZE];
-extern ContinuationHistory g_ary_continuationHistory[HISTORY_ARRAY_SIZE][2][2];
-
-
 Thinking::Thinking(const UsiOptions& usi_options)
     : usi_options_(usi_options),
       time_manager_(usi_options, &shared_data_.signals),
@@ -48,31 +40,21 @@ void Thinking::Initialize() {
   book_.ReadFromFile(usi_options_["BookFile"].string().c_str());
   shared_data_.hash_table.SetSize(usi_options_["USI_Hash"]);
   shared_data_.countermoves_history.Clear();
-  MoveProbability::SetCacheTableSize(ProbabilityCacheTable::kDefaultSize * usi_options_["Threads"]);
+  MoveProbability::SetCacheTableSize(usi_options_["ProbabilityCacheSize"]);
 
-  // やねうら王（Stockfish11）のHistoryのクリア
-  for (int i = 0; i < HISTORY_ARRAY_SIZE; i++) {
-    g_ary_counterMoves[i].fill(Move::Create(0));
-    g_ary_mainHistory[i].fill(0);
-    g_ary_lowPlyHistory[i].fill(0);
-    g_ary_captureHistory[i].fill(0);
-
-    // ここは、未初期化のときに[SQ_ZERO][NO_PIECE]を指すので、ここを-1で初期化しておくことによって、
-    // history > 0 を条件にすれば自ずと未初期化のときは除外されるようになる。
-    for (bool inCheck : { false, true })
-      for (StatsType c : { NoCaptures, Captures })
-      {
-        for (auto& to : g_ary_continuationHistory[i][inCheck][c])
-          for (auto& h : to)
-            h->fill(0);
-        g_ary_continuationHistory[i][inCheck][c][SQ_ZERO][NO_PIECE]->fill(CounterMovePruneThreshold - 1);
-      }
-  }
+#if !defined(MINIMUM)
+  // クラスタのワーカーとして、置換表のエントリを交換する場合の設定を行う
+  tt_exchange_.Configure(usi_options_["TTExportDepth"], usi_options_["TTExportMaxEntries"]);
+  shared_data_.hash_table.set_tt_exchange(tt_exchange_.enabled() ? &tt_exchange_ : nullptr);
+#endif
 
+  // やねうら王（Stockfish11）のHistoryのクリア
+  Search::ClearHistories();
 }
 
 void Thinking::StartNewGame() {
-  // 現在のところ、特に行う処理はない
+  // ５手詰・７手詰関数のキャッシュは、前の対局の結果を持ち越さないようにクリアする
+  thread_manager_.ClearMateCaches();
 }
 
 void Thinking::ResetSignals() {
@@ -142,12 +124,31 @@ void Thinking::StartThinking(const Node& root_node,
     // 読みの深さ制限機能については、USIオプションよりも、goコマンドのオプションを優先する
     int depth_limit = (go_options.depth != kMaxPly) ? go_options.depth : int(usi_options_["DepthLimit"]);
     uint64_t nodes_limit = go_options.nodes;
+#if !defined(MINIMUM)
+    {
+      std::unique_lock<std::mutex> lock(tt_data_mutex_);
+      accepts_tt_data_ = true;
+    }
+    tt_exchange_.StartPublishing(shared_data_.hash_table, root_node.key());
+#endif
     const RootMove& best_root_move = thread_manager_.ParallelSearch(node,
                                                                     draw_score,
                                                                     root_moves,
                                                                     usi_options_["MultiPV"],
                                                                     depth_limit,
                                                                     nodes_limit);
+#if !defined(MINIMUM)
+    {
+      std::unique_lock<std::mutex> lock(tt_data_mutex_);
+      accepts_tt_data_ = false;
+    }
+    tt_exchange_.StopPublishing();
+    if (tt_exchange_.enabled()) {
+      // info stringではなく、マスター（Clusterクラス）が解釈する専用のコマンドとして送る
+      SYNCED_PRINTF("ttstats exported %" PRIu64 " imported %" PRIu64 "\n",
+                    tt_exchange_.num_exported(), tt_exchange_.num_imported());
+    }
+#endif
 
     // d. 時間管理用のスレッドに終了の指示を出す
     time_manager_.StopTimeManagement();
@@ -211,6 +212,15 @@ void Thinking::StopThinking() {
   sleep_condition_.notify_one();
 }
 
+#if !defined(MINIMUM)
+void Thinking::ImportTtData(const std::string& payload) {
+  std::unique_lock<std::mutex> lock(tt_data_mutex_);
+  if (accepts_tt_data_) {
+    tt_exchange_.Import(payload, &shared_data_.hash_table);
+  }
+}
+#endif
+
 void Thinking::Ponderhit() {
   time_manager_.RecordPonderhitTime();
 
@@ -30,6 +30,7 @@
 #include "signals.h"
 #include "thread.h"
 #include "time_manager.h"
+#include "tt_exchange.h"
 
 class Node;
 class UsiGoOptions;
@@ -89,6 +90,21 @@ class Thinking {
    */
   void Ponderhit();
 
+  /**
+   * 直前の探索での、全スレッドの詰み探索の統計データを返します（開発用）.
+   */
+  const Search::MateStats& mate_stats() const {
+    return thread_manager_.mate_stats();
+  }
+
+#if !defined(MINIMUM)
+  /**
+   * 他のエンジンから送られてきた置換表のエントリ（ttdataコマンドの引数）を、置換表に書き込みます.
+   * 探索中以外に送られてきたものは、無視します。
+   */
+  void ImportTtData(const std::string& payload);
+#endif
+
  private:
   const UsiOptions& usi_options_;
   std::mutex mutex_;
@@ -97,6 +113,15 @@ class Thinking {
   SharedData shared_data_;
   SimpleTimeManager time_manager_;
   ThreadManager thread_manager_;
+
+#if !defined(MINIMUM)
+  /** クラスタのワーカー間で、置換表のエントリを交換するためのオブジェクト */
+  TtExchange tt_exchange_;
+
+  /** 探索中であればtrue（ttdataコマンドを受け付けるかどうかの判定に用いる） */
+  bool accepts_tt_data_ = false;
+  std::mutex tt_data_mutex_;
+#endif
 };
 
 #endif /* THINKING_H_ */
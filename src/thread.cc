@@ -127,6 +127,13 @@ uint64_t ThreadManager::CountNodesUnder(Move move) const {
   return total;
 }
 
+void ThreadManager::ClearMateCaches() {
+  // マスタースレッドのSearchオブジェクトは、探索のたびに作り直すので、ワーカースレッドの分だけクリアすればよい
+  for (std::unique_ptr<SearchThread>& worker : worker_threads_) {
+    worker->search_.ClearMateCache();
+  }
+}
+
 RootMove ThreadManager::ParallelSearch(Node& node, const Score draw_score,
                                        const std::vector<RootMove>& root_moves,
                                        int multipv,
@@ -159,6 +166,12 @@ RootMove ThreadManager::ParallelSearch(Node& node, const Score draw_score,
     worker->WaitUntilSearchIsFinished();
   }
 
+  // 詰み探索の統計データを集計する
+  mate_stats_ = master_search.mate_stats();
+  for (const std::unique_ptr<SearchThread>& worker : worker_threads_) {
+    mate_stats_ += worker->search_.mate_stats();
+  }
+
   // 最善手と、相手の予想手を取得する
   const RootMove& best_root_move = master_search.GetBestRootMove();
   return best_root_move;
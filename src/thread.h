@@ -69,6 +69,15 @@ class ThreadManager {
   size_t GetNumSearchThreads();
   uint64_t CountNodesSearchedByWorkerThreads() const;
   uint64_t CountNodesUnder(Move move) const;
+  void ClearMateCaches();
+
+  /**
+   * 直前の探索での、全スレッドの詰み探索の統計データを返します（開発用）.
+   */
+  const Search::MateStats& mate_stats() const {
+    return mate_stats_;
+  }
+
   RootMove ParallelSearch(Node& node, Score draw_score,
                           const std::vector<RootMove>& root_moves,
                           int multipv, int depth_limit, uint64_t nodes_limit);
@@ -77,6 +86,7 @@ class ThreadManager {
   TimeManager& time_manager_;
   std::vector<std::unique_ptr<SearchThread>> worker_threads_;
   size_t num_search_threads_;
+  Search::MateStats mate_stats_;
 };
 
 #endif /* THREAD_H_ */
@@ -19,6 +19,7 @@
 
 #include "time_manager.h"
 
+#include <algorithm>
 #include "signals.h"
 #include "usi_protocol.h"
 
@@ -35,6 +36,7 @@ void TimeManager::StartTimeManagement(const Position& pos,
   // 各種データをリセットする
   num_nodes_searched_.clear();
   panic_mode_ = false;
+  early_stop_requested_ = false;
 
   // 今回の設定を保存しておく
   ponder_ = go_options.ponder;
@@ -75,6 +77,22 @@ void TimeManager::StopTimeManagement() {
   sleep_condition_.notify_one();
 }
 
+void TimeManager::RequestEarlyStop() {
+  std::unique_lock<std::mutex> lock(mutex_);
+  early_stop_requested_ = true;
+  sleep_condition_.notify_one();
+}
+
+int64_t TimeManager::remaining_time() const {
+  if (   time_control_->target_time() == INT64_MAX
+      || time_control_->maximum_time() == INT64_MAX) {
+    return 0;
+  }
+  int64_t remaining = std::min(time_control_->target_time() - elapsed_time(),
+                               time_control_->maximum_time() - expended_time());
+  return std::max(remaining, int64_t(0));
+}
+
 void TimeManager::RecordPonderhitTime() {
   ponderhit_time_ = std::chrono::steady_clock::now();
   ponderhit_ = true;
@@ -166,6 +184,12 @@ void TimeManager::Run() {
       break;
     }
 
+    // Step 4. 早期打ち切りの要求があれば、思考を終了する（先読み中を除く）
+    if (early_stop_requested_ && (!ponder_ || ponderhit_)) {
+      HandleEarlyStopEvent();
+      break;
+    }
+
 sleep:
     // 一定時間スリープしてから、再度時間をチェックする
     std::unique_lock<std::mutex> lock(mutex_);
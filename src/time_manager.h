@@ -43,6 +43,15 @@ class TimeManager : public TaskThread {
    */
   virtual void HandleTimeUpEvent() {}
 
+  /**
+   * RequestEarlyStop()による早期打ち切りの要求を受けて、思考を打ち切る際に呼ばれる関数です.
+   * 最大思考時間や目標思考時間に達した場合には呼ばれません。
+   * デフォルトでは、HandleTimeUpEvent()を呼び出します。
+   */
+  virtual void HandleEarlyStopEvent() {
+    HandleTimeUpEvent();
+  }
+
   /**
    * 時間管理を開始します.
    */
@@ -53,6 +62,25 @@ class TimeManager : public TaskThread {
    */
   void StopTimeManagement();
 
+  /**
+   * 目標思考時間に達する前に、思考を打ち切るよう要求します.
+   * 実際の打ち切り（HandleEarlyStopEvent()の呼び出し）は、時間管理用スレッドで、最小思考時間を使いきった後に行われます。
+   */
+  void RequestEarlyStop();
+
+  /**
+   * RequestEarlyStop()により、思考の打ち切りが要求されていれば、trueを返します.
+   */
+  bool early_stop_requested() const {
+    return early_stop_requested_;
+  }
+
+  /**
+   * 目標思考時間までの残り時間をミリ秒で返します（最大思考時間を超える分は含みません）.
+   * 時間制限がない場合は、0を返します。
+   */
+  int64_t remaining_time() const;
+
   /**
    * USIのponderhitコマンドが到着した時間を記録します.
    */
@@ -100,6 +128,7 @@ class TimeManager : public TaskThread {
   std::atomic_bool stop_{false};
   std::atomic_bool ponderhit_{false};
   std::atomic_bool panic_mode_{false};
+  std::atomic_bool early_stop_requested_{false};
   std::chrono::time_point<std::chrono::steady_clock> start_time_;
   std::chrono::time_point<std::chrono::steady_clock> ponderhit_time_;
   std::mutex mutex_;
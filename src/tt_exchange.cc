@@ -0,0 +1,243 @@
+/*
+ * 技巧 (Gikou), a USI shogi (Japanese chess) playing engine.
+ * Copyright (C) 2016-2017 Yosuke Demura
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#if !defined(MINIMUM)
+
+#include "tt_exchange.h"
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <vector>
+#include "hash_table.h"
+#include "synced_printf.h"
+
+namespace {
+
+/**
+ * ttdataコマンドで送る、置換表のエントリ１個分のデータです（20バイト。同じ実行ファイルのワーカー間で送ることを前提に、メモリ上の表現をそのまま送る）.
+ */
+struct PackedEntry {
+  uint32_t key_low;
+  uint32_t key_high;
+  uint32_t move;
+  int16_t score;
+  int16_t eval;
+  int16_t depth;
+  uint8_t bound;
+  uint8_t skip_mate3;
+};
+
+static_assert(sizeof(PackedEntry) == 20, "");
+
+const char kBase64Chars[] =
+    "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+void EncodeBase64(const uint8_t* data, size_t size, std::string* out) {
+  out->reserve(out->size() + (size + 2) / 3 * 4);
+  for (size_t i = 0; i < size; i += 3) {
+    uint32_t bits = uint32_t(data[i]) << 16;
+    if (i + 1 < size) bits |= uint32_t(data[i + 1]) << 8;
+    if (i + 2 < size) bits |= uint32_t(data[i + 2]);
+    out->push_back(kBase64Chars[(bits >> 18) & 63]);
+    out->push_back(kBase64Chars[(bits >> 12) & 63]);
+    out->push_back(i + 1 < size ? kBase64Chars[(bits >> 6) & 63] : '=');
+    out->push_back(i + 2 < size ? kBase64Chars[bits & 63] : '=');
+  }
+}
+
+/**
+ * Base64の文字列を復元します.
+ * @return 正しく復元できた場合は、true
+ */
+bool DecodeBase64(const std::string& str, std::vector<uint8_t>* out) {
+  static const auto table = [](){
+    std::array<int8_t, 256> t;
+    t.fill(-1);
+    for (int i = 0; i < 64; ++i) {
+      t[static_cast<uint8_t>(kBase64Chars[i])] = i;
+    }
+    return t;
+  }();
+
+  if (str.size() % 4 != 0) {
+    return false;
+  }
+  out->clear();
+  out->reserve(str.size() / 4 * 3);
+  for (size_t i = 0; i < str.size(); i += 4) {
+    uint32_t bits = 0;
+    int num_padding = 0;
+    for (size_t j = 0; j < 4; ++j) {
+      char c = str[i + j];
+      if (c == '=' && i + 4 == str.size() && j >= 2) {
+        ++num_padding;
+        bits <<= 6;
+        continue;
+      }
+      int value = table[static_cast<uint8_t>(c)];
+      if (value < 0 || num_padding > 0) {
+        return false;
+      }
+      bits = (bits << 6) | value;
+    }
+    out->push_back(static_cast<uint8_t>(bits >> 16));
+    if (num_padding < 2) out->push_back(static_cast<uint8_t>(bits >> 8));
+    if (num_padding < 1) out->push_back(static_cast<uint8_t>(bits));
+  }
+  return true;
+}
+
+} // namespace
+
+TtExchange::TtExchange()
+    : recorded_keys_(new std::atomic<int64_t>[kCapacity]) {
+  for (size_t i = 0; i < kCapacity; ++i) {
+    recorded_keys_[i].store(0, std::memory_order_relaxed);
+  }
+}
+
+TtExchange::~TtExchange() {
+  StopPublishing();
+}
+
+void TtExchange::Configure(int min_depth, int max_entries_per_second) {
+  min_depth_ = min_depth > 0 ? min_depth : kDepthDisabled;
+  max_entries_per_second_ = std::max(max_entries_per_second, 1);
+}
+
+void TtExchange::StartPublishing(const HashTable& hash_table, Key64 root_key) {
+  StopPublishing();
+  if (!enabled()) {
+    return;
+  }
+
+  // 前回の探索中に記録されたものは、エクスポートしない
+  num_published_ = num_recorded_.load(std::memory_order_relaxed);
+  stop_ = false;
+  publish_thread_ = std::thread([this, &hash_table, root_key]() {
+    PublishLoop(hash_table, root_key);
+  });
+}
+
+void TtExchange::StopPublishing() {
+  if (!publish_thread_.joinable()) {
+    return;
+  }
+  {
+    std::unique_lock<std::mutex> lock(mutex_);
+    stop_ = true;
+    stop_condition_.notify_one();
+  }
+  publish_thread_.join();
+}
+
+void TtExchange::PublishLoop(const HashTable& hash_table, Key64 root_key) {
+  // １回のエクスポートで送るエントリ数の上限（帯域の上限を、エクスポートの間隔で割ったもの）
+  const size_t max_entries = std::max<size_t>(
+      size_t(max_entries_per_second_) * kPublishIntervalMs / 1000, 1);
+
+  std::unique_lock<std::mutex> lock(mutex_);
+  for (bool stopping = false; !stopping; ) {
+    stopping = stop_condition_.wait_for(lock, std::chrono::milliseconds(kPublishIntervalMs),
+                                        [this](){ return stop_; });
+    Publish(hash_table, root_key, max_entries);
+  }
+}
+
+void TtExchange::Publish(const HashTable& hash_table, Key64 root_key,
+                         size_t max_entries) {
+  // 1. 前回のエクスポート以降に記録されたハッシュ値を集める（多すぎる場合は、新しいものを優先する）
+  const uint64_t num_recorded = num_recorded_.load(std::memory_order_relaxed);
+  uint64_t begin = std::max(num_published_, num_recorded - std::min<uint64_t>(num_recorded, kCapacity));
+  begin = std::max(begin, num_recorded - std::min<uint64_t>(num_recorded - begin, max_entries));
+  std::vector<int64_t> keys;
+  for (uint64_t i = begin; i < num_recorded; ++i) {
+    keys.push_back(recorded_keys_[i & (kCapacity - 1)].load(std::memory_order_relaxed));
+  }
+  num_published_ = num_recorded;
+  std::sort(keys.begin(), keys.end());
+  keys.erase(std::unique(keys.begin(), keys.end()), keys.end());
+
+  // 2. 置換表から、現在のエントリの内容を取り出す
+  std::vector<PackedEntry> entries;
+  for (int64_t key : keys) {
+    HashEntry entry;
+    if (Key64(key) == root_key || !hash_table.Peek(Key64(key), &entry)) {
+      continue;
+    }
+    if (entry.depth() < min_depth_ || !(entry.bound() & kBoundLower)) {
+      continue;
+    }
+    PackedEntry packed;
+    packed.key_low    = static_cast<uint32_t>(key);
+    packed.key_high   = static_cast<uint32_t>(static_cast<uint64_t>(key) >> 32);
+    packed.move       = entry.move().ToUint32();
+    packed.score      = static_cast<int16_t>(entry.score());
+    packed.eval       = static_cast<int16_t>(entry.eval());
+    packed.depth      = static_cast<int16_t>(entry.depth());
+    packed.bound      = static_cast<uint8_t>(entry.bound());
+    packed.skip_mate3 = entry.skip_mate3();
+    entries.push_back(packed);
+  }
+  if (entries.empty()) {
+    return;
+  }
+
+  // 3. ttdataコマンドとして出力する
+  std::string command = "ttdata ";
+  EncodeBase64(reinterpret_cast<const uint8_t*>(entries.data()),
+               entries.size() * sizeof(PackedEntry), &command);
+  command += "\n";
+  SYNCED_PRINTF("%s", command.c_str());
+  num_exported_ += entries.size();
+}
+
+void TtExchange::Import(const std::string& payload, HashTable* const hash_table) {
+  assert(hash_table != nullptr);
+
+  std::vector<uint8_t> data;
+  if (!DecodeBase64(payload, &data) || data.size() % sizeof(PackedEntry) != 0) {
+    return;
+  }
+
+  for (size_t offset = 0; offset < data.size(); offset += sizeof(PackedEntry)) {
+    PackedEntry packed;
+    std::memcpy(&packed, data.data() + offset, sizeof(packed));
+    const Key64 key(static_cast<int64_t>((uint64_t(packed.key_high) << 32) | packed.key_low));
+    bool saved = hash_table->SaveImportedEntry(key,
+                                               Move::FromUint32(packed.move),
+                                               static_cast<Score>(packed.score),
+                                               static_cast<Depth>(packed.depth),
+                                               static_cast<Bound>(packed.bound & kBoundExact),
+                                               static_cast<Score>(packed.eval),
+                                               packed.skip_mate3 != 0);
+    num_imported_ += saved;
+  }
+}
+
+size_t TtExchange::CountEntries(const std::string& payload) {
+  size_t num_bytes = payload.size() / 4 * 3;
+  if (!payload.empty() && payload.back() == '=') --num_bytes;
+  if (payload.size() >= 2 && payload[payload.size() - 2] == '=') --num_bytes;
+  return num_bytes / sizeof(PackedEntry);
+}
+
+#endif /* !defined(MINIMUM) */
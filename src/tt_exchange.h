@@ -0,0 +1,152 @@
+/*
+ * 技巧 (Gikou), a USI shogi (Japanese chess) playing engine.
+ * Copyright (C) 2016-2017 Yosuke Demura
+ * except where otherwise indicated.
+ *
+ * This program is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#ifndef TT_EXCHANGE_H_
+#define TT_EXCHANGE_H_
+
+#if !defined(MINIMUM)
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include "types.h"
+class HashTable;
+
+/**
+ * 複数のエンジン（クラスタのワーカー）の間で、置換表の深いエントリを交換するためのクラスです.
+ *
+ * 置換表に深い探索結果（下限値または正確な値）が保存されるたびに、そのハッシュ値を記録しておき、
+ * 探索中は一定間隔で、記録した局面のエントリを「ttdata」コマンドとして標準出力に書き出します（エクスポート）。
+ * クラスタのマスターは、これを他のワーカーにそのまま転送し、受け取ったワーカーは、
+ * 自分の置換表にそのエントリを書き込みます（インポート）。
+ * これにより、兄弟の部分木に手順前後で同じ局面が現れた場合に、他のワーカーの探索結果を再利用できます。
+ *
+ * ttdataコマンドの形式は「ttdata <エントリの配列をBase64で符号化したもの>」です。
+ * USIの通信は行単位なので、バイナリのデータは、改行を含まないようにBase64で符号化して送ります。
+ * エントリ１個あたりのデータ量は、20バイト（Base64では約27文字）です。
+ */
+class TtExchange {
+ public:
+  /** エクスポートを行う間隔（ミリ秒） */
+  static constexpr int kPublishIntervalMs = 100;
+
+  TtExchange();
+  ~TtExchange();
+
+  TtExchange(const TtExchange&) = delete;
+  TtExchange& operator=(const TtExchange&) = delete;
+
+  /**
+   * エクスポートの設定を行います（探索中以外に呼んでください）.
+   * @param min_depth              エクスポートするエントリの最小の深さ（0の場合は、エクスポートしない）
+   * @param max_entries_per_second １秒あたりにエクスポートするエントリ数の上限
+   */
+  void Configure(int min_depth, int max_entries_per_second);
+
+  /**
+   * 置換表にエントリが保存された際に、HashTable::Save()から呼ばれます.
+   * 深さと評価値の種類が条件を満たす場合に限り、そのハッシュ値を記録します。
+   */
+  void RecordSave(Key64 key64, Depth depth, Bound bound) {
+    if (depth >= min_depth_ && (bound & kBoundLower)) {
+      uint64_t index = num_recorded_.fetch_add(1, std::memory_order_relaxed);
+      recorded_keys_[index & (kCapacity - 1)].store(static_cast<int64_t>(key64),
+                                                    std::memory_order_relaxed);
+    }
+  }
+
+  /**
+   * 一定間隔でエクスポートを行うスレッドを開始します（探索の開始時に呼んでください）.
+   * @param hash_table エクスポートするエントリを参照する置換表
+   * @param root_key   ルート局面のハッシュ値（ignoremoves等でルートの指し手が制限されていると、
+   *                   ルート局面のエントリは正しくないので、エクスポートしない）
+   */
+  void StartPublishing(const HashTable& hash_table, Key64 root_key);
+
+  /**
+   * エクスポートを行うスレッドを停止します（残っているエントリは、停止前にエクスポートします）.
+   */
+  void StopPublishing();
+
+  /**
+   * ttdataコマンドで受け取ったエントリを、置換表に書き込みます.
+   * 探索中に、探索スレッド以外のスレッドから呼ぶことができます。
+   * @param payload    ttdataコマンドの引数（Base64で符号化されたエントリの配列）
+   * @param hash_table エントリを書き込む置換表
+   */
+  void Import(const std::string& payload, HashTable* hash_table);
+
+  /**
+   * ttdataコマンドの引数に含まれるエントリの数を返します（復元はしません）.
+   */
+  static size_t CountEntries(const std::string& payload);
+
+  /**
+   * エクスポートが有効になっていれば、trueを返します.
+   */
+  bool enabled() const {
+    return min_depth_ < kDepthDisabled;
+  }
+
+  /**
+   * これまでにエクスポートしたエントリの数を返します.
+   */
+  uint64_t num_exported() const {
+    return num_exported_;
+  }
+
+  /**
+   * これまでにインポートしたエントリの数を返します（置換表により深いエントリがあり、書き込まなかったものを除く）.
+   */
+  uint64_t num_imported() const {
+    return num_imported_;
+  }
+
+ private:
+  /** 記録しておくハッシュ値の数（古いものから上書きされる） */
+  static constexpr size_t kCapacity = 4096;
+
+  /** エクスポートを無効にする場合の、最小の深さ */
+  static constexpr int kDepthDisabled = INT32_MAX;
+
+  void PublishLoop(const HashTable& hash_table, Key64 root_key);
+  void Publish(const HashTable& hash_table, Key64 root_key, size_t max_entries);
+
+  int min_depth_ = kDepthDisabled;
+  int max_entries_per_second_ = 1000;
+
+  std::unique_ptr<std::atomic<int64_t>[]> recorded_keys_;
+  std::atomic<uint64_t> num_recorded_{0};
+  uint64_t num_published_ = 0;
+
+  std::atomic<uint64_t> num_exported_{0};
+  std::atomic<uint64_t> num_imported_{0};
+
+  std::thread publish_thread_;
+  std::mutex mutex_;
+  std::condition_variable stop_condition_;
+  bool stop_ = false;
+};
+
+#endif /* !defined(MINIMUM) */
+#endif /* TT_EXCHANGE_H_ */
@@ -29,6 +29,7 @@
 #include <thread>
 #include <vector>
 #include "movegen.h"
+#include "move_probability.h"
 #include "node.h"
 #include "search.h"
 #include "synced_printf.h"
@@ -120,6 +121,16 @@ void ReceiveCommands(CommandQueue* const queue, Thinking* const thinking) {
       continue;
     }
 
+#if !defined(MINIMUM)
+    // クラスタの他のワーカーの置換表のエントリは、探索中に書き込む必要があるので、キューを通さずに処理する
+    if (type == "ttdata") {
+      std::string payload;
+      is >> payload;
+      thinking->ImportTtData(payload);
+      continue;
+    }
+#endif
+
     // stop, gameoverコマンドが来たときは、思考を終了する
     if (type == "stop" || type == "gameover") {
       thinking->StopThinking();
@@ -325,6 +336,9 @@ UsiOptions::UsiOptions() {
   // トランスポジションテーブルのサイズ（単位はMB）
   map_.emplace("USI_Hash", UsiOption(256, 1, 16384)); // from 1MB to 16GB
 
+  // 実現確率のキャッシュテーブルのサイズ（単位はMB）（全スレッドで共有するテーブル全体の大きさで、スレッド数には比例しない）
+  map_.emplace("ProbabilityCacheSize", UsiOption(ProbabilityCacheTable::kDefaultSize, 1, 16384));
+
   // 先読みを有効にする場合はtrue
   map_.emplace("USI_Ponder", UsiOption(true));
 
@@ -380,6 +394,14 @@ UsiOptions::UsiOptions() {
 
   // NNUE評価関数バイナリのフォルダ
   map_.emplace("EvalDir", UsiOption("nnue_eval", 0));
+
+#if !defined(MINIMUM)
+  // クラスタのワーカー間で交換する、置換表のエントリの最小の深さ（0の場合は、交換しない）
+  map_.emplace("TTExportDepth", UsiOption(0, 0, kMaxPly));
+
+  // クラスタのワーカー間で交換する、置換表のエントリ数の上限（１秒あたり）
+  map_.emplace("TTExportMaxEntries", UsiOption(1000, 1, 100000));
+#endif
 }
 
 void UsiOptions::PrintListOfOptions() {
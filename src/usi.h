@@ -219,6 +219,15 @@ class UsiOptions {
     return map_.find(key)->second;
   }
 
+  /**
+   * USIオプションを追加します（すでに同じ名前のオプションがある場合は、何もしません）.
+   * @param key    USIオプション名
+   * @param option USIオプションの初期値など
+   */
+  void Add(const std::string& key, const UsiOption& option) {
+    map_.emplace(key, option);
+  }
+
  private:
   std::map<std::string, UsiOption> map_;
 };
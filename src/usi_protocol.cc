@@ -154,7 +154,8 @@ void UsiProtocol::ParseSetoptionCommand(std::istringstream& is,
     if (token == "name") {
       is >> name;
     } else if (token == "value") {
-      is >> value;
+      // 文字列のオプションには空白が含まれることがあるので、行末までを値とする
+      std::getline(is >> std::ws, value);
     }
   }
 
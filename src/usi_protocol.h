@@ -198,6 +198,14 @@ class UsiProtocol {
     return position_sfen_;
   }
 
+ protected:
+  /**
+   * 子クラス独自のUSIオプションを追加する際に用います.
+   */
+  UsiOptions& mutable_usi_options() {
+    return usi_options_;
+  }
+
  private:
   const char* const program_name_;
   const char* const author_name_;